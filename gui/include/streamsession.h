@@ -144,6 +144,10 @@ class StreamSession : public QObject
 	private:
 		SessionLog log;
 		ChiakiSession session;
+		ChiakiMetrics *metrics = nullptr;
+		ChiakiMetricsExporter metrics_exporter;
+		bool metrics_exporter_started = false;
+		ChiakiMetric *metric_frames_dropped = nullptr;
 		ChiakiOpusDecoder opus_decoder;
 		ChiakiOpusEncoder opus_encoder;
 		bool connected;
@@ -285,6 +289,9 @@ class StreamSession : public QObject
 		void CancelPsnConnection(bool stop_thread);
 
 		ChiakiLog *GetChiakiLog()				{ return log.GetChiakiLog(); }
+		ChiakiMetrics *GetMetrics()				{ return metrics; }
+		void AddDroppedFrames(uint64_t count)	{ chiaki_metric_add(metric_frames_dropped, count); }
+		void TraceFramePresented(int64_t pts, uint64_t presented_us);
 		QList<Controller *> GetControllers()	{ return controllers.values(); }
 		ChiakiFfmpegDecoder *GetFfmpegDecoder()	{ return ffmpeg_decoder; }
 #if CHIAKI_LIB_ENABLE_PI_DECODER
@@ -2,6 +2,7 @@
 #include "qmlbackend.h"
 #include "qmlsvgprovider.h"
 #include "chiaki/log.h"
+#include "chiaki/time.h"
 #include "streamsession.h"
 
 #include <qpa/qplatformnativeinterface.h>
@@ -287,6 +288,8 @@ void QmlMainWindow::presentFrame(AVFrame *frame, int32_t frames_lost)
     if (av_frame) {
         qCDebug(chiakiGui) << "Dropping rendering frame";
         dropped_frames_current++;
+        if (session)
+            session->AddDroppedFrames(1);
         av_frame_free(&av_frame);
     }
     av_frame = frame;
@@ -766,6 +769,7 @@ void QmlMainWindow::render()
         return;
 
     AVFrame *frame = nullptr;
+    int64_t frame_pts = AV_NOPTS_VALUE;
     pl_tex *tex = &placebo_tex[0];
 
     frame_mutex.lock();
@@ -786,7 +790,9 @@ void QmlMainWindow::render()
             .frame = frame,
             .tex = tex,
         };
-        if (!pl_map_avframe_ex(placebo_vulkan->gpu, &current_frame, &avparams))
+        if (pl_map_avframe_ex(placebo_vulkan->gpu, &current_frame, &avparams))
+            frame_pts = frame->pts;
+        else
         {
             qCWarning(chiakiGui) << "Failed to map AVFrame to Placebo frame!";
             if(backend && backend->zeroCopy())
@@ -908,10 +914,20 @@ void QmlMainWindow::render()
             qCWarning(chiakiGui) << "Failed to render Placebo frame!";
     }
 
-    if (!pl_swapchain_submit_frame(placebo_swapchain))
+    bool submitted = pl_swapchain_submit_frame(placebo_swapchain);
+    if (!submitted)
         qCWarning(chiakiGui) << "Failed to submit Placebo frame!";
 
     pl_swapchain_swap_buffers(placebo_swapchain);
+
+    if (submitted && frame_pts != AV_NOPTS_VALUE) {
+        // session belongs to the gui thread
+        uint64_t presented_us = chiaki_time_now_monotonic_us();
+        QMetaObject::invokeMethod(this, [this, frame_pts, presented_us]() {
+            if (session)
+                session->TraceFramePresented(frame_pts, presented_us);
+        });
+    }
 }
 
 bool QmlMainWindow::handleShortcut(QKeyEvent *event)
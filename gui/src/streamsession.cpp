@@ -323,9 +323,40 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
         }
         memcpy(chiaki_connect_info.psn_account_id, psn_account_id.constData(), CHIAKI_PSN_ACCOUNT_ID_SIZE);
 	}
+	// e.g. CHIAKI_METRICS_EXPORT=/tmp/chiaki.jsonl or CHIAKI_METRICS_EXPORT=unix:/run/chiaki-metrics.sock
+	QByteArray metrics_path = qgetenv("CHIAKI_METRICS_EXPORT");
+	if(!metrics_path.isEmpty())
+	{
+		metrics = chiaki_metrics_new();
+		if(!metrics)
+			CHIAKI_LOGE(GetChiakiLog(), "Failed to create metrics registry");
+		else
+			metric_frames_dropped = chiaki_metrics_counter(metrics, "chiaki_gui_frames_dropped_total", "Decoded frames replaced before they were rendered");
+	}
+
+	chiaki_connect_info.metrics = metrics;
+	// e.g. CHIAKI_FRAME_TRACE=/tmp/chiaki-frames.csv
+	QByteArray frame_trace_path = qgetenv("CHIAKI_FRAME_TRACE");
+	chiaki_connect_info.frame_trace_path = frame_trace_path.isEmpty() ? NULL : frame_trace_path.constData();
 	err = chiaki_session_init(&session, &chiaki_connect_info, GetChiakiLog());
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_metrics_free(metrics);
 		throw ChiakiException("Chiaki Session Init failed: " + QString::fromLocal8Bit(chiaki_error_string(err)));
+	}
+	if(ffmpeg_decoder)
+		ffmpeg_decoder->frame_tracer = &session.frame_tracer;
+	if(metrics)
+	{
+		ChiakiMetricsFormat format = qgetenv("CHIAKI_METRICS_FORMAT") == "prometheus"
+			? CHIAKI_METRICS_FORMAT_PROMETHEUS
+			: CHIAKI_METRICS_FORMAT_JSON_LINES;
+		err = chiaki_metrics_exporter_start(&metrics_exporter, metrics, GetChiakiLog(), format, metrics_path.constData(), 1000);
+		if(err == CHIAKI_ERR_SUCCESS)
+			metrics_exporter_started = true;
+		else
+			CHIAKI_LOGE(GetChiakiLog(), "Failed to start metrics exporter: %s", chiaki_error_string(err));
+	}
 	ChiakiCtrlDisplaySink display_sink;
 	display_sink.user = this;
 	display_sink.cantdisplay_cb = CantDisplayCb;
@@ -461,7 +492,11 @@ StreamSession::~StreamSession()
 		SDL_CloseAudioDevice(audio_in);
 	if(session_started)
 		chiaki_session_join(&session);
+	// last snapshot while the session still reports into metrics
+	if(metrics_exporter_started)
+		chiaki_metrics_exporter_stop(&metrics_exporter);
 	chiaki_session_fini(&session);
+	chiaki_metrics_free(metrics);
 	chiaki_opus_decoder_fini(&opus_decoder);
 	chiaki_opus_encoder_fini(&opus_encoder);
 #if CHIAKI_GUI_ENABLE_SPEEX
@@ -547,6 +582,13 @@ StreamSession::~StreamSession()
 #endif
 }
 
+void StreamSession::TraceFramePresented(int64_t pts, uint64_t presented_us)
+{
+	if(pts == AV_NOPTS_VALUE)
+		return;
+	chiaki_frame_tracer_mark(&session.frame_tracer, (int32_t)pts, CHIAKI_FRAME_TRACE_PRESENTED, presented_us);
+}
+
 void StreamSession::Start()
 {
 	if(!connect_timer.isValid())
@@ -6,25 +6,82 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "delaygradient.h"
+#include "seqnum.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @param send_us when the frame was sent, estimated from its index and the frame rate
+ * @param arrival_us arrival of the first packet of the frame that was received
+ */
+typedef void (*ChiakiCongestionControllerFrame)(uint64_t send_us, uint64_t arrival_us, void *user);
+
+/**
+ * Fill packet from the packets received and lost since the last report
+ */
+typedef void (*ChiakiCongestionControllerReport)(uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet, void *user);
+
+/**
+ * Algorithm deciding what to report to the console.
+ * Callbacks are serialized by ChiakiCongestionControl, frame_cb may be NULL.
+ */
+typedef struct chiaki_congestion_controller_t
+{
+	void *user;
+	ChiakiCongestionControllerFrame frame_cb;
+	ChiakiCongestionControllerReport report_cb;
+} ChiakiCongestionController;
+
 typedef struct chiaki_congestion_control_t
 {
 	ChiakiTakion *takion;
 	ChiakiPacketStats *stats;
 	ChiakiThread thread;
 	ChiakiBoolPredCond stop_cond;
-	double packet_loss;
+	ChiakiReactorTimer timer; // used instead of thread if takion->reactor is set
+	double packet_loss; // actual loss of the last interval, before the controller
 	double packet_loss_max;
+
+	ChiakiMutex controller_mutex; // protects everything below
+	ChiakiCongestionController controller;
+	ChiakiDelayGradient delay_gradient; // used by the default controller
+	unsigned int max_fps; // 0 if unknown, then no frames are passed to the controller
+	bool frame_prev_valid;
+	ChiakiSeqNum16 frame_index_prev;
+	uint64_t frames; // frame_index_prev unwrapped
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max);
+/**
+ * Init control with the default delay gradient controller.
+ * Frames can be pushed from here on, but they are ignored until control is started.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_init(ChiakiCongestionControl *control, double packet_loss_max);
+CHIAKI_EXPORT void chiaki_congestion_control_fini(ChiakiCongestionControl *control);
+
+/**
+ * @param controller replaces the current controller, NULL to restore the default one
+ */
+CHIAKI_EXPORT void chiaki_congestion_control_set_controller(ChiakiCongestionControl *control, const ChiakiCongestionController *controller);
+
+/**
+ * Thread-safe: a video frame was received, completely or partially
+ *
+ * @param arrival_us arrival of the first packet of the frame that was received
+ */
+CHIAKI_EXPORT void chiaki_congestion_control_push_frame(ChiakiCongestionControl *control, ChiakiSeqNum16 frame_index, uint64_t arrival_us);
+
+/**
+ * Start sending a report every 200ms
+ *
+ * @param max_fps frame rate the console sends at, used to estimate the send time of frames, 0 if unknown
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, unsigned int max_fps);
 
 /**
- * Stop control and join the thread
+ * Stop control and join the thread or remove the reactor timer
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_DELAYGRADIENT_H
+#define CHIAKI_DELAYGRADIENT_H
+
+#include "common.h"
+#include "takion.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_DELAY_GRADIENT_WINDOW 20
+
+typedef enum chiaki_delay_gradient_state_t
+{
+	CHIAKI_DELAY_GRADIENT_NORMAL,
+	CHIAKI_DELAY_GRADIENT_UNDERUSE, // queue on the path is draining
+	CHIAKI_DELAY_GRADIENT_OVERUSE // queue on the path is building up
+} ChiakiDelayGradientState;
+
+CHIAKI_EXPORT const char *chiaki_delay_gradient_state_string(ChiakiDelayGradientState state);
+
+/**
+ * Estimates the trend of the one-way queuing delay from the send and arrival times of frames,
+ * like the trendline filter and overuse detector of Google Congestion Control,
+ * and decides how much loss to report to the console.
+ *
+ * Not thread-safe.
+ */
+typedef struct chiaki_delay_gradient_t
+{
+	double packet_loss_max;
+
+	bool sample_prev_valid;
+	uint64_t send_prev_us;
+	uint64_t arrival_prev_us;
+	uint64_t arrival_first_us;
+
+	double delay_accumulated_ms;
+	double delay_smoothed_ms;
+	double window_x[CHIAKI_DELAY_GRADIENT_WINDOW]; // arrival time in ms since arrival_first_us
+	double window_y[CHIAKI_DELAY_GRADIENT_WINDOW]; // smoothed accumulated delay in ms
+	size_t window_count;
+	size_t window_next;
+	uint64_t deltas;
+
+	double trend; // delay gradient scaled like modified_trend of GCC
+	double trend_prev;
+	double threshold;
+	double overuse_time_ms;
+	unsigned int overuse_counter;
+	ChiakiDelayGradientState state;
+	bool overused; // overuse was detected since the last report
+
+	double packet_loss_overuse; // loss reported while overused, 0 otherwise
+	uint64_t overuse_detected; // total, for stats
+} ChiakiDelayGradient;
+
+/**
+ * @param packet_loss_max loss above this is not reported unless the delay indicates congestion
+ */
+CHIAKI_EXPORT void chiaki_delay_gradient_init(ChiakiDelayGradient *dg, double packet_loss_max);
+
+/**
+ * Reset the estimate, e.g. after the stream was interrupted.
+ */
+CHIAKI_EXPORT void chiaki_delay_gradient_reset(ChiakiDelayGradient *dg);
+
+/**
+ * @param send_us when the frame was sent, in any time base that is consistent between frames
+ * @param arrival_us arrival of the first packet of the frame that was received
+ */
+CHIAKI_EXPORT void chiaki_delay_gradient_push_frame(ChiakiDelayGradient *dg, uint64_t send_us, uint64_t arrival_us);
+
+/**
+ * Fill packet from the packets received and lost since the last report.
+ * While the delay is building up, at least an increasing minimum loss is reported so the console backs off,
+ * otherwise the loss is clamped to packet_loss_max because it is likely not caused by congestion.
+ */
+CHIAKI_EXPORT void chiaki_delay_gradient_report(ChiakiDelayGradient *dg, uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_DELAYGRADIENT_H
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_EVENTLOOP_H
+#define CHIAKI_EVENTLOOP_H
+
+#include "sock.h"
+#include "stoppipe.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_EVENT_LOOP_READ (1 << 0)
+#define CHIAKI_EVENT_LOOP_WRITE (1 << 1)
+/**
+ * Only report readiness when it changes. The owner of the fd must read/write until it would block
+ * before waiting again. Ignored by the select() fallback, which is always level-triggered,
+ * so code written for edge-triggered registration works with both.
+ */
+#define CHIAKI_EVENT_LOOP_EDGE (1 << 2)
+
+/**
+ * Maximum number of fds registered with one loop
+ */
+#define CHIAKI_EVENT_LOOP_FDS_MAX 16
+
+typedef struct chiaki_event_loop_event_t
+{
+	chiaki_socket_t fd;
+	uint32_t events; // CHIAKI_EVENT_LOOP_READ and/or CHIAKI_EVENT_LOOP_WRITE that are ready
+	void *user;
+} ChiakiEventLoopEvent;
+
+/**
+ * Waits for readiness of multiple sockets which are registered once instead of on every wait,
+ * and can be stopped from any thread like ChiakiStopPipe.
+ *
+ * Uses epoll on Linux and select() elsewhere.
+ */
+typedef struct chiaki_event_loop_t
+{
+	ChiakiStopPipe stop_pipe;
+#ifdef __linux__
+	int epoll_fd;
+#endif
+	struct
+	{
+		chiaki_socket_t fd; // CHIAKI_INVALID_SOCKET if the slot is free
+		uint32_t events;
+		void *user;
+	} fds[CHIAKI_EVENT_LOOP_FDS_MAX];
+} ChiakiEventLoop;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop);
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop);
+
+/**
+ * Register fd. Must not be called concurrently with chiaki_event_loop_wait().
+ *
+ * @param events combination of CHIAKI_EVENT_LOOP_READ, CHIAKI_EVENT_LOOP_WRITE and CHIAKI_EVENT_LOOP_EDGE
+ * @param user passed back in ChiakiEventLoopEvent
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add(ChiakiEventLoop *loop, chiaki_socket_t fd, uint32_t events, void *user);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_modify(ChiakiEventLoop *loop, chiaki_socket_t fd, uint32_t events, void *user);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_remove(ChiakiEventLoop *loop, chiaki_socket_t fd);
+
+/**
+ * Wait until at least one registered fd is ready, the timeout expires or the loop is stopped.
+ *
+ * @param events array of events_max entries to write ready fds to
+ * @param events_count number of entries written to events, 0 on timeout
+ * @return CHIAKI_ERR_SUCCESS, CHIAKI_ERR_TIMEOUT or CHIAKI_ERR_CANCELED if chiaki_event_loop_stop() was called
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_wait(ChiakiEventLoop *loop, ChiakiEventLoopEvent *events, size_t events_max, size_t *events_count, uint64_t timeout_ms);
+
+/**
+ * Thread-safe. Makes all current and future waits return CHIAKI_ERR_CANCELED until chiaki_event_loop_reset() is called.
+ */
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_reset(ChiakiEventLoop *loop);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_EVENTLOOP_H
@@ -15,8 +15,150 @@ extern "C" {
 #endif
 
 #define CHIAKI_FEC_WORDSIZE 8
+#define CHIAKI_FEC_UNITS_MAX 256 // k + m
+#define CHIAKI_FEC_CACHE_CODING_SIZE 4
+#define CHIAKI_FEC_CACHE_DECODING_SIZE 16
 
+/**
+ * Instruction sets for multiplying a region with a constant in GF(2^8), with split 4 bit lookup tables for the SIMD ones.
+ */
+typedef enum chiaki_fec_simd_t
+{
+	CHIAKI_FEC_SIMD_NONE = 0,
+	CHIAKI_FEC_SIMD_SSSE3 = 1,
+	CHIAKI_FEC_SIMD_AVX2 = 2,
+	CHIAKI_FEC_SIMD_NEON = 3
+} ChiakiFecSimd;
+
+CHIAKI_EXPORT const char *chiaki_fec_simd_string(ChiakiFecSimd simd);
+
+/**
+ * @return whether simd is compiled in and supported by the cpu this is running on
+ */
+CHIAKI_EXPORT bool chiaki_fec_simd_supported(ChiakiFecSimd simd);
+
+/**
+ * @return the fastest ChiakiFecSimd supported on this cpu
+ */
+CHIAKI_EXPORT ChiakiFecSimd chiaki_fec_simd_best(void);
+
+/**
+ * dst = c * src, or dst ^= c * src if accumulate, in GF(2^8) with the same polynomial as jerasure for w = 8.
+ * simd must be supported.
+ */
+CHIAKI_EXPORT void chiaki_fec_region_mul(ChiakiFecSimd simd, uint8_t *dst, const uint8_t *src, uint8_t c, size_t size, bool accumulate);
+
+typedef struct chiaki_fec_cache_stats_t
+{
+	uint64_t coding_hits;
+	uint64_t coding_misses;
+	uint64_t decoding_hits;
+	uint64_t decoding_misses;
+} ChiakiFecCacheStats;
+
+typedef struct chiaki_fec_coding_matrix_t
+{
+	unsigned int k;
+	unsigned int m;
+	int *matrix; // NULL if the entry is unused
+	uint8_t *tables; // split multiplication tables for each coefficient of matrix, see chiaki_fec_region_mul()
+	uint64_t last_use;
+} ChiakiFecCodingMatrix;
+
+typedef struct chiaki_fec_decoding_matrix_t
+{
+	unsigned int k;
+	unsigned int m;
+	uint64_t erased[CHIAKI_FEC_UNITS_MAX / 64]; // bitmap of erased units
+	bool progressive; // for ChiakiFecProgressive, rows and dm_ids then only cover the fec units used for the erased source units
+	int *rows; // rows of the inverted decoding matrix for each erased source unit, in order, NULL if the entry is unused
+	int *dm_ids; // units the decoding matrix is applied to
+	uint8_t *tables; // split multiplication tables for each coefficient of rows
+	uint64_t last_use;
+} ChiakiFecDecodingMatrix;
+
+/**
+ * LRU cache of the Cauchy coding matrices by (k, m) and of the inverted decoding matrices by (k, m, erasures),
+ * because a stream only uses very few of them and the same erasure patterns come up again and again.
+ * Not thread-safe.
+ */
+typedef struct chiaki_fec_cache_t
+{
+	ChiakiFecCodingMatrix coding[CHIAKI_FEC_CACHE_CODING_SIZE];
+	ChiakiFecDecodingMatrix decoding[CHIAKI_FEC_CACHE_DECODING_SIZE];
+	uint64_t use_counter;
+	ChiakiFecCacheStats stats;
+	ChiakiFecSimd simd; // chiaki_fec_simd_best() after init, may be changed to any other supported one
+} ChiakiFecCache;
+
+CHIAKI_EXPORT void chiaki_fec_cache_init(ChiakiFecCache *cache);
+CHIAKI_EXPORT void chiaki_fec_cache_fini(ChiakiFecCache *cache);
+
+/**
+ * Recover the erased units of frame_buf, which holds k source and m fec units of unit_size bytes each, stride bytes apart.
+ * k + m must not be more than CHIAKI_FEC_UNITS_MAX.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_decode(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
+
+/**
+ * Same as chiaki_fec_cache_decode() without keeping any matrices.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
+/**
+ * Incremental decoder that folds units into the fec units while they are arriving:
+ * each row of acc holds a fec unit minus the contributions of all source units received so far,
+ * so when the frame is complete, the erased source units only depend on as many fec units as there are erasures
+ * and recovering e of them takes e * e region multiplications instead of e * k.
+ *
+ * Only as many rows are kept up to date as are reserved, which should be the number of source units known to be lost,
+ * so every source unit costs e region multiplications and a whole frame about e * k, like a full decode.
+ * Rows that turn out to be needed on decode are caught up from the source units in frame_buf.
+ */
+typedef struct chiaki_fec_progressive_t
+{
+	ChiakiFecCache *cache;
+	ChiakiFecCodingMatrix *coding; // from cache, stays valid as long as cache is only used for the same (k, m) until decode
+	unsigned int k;
+	unsigned int m;
+	uint8_t *frame_buf;
+	size_t unit_size;
+	size_t stride;
+	uint8_t *acc; // m units, stride bytes apart
+	size_t acc_size;
+	uint64_t received[CHIAKI_FEC_UNITS_MAX / 64]; // bitmap of units put so far
+	uint64_t folded[CHIAKI_FEC_UNITS_MAX / 64]; // bitmap of rows of acc that all received source units are folded into
+	unsigned int source_received;
+	unsigned int fec_received;
+	unsigned int rows_folded;
+} ChiakiFecProgressive;
+
+CHIAKI_EXPORT void chiaki_fec_progressive_init(ChiakiFecProgressive *progressive, ChiakiFecCache *cache);
+CHIAKI_EXPORT void chiaki_fec_progressive_fini(ChiakiFecProgressive *progressive);
+
+/**
+ * Reset for a new frame of k source and m fec units in frame_buf, laid out as for chiaki_fec_cache_decode().
+ * No rows are reserved.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_start(ChiakiFecProgressive *progressive, uint8_t *frame_buf, unsigned int k, unsigned int m, size_t unit_size, size_t stride);
+
+/**
+ * Fold in the unit with the given index, which must already be in its place in frame_buf, zero-padded like for chiaki_fec_cache_decode().
+ * Source units must stay there until decode.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_put(ChiakiFecProgressive *progressive, unsigned int index);
+
+/**
+ * Keep at least rows rows of acc up to date from now on, folding in all source units received so far for the new ones.
+ * Rows are never released until the next start.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_reserve(ChiakiFecProgressive *progressive, unsigned int rows);
+
+/**
+ * Recover all source units that were not put into their place in frame_buf.
+ * fec units are not recovered.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_decode(ChiakiFecProgressive *progressive);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
 
 #ifdef __cplusplus
@@ -29,6 +29,9 @@ typedef struct chiaki_feedback_sender_t
 	bool controller_state_changed;
 	ChiakiMutex state_mutex;
 	ChiakiCond state_cond;
+
+	ChiakiReactor *reactor; // takion->reactor, if non-NULL timer is used instead of thread
+	ChiakiReactorTimer timer;
 } ChiakiFeedbackSender;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion);
@@ -4,6 +4,7 @@
 #include <chiaki/config.h>
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/frametrace.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,13 +31,17 @@ struct chiaki_ffmpeg_decoder_t
 	int32_t frames_lost;
 	bool frame_recovered;
 	int32_t session_bitrate_kbps;
+	ChiakiFrameTracer *frame_tracer; // optional
 };
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
-CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
+/**
+ * ChiakiVideoSampleCallback, buf must be a video buffer (see videobuffer.h), which is passed to FFmpeg without copying.
+ */
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, int32_t frame_index, void *user);
 CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost);
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder);
 
@@ -6,6 +6,9 @@
 #include "common.h"
 #include "takion.h"
 #include "packetstats.h"
+#include "fec.h"
+#include "videobuffer.h"
+#include "streamstats.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -14,15 +17,13 @@
 extern "C" {
 #endif
 
-typedef struct chiaki_stream_stats_t
+typedef struct chiaki_frame_processor_fec_stats_t
 {
-	uint64_t frames;
-	uint64_t bytes;
-} ChiakiStreamStats;
-
-CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats);
-CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size);
-CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate);
+	uint64_t frames; // frames recovered by fec
+	uint64_t frames_progressive; // of those, frames whose units were folded in while arriving
+	uint64_t ready_us_sum; // time from putting the last unit to the recovered frame, summed over frames
+	uint64_t ready_us_max;
+} ChiakiFrameProcessorFecStats;
 
 struct chiaki_frame_unit_t;
 typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
@@ -30,7 +31,8 @@ typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
-	uint8_t *frame_buf;
+	ChiakiVideoBufferPool *buffer_pool; // created with the first frame
+	uint8_t *frame_buf; // from buffer_pool, replaced when it is too small or still referenced elsewhere
 	size_t frame_buf_size;
 	size_t buf_size_per_unit;
 	size_t buf_stride_per_unit;
@@ -38,10 +40,20 @@ typedef struct chiaki_frame_processor_t
 	unsigned int units_fec_expected;
 	unsigned int units_source_received;
 	unsigned int units_fec_received;
-	ChiakiFrameUnit *unit_slots;
-	size_t unit_slots_size;
+	ChiakiFrameUnit *unit_slots; // always CHIAKI_FEC_UNITS_MAX, allocated with the first frame
+	size_t unit_slots_size; // units of the current frame
+	uint64_t unit_received[CHIAKI_FEC_UNITS_MAX / 64]; // bitmap, unit_slots[i] is only valid if set
+	unsigned int unit_first_missing; // lowest unit index of the current frame not received yet
+	unsigned int unit_index_end; // highest unit index of the current frame received so far + 1
 	bool flushed; // whether we have already flushed the current frame, i.e. are only interested in stats, not data.
 	ChiakiStreamStats stream_stats;
+	ChiakiFecCache fec_cache;
+	ChiakiFecProgressive fec_progressive;
+	bool fec_progressive_enabled; // whether to fold the units of lossy frames into fec_progressive while they arrive, true after init
+	bool fec_progressive_active; // whether units of the current frame are being folded into fec_progressive, started once a unit is considered lost
+	uint64_t last_unit_us;
+	ChiakiFrameProcessorFecStats fec_stats;
+	uint64_t bytes_zeroed; // by all frames so far, only what fec needs is zeroed
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -54,13 +66,13 @@ typedef enum chiaki_frame_flush_result_t {
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor);
 
-CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 
 /**
- * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer into the internal buffer of frame_processor.
- * MUST NOT be used after the next call to this frame processor!
+ * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive the internal video buffer of frame_processor,
+ * followed by CHIAKI_VIDEO_BUFFER_PADDING_SIZE zero bytes.
+ * MUST NOT be used after the next call to this frame processor, unless a reference has been taken with chiaki_video_buffer_ref()!
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_FRAMETRACE_H
+#define CHIAKI_FRAMETRACE_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "metrics.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Stages of a video frame through the pipeline, in order
+ */
+typedef enum chiaki_frame_trace_stage_t
+{
+	CHIAKI_FRAME_TRACE_FIRST_UNIT, // first unit of the frame received
+	CHIAKI_FRAME_TRACE_LAST_UNIT, // last unit received before the frame was handed to assembly
+	CHIAKI_FRAME_TRACE_FEC_DONE, // frame processor flushed, including fec
+	CHIAKI_FRAME_TRACE_BITSTREAM_DONE, // reference frames fixed up, right before the video sample callback
+	CHIAKI_FRAME_TRACE_DECODER_SUBMIT, // handed to the decoder
+	CHIAKI_FRAME_TRACE_DECODER_PULL, // decoded picture pulled from the decoder
+	CHIAKI_FRAME_TRACE_PRESENTED, // rendered and swapped to the screen, never reached by frames the renderer drops
+	CHIAKI_FRAME_TRACE_STAGES_COUNT
+} ChiakiFrameTraceStage;
+
+CHIAKI_EXPORT const char *chiaki_frame_trace_stage_name(ChiakiFrameTraceStage stage);
+
+typedef struct chiaki_frame_trace_t
+{
+	int32_t frame_index; // -1 if unused
+	uint64_t stages_us[CHIAKI_FRAME_TRACE_STAGES_COUNT]; // chiaki_time_now_monotonic_us() domain, 0 if not reached
+} ChiakiFrameTrace;
+
+#define CHIAKI_FRAME_TRACER_FRAMES 64
+
+/**
+ * Collects a timestamp per stage for every video frame, from the network to the renderer.
+ *
+ * A trace is finished when its frame is presented, or as incomplete when a frame 64 indices later begins
+ * or the tracer is finished. Finished traces are aggregated into histograms of the time between each stage
+ * and the one reached before it, plus from the first unit to presentation, and optionally written to a
+ * CSV file with one line per frame.
+ *
+ * All functions are thread-safe and do nothing if tracer is NULL or tracing is disabled,
+ * so stages in other components can be marked unconditionally.
+ */
+typedef struct chiaki_frame_tracer_t
+{
+	ChiakiLog *log;
+	ChiakiMutex mutex;
+	bool enabled;
+	ChiakiFrameTrace traces[CHIAKI_FRAME_TRACER_FRAMES]; // frames in flight, at frame_index % CHIAKI_FRAME_TRACER_FRAMES
+	ChiakiMetric *stage_latency[CHIAKI_FRAME_TRACE_STAGES_COUNT]; // ms since the previous stage reached, none for the first
+	ChiakiMetric *total_latency; // ms from the first unit to presentation
+	ChiakiMetric *incomplete; // traces finished without being presented
+	FILE *dump;
+} ChiakiFrameTracer;
+
+/**
+ * Tracing is enabled if metrics or dump_path is given.
+ *
+ * @param metrics registry for the latency histograms, may be NULL
+ * @param dump_path file to write raw traces to as CSV, may be NULL
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_tracer_init(ChiakiFrameTracer *tracer, ChiakiLog *log, ChiakiMetrics *metrics, const char *dump_path);
+
+/**
+ * Finishes all traces in flight as incomplete
+ */
+CHIAKI_EXPORT void chiaki_frame_tracer_fini(ChiakiFrameTracer *tracer);
+
+/**
+ * Start the trace of a frame with the arrival of its first and last unit.
+ */
+CHIAKI_EXPORT void chiaki_frame_tracer_begin(ChiakiFrameTracer *tracer, int32_t frame_index, uint64_t first_unit_us, uint64_t last_unit_us);
+
+/**
+ * Record that frame_index reached stage at now_us. Stages of frames that are not traced are ignored.
+ * Reaching CHIAKI_FRAME_TRACE_PRESENTED finishes the trace.
+ */
+CHIAKI_EXPORT void chiaki_frame_tracer_mark(ChiakiFrameTracer *tracer, int32_t frame_index, ChiakiFrameTraceStage stage, uint64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_FRAMETRACE_H
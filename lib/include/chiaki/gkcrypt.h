@@ -14,11 +14,17 @@
 extern "C" {
 #endif
 
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#endif
+
 #define CHIAKI_GKCRYPT_BLOCK_SIZE 0x10
-#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x20 // 2MB
+#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x200 // 2MB at most, the key buf grows and shrinks with the bitrate
 #define CHIAKI_GKCRYPT_GMAC_SIZE 4
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS 45000
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_IV_OFFSET 44910
+#define CHIAKI_GKCRYPT_AES_ROUND_KEYS_SIZE (11 * CHIAKI_GKCRYPT_BLOCK_SIZE) // AES-128
 
 typedef struct chiaki_key_state_t
 {
@@ -28,14 +34,10 @@ typedef struct chiaki_key_state_t
 typedef struct chiaki_gkcrypt_t {
 	uint8_t index;
 
-	uint8_t *key_buf; // circular buffer of the ctr mode key stream
-	uint64_t key_buf_size;
-	uint64_t key_buf_populated; // size of key_buf that is already populated (on startup)
-	uint64_t key_buf_key_pos_min; // minimal key pos currently in key_buf
-	size_t key_buf_start_offset; // offset in key_buf of the minimal key pos
-	uint64_t last_key_pos;        // last key pos that has been requested
+	uint64_t key_buf_size_max; // memory budget for the key stream buffer, 0 if no thread is used
+	struct chiaki_gkcrypt_key_ring_t *key_ring; // lock-free circular buffer of the ctr mode key stream, see gkcrypt.c
 	bool key_buf_thread_stop;
-	ChiakiMutex key_buf_mutex;
+	ChiakiMutex key_buf_mutex; // only for putting the thread to sleep and waking it up
 	ChiakiCond key_buf_cond;
 	ChiakiThread key_buf_thread;
 
@@ -44,24 +46,88 @@ typedef struct chiaki_gkcrypt_t {
 	uint8_t key_gmac_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint64_t key_gmac_index_current;
+
+	/**
+	 * AES set up with key_base once for generating the key stream, valid if key_stream_ctx_valid.
+	 */
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_context key_stream_aes; // only read while encrypting, so also used by the key buf thread
+	bool key_stream_aes_hw; // whether key_stream_round_keys is used with AES-NI/ARMv8 instead of key_stream_aes
+	uint8_t key_stream_round_keys[CHIAKI_GKCRYPT_AES_ROUND_KEYS_SIZE];
+#else
+	struct evp_cipher_ctx_st *key_stream_ctx;
+	struct evp_cipher_ctx_st *key_buf_thread_ctx; // a cipher ctx can't be shared between threads
+#endif
+	bool key_stream_ctx_valid;
+
+	/**
+	 * GCM context set up with key_gmac_current, so the key is only expanded again when it is rotated.
+	 * Created on first use, so key_gmac_current must only be changed through chiaki_gkcrypt_gen_new_gmac_key() after that.
+	 */
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context gmac_ctx;
+#else
+	struct evp_cipher_ctx_st *gmac_ctx;
+#endif
+	bool gmac_ctx_valid; // whether gmac_ctx is set up with the key of gmac_ctx_key_index
+	uint64_t gmac_ctx_key_index;
+
 	ChiakiLog *log;
 } ChiakiGKCrypt;
 
+typedef struct chiaki_gkcrypt_stats_t
+{
+	uint64_t key_buf_hits; // requests served from the key buffer
+	uint64_t key_buf_misses_ahead; // requests beyond the buffered key stream, generated on the calling thread instead
+	uint64_t key_buf_misses_late; // requests for key stream that was already dropped from the buffer
+	uint64_t key_buf_skips; // times the key buffer thread had to skip ahead to the requested key pos
+	uint64_t key_buf_resizes;
+	uint64_t key_buf_size; // current size of the key buffer in bytes
+	uint64_t key_pos_rate; // smoothed velocity of the requested key pos in bytes/s
+} ChiakiGKCryptStats;
+
 struct chiaki_session_t;
 
 /**
- * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream
+ * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream ahead into a buffer of at most this many 4KiB chunks.
+ * The buffer is sized from the observed key pos velocity and grows when the key stream had to be generated on the calling thread.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+/**
+ * chiaki_gkcrypt_get_key_stream(), chiaki_gkcrypt_decrypt() and chiaki_gkcrypt_encrypt() read the key stream from the key buffer
+ * without locking, so calls to them on the same ChiakiGKCrypt must not run concurrently.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+/**
+ * @return whether the key stream for [key_pos, key_pos + size) is currently in the key buffer
+ */
+CHIAKI_EXPORT bool chiaki_gkcrypt_key_stream_buffered(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size);
+
+/**
+ * Can be called from any thread while the ChiakiGKCrypt is in use. Counters are never reset.
+ */
+CHIAKI_EXPORT void chiaki_gkcrypt_get_stats(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptStats *stats);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+/**
+ * Same as chiaki_gkcrypt_decrypt(), but reading the encrypted data from src, which must not overlap buf unless it is buf.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt_to(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *buf, size_t buf_size);
+
 static inline ChiakiErrorCode chiaki_gkcrypt_encrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size) { return chiaki_gkcrypt_decrypt(gkcrypt, key_pos, buf, buf_size); }
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_gmac_key(uint64_t index, const uint8_t *key_base, const uint8_t *iv, uint8_t *key_out);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
+
+/**
+ * Not thread-safe, the same ChiakiGKCrypt must not be used for gmacs from multiple threads at the same time.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
 static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
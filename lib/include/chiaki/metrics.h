@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_METRICS_H
+#define CHIAKI_METRICS_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "sock.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum chiaki_metric_type_t
+{
+	CHIAKI_METRIC_COUNTER, // monotonically increasing integer
+	CHIAKI_METRIC_GAUGE, // arbitrary value
+	CHIAKI_METRIC_HISTOGRAM // distribution of observed values over fixed buckets
+} ChiakiMetricType;
+
+typedef struct chiaki_metrics_t ChiakiMetrics;
+typedef struct chiaki_metric_t ChiakiMetric;
+
+/**
+ * Called whenever a snapshot is taken, to update metrics from values that are only available by polling.
+ * Must not register metrics or collectors.
+ */
+typedef void (*ChiakiMetricsCollector)(ChiakiMetrics *metrics, void *user);
+
+/**
+ * Registry of named metrics.
+ * Registering takes a lock, updating a registered metric is lock-free and can happen from any thread.
+ */
+CHIAKI_EXPORT ChiakiMetrics *chiaki_metrics_new(void);
+CHIAKI_EXPORT void chiaki_metrics_free(ChiakiMetrics *metrics);
+
+/**
+ * Register a metric, or get the one that was already registered with the same name.
+ * The metric lives as long as metrics.
+ *
+ * @param metrics may be NULL, then NULL is returned
+ * @param name must match [a-zA-Z_:][a-zA-Z0-9_:]* like Prometheus metric names
+ * @param help optional description
+ * @return NULL on error, e.g. if name is invalid or a metric of another type is registered with the same name
+ */
+CHIAKI_EXPORT ChiakiMetric *chiaki_metrics_counter(ChiakiMetrics *metrics, const char *name, const char *help);
+CHIAKI_EXPORT ChiakiMetric *chiaki_metrics_gauge(ChiakiMetrics *metrics, const char *name, const char *help);
+
+/**
+ * @param buckets upper bounds of the buckets in ascending order, copied.
+ * Observations above the last bound only count for the implicit +Inf bucket.
+ */
+CHIAKI_EXPORT ChiakiMetric *chiaki_metrics_histogram(ChiakiMetrics *metrics, const char *name, const char *help, const double *buckets, size_t buckets_count);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_collector_add(ChiakiMetrics *metrics, ChiakiMetricsCollector cb, void *user);
+
+/**
+ * After this returns, cb is not running and will not be called with user anymore.
+ */
+CHIAKI_EXPORT void chiaki_metrics_collector_remove(ChiakiMetrics *metrics, ChiakiMetricsCollector cb, void *user);
+
+/**
+ * All of these do nothing if metric is NULL, so subsystems can report unconditionally.
+ */
+CHIAKI_EXPORT void chiaki_metric_add(ChiakiMetric *metric, uint64_t v); // counter
+CHIAKI_EXPORT void chiaki_metric_set(ChiakiMetric *metric, double v); // gauge, or counter that is kept elsewhere
+CHIAKI_EXPORT void chiaki_metric_observe(ChiakiMetric *metric, double v); // histogram
+
+typedef struct chiaki_metric_snapshot_t
+{
+	const char *name; // owned by the registry
+	const char *help; // owned by the registry, may be NULL
+	ChiakiMetricType type;
+	double value; // counter or gauge
+
+	// histogram only
+	uint64_t count;
+	double sum;
+	size_t buckets_count;
+	const double *buckets; // upper bounds, owned by the registry
+	uint64_t *bucket_counts; // cumulative like in Prometheus, buckets_count entries without +Inf, which is count
+} ChiakiMetricSnapshot;
+
+typedef struct chiaki_metrics_snapshot_t
+{
+	uint64_t timestamp_ms; // unix time
+	ChiakiMetricSnapshot *metrics;
+	size_t metrics_count;
+} ChiakiMetricsSnapshot;
+
+/**
+ * Run all collectors and take a snapshot of all metrics.
+ * Values of different metrics may be taken at slightly different times.
+ * The snapshot must be finished with chiaki_metrics_snapshot_fini() and not outlive metrics.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_snapshot(ChiakiMetrics *metrics, ChiakiMetricsSnapshot *snapshot);
+CHIAKI_EXPORT void chiaki_metrics_snapshot_fini(ChiakiMetricsSnapshot *snapshot);
+
+typedef enum chiaki_metrics_format_t
+{
+	CHIAKI_METRICS_FORMAT_JSON_LINES, // one JSON object per snapshot and line
+	CHIAKI_METRICS_FORMAT_PROMETHEUS // Prometheus text exposition format
+} ChiakiMetricsFormat;
+
+/**
+ * @param out receives a null-terminated string, to be freed with free()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_format(ChiakiMetricsSnapshot *snapshot, ChiakiMetricsFormat format, char **out, size_t *out_size);
+
+/**
+ * Periodically writes snapshots of metrics on its own thread.
+ *
+ * If path starts with "unix:", the rest is the path of a stream Unix socket to connect to,
+ * which is reconnected if it goes away, otherwise path is a file.
+ * JSON lines are appended to the file, Prometheus text replaces it atomically after every snapshot,
+ * like the textfile collector of node_exporter expects.
+ */
+typedef struct chiaki_metrics_exporter_t
+{
+	ChiakiMetrics *metrics;
+	ChiakiLog *log;
+	ChiakiMetricsFormat format;
+	char *path;
+	bool unix_socket;
+	uint64_t interval_ms;
+	FILE *file; // for appending json lines
+	chiaki_socket_t sock;
+	ChiakiThread thread;
+	ChiakiBoolPredCond stop_cond;
+} ChiakiMetricsExporter;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_exporter_start(ChiakiMetricsExporter *exporter, ChiakiMetrics *metrics, ChiakiLog *log,
+		ChiakiMetricsFormat format, const char *path, uint64_t interval_ms);
+
+/**
+ * Write a last snapshot, then stop and join the thread
+ */
+CHIAKI_EXPORT void chiaki_metrics_exporter_stop(ChiakiMetricsExporter *exporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_METRICS_H
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_PACKETPOOL_H
+#define CHIAKI_PACKETPOOL_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_packet_pool_stats_t
+{
+	uint64_t hits; // allocations served from the pool
+	uint64_t misses; // allocations that had to fall back to the heap because the pool was exhausted
+	size_t in_use; // buffers currently referenced, including heap fallbacks
+	size_t high_water; // maximum of in_use since init or the last reset
+} ChiakiPacketPoolStats;
+
+/**
+ * Pool of fixed-size, reference counted packet buffers.
+ *
+ * All buffers are carved out of a single slab at init, so steady-state
+ * allocation and release never touch the heap. When the pool is exhausted,
+ * buffers are allocated from the heap and freed again on their last unref.
+ */
+typedef struct chiaki_packet_pool_t
+{
+	ChiakiMutex mutex;
+	size_t buf_size;
+	size_t count;
+	uint8_t *slab;
+	struct chiaki_packet_pool_buf_header_t *free_list;
+	ChiakiPacketPoolStats stats;
+} ChiakiPacketPool;
+
+/**
+ * @param buf_size usable size of each buffer
+ * @param count number of buffers preallocated in the pool
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t buf_size, size_t count);
+
+/**
+ * All buffers must have been released before calling this.
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool);
+
+/**
+ * Get a buffer of pool->buf_size bytes with a reference count of 1.
+ *
+ * Thread-safe.
+ * @return the buffer or NULL if the pool was exhausted and the heap fallback failed
+ */
+CHIAKI_EXPORT uint8_t *chiaki_packet_pool_alloc(ChiakiPacketPool *pool);
+
+/**
+ * Take an additional reference on a buffer returned by chiaki_packet_pool_alloc().
+ *
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_ref(uint8_t *buf);
+
+/**
+ * Release a reference, returning the buffer to its pool when it was the last one.
+ *
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_unref(uint8_t *buf);
+
+/**
+ * Thread-safe.
+ * @param reset whether to reset hits, misses and high_water after reading them
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_get_stats(ChiakiPacketPool *pool, ChiakiPacketPoolStats *stats, bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_PACKETPOOL_H
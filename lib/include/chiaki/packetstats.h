@@ -6,30 +6,107 @@
 #include "thread.h"
 #include "seqnum.h"
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef struct chiaki_packet_stats_t
+/**
+ * Bucket i counts loss bursts of 2^i to 2^(i+1)-1 packets, the last one also all longer bursts
+ */
+#define CHIAKI_PACKET_STATS_BURST_BUCKETS 8
+
+/**
+ * Bucket 0 counts generations without loss,
+ * bucket i > 0 the ones that lost more than chiaki_packet_stats_frame_loss_bucket_max(i - 1)
+ * and at most chiaki_packet_stats_frame_loss_bucket_max(i) percent of their packets.
+ */
+#define CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS 8
+
+typedef struct chiaki_packet_stats_snapshot_t
 {
-	ChiakiMutex mutex;
+	// since init, not affected by reset
+	uint64_t received;
+	uint64_t lost; // without local_dropped
+	uint64_t local_dropped;
 
-	// For generations of packets, i.e. where we know the number of expected packets per generation
-	uint64_t gen_received;
-	uint64_t gen_lost;
+	/**
+	 * Runs of consecutive lost packets by length, see CHIAKI_PACKET_STATS_BURST_BUCKETS.
+	 * Bursts of generations are only known for chiaki_packet_stats_push_generation_units().
+	 */
+	uint64_t loss_bursts[CHIAKI_PACKET_STATS_BURST_BUCKETS];
+
+	/**
+	 * Generations, i.e. video frames, by the fraction of their packets that was lost,
+	 * see CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS
+	 */
+	uint64_t frame_loss[CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS];
+} ChiakiPacketStatsSnapshot;
+
+typedef struct chiaki_packet_stats_counters_t ChiakiPacketStatsCounters;
+
+/**
+ * Pushing is lock-free. Generations must be pushed from one thread at a time,
+ * sequential packets from one thread at a time, which may be a different one.
+ */
+typedef struct chiaki_packet_stats_t
+{
+	ChiakiPacketStatsCounters *counters;
 
-	// For sequential packets, i.e. where packets are identified by a sequence number
+	// state of the last reset, protected by mutex
+	ChiakiMutex mutex;
+	uint64_t gen_received_reset;
+	uint64_t gen_lost_reset;
 	ChiakiSeqNum16 seq_min; // sequence number that was max at the last reset
-	ChiakiSeqNum16 seq_max; // currently maximal sequence number
-	uint64_t seq_received; // total received packets since the last reset
+	uint64_t seq_received_reset;
+	uint64_t local_dropped_reset;
 } ChiakiPacketStats;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats);
+
+/**
+ * For generations of packets, i.e. where we know the number of expected packets per generation
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost);
+
+/**
+ * Like chiaki_packet_stats_push_generation(), but also counts loss bursts,
+ * which may continue from the previous generation.
+ *
+ * @param units_received bitmap of the received packets of the generation
+ * @param units_expected number of packets in the generation
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_push_generation_units(ChiakiPacketStats *stats, const uint64_t *units_received, size_t units_expected);
+
+/**
+ * For sequential packets, i.e. where packets are identified by a sequence number
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num);
-CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost);
+
+/**
+ * Packets that never reached us because the local socket receive buffer overflowed.
+ * They show up as lost in the counters, but are not caused by the network.
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_push_local_drops(ChiakiPacketStats *stats, uint64_t dropped);
+
+/**
+ * @param lost packets lost on the network, i.e. without the ones dropped locally
+ * @param local_dropped optional, packets dropped locally by the kernel
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost, uint64_t *local_dropped);
+
+/**
+ * Get the totals and histograms since init, without resetting anything
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_snapshot(ChiakiPacketStats *stats, ChiakiPacketStatsSnapshot *snapshot);
+
+/**
+ * @return upper bound in percent of the lost packets of a generation in the given bucket of ChiakiPacketStatsSnapshot.frame_loss
+ */
+CHIAKI_EXPORT unsigned int chiaki_packet_stats_frame_loss_bucket_max(size_t bucket);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_REACTOR_H
+#define CHIAKI_REACTOR_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_REACTOR_TIMER_IDLE UINT64_MAX
+
+/**
+ * Called on the reactor thread when the timer is due.
+ *
+ * @return delay in ms until the timer should run again or CHIAKI_REACTOR_TIMER_IDLE to park it
+ * until the next chiaki_reactor_timer_schedule()
+ */
+typedef uint64_t (*ChiakiReactorTimerCb)(void *user);
+
+typedef struct chiaki_reactor_timer_t
+{
+	ChiakiReactorTimerCb cb;
+	void *user;
+	uint64_t due_ms; // chiaki_time_now_monotonic_ms() or CHIAKI_REACTOR_TIMER_IDLE
+	struct chiaki_reactor_timer_t *next;
+} ChiakiReactorTimer;
+
+/**
+ * A single thread running the periodic work of many components as timers,
+ * instead of each of them sleeping on a thread of its own.
+ */
+typedef struct chiaki_reactor_t
+{
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop;
+	ChiakiReactorTimer *timers;
+	ChiakiReactorTimer *running; // timer whose callback is currently executing
+} ChiakiReactor;
+
+/**
+ * Init the reactor and start its thread.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_init(ChiakiReactor *reactor);
+
+/**
+ * Stop and join the thread. All timers must have been removed before.
+ */
+CHIAKI_EXPORT void chiaki_reactor_fini(ChiakiReactor *reactor);
+
+/**
+ * Register timer, which is owned by the caller and must stay valid until removed.
+ *
+ * Thread-safe.
+ * @param delay_ms delay until the first run or CHIAKI_REACTOR_TIMER_IDLE to start parked
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_timer_add(ChiakiReactor *reactor, ChiakiReactorTimer *timer, ChiakiReactorTimerCb cb, void *user, uint64_t delay_ms);
+
+/**
+ * Unregister timer. If its callback is currently running, this waits for it to return,
+ * so it must not be called from the timer's own callback.
+ *
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_reactor_timer_remove(ChiakiReactor *reactor, ChiakiReactorTimer *timer);
+
+/**
+ * Make timer run after delay_ms, or earlier if it is already due earlier.
+ *
+ * Thread-safe, also from within any timer callback.
+ */
+CHIAKI_EXPORT void chiaki_reactor_timer_schedule(ChiakiReactor *reactor, ChiakiReactorTimer *timer, uint64_t delay_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_REACTOR_H
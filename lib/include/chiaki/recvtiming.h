@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_RECVTIMING_H
+#define CHIAKI_RECVTIMING_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_takion_recv_time_t ChiakiTakionRecvTime;
+
+typedef struct chiaki_recv_timing_stats_t
+{
+	uint64_t packets; // packets pushed since the last reset
+	uint64_t packets_kernel; // of those, packets with a kernel receive timestamp
+
+	/**
+	 * Time between arrival in the kernel and being read from the socket, only over packets_kernel
+	 */
+	uint64_t queue_delay_avg_us;
+	uint64_t queue_delay_max_us;
+
+	uint64_t frames; // frames pushed since the last reset
+
+	/**
+	 * Time between arrival of the first and the last packet of a frame
+	 */
+	uint64_t frame_spread_avg_us;
+	uint64_t frame_spread_max_us;
+
+	/**
+	 * Smoothed variation of the time between the first packets of consecutive frames,
+	 * estimated like the RFC 3550 interarrival jitter. Not affected by reset.
+	 */
+	double jitter_us;
+} ChiakiRecvTimingStats;
+
+/**
+ * Receive timing of one stream of packets, e.g. video or audio.
+ */
+typedef struct chiaki_recv_timing_t
+{
+	ChiakiMutex mutex;
+	ChiakiRecvTimingStats stats;
+	uint64_t queue_delay_sum_us;
+	uint64_t frame_spread_sum_us;
+	uint64_t frame_arrival_prev_us; // 0 if no frame was pushed yet
+	int64_t frame_interarrival_prev_us; // -1 if unknown
+} ChiakiRecvTiming;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recv_timing_init(ChiakiRecvTiming *timing);
+CHIAKI_EXPORT void chiaki_recv_timing_fini(ChiakiRecvTiming *timing);
+CHIAKI_EXPORT void chiaki_recv_timing_push_packet(ChiakiRecvTiming *timing, const ChiakiTakionRecvTime *recv_time);
+
+/**
+ * @param first_arrival_us arrival of the first packet of the frame that was received
+ * @param last_arrival_us arrival of the last packet of the frame that was received
+ */
+CHIAKI_EXPORT void chiaki_recv_timing_push_frame(ChiakiRecvTiming *timing, uint64_t first_arrival_us, uint64_t last_arrival_us);
+CHIAKI_EXPORT void chiaki_recv_timing_get(ChiakiRecvTiming *timing, ChiakiRecvTimingStats *stats, bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_RECVTIMING_H
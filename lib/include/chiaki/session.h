@@ -13,10 +13,14 @@
 #include "ecdh.h"
 #include "audio.h"
 #include "controller.h"
+#include "videobuffer.h"
 #include "stoppipe.h"
+#include "reactor.h"
 #include "remote/holepunch.h"
 #include "remote/rudp.h"
 #include "regist.h"
+#include "metrics.h"
+#include "frametrace.h"
 
 #include <stdint.h>
 
@@ -86,6 +90,11 @@ typedef struct chiaki_connect_info_t
 	chiaki_socket_t *rudp_sock;
 	uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
 	double packet_loss_max;
+	bool single_reactor; // run periodic stream workers (resends, congestion control, feedback, heartbeats) as timers on one thread
+	bool enable_recv_timestamps; // use kernel receive timestamps for ChiakiRecvTiming where supported
+	unsigned int send_coalesce_ms; // hold outgoing stream packets back for at most this long to send them in batches, 0 to disable
+	ChiakiMetrics *metrics; // optional registry to report into, must outlive the session
+	const char *frame_trace_path; // optional file to write per-frame latency traces to as CSV
 } ChiakiConnectInfo;
 
 
@@ -186,10 +195,18 @@ typedef struct chiaki_event_t
 typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
 
 /**
- * buf will always have an allocated padding of at least CHIAKI_VIDEO_BUFFER_PADDING_SIZE after buf_size
+ * buf will always have an allocated padding of at least CHIAKI_VIDEO_BUFFER_PADDING_SIZE zero bytes after buf_size.
+ * It is a reference counted video buffer from a ChiakiVideoBufferPool (see videobuffer.h), not plain memory:
+ * the caller keeps its own reference only for the duration of the call, so to use buf afterwards,
+ * e.g. to hand it to a decoder without copying, take a reference with chiaki_video_buffer_ref()
+ * and release it with chiaki_video_buffer_unref() (or chiaki_video_buffer_av_free() for FFmpeg) when done.
+ * It must never be passed to free() and must not be written to unless chiaki_video_buffer_unique() says so.
+ * Called in frame order from the video assembly thread.
+ * frame_index is the index of the frame in the stream, e.g. to follow it through the decoder for ChiakiFrameTracer,
+ * or -1 for samples that are not a frame, like the codec header sent before the first frame of a new profile.
  * @return whether the sample was successfully pushed into the decoder. On false, a corrupt frame will be reported to get a new keyframe.
  */
-typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
+typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, int32_t frame_index, void *user);
 
 
 
@@ -208,6 +225,8 @@ typedef struct chiaki_session_t
 		bool video_profile_auto_downgrade;
 		bool enable_keyboard;
 		bool enable_dualsense;
+		bool enable_recv_timestamps;
+		unsigned int send_coalesce_ms;
 		uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
 	} connect_info;
 
@@ -220,6 +239,7 @@ typedef struct chiaki_session_t
 	uint32_t mtu_in;
 	uint32_t mtu_out;
 	uint64_t rtt_us;
+	bool rtt_measured; // false if rtt_us is only a fallback value
 	ChiakiECDH ecdh;
 
 	ChiakiQuitReason quit_reason;
@@ -238,6 +258,8 @@ typedef struct chiaki_session_t
 	ChiakiCond state_cond;
 	ChiakiMutex state_mutex;
 	ChiakiStopPipe stop_pipe;
+	ChiakiReactor reactor; // only initialized if reactor_enabled
+	bool reactor_enabled;
 	bool should_stop;
 	bool ctrl_failed;
 	bool ctrl_session_id_received;
@@ -254,6 +276,8 @@ typedef struct chiaki_session_t
 	ChiakiRudp rudp;
 
 	ChiakiLog *log;
+	ChiakiMetrics *metrics; // may be NULL
+	ChiakiFrameTracer frame_tracer; // enabled if metrics or frame_trace_path is given
 
 	ChiakiStreamConnection stream_connection;
 
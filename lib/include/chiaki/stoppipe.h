@@ -32,6 +32,9 @@ typedef struct chiaki_stop_pipe_t
 	// this fd is audited by 'select' as
 	// fd_set *readfds
 	int fd;
+#elif defined(__linux__)
+	// eventfd, waited on with poll() together with the socket
+	int fd;
 #else
 	int fds[2];
 #endif
@@ -11,6 +11,9 @@
 #include "audioreceiver.h"
 #include "videoreceiver.h"
 #include "congestioncontrol.h"
+#include "recvtiming.h"
+#include "streamstats.h"
+#include "metrics.h"
 
 #include <stdbool.h>
 
@@ -30,6 +33,9 @@ typedef struct chiaki_stream_connection_t
 	ChiakiGKCrypt *gkcrypt_remote;
 
 	ChiakiPacketStats packet_stats;
+	ChiakiRecvTiming video_recv_timing;
+	ChiakiRecvTiming audio_recv_timing;
+	ChiakiStreamStatsHistory video_stats_history; // of assembled frames, for frontends to poll
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
 	ChiakiAudioReceiver *haptics_receiver;
@@ -37,6 +43,7 @@ typedef struct chiaki_stream_connection_t
 	uint32_t motion_counter;
 	ChiakiFeedbackSender feedback_sender;
 	ChiakiCongestionControl congestion_control;
+	ChiakiReactorTimer heartbeat_timer; // used instead of waking up state_cond if takion.reactor is set
 	/**
 	 * whether feedback_sender is initialized
 	 * only if this is true, feedback_sender may be accessed!
@@ -65,6 +72,30 @@ typedef struct chiaki_stream_connection_t
 	char *remote_disconnect_reason;
 
 	double measured_bitrate;
+
+	struct
+	{
+		ChiakiMetric *packets_received;
+		ChiakiMetric *packets_lost;
+		ChiakiMetric *packets_local_dropped;
+		ChiakiMetric *packet_loss;
+		ChiakiMetric *congestion_state;
+		ChiakiMetric *video_bitrate;
+		ChiakiMetric *video_bitrate_ewma;
+		ChiakiMetric *video_bitrate_p95;
+		ChiakiMetric *video_fps_ewma;
+		ChiakiMetric *video_frame_size_max_p95;
+		ChiakiMetric *video_keyframe_size_ewma;
+		ChiakiMetric *video_jitter;
+		ChiakiMetric *audio_jitter;
+		ChiakiMetric *key_buf_hits;
+		ChiakiMetric *key_buf_misses_ahead;
+		ChiakiMetric *key_buf_misses_late;
+		ChiakiMetric *key_buf_skips;
+		ChiakiMetric *key_buf_resizes;
+		ChiakiMetric *key_buf_size;
+		ChiakiMetric *key_pos_rate;
+	} metrics; // updated by collectors of session->metrics, the key_buf ones only once the remote GKCrypt exists
 } ChiakiStreamConnection;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session, double packet_loss_max);
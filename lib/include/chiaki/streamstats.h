@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_STREAMSTATS_H
+#define CHIAKI_STREAMSTATS_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_stream_stats_t
+{
+	uint64_t frames;
+	uint64_t bytes;
+} ChiakiStreamStats;
+
+CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats);
+CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size);
+CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate);
+
+#define CHIAKI_STREAM_STATS_HISTORY_SECONDS 60
+
+/**
+ * Stats of the frames of one second
+ */
+typedef struct chiaki_stream_stats_sample_t
+{
+	uint64_t start_us; // beginning of the second
+	uint64_t frames; // successfully assembled frames
+	uint64_t bytes; // of those frames
+	uint64_t frame_size_max;
+	uint64_t keyframes;
+	uint64_t keyframe_bytes;
+	uint64_t frames_fec_recovered; // frames that could only be assembled with fec
+	uint64_t frames_failed; // frames that could not be assembled
+} ChiakiStreamStatsSample;
+
+typedef enum chiaki_stream_stats_metric_t
+{
+	CHIAKI_STREAM_STATS_METRIC_BITRATE, // bits per second
+	CHIAKI_STREAM_STATS_METRIC_FRAMES,
+	CHIAKI_STREAM_STATS_METRIC_FRAME_SIZE_MAX,
+	CHIAKI_STREAM_STATS_METRIC_KEYFRAME_SIZE, // average, seconds without keyframes are skipped
+	CHIAKI_STREAM_STATS_METRIC_FRAMES_FEC_RECOVERED,
+	CHIAKI_STREAM_STATS_METRIC_FRAMES_FAILED,
+	CHIAKI_STREAM_STATS_METRIC_COUNT
+} ChiakiStreamStatsMetric;
+
+/**
+ * Fixed-size ring of per-second samples of a stream, with running EWMAs of every metric.
+ * All functions are thread-safe and take the current time as now_us, usually chiaki_time_now_monotonic_us(),
+ * so seconds without any frames are accounted for even if nothing is pushed.
+ * Only completed seconds are considered by queries.
+ */
+typedef struct chiaki_stream_stats_history_t
+{
+	ChiakiMutex mutex;
+	ChiakiStreamStatsSample samples[CHIAKI_STREAM_STATS_HISTORY_SECONDS];
+	size_t samples_count;
+	size_t samples_next; // where the next completed sample goes
+	ChiakiStreamStatsSample cur; // second in progress, start_us is 0 before the first frame
+	double ewma[CHIAKI_STREAM_STATS_METRIC_COUNT];
+	bool ewma_valid[CHIAKI_STREAM_STATS_METRIC_COUNT];
+} ChiakiStreamStatsHistory;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_stats_history_init(ChiakiStreamStatsHistory *history);
+CHIAKI_EXPORT void chiaki_stream_stats_history_fini(ChiakiStreamStatsHistory *history);
+CHIAKI_EXPORT void chiaki_stream_stats_history_reset(ChiakiStreamStatsHistory *history);
+
+CHIAKI_EXPORT void chiaki_stream_stats_history_frame(ChiakiStreamStatsHistory *history, uint64_t now_us, uint64_t size, bool keyframe, bool fec_recovered);
+CHIAKI_EXPORT void chiaki_stream_stats_history_frame_failed(ChiakiStreamStatsHistory *history, uint64_t now_us);
+
+/**
+ * Copy the most recent completed samples, oldest first
+ *
+ * @return number of samples written to samples, at most samples_max
+ */
+CHIAKI_EXPORT size_t chiaki_stream_stats_history_samples(ChiakiStreamStatsHistory *history, uint64_t now_us, ChiakiStreamStatsSample *samples, size_t samples_max);
+
+/**
+ * @param value receives the exponentially weighted moving average of metric over completed seconds
+ * @return false if there is no value yet
+ */
+CHIAKI_EXPORT bool chiaki_stream_stats_history_ewma(ChiakiStreamStatsHistory *history, uint64_t now_us, ChiakiStreamStatsMetric metric, double *value);
+
+/**
+ * @param percentile in [0, 100], nearest-rank over the completed seconds in the ring, e.g. 50 for the median
+ * @param value receives the percentile of metric
+ * @return false if there is no value yet
+ */
+CHIAKI_EXPORT bool chiaki_stream_stats_history_percentile(ChiakiStreamStatsHistory *history, uint64_t now_us, ChiakiStreamStatsMetric metric, double percentile, double *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_STREAMSTATS_H
@@ -8,12 +8,16 @@
 #include "log.h"
 #include "gkcrypt.h"
 #include "seqnum.h"
-#include "stoppipe.h"
+#include "eventloop.h"
+#include "reactor.h"
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
+#include "packetpool.h"
+#include "packetstats.h"
 
 #include <stdbool.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -31,6 +35,16 @@ typedef enum chiaki_takion_message_data_type_t {
 	CHIAKI_TAKION_MESSAGE_DATA_TYPE_TRIGGER_EFFECTS = 11,
 } ChiakiTakionMessageDataType;
 
+/**
+ * When a packet was received, all in the chiaki_time_now_monotonic_us() domain
+ */
+typedef struct chiaki_takion_recv_time_t
+{
+	uint64_t arrival_us; // arrival in the kernel if kernel is true, else same as read_us
+	uint64_t read_us; // when the packet was read from the socket
+	bool kernel; // whether arrival_us is a kernel receive timestamp (SO_TIMESTAMPNS)
+} ChiakiTakionRecvTime;
+
 typedef struct chiaki_takion_av_packet_t
 {
 	ChiakiSeqNum16 packet_index;
@@ -50,8 +64,29 @@ typedef struct chiaki_takion_av_packet_t
 
 	uint8_t *data; // not owned
 	size_t data_size;
+
+	/**
+	 * If not NULL, data is still encrypted and must be read with chiaki_takion_av_packet_read_data(),
+	 * so it can be decrypted straight into its final place.
+	 */
+	ChiakiGKCrypt *gkcrypt;
+
+	ChiakiTakionRecvTime recv_time;
 } ChiakiTakionAVPacket;
 
+/**
+ * Copy the first size bytes of packet->data to buf, decrypting them if packet->gkcrypt is set.
+ */
+static inline ChiakiErrorCode chiaki_takion_av_packet_read_data(ChiakiTakionAVPacket *packet, uint8_t *buf, size_t size)
+{
+	if(size > packet->data_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	if(packet->gkcrypt)
+		return chiaki_gkcrypt_decrypt_to(packet->gkcrypt, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, buf, size);
+	memcpy(buf, packet->data, size);
+	return CHIAKI_ERR_SUCCESS;
+}
+
 static inline uint8_t chiaki_takion_av_packet_audio_unit_size(ChiakiTakionAVPacket *packet)				{ return packet->units_in_frame_fec >> 8; }
 static inline uint8_t chiaki_takion_av_packet_audio_source_units_count(ChiakiTakionAVPacket *packet)	{ return packet->units_in_frame_fec & 0xf; }
 static inline uint8_t chiaki_takion_av_packet_audio_fec_units_count(ChiakiTakionAVPacket *packet)		{ return (packet->units_in_frame_fec >> 4) & 0xf; }
@@ -109,8 +144,92 @@ typedef struct chiaki_takion_connect_info_t
 	bool enable_dualsense;
 	uint8_t protocol_version;
 	bool close_socket; // close socket when finishing takion
+
+	/**
+	 * If non-NULL, periodic work like re-sending unacked packets runs as timers on this reactor
+	 * instead of on threads of its own. Must outlive the ChiakiTakion.
+	 */
+	ChiakiReactor *reactor;
+
+	/**
+	 * Request kernel receive timestamps for ChiakiTakionAVPacket.recv_time where supported (Linux).
+	 * Otherwise, only the time the packet was read from the socket is available.
+	 */
+	bool enable_recv_timestamps;
+
+	/**
+	 * Bitrate of the stream in kbit/s to size the socket receive buffer for, 0 if unknown
+	 */
+	unsigned int rcvbuf_bitrate;
+
+	/**
+	 * If non-NULL, datagrams dropped by the kernel because the socket receive buffer was full
+	 * are reported here as local drops. Must outlive the ChiakiTakion.
+	 */
+	ChiakiPacketStats *packet_stats;
+
+	/**
+	 * Maximum time in ms an outgoing datagram may be held back to be sent together with others
+	 * in a single system call (Linux, sendmmsg). 0 sends every datagram immediately.
+	 */
+	unsigned int send_coalesce_ms;
+
+	/**
+	 * Round trip time measured beforehand, e.g. by senkusha, to start the resend timeout from. 0 if unknown.
+	 */
+	uint64_t rtt_initial_us;
 } ChiakiTakionConnectInfo;
 
+/**
+ * Maximum number of datagrams pulled from the socket by a single receive call
+ */
+#define CHIAKI_TAKION_RECV_BATCH_SIZE 32
+
+typedef struct chiaki_takion_recv_stats_t
+{
+	uint64_t batches; // receive calls that returned at least one datagram
+	uint64_t packets; // datagrams received in total
+	uint64_t batch_max; // largest number of datagrams returned by one receive call
+	uint64_t batches_full; // receive calls that filled all CHIAKI_TAKION_RECV_BATCH_SIZE slots
+	uint64_t waits; // times the socket was drained and the thread had to block
+	uint64_t kernel_drops; // datagrams dropped by the kernel because the socket receive buffer was full
+} ChiakiTakionRecvStats;
+
+/**
+ * Maximum number of datagrams held back by the send queue and sent by a single send call
+ */
+#define CHIAKI_TAKION_SEND_BATCH_SIZE 32
+
+typedef struct chiaki_takion_send_stats_t
+{
+	uint64_t datagrams; // datagrams sent in total
+	uint64_t syscalls; // send calls made for them
+	uint64_t batch_max; // largest number of datagrams sent by one send call
+	uint64_t flushes_full; // times the queue was flushed because all CHIAKI_TAKION_SEND_BATCH_SIZE slots were used
+	uint64_t flushes_deadline; // times the queue was flushed because its oldest datagram reached send_coalesce_ms
+	uint64_t delay_max_us; // longest time a datagram was held back
+} ChiakiTakionSendStats;
+
+struct chiaki_takion_send_counters_t;
+
+/**
+ * Outgoing datagrams waiting to be sent together
+ */
+typedef struct chiaki_takion_send_queue_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	uint64_t coalesce_ms; // 0 if disabled, then none of the below is used
+	uint8_t *bufs; // CHIAKI_TAKION_SEND_BATCH_SIZE slots of one MTU each
+	size_t sizes[CHIAKI_TAKION_SEND_BATCH_SIZE];
+	size_t count;
+	uint64_t oldest_us; // time the first queued datagram was queued
+	bool should_stop;
+	ChiakiThread thread; // flushes at the deadline if there is no reactor
+	ChiakiReactorTimer timer; // flushes at the deadline if there is a reactor
+	struct chiaki_takion_send_counters_t *counters; // atomic, so sending without coalescing doesn't need mutex
+} ChiakiTakionSendQueue;
+
 
 typedef struct chiaki_takion_t
 {
@@ -149,10 +268,16 @@ typedef struct chiaki_takion_t
 	void *cb_user;
 	chiaki_socket_t sock;
 	ChiakiThread thread;
-	ChiakiStopPipe stop_pipe;
+	ChiakiEventLoop event_loop;
 	uint32_t tag_local;
 	uint32_t tag_remote;
 	bool close_socket;
+	ChiakiReactor *reactor; // may be NULL
+	bool recv_timestamps; // whether kernel receive timestamps are enabled on sock
+	bool recv_overflow; // whether SO_RXQ_OVFL is enabled on sock
+	uint32_t recv_overflow_count; // last drop counter reported by the kernel
+	ChiakiPacketStats *packet_stats; // may be NULL
+	uint64_t rtt_initial_us; // 0 if unknown
 
 	ChiakiSeqNum32 seq_num_local;
 	ChiakiMutex seq_num_local_mutex;
@@ -167,6 +292,16 @@ typedef struct chiaki_takion_t
 	ChiakiKeyState key_state;
 
 	bool enable_dualsense;
+
+	ChiakiTakionRecvStats recv_stats;
+	ChiakiMutex recv_stats_mutex;
+
+	ChiakiTakionSendQueue send_queue;
+
+	/**
+	 * Fixed-MTU buffers all received packets live in. Use chiaki_packet_pool_get_stats() to read its counters.
+	 */
+	ChiakiPacketPool packet_pool;
 } ChiakiTakion;
 
 
@@ -182,6 +317,22 @@ static inline void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *
 	takion->gkcrypt_remote = gkcrypt_remote;
 }
 
+/**
+ * Get the counters of the batched receive path.
+ *
+ * Thread-safe while Takion is running.
+ * @param reset whether to reset the counters after reading them
+ */
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats, bool reset);
+
+/**
+ * Get the counters of the send path.
+ *
+ * Thread-safe while Takion is running.
+ * @param reset whether to reset the counters after reading them
+ */
+CHIAKI_EXPORT void chiaki_takion_get_send_stats(ChiakiTakion *takion, ChiakiTakionSendStats *stats, bool reset);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint64_t key_pos, uint8_t *mac_out, uint8_t *mac_old_out);
 
 /**
@@ -193,12 +344,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uin
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, uint64_t *key_pos);
 
 /**
- * Send a datagram directly on the socket.
+ * Send a datagram on the socket.
+ *
+ * If send_coalesce_ms is non-zero, the datagram may be queued to be sent together with others
+ * at most send_coalesce_ms later, in which case errors from the socket are only logged.
  *
  * Thread-safe while Takion is running.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size);
 
+/**
+ * Send all datagrams queued by chiaki_takion_send_raw() now.
+ *
+ * Thread-safe while Takion is running.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_flush(ChiakiTakion *takion);
+
 /**
  * Calculate the MAC for the packet depending on the type derived from the first byte in buf,
  * assign MAC inside buf at the respective position and send the packet.
@@ -211,6 +372,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *
  * Thread-safe while Takion is running.
  *
  * @param optional pointer to write the sequence number of the sent packet to
+ * @return CHIAKI_ERR_OVERFLOW if the packet was sent, but the send buffer is full, so it will not be re-sent
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *takion, uint8_t chunk_flags, uint16_t channel, uint8_t *buf, size_t buf_size, ChiakiSeqNum32 *seq_num);
 
@@ -7,6 +7,7 @@
 #include "log.h"
 #include "thread.h"
 #include "seqnum.h"
+#include "reactor.h"
 
 #include <stdbool.h>
 
@@ -18,26 +19,70 @@ typedef struct chiaki_takion_t ChiakiTakion;
 
 typedef struct chiaki_takion_send_buffer_packet_t ChiakiTakionSendBufferPacket;
 
+/**
+ * Number of buckets of the resend timer wheel.
+ * Together with the tick length, this covers the maximum resend timeout, so no packet ever has to wait for a second round.
+ */
+#define CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS 256
+
+/**
+ * @return monotonic time in microseconds
+ */
+typedef uint64_t (*ChiakiTakionSendBufferClock)(void *user);
+
 typedef struct chiaki_takion_send_buffer_t
 {
 	ChiakiLog *log;
 	ChiakiTakion *takion;
 
+	/**
+	 * Ring indexed by seq num, so only packets whose seq nums span at most packets_size can be in flight
+	 */
 	ChiakiTakionSendBufferPacket *packets;
-	size_t packets_size; // allocated size
+	size_t packets_alloc; // allocated size, power of two >= packets_size
+	size_t packets_size; // max number of packets in flight
 	size_t packets_count; // current count
+	ChiakiSeqNum32 seq_num_begin; // no packet in flight is lower than this
+	ChiakiSeqNum32 seq_num_end; // all packets in flight are lower than this
+
+	/**
+	 * Packets in flight by the time they are due to be re-sent
+	 */
+	ChiakiTakionSendBufferPacket *wheel[CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS];
+	uint64_t wheel_tick; // all ticks before this one have been handled
+
+	/**
+	 * Round trip time estimation like RFC 6298, from acks of packets that were not re-sent
+	 */
+	bool rtt_valid;
+	uint64_t srtt_us;
+	uint64_t rttvar_us;
+	uint64_t rto_us; // current resend timeout, doubled for every try of a packet
+
+	uint64_t resends; // packets re-sent in total
+	uint64_t give_ups; // packets dropped because they, or a later packet, hit the max number of tries
+
+	ChiakiTakionSendBufferClock clock; // chiaki_time_now_monotonic_us() by default, can be replaced for unit testing
+	void *clock_user;
 
 	ChiakiMutex mutex;
 	ChiakiCond cond;
 	bool should_stop;
 	ChiakiThread thread;
+
+	ChiakiReactor *reactor; // if non-NULL, resends run from resend_timer instead of thread
+	ChiakiReactorTimer resend_timer;
 } ChiakiTakionSendBuffer;
 
 
 /**
  * Init a Send Buffer and start a thread that automatically re-sends packets on takion.
+ * If takion has a reactor, a timer on it is used instead of the thread.
+ *
+ * The resend timeout starts out from takion->rtt_initial_us if known and adapts to the measured round trip time.
  *
- * @param takion if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
+ * @param takion if NULL, the Send Buffer thread will effectively do nothing and packets are only
+ *               "re-sent" by explicit calls to chiaki_takion_send_buffer_resend() (for unit testing)
  * @param size number of packet slots
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size);
@@ -54,6 +99,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuf
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count);
 
+/**
+ * Re-send all packets that are due and drop those that hit the max number of tries.
+ * This is done automatically by the thread or reactor timer, only exposed for unit testing.
+ *
+ * @return time in ms until the next packet is due or CHIAKI_REACTOR_TIMER_IDLE if there are no packets
+ */
+CHIAKI_EXPORT uint64_t chiaki_takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_VIDEOBUFFER_H
+#define CHIAKI_VIDEOBUFFER_H
+
+#include "common.h"
+#include "video.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_video_buffer_pool_stats_t
+{
+	uint64_t hits; // allocations served from the pool
+	uint64_t misses; // allocations that had to go to the heap because no pooled buffer was free or big enough
+	size_t in_use; // buffers currently referenced
+	size_t high_water; // maximum of in_use since creation or the last reset
+	size_t count; // released buffers currently kept for reuse at most
+} ChiakiVideoBufferPoolStats;
+
+/**
+ * Pool of reference counted buffers for whole video frames, with CHIAKI_VIDEO_BUFFER_PADDING_SIZE
+ * bytes of padding after the requested size, so they can be handed to the decoder without copying,
+ * e.g. wrapped with av_buffer_create() and chiaki_video_buffer_av_free().
+ *
+ * Sizes vary from frame to frame, so buffers grow as needed and up to count released ones are kept.
+ * The pool itself stays alive until the last buffer is released, buffers may outlive chiaki_video_buffer_pool_free().
+ */
+typedef struct chiaki_video_buffer_pool_t ChiakiVideoBufferPool;
+
+/**
+ * @param count number of released buffers kept for reuse
+ * @return the pool or NULL on allocation failure
+ */
+CHIAKI_EXPORT ChiakiVideoBufferPool *chiaki_video_buffer_pool_new(size_t count);
+
+/**
+ * Let the number of released buffers kept for reuse grow up to count_max:
+ * whenever an allocation misses because all of the kept buffers are in use, one more is kept from then on.
+ * For consumers like decoders that hold on to an unknown number of buffers.
+ *
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_video_buffer_pool_set_count_max(ChiakiVideoBufferPool *pool, size_t count_max);
+
+/**
+ * Release the owner's reference to the pool. Buffers that are still referenced stay valid.
+ */
+CHIAKI_EXPORT void chiaki_video_buffer_pool_free(ChiakiVideoBufferPool *pool);
+
+/**
+ * Get a buffer of at least size bytes plus CHIAKI_VIDEO_BUFFER_PADDING_SIZE with a reference count of 1.
+ * Its contents are undefined.
+ *
+ * Thread-safe.
+ * @return the buffer or NULL on allocation failure
+ */
+CHIAKI_EXPORT uint8_t *chiaki_video_buffer_alloc(ChiakiVideoBufferPool *pool, size_t size);
+
+/**
+ * @return usable size of a buffer returned by chiaki_video_buffer_alloc(), without the padding
+ */
+CHIAKI_EXPORT size_t chiaki_video_buffer_size(uint8_t *buf);
+
+/**
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_video_buffer_ref(uint8_t *buf);
+
+/**
+ * Release a reference, returning the buffer to its pool when it was the last one.
+ *
+ * Thread-safe.
+ */
+CHIAKI_EXPORT void chiaki_video_buffer_unref(uint8_t *buf);
+
+/**
+ * Thread-safe.
+ * @return whether the caller holds the only reference to buf, so it may be written to
+ */
+CHIAKI_EXPORT bool chiaki_video_buffer_unique(uint8_t *buf);
+
+/**
+ * Same signature as the free callback of FFmpeg's av_buffer_create(), to be passed along with
+ * a video buffer as both opaque and data, for which a reference has been taken with chiaki_video_buffer_ref().
+ */
+CHIAKI_EXPORT void chiaki_video_buffer_av_free(void *opaque, uint8_t *data);
+
+/**
+ * Thread-safe.
+ * @param reset whether to reset hits, misses and high_water after reading them
+ */
+CHIAKI_EXPORT void chiaki_video_buffer_pool_get_stats(ChiakiVideoBufferPool *pool, ChiakiVideoBufferPoolStats *stats, bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEOBUFFER_H
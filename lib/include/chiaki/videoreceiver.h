@@ -9,6 +9,11 @@
 #include "takion.h"
 #include "frameprocessor.h"
 #include "bitstream.h"
+#include "recvtiming.h"
+#include "congestioncontrol.h"
+#include "metrics.h"
+#include "frametrace.h"
+#include "thread.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +21,61 @@ extern "C" {
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
 
+/**
+ * Frames that can be waiting for or in assembly at once.
+ * If the assembly thread is this far behind, new frames are dropped instead of stalling the receive thread.
+ */
+#define CHIAKI_VIDEO_RECEIVER_QUEUE_SIZE 4
+
+/**
+ * Frames that can be filled at once, so units arriving out of order across frames still complete their frame.
+ * Frames are handed over to the assembly thread in order, an incomplete frame only when it falls out of the window
+ * or no unit arrived for it within the reorder tolerance while a later frame or its last unit has already been seen.
+ * The tolerance is also enforced by the assembly thread, so a stall after a lossy frame doesn't hold it back.
+ */
+#define CHIAKI_VIDEO_RECEIVER_WINDOW_MAX 4
+#define CHIAKI_VIDEO_RECEIVER_WINDOW_DEFAULT 3
+#define CHIAKI_VIDEO_RECEIVER_REORDER_TOLERANCE_US_DEFAULT 3000
+
+typedef struct chiaki_video_receiver_queue_stats_t
+{
+	uint64_t frames_queued;
+	uint64_t frames_dropped; // because the queue was full
+	uint64_t depth; // frames currently waiting for or in assembly
+	uint64_t depth_max;
+} ChiakiVideoReceiverQueueStats;
+
+typedef struct chiaki_video_receiver_window_stats_t
+{
+	uint64_t frames_rescued; // completed after a later frame had started, i.e. would have been incomplete without the window
+	uint64_t frames_incomplete; // handed over without enough units, FEC will fail for these
+	uint64_t packets_late; // for frames that had already been handed over or did not fit into the window anymore
+} ChiakiVideoReceiverWindowStats;
+
+typedef struct chiaki_video_receiver_window_frame_t
+{
+	int32_t frame_index;
+	int profile;
+	ChiakiFrameProcessor *frame_processor; // NULL if the frame is dropped
+	unsigned int units_expected;
+	unsigned int units_received;
+	uint64_t units_seen[CHIAKI_FEC_UNITS_MAX / 64]; // bitmap
+	bool last_unit_seen;
+	bool overtaken; // a later frame started before this one was complete
+	bool incomplete; // handed over without enough units
+	uint64_t first_arrival_us; // 0 if no packet arrived yet
+	uint64_t last_arrival_us;
+	uint64_t last_put_us; // monotonic time the last unit was put, for the reorder tolerance
+} ChiakiVideoReceiverWindowFrame;
+
+struct chiaki_video_receiver_queue_t;
+
+/**
+ * Units are put into frames on the thread calling chiaki_video_receiver_av_packet(),
+ * while FEC, assembly and the video sample callback run on a separate assembly thread,
+ * which gets the frames through a lock-free queue.
+ * The assembly thread only touches the window to hand over frames whose reorder tolerance expired without more packets.
+ */
 typedef struct chiaki_video_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -24,18 +84,55 @@ typedef struct chiaki_video_receiver_t
 	size_t profiles_count;
 	int profile_cur; // < 1 if no profile selected yet, else index in profiles
 
-	int32_t frame_index_cur; // frame that is currently being filled
-	int32_t frame_index_prev; // last frame that has been at least partially decoded
-	int32_t frame_index_prev_complete; // last frame that has been completely decoded
-	ChiakiFrameProcessor frame_processor;
+	// receive thread, or the assembly thread for expired frames, with window_mutex locked
+	ChiakiMutex window_mutex;
+	int32_t frame_index_prev; // last frame that has been handed to the assembly thread or dropped, -1 if none
+	ChiakiVideoReceiverWindowFrame window[CHIAKI_VIDEO_RECEIVER_WINDOW_MAX]; // frames being filled, ordered by frame index
+	size_t window_count;
+	size_t window_size;
+	// frames handed over recently, still counting their remaining units for the packet stats, oldest first
+	ChiakiVideoReceiverWindowFrame window_done[CHIAKI_VIDEO_RECEIVER_WINDOW_MAX];
+	size_t window_done_count;
+	uint64_t reorder_tolerance_us;
 	ChiakiPacketStats *packet_stats;
+	ChiakiRecvTiming *recv_timing;
+	ChiakiCongestionControl *congestion_control;
 
+	// assembly thread
+	int32_t frame_index_prev_complete; // last frame that has been completely decoded
+	bool frame_assembled; // whether any frame has been assembled yet
+	int profile_assembled; // profile of the last assembled frame, -1 if none
 	int32_t frames_lost;
+	uint64_t window_deadline_seen_us; // deadline of the window the assembly thread is sleeping for
 	int32_t reference_frames[16];
 	ChiakiBitstream bitstream;
+	// reports missing or corrupt frames to the server, set to the session's stream connection by init
+	ChiakiErrorCode (*corrupt_frame_cb)(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user);
+	void *corrupt_frame_cb_user;
+
+	struct chiaki_video_receiver_queue_t *queue;
+	ChiakiThread assembly_thread;
+	bool assembly_thread_stop;
+	ChiakiMutex assembly_mutex; // only for putting the assembly thread to sleep and waking it up
+	ChiakiCond assembly_cond;
+
+	ChiakiMutex stream_stats_mutex;
+	ChiakiStreamStats stream_stats; // of assembled frames
+	ChiakiStreamStatsHistory *stats_history; // of assembled frames, per second
+	ChiakiFrameTracer *frame_tracer;
+
+	struct
+	{
+		ChiakiMetric *frames;
+		ChiakiMetric *frames_failed;
+		ChiakiMetric *frames_fec_recovered;
+		ChiakiMetric *frames_lost;
+		ChiakiMetric *frame_bytes;
+		ChiakiMetric *buffer_pool_misses;
+	} metrics; // all NULL if the session has no metrics
 } ChiakiVideoReceiver;
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver);
 
 /**
@@ -49,12 +146,41 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet);
 
+/**
+ * Set how far units may arrive out of order across frames. Must not be called while packets are being received.
+ *
+ * @param window_size number of frames filled at once, clamped to [1, CHIAKI_VIDEO_RECEIVER_WINDOW_MAX].
+ * 1 hands over each frame as soon as a unit of the next one arrives.
+ * @param reorder_tolerance_us how long to wait for more units of the oldest incomplete frame
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_set_reorder_window(ChiakiVideoReceiver *video_receiver, size_t window_size, uint64_t reorder_tolerance_us);
+
+/**
+ * Thread-safe
+ * @param reset whether to start over with the stats after getting them
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_stream_stats(ChiakiVideoReceiver *video_receiver, ChiakiStreamStats *stats, bool reset);
+
+/**
+ * Thread-safe
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_queue_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverQueueStats *stats);
+
+/**
+ * Thread-safe
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_window_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverWindowStats *stats);
+
 static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	ChiakiVideoReceiver *video_receiver = CHIAKI_NEW(ChiakiVideoReceiver);
 	if(!video_receiver)
 		return NULL;
-	chiaki_video_receiver_init(video_receiver, session, packet_stats);
+	if(chiaki_video_receiver_init(video_receiver, session, packet_stats) != CHIAKI_ERR_SUCCESS)
+	{
+		free(video_receiver);
+		return NULL;
+	}
 	return video_receiver;
 }
 
@@ -107,6 +107,14 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 
 	if(audio_receiver->packet_stats)
 		chiaki_packet_stats_push_seq(audio_receiver->packet_stats, packet->frame_index);
+
+	if(!packet->is_haptics)
+	{
+		// every audio packet carries whole frames, so it is its own "frame" for timing
+		ChiakiRecvTiming *timing = &audio_receiver->session->stream_connection.audio_recv_timing;
+		chiaki_recv_timing_push_packet(timing, &packet->recv_time);
+		chiaki_recv_timing_push_frame(timing, packet->recv_time.arrival_us, packet->recv_time.arrival_us);
+	}
 }
 
 static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
@@ -4,6 +4,48 @@
 
 #define CONGESTION_CONTROL_INTERVAL_MS 200
 
+static void congestion_control_send(ChiakiCongestionControl *control)
+{
+	uint64_t received;
+	uint64_t lost;
+	uint64_t local_dropped;
+	chiaki_packet_stats_get(control->stats, true, &received, &lost, &local_dropped);
+	if(local_dropped)
+		CHIAKI_LOGV(control->takion->log, "Not reporting %llu locally dropped packets as lost", (unsigned long long)local_dropped);
+	uint64_t total = received + lost;
+	control->packet_loss = total > 0 ? (double)lost / total : 0;
+
+	ChiakiTakionCongestionPacket packet = { 0 };
+	chiaki_mutex_lock(&control->controller_mutex);
+	control->controller.report_cb(received, lost, &packet, control->controller.user);
+	chiaki_mutex_unlock(&control->controller_mutex);
+
+	if(packet.lost < lost)
+		CHIAKI_LOGW(control->takion->log, "Increasing received packets to reduce hit on stream quality");
+	else if(packet.lost > lost)
+		CHIAKI_LOGI(control->takion->log, "Reporting more lost packets because of increasing delay");
+	CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
+		(unsigned int)packet.received, (unsigned int)packet.lost);
+	chiaki_takion_send_congestion(control->takion, &packet);
+}
+
+static void congestion_control_default_frame(uint64_t send_us, uint64_t arrival_us, void *user)
+{
+	chiaki_delay_gradient_push_frame(user, send_us, arrival_us);
+}
+
+static void congestion_control_default_report(uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet, void *user)
+{
+	chiaki_delay_gradient_report(user, received, lost, packet);
+}
+
+static void congestion_control_default_controller(ChiakiCongestionControl *control)
+{
+	control->controller.user = &control->delay_gradient;
+	control->controller.frame_cb = congestion_control_default_frame;
+	control->controller.report_cb = congestion_control_default_report;
+}
+
 static void *congestion_control_thread_func(void *user)
 {
 	ChiakiCongestionControl *control = user;
@@ -18,36 +60,88 @@ static void *congestion_control_thread_func(void *user)
 		if(err != CHIAKI_ERR_TIMEOUT)
 			break;
 
-		uint64_t received;
-		uint64_t lost;
-		chiaki_packet_stats_get(control->stats, true, &received, &lost);
-		ChiakiTakionCongestionPacket packet = { 0 };
-		uint64_t total = received + lost;
-		control->packet_loss = total > 0 ? (double)lost / total : 0;
-		if(control->packet_loss > control->packet_loss_max)
-		{
-			CHIAKI_LOGW(control->takion->log, "Increasing received packets to reduce hit on stream quality");
-			lost = total * control->packet_loss_max;
-			received = total - lost;
-		}
-		packet.received = (uint16_t)received;
-		packet.lost = (uint16_t)lost;
-		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
-			(unsigned int)packet.received, (unsigned int)packet.lost);
-		chiaki_takion_send_congestion(control->takion, &packet);
+		congestion_control_send(control);
 	}
 
 	chiaki_bool_pred_cond_unlock(&control->stop_cond);
 	return NULL;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max)
+static uint64_t congestion_control_timer_cb(void *user)
+{
+	congestion_control_send(user);
+	return CONGESTION_CONTROL_INTERVAL_MS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_init(ChiakiCongestionControl *control, double packet_loss_max)
+{
+	control->takion = NULL;
+	control->stats = NULL;
+	control->thread.thread = 0;
+	control->packet_loss = 0;
+	control->packet_loss_max = packet_loss_max;
+
+	chiaki_delay_gradient_init(&control->delay_gradient, packet_loss_max);
+	congestion_control_default_controller(control);
+	control->max_fps = 0;
+	control->frame_prev_valid = false;
+	control->frame_index_prev = 0;
+	control->frames = 0;
+	return chiaki_mutex_init(&control->controller_mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_fini(ChiakiCongestionControl *control)
+{
+	chiaki_mutex_fini(&control->controller_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_set_controller(ChiakiCongestionControl *control, const ChiakiCongestionController *controller)
+{
+	chiaki_mutex_lock(&control->controller_mutex);
+	if(controller)
+		control->controller = *controller;
+	else
+		congestion_control_default_controller(control);
+	chiaki_mutex_unlock(&control->controller_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_push_frame(ChiakiCongestionControl *control, ChiakiSeqNum16 frame_index, uint64_t arrival_us)
+{
+	chiaki_mutex_lock(&control->controller_mutex);
+	if(!control->max_fps)
+		goto beach;
+	if(control->frame_prev_valid)
+	{
+		int16_t d = (int16_t)(frame_index - control->frame_index_prev);
+		if(d <= 0)
+			goto beach; // reordered or duplicate
+		control->frames += d;
+	}
+	control->frame_prev_valid = true;
+	control->frame_index_prev = frame_index;
+	if(control->controller.frame_cb)
+	{
+		// the console encodes and sends frames at a fixed rate
+		uint64_t send_us = control->frames * 1000000 / control->max_fps;
+		control->controller.frame_cb(send_us, arrival_us, control->controller.user);
+	}
+beach:
+	chiaki_mutex_unlock(&control->controller_mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, unsigned int max_fps)
 {
 	control->takion = takion;
 	control->stats = stats;
-	control->packet_loss_max = packet_loss_max;
 	control->packet_loss = 0;
 
+	chiaki_mutex_lock(&control->controller_mutex);
+	control->max_fps = max_fps;
+	chiaki_mutex_unlock(&control->controller_mutex);
+
+	if(takion->reactor)
+		return chiaki_reactor_timer_add(takion->reactor, &control->timer, congestion_control_timer_cb, control, CONGESTION_CONTROL_INTERVAL_MS);
+
 	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -66,6 +160,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionCo
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
 {
+	if(control->takion->reactor)
+	{
+		chiaki_reactor_timer_remove(control->takion->reactor, &control->timer);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	ChiakiErrorCode err = chiaki_bool_pred_cond_signal(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
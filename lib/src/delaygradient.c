@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/delaygradient.h>
+
+#include <math.h>
+
+// constants as in the trendline estimator and overuse detector of GCC, all times in ms
+#define DELAY_GRADIENT_SMOOTHING 0.9
+#define DELAY_GRADIENT_TREND_GAIN 4.0
+#define DELAY_GRADIENT_DELTAS_MAX 60
+#define DELAY_GRADIENT_THRESHOLD_INITIAL 12.5
+#define DELAY_GRADIENT_THRESHOLD_MIN 6.0
+#define DELAY_GRADIENT_THRESHOLD_MAX 600.0
+#define DELAY_GRADIENT_THRESHOLD_K_UP 0.0087
+#define DELAY_GRADIENT_THRESHOLD_K_DOWN 0.039
+#define DELAY_GRADIENT_THRESHOLD_ADAPT_OFFSET_MAX 15.0
+#define DELAY_GRADIENT_THRESHOLD_ADAPT_TIME_MAX 100.0
+#define DELAY_GRADIENT_OVERUSE_TIME 10.0
+
+// a gap this long between frames means the stream was interrupted
+#define DELAY_GRADIENT_RESET_GAP_US 1000000
+
+#define DELAY_GRADIENT_OVERUSE_LOSS_MIN 0.1
+#define DELAY_GRADIENT_OVERUSE_LOSS_MAX 0.5
+
+CHIAKI_EXPORT const char *chiaki_delay_gradient_state_string(ChiakiDelayGradientState state)
+{
+	switch(state)
+	{
+		case CHIAKI_DELAY_GRADIENT_NORMAL:
+			return "normal";
+		case CHIAKI_DELAY_GRADIENT_UNDERUSE:
+			return "underuse";
+		case CHIAKI_DELAY_GRADIENT_OVERUSE:
+			return "overuse";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_delay_gradient_init(ChiakiDelayGradient *dg, double packet_loss_max)
+{
+	dg->packet_loss_max = packet_loss_max;
+	dg->packet_loss_overuse = 0.0;
+	dg->overuse_detected = 0;
+	chiaki_delay_gradient_reset(dg);
+}
+
+CHIAKI_EXPORT void chiaki_delay_gradient_reset(ChiakiDelayGradient *dg)
+{
+	dg->sample_prev_valid = false;
+	dg->send_prev_us = 0;
+	dg->arrival_prev_us = 0;
+	dg->arrival_first_us = 0;
+	dg->delay_accumulated_ms = 0.0;
+	dg->delay_smoothed_ms = 0.0;
+	dg->window_count = 0;
+	dg->window_next = 0;
+	dg->deltas = 0;
+	dg->trend = 0.0;
+	dg->trend_prev = 0.0;
+	dg->threshold = DELAY_GRADIENT_THRESHOLD_INITIAL;
+	dg->overuse_time_ms = -1.0;
+	dg->overuse_counter = 0;
+	dg->state = CHIAKI_DELAY_GRADIENT_NORMAL;
+	dg->overused = false;
+}
+
+/**
+ * Least squares slope of the window, false if it is undefined
+ */
+static bool delay_gradient_slope(ChiakiDelayGradient *dg, double *slope)
+{
+	double x_avg = 0.0;
+	double y_avg = 0.0;
+	for(size_t i=0; i<dg->window_count; i++)
+	{
+		x_avg += dg->window_x[i];
+		y_avg += dg->window_y[i];
+	}
+	x_avg /= dg->window_count;
+	y_avg /= dg->window_count;
+
+	double num = 0.0;
+	double den = 0.0;
+	for(size_t i=0; i<dg->window_count; i++)
+	{
+		double dx = dg->window_x[i] - x_avg;
+		num += dx * (dg->window_y[i] - y_avg);
+		den += dx * dx;
+	}
+	if(den == 0.0)
+		return false;
+	*slope = num / den;
+	return true;
+}
+
+static void delay_gradient_detect(ChiakiDelayGradient *dg, double ts_delta_ms)
+{
+	double trend = dg->trend;
+	if(trend > dg->threshold)
+	{
+		if(dg->overuse_time_ms < 0.0)
+			dg->overuse_time_ms = ts_delta_ms / 2.0;
+		else
+			dg->overuse_time_ms += ts_delta_ms;
+		dg->overuse_counter++;
+		if(dg->overuse_time_ms > DELAY_GRADIENT_OVERUSE_TIME && dg->overuse_counter > 1 && trend >= dg->trend_prev)
+		{
+			dg->overuse_time_ms = 0.0;
+			dg->overuse_counter = 0;
+			if(dg->state != CHIAKI_DELAY_GRADIENT_OVERUSE)
+				dg->overuse_detected++;
+			dg->state = CHIAKI_DELAY_GRADIENT_OVERUSE;
+			dg->overused = true;
+		}
+	}
+	else if(trend < -dg->threshold)
+	{
+		dg->overuse_time_ms = -1.0;
+		dg->overuse_counter = 0;
+		dg->state = CHIAKI_DELAY_GRADIENT_UNDERUSE;
+	}
+	else
+	{
+		dg->overuse_time_ms = -1.0;
+		dg->overuse_counter = 0;
+		dg->state = CHIAKI_DELAY_GRADIENT_NORMAL;
+	}
+	dg->trend_prev = trend;
+
+	// adapt the threshold so it follows the trend slowly, but not single outliers
+	double trend_abs = fabs(trend);
+	if(trend_abs > dg->threshold + DELAY_GRADIENT_THRESHOLD_ADAPT_OFFSET_MAX)
+		return;
+	double k = trend_abs < dg->threshold ? DELAY_GRADIENT_THRESHOLD_K_DOWN : DELAY_GRADIENT_THRESHOLD_K_UP;
+	double adapt_time = ts_delta_ms < DELAY_GRADIENT_THRESHOLD_ADAPT_TIME_MAX ? ts_delta_ms : DELAY_GRADIENT_THRESHOLD_ADAPT_TIME_MAX;
+	dg->threshold += k * (trend_abs - dg->threshold) * adapt_time;
+	if(dg->threshold < DELAY_GRADIENT_THRESHOLD_MIN)
+		dg->threshold = DELAY_GRADIENT_THRESHOLD_MIN;
+	else if(dg->threshold > DELAY_GRADIENT_THRESHOLD_MAX)
+		dg->threshold = DELAY_GRADIENT_THRESHOLD_MAX;
+}
+
+CHIAKI_EXPORT void chiaki_delay_gradient_push_frame(ChiakiDelayGradient *dg, uint64_t send_us, uint64_t arrival_us)
+{
+	if(dg->sample_prev_valid)
+	{
+		if(send_us <= dg->send_prev_us)
+			return; // reordered or duplicate
+		if(arrival_us > dg->arrival_prev_us + DELAY_GRADIENT_RESET_GAP_US
+			|| send_us > dg->send_prev_us + DELAY_GRADIENT_RESET_GAP_US)
+			chiaki_delay_gradient_reset(dg);
+	}
+
+	if(!dg->sample_prev_valid)
+	{
+		dg->sample_prev_valid = true;
+		dg->send_prev_us = send_us;
+		dg->arrival_prev_us = arrival_us;
+		dg->arrival_first_us = arrival_us;
+		return;
+	}
+
+	double send_delta_ms = (double)(send_us - dg->send_prev_us) / 1000.0;
+	double arrival_delta_ms = ((double)arrival_us - (double)dg->arrival_prev_us) / 1000.0;
+	dg->send_prev_us = send_us;
+	dg->arrival_prev_us = arrival_us;
+	dg->deltas++;
+
+	dg->delay_accumulated_ms += arrival_delta_ms - send_delta_ms;
+	dg->delay_smoothed_ms = DELAY_GRADIENT_SMOOTHING * dg->delay_smoothed_ms
+		+ (1.0 - DELAY_GRADIENT_SMOOTHING) * dg->delay_accumulated_ms;
+
+	dg->window_x[dg->window_next] = ((double)arrival_us - (double)dg->arrival_first_us) / 1000.0;
+	dg->window_y[dg->window_next] = dg->delay_smoothed_ms;
+	dg->window_next = (dg->window_next + 1) % CHIAKI_DELAY_GRADIENT_WINDOW;
+	if(dg->window_count < CHIAKI_DELAY_GRADIENT_WINDOW)
+		dg->window_count++;
+
+	double slope;
+	if(dg->window_count == CHIAKI_DELAY_GRADIENT_WINDOW && delay_gradient_slope(dg, &slope))
+	{
+		double deltas = dg->deltas < DELAY_GRADIENT_DELTAS_MAX ? (double)dg->deltas : DELAY_GRADIENT_DELTAS_MAX;
+		dg->trend = deltas * slope * DELAY_GRADIENT_TREND_GAIN;
+	}
+
+	delay_gradient_detect(dg, send_delta_ms);
+}
+
+CHIAKI_EXPORT void chiaki_delay_gradient_report(ChiakiDelayGradient *dg, uint64_t received, uint64_t lost, ChiakiTakionCongestionPacket *packet)
+{
+	uint64_t total = received + lost;
+	double packet_loss = total > 0 ? (double)lost / total : 0.0;
+
+	if(dg->overused || dg->state == CHIAKI_DELAY_GRADIENT_OVERUSE)
+	{
+		// back off harder for every report the queue keeps building up
+		if(dg->packet_loss_overuse > 0.0)
+			dg->packet_loss_overuse *= 2.0;
+		else
+			dg->packet_loss_overuse = dg->packet_loss_max * 2.0 > DELAY_GRADIENT_OVERUSE_LOSS_MIN ? dg->packet_loss_max * 2.0 : DELAY_GRADIENT_OVERUSE_LOSS_MIN;
+		if(dg->packet_loss_overuse > DELAY_GRADIENT_OVERUSE_LOSS_MAX)
+			dg->packet_loss_overuse = DELAY_GRADIENT_OVERUSE_LOSS_MAX;
+		if(packet_loss < dg->packet_loss_overuse)
+			packet_loss = dg->packet_loss_overuse;
+	}
+	else
+	{
+		dg->packet_loss_overuse = 0.0;
+		if(packet_loss > dg->packet_loss_max)
+			packet_loss = dg->packet_loss_max;
+	}
+	dg->overused = false;
+
+	lost = (uint64_t)(total * packet_loss + 0.5);
+	if(lost > total)
+		lost = total;
+	received = total - lost;
+	packet->received = (uint16_t)received;
+	packet->lost = (uint16_t)lost;
+}
@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/eventloop.h>
+
+#include <string.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define STOP_DATA UINT64_MAX
+#endif
+
+static int event_loop_find(ChiakiEventLoop *loop, chiaki_socket_t fd)
+{
+	for(int i=0; i<CHIAKI_EVENT_LOOP_FDS_MAX; i++)
+	{
+		if(loop->fds[i].fd == fd)
+			return i;
+	}
+	return -1;
+}
+
+#ifdef __linux__
+static uint32_t epoll_events(uint32_t events)
+{
+	uint32_t r = 0;
+	if(events & CHIAKI_EVENT_LOOP_READ)
+		r |= EPOLLIN;
+	if(events & CHIAKI_EVENT_LOOP_WRITE)
+		r |= EPOLLOUT;
+	if(events & CHIAKI_EVENT_LOOP_EDGE)
+		r |= EPOLLET;
+	return r;
+}
+#endif
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_init(ChiakiEventLoop *loop)
+{
+	for(size_t i=0; i<CHIAKI_EVENT_LOOP_FDS_MAX; i++)
+	{
+		loop->fds[i].fd = CHIAKI_INVALID_SOCKET;
+		loop->fds[i].events = 0;
+		loop->fds[i].user = NULL;
+	}
+
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&loop->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+#ifdef __linux__
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epoll_fd < 0)
+	{
+		chiaki_stop_pipe_fini(&loop->stop_pipe);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	// level-triggered, so the stop stays visible to every wait until reset
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.u64 = STOP_DATA;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->stop_pipe.fd, &ev) < 0)
+	{
+		close(loop->epoll_fd);
+		chiaki_stop_pipe_fini(&loop->stop_pipe);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#endif
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_fini(ChiakiEventLoop *loop)
+{
+#ifdef __linux__
+	close(loop->epoll_fd);
+#endif
+	chiaki_stop_pipe_fini(&loop->stop_pipe);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_add(ChiakiEventLoop *loop, chiaki_socket_t fd, uint32_t events, void *user)
+{
+	if(CHIAKI_SOCKET_IS_INVALID(fd) || event_loop_find(loop, fd) >= 0)
+		return CHIAKI_ERR_INVALID_DATA;
+	int i = event_loop_find(loop, CHIAKI_INVALID_SOCKET);
+	if(i < 0)
+		return CHIAKI_ERR_OVERFLOW;
+
+#ifdef __linux__
+	struct epoll_event ev = { 0 };
+	ev.events = epoll_events(events);
+	ev.data.u64 = (uint64_t)i;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+
+	loop->fds[i].fd = fd;
+	loop->fds[i].events = events;
+	loop->fds[i].user = user;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_modify(ChiakiEventLoop *loop, chiaki_socket_t fd, uint32_t events, void *user)
+{
+	int i = event_loop_find(loop, fd);
+	if(CHIAKI_SOCKET_IS_INVALID(fd) || i < 0)
+		return CHIAKI_ERR_INVALID_DATA;
+
+#ifdef __linux__
+	struct epoll_event ev = { 0 };
+	ev.events = epoll_events(events);
+	ev.data.u64 = (uint64_t)i;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+
+	loop->fds[i].events = events;
+	loop->fds[i].user = user;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_remove(ChiakiEventLoop *loop, chiaki_socket_t fd)
+{
+	int i = event_loop_find(loop, fd);
+	if(CHIAKI_SOCKET_IS_INVALID(fd) || i < 0)
+		return CHIAKI_ERR_INVALID_DATA;
+
+#ifdef __linux__
+	// may fail if fd was closed already, which removed it implicitly
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+	loop->fds[i].fd = CHIAKI_INVALID_SOCKET;
+	loop->fds[i].events = 0;
+	loop->fds[i].user = NULL;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_wait(ChiakiEventLoop *loop, ChiakiEventLoopEvent *events, size_t events_max, size_t *events_count, uint64_t timeout_ms)
+{
+	*events_count = 0;
+#ifdef __linux__
+	struct epoll_event evs[CHIAKI_EVENT_LOOP_FDS_MAX + 1];
+	int evs_max = events_max + 1 < sizeof(evs) / sizeof(evs[0]) ? (int)events_max + 1 : (int)(sizeof(evs) / sizeof(evs[0]));
+	int timeout = timeout_ms == UINT64_MAX ? -1 : (timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms);
+	int r;
+	do
+	{
+		r = epoll_wait(loop->epoll_fd, evs, evs_max, timeout);
+	} while(r < 0 && errno == EINTR);
+
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+
+	for(int j=0; j<r; j++)
+	{
+		if(evs[j].data.u64 == STOP_DATA)
+			return CHIAKI_ERR_CANCELED;
+	}
+
+	for(int j=0; j<r && *events_count < events_max; j++)
+	{
+		size_t i = (size_t)evs[j].data.u64;
+		ChiakiEventLoopEvent *event = &events[(*events_count)++];
+		event->fd = loop->fds[i].fd;
+		event->user = loop->fds[i].user;
+		event->events = 0;
+		// errors and hangups are reported as ready so the following recv/send picks them up
+		if(evs[j].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			event->events |= loop->fds[i].events & CHIAKI_EVENT_LOOP_READ;
+		if(evs[j].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			event->events |= loop->fds[i].events & CHIAKI_EVENT_LOOP_WRITE;
+	}
+
+	return *events_count ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_TIMEOUT;
+#elif defined(_WIN32)
+	WSAEVENT wsa_events[CHIAKI_EVENT_LOOP_FDS_MAX + 1];
+	int wsa_events_fd[CHIAKI_EVENT_LOOP_FDS_MAX + 1];
+	DWORD wsa_events_count = 1;
+	wsa_events[0] = loop->stop_pipe.event;
+
+	for(int i=0; i<CHIAKI_EVENT_LOOP_FDS_MAX; i++)
+	{
+		if(CHIAKI_SOCKET_IS_INVALID(loop->fds[i].fd))
+			continue;
+		WSAEVENT ev = WSACreateEvent();
+		if(ev == WSA_INVALID_EVENT)
+			continue;
+		long network_events = 0;
+		if(loop->fds[i].events & CHIAKI_EVENT_LOOP_READ)
+			network_events |= FD_READ;
+		if(loop->fds[i].events & CHIAKI_EVENT_LOOP_WRITE)
+			network_events |= FD_WRITE;
+		WSAEventSelect(loop->fds[i].fd, ev, network_events);
+		wsa_events_fd[wsa_events_count] = i;
+		wsa_events[wsa_events_count++] = ev;
+	}
+
+	DWORD r = WSAWaitForMultipleEvents(wsa_events_count, wsa_events, FALSE, timeout_ms == UINT64_MAX ? WSA_INFINITE : (DWORD)timeout_ms, FALSE);
+
+	ChiakiErrorCode err;
+	if(r == WSA_WAIT_EVENT_0)
+		err = CHIAKI_ERR_CANCELED;
+	else if(r == WSA_WAIT_TIMEOUT)
+		err = CHIAKI_ERR_TIMEOUT;
+	else if(r > WSA_WAIT_EVENT_0 && r < WSA_WAIT_EVENT_0 + wsa_events_count)
+	{
+		// the first signaled event is returned, check the ones after it without waiting
+		for(DWORD j=r - WSA_WAIT_EVENT_0; j<wsa_events_count && *events_count < events_max; j++)
+		{
+			if(j != r - WSA_WAIT_EVENT_0 && WSAWaitForMultipleEvents(1, &wsa_events[j], FALSE, 0, FALSE) != WSA_WAIT_EVENT_0)
+				continue;
+			int i = wsa_events_fd[j];
+			ChiakiEventLoopEvent *event = &events[(*events_count)++];
+			event->fd = loop->fds[i].fd;
+			event->events = loop->fds[i].events & (CHIAKI_EVENT_LOOP_READ | CHIAKI_EVENT_LOOP_WRITE);
+			event->user = loop->fds[i].user;
+		}
+		err = CHIAKI_ERR_SUCCESS;
+	}
+	else
+		err = CHIAKI_ERR_UNKNOWN;
+
+	for(DWORD j=1; j<wsa_events_count; j++)
+		WSACloseEvent(wsa_events[j]);
+
+	return err;
+#else
+	fd_set rfds;
+	fd_set wfds;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+#if defined(__SWITCH__)
+	int stop_fd = loop->stop_pipe.fd;
+#else
+	int stop_fd = loop->stop_pipe.fds[0];
+#endif
+	FD_SET(stop_fd, &rfds);
+	int nfds = stop_fd;
+
+	for(int i=0; i<CHIAKI_EVENT_LOOP_FDS_MAX; i++)
+	{
+		chiaki_socket_t fd = loop->fds[i].fd;
+		if(CHIAKI_SOCKET_IS_INVALID(fd))
+			continue;
+		if(loop->fds[i].events & CHIAKI_EVENT_LOOP_READ)
+			FD_SET(fd, &rfds);
+		if(loop->fds[i].events & CHIAKI_EVENT_LOOP_WRITE)
+			FD_SET(fd, &wfds);
+		if(fd > nfds)
+			nfds = fd;
+	}
+	nfds++;
+
+	struct timeval timeout_s;
+	struct timeval *timeout = NULL;
+	if(timeout_ms != UINT64_MAX)
+	{
+		timeout_s.tv_sec = timeout_ms / 1000;
+		timeout_s.tv_usec = (timeout_ms % 1000) * 1000;
+		timeout = &timeout_s;
+	}
+
+	int r;
+	do
+	{
+		r = select(nfds, &rfds, &wfds, NULL, timeout);
+	} while(r < 0 && errno == EINTR);
+
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+
+	if(FD_ISSET(stop_fd, &rfds))
+		return CHIAKI_ERR_CANCELED;
+
+	for(int i=0; i<CHIAKI_EVENT_LOOP_FDS_MAX && *events_count < events_max; i++)
+	{
+		chiaki_socket_t fd = loop->fds[i].fd;
+		if(CHIAKI_SOCKET_IS_INVALID(fd))
+			continue;
+		uint32_t ready = 0;
+		if((loop->fds[i].events & CHIAKI_EVENT_LOOP_READ) && FD_ISSET(fd, &rfds))
+			ready |= CHIAKI_EVENT_LOOP_READ;
+		if((loop->fds[i].events & CHIAKI_EVENT_LOOP_WRITE) && FD_ISSET(fd, &wfds))
+			ready |= CHIAKI_EVENT_LOOP_WRITE;
+		if(!ready)
+			continue;
+		ChiakiEventLoopEvent *event = &events[(*events_count)++];
+		event->fd = fd;
+		event->events = ready;
+		event->user = loop->fds[i].user;
+	}
+
+	return *events_count ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_TIMEOUT;
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_event_loop_stop(ChiakiEventLoop *loop)
+{
+	chiaki_stop_pipe_stop(&loop->stop_pipe);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_loop_reset(ChiakiEventLoop *loop)
+{
+	return chiaki_stop_pipe_reset(&loop->stop_pipe);
+}
@@ -9,69 +9,729 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// compiled for ssse3/avx2 regardless of the target flags, only used if the cpu supports it
+#define FEC_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define FEC_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#include "utils.h"
+
+#define GF_POLY 0x1d // x^8 + x^4 + x^3 + x^2 + 1 without x^8, the default of gf-complete for w = 8
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	uint8_t r = 0;
+	while(b)
+	{
+		if(b & 1)
+			r ^= a;
+		a = (uint8_t)((a << 1) ^ ((a & 0x80) ? GF_POLY : 0));
+		b >>= 1;
+	}
+	return r;
+}
+
+#define GF_SPLIT_TABLES_SIZE 0x20
+
+/**
+ * c * x = tables[x & 0xf] ^ tables[0x10 + (x >> 4)]
+ */
+static void gf_split_tables(uint8_t c, uint8_t *tables)
+{
+	for(uint8_t x=0; x<0x10; x++)
+	{
+		tables[x] = gf_mul(c, x);
+		tables[0x10 + x] = gf_mul(c, (uint8_t)(x << 4));
+	}
+}
+
+/**
+ * @return GF_SPLIT_TABLES_SIZE bytes of split tables for each of the count coefficients
+ */
+static uint8_t *gf_split_tables_new(const int *coefficients, size_t count)
+{
+	uint8_t *tables = malloc(count * GF_SPLIT_TABLES_SIZE);
+	if(!tables)
+		return NULL;
+	for(size_t i=0; i<count; i++)
+		gf_split_tables((uint8_t)coefficients[i], tables + i * GF_SPLIT_TABLES_SIZE);
+	return tables;
+}
+
+static void region_mul_scalar(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool accumulate)
+{
+	uint8_t table[0x100];
+	for(size_t x=0; x<0x100; x++)
+		table[x] = lo[x & 0xf] ^ hi[x >> 4];
+	if(accumulate)
+	{
+		for(size_t i=0; i<size; i++)
+			dst[i] ^= table[src[i]];
+	}
+	else
+	{
+		for(size_t i=0; i<size; i++)
+			dst[i] = table[src[i]];
+	}
+}
+
+#ifdef FEC_SIMD_X86
+__attribute__((target("ssse3")))
+static size_t region_mul_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool accumulate)
+{
+	__m128i table_lo = _mm_loadu_si128((const __m128i *)lo);
+	__m128i table_hi = _mm_loadu_si128((const __m128i *)hi);
+	__m128i mask = _mm_set1_epi8(0xf);
+	size_t i = 0;
+	for(; i + 16 <= size; i += 16)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i p = _mm_xor_si128(
+				_mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask)),
+				_mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		if(accumulate)
+			p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t region_mul_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool accumulate)
+{
+	// vpshufb looks up within each 128 bit lane, so both lanes get the same table
+	__m256i table_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	__m256i table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+	__m256i mask = _mm256_set1_epi8(0xf);
+	size_t i = 0;
+	for(; i + 32 <= size; i += 32)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i p = _mm256_xor_si256(
+				_mm256_shuffle_epi8(table_lo, _mm256_and_si256(s, mask)),
+				_mm256_shuffle_epi8(table_hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+		if(accumulate)
+			p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+		_mm256_storeu_si256((__m256i *)(dst + i), p);
+	}
+	return i;
+}
+#endif
+
+#ifdef FEC_SIMD_NEON
+static size_t region_mul_neon(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi, size_t size, bool accumulate)
+{
+	uint8x16_t table_lo = vld1q_u8(lo);
+	uint8x16_t table_hi = vld1q_u8(hi);
+	uint8x16_t mask = vdupq_n_u8(0xf);
+	size_t i = 0;
+	for(; i + 16 <= size; i += 16)
+	{
+		uint8x16_t s = vld1q_u8(src + i);
+		uint8x16_t p = veorq_u8(vqtbl1q_u8(table_lo, vandq_u8(s, mask)), vqtbl1q_u8(table_hi, vshrq_n_u8(s, 4)));
+		if(accumulate)
+			p = veorq_u8(p, vld1q_u8(dst + i));
+		vst1q_u8(dst + i, p);
+	}
+	return i;
+}
+#endif
+
+CHIAKI_EXPORT const char *chiaki_fec_simd_string(ChiakiFecSimd simd)
+{
+	switch(simd)
+	{
+		case CHIAKI_FEC_SIMD_NONE:
+			return "none";
+		case CHIAKI_FEC_SIMD_SSSE3:
+			return "ssse3";
+		case CHIAKI_FEC_SIMD_AVX2:
+			return "avx2";
+		case CHIAKI_FEC_SIMD_NEON:
+			return "neon";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT bool chiaki_fec_simd_supported(ChiakiFecSimd simd)
+{
+	switch(simd)
+	{
+		case CHIAKI_FEC_SIMD_NONE:
+			return true;
+#ifdef FEC_SIMD_X86
+		case CHIAKI_FEC_SIMD_SSSE3:
+			return __builtin_cpu_supports("ssse3");
+		case CHIAKI_FEC_SIMD_AVX2:
+			return __builtin_cpu_supports("avx2");
+#endif
+#ifdef FEC_SIMD_NEON
+		case CHIAKI_FEC_SIMD_NEON:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+CHIAKI_EXPORT ChiakiFecSimd chiaki_fec_simd_best(void)
+{
+	if(chiaki_fec_simd_supported(CHIAKI_FEC_SIMD_AVX2))
+		return CHIAKI_FEC_SIMD_AVX2;
+	if(chiaki_fec_simd_supported(CHIAKI_FEC_SIMD_SSSE3))
+		return CHIAKI_FEC_SIMD_SSSE3;
+	if(chiaki_fec_simd_supported(CHIAKI_FEC_SIMD_NEON))
+		return CHIAKI_FEC_SIMD_NEON;
+	return CHIAKI_FEC_SIMD_NONE;
+}
+
+/**
+ * chiaki_fec_region_mul() with the split tables of c already built
+ */
+static void region_mul(ChiakiFecSimd simd, uint8_t *dst, const uint8_t *src, uint8_t c, const uint8_t *tables, size_t size, bool accumulate)
+{
+	if(c == 0)
+	{
+		if(!accumulate)
+			memset(dst, 0, size);
+		return;
+	}
+	if(c == 1)
+	{
+		if(accumulate)
+			xor_bytes(dst, src, size);
+		else
+			memcpy(dst, src, size);
+		return;
+	}
+
+	const uint8_t *lo = tables;
+	const uint8_t *hi = tables + 0x10;
+	size_t i = 0;
+	switch(simd)
+	{
+#ifdef FEC_SIMD_X86
+		case CHIAKI_FEC_SIMD_SSSE3:
+			i = region_mul_ssse3(dst, src, lo, hi, size, accumulate);
+			break;
+		case CHIAKI_FEC_SIMD_AVX2:
+			i = region_mul_avx2(dst, src, lo, hi, size, accumulate);
+			break;
+#endif
+#ifdef FEC_SIMD_NEON
+		case CHIAKI_FEC_SIMD_NEON:
+			i = region_mul_neon(dst, src, lo, hi, size, accumulate);
+			break;
+#endif
+		default:
+			break;
+	}
+	if(i < size)
+		region_mul_scalar(dst + i, src + i, lo, hi, size - i, accumulate);
+}
+
+CHIAKI_EXPORT void chiaki_fec_region_mul(ChiakiFecSimd simd, uint8_t *dst, const uint8_t *src, uint8_t c, size_t size, bool accumulate)
+{
+	uint8_t tables[GF_SPLIT_TABLES_SIZE];
+	gf_split_tables(c, tables);
+	region_mul(simd, dst, src, c, tables, size, accumulate);
+}
+
+/**
+ * Same as jerasure_matrix_dotprod() for w = 8: the unit dest_id = sum of matrix_row[j] * unit src_ids[j] (or j if src_ids is NULL)
+ */
+static void fec_dotprod(ChiakiFecSimd simd, unsigned int k, const int *matrix_row, const uint8_t *row_tables, const int *src_ids, unsigned int dest_id,
+		uint8_t **ptrs, size_t size)
+{
+	uint8_t *dst = ptrs[dest_id];
+	bool accumulate = false;
+	for(unsigned int j=0; j<k; j++)
+	{
+		uint8_t c = (uint8_t)matrix_row[j];
+		if(!c)
+			continue;
+		region_mul(simd, dst, ptrs[src_ids ? (unsigned int)src_ids[j] : j], c, row_tables + j * GF_SPLIT_TABLES_SIZE, size, accumulate);
+		accumulate = true;
+	}
+	if(!accumulate)
+		memset(dst, 0, size);
+}
+
 int *create_matrix(unsigned int k, unsigned int m)
 {
 	return cauchy_original_coding_matrix(k, m, CHIAKI_FEC_WORDSIZE);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+#define ERASED_GET(erased, i) (((erased)[(i) / 64] >> ((i) % 64)) & 1)
+#define ERASED_SET(erased, i) ((erased)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+
+CHIAKI_EXPORT void chiaki_fec_cache_init(ChiakiFecCache *cache)
 {
-	if(stride < unit_size)
-		return CHIAKI_ERR_INVALID_DATA;
+	memset(cache, 0, sizeof(*cache));
+	cache->simd = chiaki_fec_simd_best();
+}
+
+CHIAKI_EXPORT void chiaki_fec_cache_fini(ChiakiFecCache *cache)
+{
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_CODING_SIZE; i++)
+	{
+		free(cache->coding[i].matrix);
+		free(cache->coding[i].tables);
+	}
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_DECODING_SIZE; i++)
+	{
+		free(cache->decoding[i].rows);
+		free(cache->decoding[i].dm_ids);
+		free(cache->decoding[i].tables);
+	}
+}
+
+static ChiakiFecCodingMatrix *fec_cache_coding_matrix(ChiakiFecCache *cache, unsigned int k, unsigned int m)
+{
+	// unused entries have last_use == 0, so they are taken first
+	ChiakiFecCodingMatrix *lru = &cache->coding[0];
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_CODING_SIZE; i++)
+	{
+		ChiakiFecCodingMatrix *entry = &cache->coding[i];
+		if(entry->matrix && entry->k == k && entry->m == m)
+		{
+			entry->last_use = ++cache->use_counter;
+			cache->stats.coding_hits++;
+			return entry;
+		}
+		if(entry->last_use < lru->last_use)
+			lru = entry;
+	}
+
 	int *matrix = create_matrix(k, m);
 	if(!matrix)
-		return CHIAKI_ERR_MEMORY;
+		return NULL;
+	uint8_t *tables = gf_split_tables_new(matrix, (size_t)k * m);
+	if(!tables)
+	{
+		free(matrix);
+		return NULL;
+	}
+	cache->stats.coding_misses++;
+	free(lru->matrix);
+	free(lru->tables);
+	lru->k = k;
+	lru->m = m;
+	lru->matrix = matrix;
+	lru->tables = tables;
+	lru->last_use = ++cache->use_counter;
+	return lru;
+}
+
+/**
+ * @return the cached entry for (k, m, erased, progressive) or NULL, with *lru set to the entry to replace on a miss
+ */
+static ChiakiFecDecodingMatrix *fec_cache_decoding_lookup(ChiakiFecCache *cache, unsigned int k, unsigned int m,
+		const uint64_t *erased, bool progressive, ChiakiFecDecodingMatrix **lru)
+{
+	*lru = &cache->decoding[0];
+	for(size_t i=0; i<CHIAKI_FEC_CACHE_DECODING_SIZE; i++)
+	{
+		ChiakiFecDecodingMatrix *entry = &cache->decoding[i];
+		if(entry->rows && entry->k == k && entry->m == m && entry->progressive == progressive
+				&& !memcmp(entry->erased, erased, sizeof(entry->erased)))
+		{
+			entry->last_use = ++cache->use_counter;
+			cache->stats.decoding_hits++;
+			return entry;
+		}
+		if(entry->last_use < (*lru)->last_use)
+			*lru = entry;
+	}
+	return NULL;
+}
+
+static void fec_cache_decoding_replace(ChiakiFecCache *cache, ChiakiFecDecodingMatrix *lru, unsigned int k, unsigned int m,
+		const uint64_t *erased, bool progressive, int *rows, int *dm_ids, uint8_t *tables)
+{
+	cache->stats.decoding_misses++;
+	free(lru->rows);
+	free(lru->dm_ids);
+	free(lru->tables);
+	lru->k = k;
+	lru->m = m;
+	memcpy(lru->erased, erased, sizeof(lru->erased));
+	lru->progressive = progressive;
+	lru->rows = rows;
+	lru->dm_ids = dm_ids;
+	lru->tables = tables;
+	lru->last_use = ++cache->use_counter;
+}
+
+static ChiakiErrorCode fec_cache_decoding_matrix(ChiakiFecCache *cache, unsigned int k, unsigned int m, int *matrix,
+		const uint64_t *erased, size_t erased_source_count, ChiakiFecDecodingMatrix **out)
+{
+	ChiakiFecDecodingMatrix *lru;
+	*out = fec_cache_decoding_lookup(cache, k, m, erased, false, &lru);
+	if(*out)
+		return CHIAKI_ERR_SUCCESS;
+
+	int erased_ints[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<k+m; i++)
+		erased_ints[i] = (int)ERASED_GET(erased, i);
 
 	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	int *decoding_matrix = calloc((size_t)k * k, sizeof(int));
+	int *dm_ids = calloc(k, sizeof(int));
+	int *rows = calloc(erased_source_count * k, sizeof(int));
+	uint8_t *tables = NULL;
+	if(!decoding_matrix || !dm_ids || !rows)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error;
+	}
 
-	int *jerasures = calloc(erasures_count + 1, sizeof(int));
-	if(!jerasures)
+	if(jerasure_make_decoding_matrix(k, m, CHIAKI_FEC_WORDSIZE, matrix, erased_ints, decoding_matrix, dm_ids) < 0)
+	{
+		err = CHIAKI_ERR_FEC_FAILED;
+		goto error;
+	}
+
+	// only the rows for the erased source units are ever needed
+	size_t row = 0;
+	for(unsigned int i=0; i<k; i++)
+	{
+		if(erased_ints[i])
+			memcpy(rows + row++ * k, decoding_matrix + (size_t)i * k, k * sizeof(int));
+	}
+	free(decoding_matrix);
+	decoding_matrix = NULL;
+
+	tables = gf_split_tables_new(rows, erased_source_count * k);
+	if(!tables)
 	{
 		err = CHIAKI_ERR_MEMORY;
-		goto error_matrix;
+		goto error;
 	}
-	memcpy(jerasures, erasures, erasures_count * sizeof(int));
-	jerasures[erasures_count] = -1;
 
-	uint8_t **data_ptrs = calloc(k, sizeof(uint8_t *));
-	if(!data_ptrs)
+	fec_cache_decoding_replace(cache, lru, k, m, erased, false, rows, dm_ids, tables);
+	*out = lru;
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	free(tables);
+	free(rows);
+	free(dm_ids);
+	free(decoding_matrix);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_cache_decode(ChiakiFecCache *cache, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	if(stride < unit_size || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	uint64_t erased[CHIAKI_FEC_UNITS_MAX / 64] = { 0 };
+	size_t erased_count = 0;
+	size_t erased_source_count = 0;
+	for(size_t i=0; i<erasures_count; i++)
+	{
+		unsigned int e = erasures[i];
+		if(e >= k + m)
+			return CHIAKI_ERR_INVALID_DATA;
+		if(ERASED_GET(erased, e))
+			continue;
+		ERASED_SET(erased, e);
+		erased_count++;
+		if(e < k)
+			erased_source_count++;
+	}
+	if(erased_count > m)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	ChiakiFecCodingMatrix *coding = fec_cache_coding_matrix(cache, k, m);
+	if(!coding)
+		return CHIAKI_ERR_MEMORY;
+
+	uint8_t *ptrs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<k+m; i++)
+		ptrs[i] = frame_buf + stride * i;
+
+	// same as jerasure_matrix_decode(), but with the matrices from the cache and the region multiply from above
+	if(erased_source_count)
+	{
+		ChiakiFecDecodingMatrix *decoding;
+		ChiakiErrorCode err = fec_cache_decoding_matrix(cache, k, m, coding->matrix, erased, erased_source_count, &decoding);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		size_t row = 0;
+		for(unsigned int i=0; i<k; i++)
+		{
+			if(ERASED_GET(erased, i))
+			{
+				fec_dotprod(cache->simd, k, decoding->rows + row * k, decoding->tables + row * k * GF_SPLIT_TABLES_SIZE,
+						decoding->dm_ids, i, ptrs, unit_size);
+				row++;
+			}
+		}
+	}
+
+	for(unsigned int i=0; i<m; i++)
+	{
+		if(ERASED_GET(erased, k + i))
+			fec_dotprod(cache->simd, k, coding->matrix + (size_t)i * k, coding->tables + (size_t)i * k * GF_SPLIT_TABLES_SIZE,
+					NULL, k + i, ptrs, unit_size);
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+	ChiakiErrorCode err = chiaki_fec_cache_decode(&cache, frame_buf, unit_size, stride, k, m, erasures, erasures_count);
+	chiaki_fec_cache_fini(&cache);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_fec_progressive_init(ChiakiFecProgressive *progressive, ChiakiFecCache *cache)
+{
+	memset(progressive, 0, sizeof(*progressive));
+	progressive->cache = cache;
+}
+
+CHIAKI_EXPORT void chiaki_fec_progressive_fini(ChiakiFecProgressive *progressive)
+{
+	free(progressive->acc);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_start(ChiakiFecProgressive *progressive, uint8_t *frame_buf, unsigned int k, unsigned int m, size_t unit_size, size_t stride)
+{
+	progressive->coding = NULL;
+	if(!k || !m || stride < unit_size || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	size_t acc_size = stride * m;
+	if(acc_size > progressive->acc_size)
+	{
+		uint8_t *acc = realloc(progressive->acc, acc_size);
+		if(!acc)
+			return CHIAKI_ERR_MEMORY;
+		progressive->acc = acc;
+		progressive->acc_size = acc_size;
+	}
+	memset(progressive->acc, 0, acc_size);
+
+	progressive->coding = fec_cache_coding_matrix(progressive->cache, k, m);
+	if(!progressive->coding)
+		return CHIAKI_ERR_MEMORY;
+	progressive->k = k;
+	progressive->m = m;
+	progressive->frame_buf = frame_buf;
+	progressive->unit_size = unit_size;
+	progressive->stride = stride;
+	memset(progressive->received, 0, sizeof(progressive->received));
+	memset(progressive->folded, 0, sizeof(progressive->folded));
+	progressive->source_received = 0;
+	progressive->fec_received = 0;
+	progressive->rows_folded = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * acc row i ^= matrix[i][j] * source unit j, fec unit i = sum of matrix[i][j] * source unit j,
+ * so adding the parts of all received source units leaves only the erased ones in the row
+ */
+static void fec_progressive_fold(ChiakiFecProgressive *progressive, unsigned int row, unsigned int index)
+{
+	ChiakiFecCodingMatrix *coding = progressive->coding;
+	size_t c = (size_t)row * progressive->k + index;
+	region_mul(progressive->cache->simd, progressive->acc + progressive->stride * row, progressive->frame_buf + progressive->stride * index,
+			(uint8_t)coding->matrix[c], coding->tables + c * GF_SPLIT_TABLES_SIZE, progressive->unit_size, true);
+}
+
+/**
+ * Fold all source units received so far into a row that has not been kept up to date
+ */
+static void fec_progressive_catch_up(ChiakiFecProgressive *progressive, unsigned int row)
+{
+	for(unsigned int j=0; j<progressive->k; j++)
+	{
+		if(ERASED_GET(progressive->received, j))
+			fec_progressive_fold(progressive, row, j);
+	}
+	ERASED_SET(progressive->folded, row);
+	progressive->rows_folded++;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_put(ChiakiFecProgressive *progressive, unsigned int index)
+{
+	if(!progressive->coding || index >= progressive->k + progressive->m)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(ERASED_GET(progressive->received, index))
+		return CHIAKI_ERR_SUCCESS;
+	ERASED_SET(progressive->received, index);
+
+	unsigned int k = progressive->k;
+	if(index >= k)
+	{
+		xor_bytes(progressive->acc + progressive->stride * (index - k), progressive->frame_buf + progressive->stride * index, progressive->unit_size);
+		progressive->fec_received++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	for(unsigned int i=0; i<progressive->m; i++)
+	{
+		if(ERASED_GET(progressive->folded, i))
+			fec_progressive_fold(progressive, i, index);
+	}
+	progressive->source_received++;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_reserve(ChiakiFecProgressive *progressive, unsigned int rows)
+{
+	if(!progressive->coding)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(rows > progressive->m)
+		rows = progressive->m;
+	// prefer rows whose fec unit is already known to have arrived, the others might be lost
+	for(unsigned int pass=0; pass<2; pass++)
+	{
+		for(unsigned int i=0; i<progressive->m && progressive->rows_folded<rows; i++)
+		{
+			if(ERASED_GET(progressive->folded, i))
+				continue;
+			if(pass == 0 && !ERASED_GET(progressive->received, progressive->k + i))
+				continue;
+			fec_progressive_catch_up(progressive, i);
+		}
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Invert the square submatrix of the coding matrix for the erased source units and the first received fec units
+ */
+static ChiakiErrorCode fec_cache_progressive_matrix(ChiakiFecCache *cache, ChiakiFecCodingMatrix *coding, const uint64_t *erased,
+		const unsigned int *erased_sources, unsigned int e, ChiakiFecDecodingMatrix **out)
+{
+	unsigned int k = coding->k;
+	unsigned int m = coding->m;
+	ChiakiFecDecodingMatrix *lru;
+	*out = fec_cache_decoding_lookup(cache, k, m, erased, true, &lru);
+	if(*out)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	int *submatrix = calloc((size_t)e * e, sizeof(int));
+	int *rows = calloc((size_t)e * e, sizeof(int));
+	int *dm_ids = calloc(e, sizeof(int));
+	uint8_t *tables = NULL;
+	if(!submatrix || !rows || !dm_ids)
 	{
 		err = CHIAKI_ERR_MEMORY;
-		goto error_jerasures;
+		goto error;
 	}
 
-	uint8_t **coding_ptrs = calloc(m, sizeof(uint8_t *));
-	if(!coding_ptrs)
+	unsigned int row = 0;
+	for(unsigned int i=0; i<m && row<e; i++)
+	{
+		if(ERASED_GET(erased, k + i))
+			continue;
+		dm_ids[row] = (int)(k + i);
+		for(unsigned int j=0; j<e; j++)
+			submatrix[row * e + j] = coding->matrix[(size_t)i * k + erased_sources[j]];
+		row++;
+	}
+	if(row < e)
+	{
+		err = CHIAKI_ERR_FEC_FAILED;
+		goto error;
+	}
+
+	// every square submatrix of a cauchy matrix is invertible
+	if(jerasure_invert_matrix(submatrix, rows, (int)e, CHIAKI_FEC_WORDSIZE) < 0)
+	{
+		err = CHIAKI_ERR_FEC_FAILED;
+		goto error;
+	}
+	free(submatrix);
+	submatrix = NULL;
+
+	tables = gf_split_tables_new(rows, (size_t)e * e);
+	if(!tables)
 	{
 		err = CHIAKI_ERR_MEMORY;
-		goto error_data_ptrs;
+		goto error;
 	}
 
-	for(size_t i=0; i<k+m; i++)
+	fec_cache_decoding_replace(cache, lru, k, m, erased, true, rows, dm_ids, tables);
+	*out = lru;
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	free(tables);
+	free(dm_ids);
+	free(rows);
+	free(submatrix);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_progressive_decode(ChiakiFecProgressive *progressive)
+{
+	if(!progressive->coding)
+		return CHIAKI_ERR_INVALID_DATA;
+	unsigned int k = progressive->k;
+	unsigned int m = progressive->m;
+	unsigned int e = k - progressive->source_received;
+	if(!e)
+		return CHIAKI_ERR_SUCCESS;
+	if(progressive->fec_received < e)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	uint64_t erased[CHIAKI_FEC_UNITS_MAX / 64] = { 0 };
+	unsigned int erased_sources[CHIAKI_FEC_UNITS_MAX];
+	unsigned int erased_source_count = 0;
+	for(unsigned int i=0; i<k+m; i++)
 	{
-		uint8_t *buf_ptr = frame_buf + stride * i;
+		if(ERASED_GET(progressive->received, i))
+			continue;
+		ERASED_SET(erased, i);
 		if(i < k)
-			data_ptrs[i] = buf_ptr;
-		else
-			coding_ptrs[i - k] = buf_ptr;
+			erased_sources[erased_source_count++] = i;
 	}
 
-	int res = jerasure_matrix_decode(k, m, CHIAKI_FEC_WORDSIZE, matrix, 0, jerasures,
-									 (char **)data_ptrs, (char **)coding_ptrs, unit_size);
+	ChiakiFecDecodingMatrix *decoding;
+	ChiakiErrorCode err = fec_cache_progressive_matrix(progressive->cache, progressive->coding, erased, erased_sources, e, &decoding);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-	if(res < 0)
-		err = CHIAKI_ERR_FEC_FAILED;
-	else
-		err = CHIAKI_ERR_SUCCESS;
+	// the matrix uses the first e received fec units
+	for(unsigned int i=0, used=0; i<m && used<e; i++)
+	{
+		if(ERASED_GET(erased, k + i))
+			continue;
+		if(!ERASED_GET(progressive->folded, i))
+			fec_progressive_catch_up(progressive, i);
+		used++;
+	}
 
-	free(coding_ptrs);
-error_data_ptrs:
-	free(data_ptrs);
-error_jerasures:
-	free(jerasures);
-error_matrix:
-	free(matrix);
-	return err;
+	uint8_t *ptrs[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<k; i++)
+		ptrs[i] = progressive->frame_buf + progressive->stride * i;
+	for(unsigned int i=0; i<m; i++)
+		ptrs[k + i] = progressive->acc + progressive->stride * i;
+
+	for(unsigned int row=0; row<e; row++)
+	{
+		fec_dotprod(progressive->cache->simd, e, decoding->rows + row * e, decoding->tables + (size_t)row * e * GF_SPLIT_TABLES_SIZE,
+				decoding->dm_ids, erased_sources[row], ptrs, progressive->unit_size);
+	}
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m)
@@ -8,6 +8,7 @@
 #define FEEDBACK_HISTORY_BUFFER_SIZE 0x10
 
 static void *feedback_sender_thread_func(void *user);
+static uint64_t feedback_sender_timer_cb(void *user);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion)
 {
@@ -32,6 +33,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
+	feedback_sender->reactor = takion->reactor;
+	if(feedback_sender->reactor)
+	{
+		err = chiaki_reactor_timer_add(feedback_sender->reactor, &feedback_sender->timer, feedback_sender_timer_cb, feedback_sender, FEEDBACK_STATE_TIMEOUT_MAX_MS);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_cond;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	err = chiaki_thread_create(&feedback_sender->thread, feedback_sender_thread_func, feedback_sender);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
@@ -50,11 +60,16 @@ error_history_buffer:
 
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender)
 {
-	chiaki_mutex_lock(&feedback_sender->state_mutex);
-	feedback_sender->should_stop = true;
-	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
-	chiaki_thread_join(&feedback_sender->thread, NULL);
+	if(feedback_sender->reactor)
+		chiaki_reactor_timer_remove(feedback_sender->reactor, &feedback_sender->timer);
+	else
+	{
+		chiaki_mutex_lock(&feedback_sender->state_mutex);
+		feedback_sender->should_stop = true;
+		chiaki_mutex_unlock(&feedback_sender->state_mutex);
+		chiaki_cond_signal(&feedback_sender->state_cond);
+		chiaki_thread_join(&feedback_sender->thread, NULL);
+	}
 	chiaki_cond_fini(&feedback_sender->state_cond);
 	chiaki_mutex_fini(&feedback_sender->state_mutex);
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
@@ -76,7 +91,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(Chiaki
 	feedback_sender->controller_state_changed = true;
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
+	if(feedback_sender->reactor)
+		chiaki_reactor_timer_schedule(feedback_sender->reactor, &feedback_sender->timer, 0);
+	else
+		chiaki_cond_signal(&feedback_sender->state_cond);
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -235,6 +253,35 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 	}
 }
 
+/**
+ * Must be called with state_mutex locked
+ */
+static void feedback_sender_send(ChiakiFeedbackSender *feedback_sender)
+{
+	bool send_feedback_state = true;
+	bool send_feedback_history = false;
+
+	if(feedback_sender->controller_state_changed)
+	{
+		// TODO: FEEDBACK_STATE_TIMEOUT_MIN_MS
+		feedback_sender->controller_state_changed = false;
+
+		// don't need to send feedback state if nothing relevant changed
+		if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
+			send_feedback_state = false;
+
+		send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
+	} // else: timeout or periodic timer
+
+	if(send_feedback_state)
+		feedback_sender_send_state(feedback_sender);
+
+	if(send_feedback_history)
+		feedback_sender_send_history(feedback_sender);
+
+	feedback_sender->controller_state_prev = feedback_sender->controller_state;
+}
+
 static bool state_cond_check(void *user)
 {
 	ChiakiFeedbackSender *feedback_sender = user;
@@ -259,31 +306,24 @@ static void *feedback_sender_thread_func(void *user)
 		if(feedback_sender->should_stop)
 			break;
 
-		bool send_feedback_state = true;
-		bool send_feedback_history = false;
-
-		if(feedback_sender->controller_state_changed)
-		{
-			// TODO: FEEDBACK_STATE_TIMEOUT_MIN_MS
-			feedback_sender->controller_state_changed = false;
+		feedback_sender_send(feedback_sender);
+	}
 
-			// don't need to send feedback state if nothing relevant changed
-			if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
-				send_feedback_state = false;
+	chiaki_mutex_unlock(&feedback_sender->state_mutex);
 
-			send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
-		} // else: timeout
+	return NULL;
+}
 
-		if(send_feedback_state)
-			feedback_sender_send_state(feedback_sender);
+static uint64_t feedback_sender_timer_cb(void *user)
+{
+	ChiakiFeedbackSender *feedback_sender = user;
 
-		if(send_feedback_history)
-			feedback_sender_send_history(feedback_sender);
+	ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return FEEDBACK_STATE_TIMEOUT_MAX_MS;
 
-		feedback_sender->controller_state_prev = feedback_sender->controller_state;
-	}
+	feedback_sender_send(feedback_sender);
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-
-	return NULL;
+	return FEEDBACK_STATE_TIMEOUT_MAX_MS;
 }
@@ -1,5 +1,7 @@
 
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/videobuffer.h>
+#include <chiaki/time.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixdesc.h>
@@ -30,6 +32,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 	decoder->hdr_enabled = codec == CHIAKI_CODEC_H265_HDR;
 	decoder->frames_lost = 0;
 	decoder->frame_recovered = false;
+	decoder->frame_tracer = NULL;
 
 	decoder->hw_device_ctx = hw_device_ctx ? av_buffer_ref(hw_device_ctx) : NULL;
 	decoder->hw_pix_fmt = AV_PIX_FMT_NONE;
@@ -113,7 +116,7 @@ CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 	chiaki_mutex_fini(&decoder->mutex);
 }
 
-CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, int32_t frame_index, void *user)
 {
 	ChiakiFfmpegDecoder *decoder = user;
 
@@ -121,8 +124,23 @@ CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t bu
 	decoder->frames_lost += frames_lost;
 	decoder->frame_recovered = frame_recovered;
 	AVPacket *packet = av_packet_alloc();
+	if(!packet)
+	{
+		CHIAKI_LOGE(decoder->log, "Failed to alloc AVPacket");
+		chiaki_mutex_unlock(&decoder->mutex);
+		return false;
+	}
+	// wrap the video buffer so the decoder references it instead of copying the frame
+	chiaki_video_buffer_ref(buf);
+	packet->buf = av_buffer_create(buf, buf_size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE, chiaki_video_buffer_av_free, buf, 0);
+	if(!packet->buf)
+		chiaki_video_buffer_unref(buf); // fall back to letting FFmpeg copy it
 	packet->data = buf;
 	packet->size = buf_size;
+	// the pts of decoded frames is the frame index, to trace them up to presentation
+	packet->pts = frame_index >= 0 ? frame_index : AV_NOPTS_VALUE;
+	if(frame_index >= 0)
+		chiaki_frame_tracer_mark(decoder->frame_tracer, frame_index, CHIAKI_FRAME_TRACE_DECODER_SUBMIT, chiaki_time_now_monotonic_us());
 	int r;
 send_packet:
 	r = avcodec_send_packet(decoder->codec_context, packet);
@@ -196,6 +214,8 @@ CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *dec
 			frame = frame_last;
 			break;
 		}
+		if(frame->pts != AV_NOPTS_VALUE)
+			chiaki_frame_tracer_mark(decoder->frame_tracer, (int32_t)frame->pts, CHIAKI_FRAME_TRACE_DECODER_PULL, chiaki_time_now_monotonic_us());
 	}
 	*frames_lost = decoder->frames_lost;
 	if(frame && decoder->frame_recovered)
@@ -3,6 +3,7 @@
 #include <chiaki/frameprocessor.h>
 #include <chiaki/fec.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
 
 #include <jerasure.h>
 
@@ -13,28 +14,19 @@
 #include <arpa/inet.h>
 #endif
 
-CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats)
-{
-	stats->frames = 0;
-	stats->bytes = 0;
-}
+#define UNIT_SLOTS_MAX CHIAKI_FEC_UNITS_MAX
 
-CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size)
-{
-	stats->frames++;
-	stats->bytes += size;
-	//float br = (float)chiaki_stream_stats_bitrate(stats, 60) / 1000000.0f;
-	//CHIAKI_LOGD(NULL, "bitrate: %f", br);
-}
+#define UNIT_RECEIVED(frame_processor, i) (((frame_processor)->unit_received[(i) / 64] >> ((i) % 64)) & 1)
+#define UNIT_RECEIVED_SET(frame_processor, i) ((frame_processor)->unit_received[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+#define UNIT_RECEIVED_CLEAR(frame_processor, i) ((frame_processor)->unit_received[(i) / 64] &= ~((uint64_t)1 << ((i) % 64)))
 
-CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate)
-{
-	if (stats->frames == 0)
-		return 0;
-	return (stats->bytes * 8 * framerate) / stats->frames;
-}
+// units that may overtake a missing one before it is considered lost rather than reordered
+#define FEC_PROGRESSIVE_REORDER_UNITS 8
 
-#define UNIT_SLOTS_MAX 256
+// one for the frame being assembled, one for the frame still held by the decoder
+#define BUFFER_POOL_COUNT 2
+// decoders with frame threading or a hardware queue hold on to several frames, the pool grows up to this on misses
+#define BUFFER_POOL_COUNT_MAX 8
 
 struct chiaki_frame_unit_t
 {
@@ -44,6 +36,7 @@ struct chiaki_frame_unit_t
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
 {
 	frame_processor->log = log;
+	frame_processor->buffer_pool = NULL;
 	frame_processor->frame_buf = NULL;
 	frame_processor->frame_buf_size = 0;
 	frame_processor->buf_size_per_unit = 0;
@@ -54,14 +47,28 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 	frame_processor->units_fec_received = 0;
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
+	memset(frame_processor->unit_received, 0, sizeof(frame_processor->unit_received));
+	frame_processor->unit_first_missing = 0;
+	frame_processor->unit_index_end = 0;
 	frame_processor->flushed = true;
 	chiaki_stream_stats_reset(&frame_processor->stream_stats);
+	chiaki_fec_cache_init(&frame_processor->fec_cache);
+	chiaki_fec_progressive_init(&frame_processor->fec_progressive, &frame_processor->fec_cache);
+	frame_processor->fec_progressive_enabled = true;
+	frame_processor->fec_progressive_active = false;
+	frame_processor->last_unit_us = 0;
+	memset(&frame_processor->fec_stats, 0, sizeof(frame_processor->fec_stats));
+	frame_processor->bytes_zeroed = 0;
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
-	free(frame_processor->frame_buf);
+	if(frame_processor->frame_buf)
+		chiaki_video_buffer_unref(frame_processor->frame_buf);
+	chiaki_video_buffer_pool_free(frame_processor->buffer_pool);
 	free(frame_processor->unit_slots);
+	chiaki_fec_progressive_fini(&frame_processor->fec_progressive);
+	chiaki_fec_cache_fini(&frame_processor->fec_cache);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
@@ -72,7 +79,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
-	frame_processor->flushed = false;
+	frame_processor->flushed = true; // until the frame is allocated successfully
 	frame_processor->units_source_expected = packet->units_in_frame_total - packet->units_in_frame_fec;
 	frame_processor->units_fec_expected = packet->units_in_frame_fec;
 	if(frame_processor->units_fec_expected < 1)
@@ -86,7 +93,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 			CHIAKI_LOGE(frame_processor->log, "Packet too small to read buf size extension");
 			return CHIAKI_ERR_BUF_TOO_SMALL;
 		}
-		frame_processor->buf_size_per_unit += ntohs(((chiaki_unaligned_uint16_t *)packet->data)[0]);
+		uint16_t buf_size_ext;
+		ChiakiErrorCode err = chiaki_takion_av_packet_read_data(packet, (uint8_t *)&buf_size_ext, sizeof(buf_size_ext));
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		frame_processor->buf_size_per_unit += ntohs(buf_size_ext);
 	}
 	frame_processor->buf_stride_per_unit = ((frame_processor->buf_size_per_unit + 0xf) / 0x10) * 0x10;
 
@@ -98,6 +109,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 
 	frame_processor->units_source_received = 0;
 	frame_processor->units_fec_received = 0;
+	memset(frame_processor->unit_received, 0, sizeof(frame_processor->unit_received));
+	frame_processor->unit_first_missing = 0;
+	frame_processor->unit_index_end = 0;
+	frame_processor->fec_progressive_active = false;
 
 	size_t unit_slots_size_required = frame_processor->units_source_expected + frame_processor->units_fec_expected;
 	if(unit_slots_size_required > UNIT_SLOTS_MAX)
@@ -105,51 +120,86 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 		CHIAKI_LOGE(frame_processor->log, "Packet suggests more than %u unit slots", UNIT_SLOTS_MAX);
 		return CHIAKI_ERR_INVALID_DATA;
 	}
-	if(unit_slots_size_required != frame_processor->unit_slots_size)
+	if(!frame_processor->unit_slots)
 	{
-		void *new_ptr = NULL;
-		if(frame_processor->unit_slots)
-		{
-			new_ptr = realloc(frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
-			if(!new_ptr)
-				free(frame_processor->unit_slots);
-		}
-		else
-			new_ptr = malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
-
-		frame_processor->unit_slots = new_ptr;
-		if(!new_ptr)
-		{
-			frame_processor->unit_slots_size = 0;
+		frame_processor->unit_slots = malloc(UNIT_SLOTS_MAX * sizeof(ChiakiFrameUnit));
+		if(!frame_processor->unit_slots)
 			return CHIAKI_ERR_MEMORY;
-		}
-		else
-			frame_processor->unit_slots_size = unit_slots_size_required;
 	}
-	memset(frame_processor->unit_slots, 0, frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
+	frame_processor->unit_slots_size = unit_slots_size_required;
 
 	if(frame_processor->unit_slots_size > SIZE_MAX / frame_processor->buf_stride_per_unit)
 		return CHIAKI_ERR_OVERFLOW;
 	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_stride_per_unit;
-	if(frame_processor->frame_buf_size < frame_buf_size_required)
+	if(!frame_processor->buffer_pool)
+	{
+		frame_processor->buffer_pool = chiaki_video_buffer_pool_new(BUFFER_POOL_COUNT);
+		if(!frame_processor->buffer_pool)
+			return CHIAKI_ERR_MEMORY;
+		chiaki_video_buffer_pool_set_count_max(frame_processor->buffer_pool, BUFFER_POOL_COUNT_MAX);
+	}
+	// the previous frame may still be referenced by the decoder
+	if(frame_processor->frame_buf
+		&& (frame_processor->frame_buf_size < frame_buf_size_required || !chiaki_video_buffer_unique(frame_processor->frame_buf)))
+	{
+		chiaki_video_buffer_unref(frame_processor->frame_buf);
+		frame_processor->frame_buf = NULL;
+	}
+	if(!frame_processor->frame_buf)
 	{
-		free(frame_processor->frame_buf);
-		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		// never shrink, so the pool keeps buffers for the biggest frames instead of reallocating when sizes jitter
+		if(frame_buf_size_required > frame_processor->frame_buf_size)
+			frame_processor->frame_buf_size = frame_buf_size_required;
+		frame_processor->frame_buf = chiaki_video_buffer_alloc(frame_processor->buffer_pool, frame_processor->frame_buf_size);
 		if(!frame_processor->frame_buf)
-		{
-			frame_processor->frame_buf_size = 0;
 			return CHIAKI_ERR_MEMORY;
-		}
-		frame_processor->frame_buf_size = frame_buf_size_required;
+		frame_processor->frame_buf_size = chiaki_video_buffer_size(frame_processor->frame_buf);
 	}
-	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	// Nothing is zeroed here: units are zero-padded to buf_size_per_unit when they are put,
+	// fec overwrites the missing ones entirely and flush zeroes the padding after the frame.
 
+	frame_processor->flushed = false;
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Fold a unit that has just been put into fec_progressive, so only a small part of the decoding is left when the last unit comes in.
+ * Nothing happens until a source unit is considered lost, i.e. fec units arrive while it is missing
+ * or FEC_PROGRESSIVE_REORDER_UNITS later units have overtaken it, so frames without loss or with only slight reordering
+ * cost nothing extra. After that, only as many fec rows as there are lost source units are kept up to date,
+ * which is about the same work a full decode does at the end, but spread over the remaining units.
+ */
+static void chiaki_frame_processor_fec_progressive_put(ChiakiFrameProcessor *frame_processor, unsigned int unit_index)
+{
+	unsigned int k = frame_processor->units_source_expected;
+	if(!frame_processor->fec_progressive_active)
+	{
+		if(frame_processor->unit_first_missing >= k
+				|| (unit_index < k && unit_index < frame_processor->unit_first_missing + FEC_PROGRESSIVE_REORDER_UNITS))
+			return;
+		ChiakiErrorCode err = chiaki_fec_progressive_start(&frame_processor->fec_progressive, frame_processor->frame_buf,
+				k, frame_processor->units_fec_expected,
+				frame_processor->buf_size_per_unit, frame_processor->buf_stride_per_unit);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return;
+		for(unsigned int i=0; i<frame_processor->unit_index_end; i++)
+		{
+			if(UNIT_RECEIVED(frame_processor, i))
+				chiaki_fec_progressive_put(&frame_processor->fec_progressive, i);
+		}
+		frame_processor->fec_progressive_active = true;
+	}
+	else
+		chiaki_fec_progressive_put(&frame_processor->fec_progressive, unit_index);
+
+	// source units before the highest one received that are still missing are most likely lost
+	unsigned int end = frame_processor->unit_index_end < k ? frame_processor->unit_index_end : k;
+	chiaki_fec_progressive_reserve(&frame_processor->fec_progressive, end - frame_processor->units_source_received);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
 {
-	if(packet->unit_index > frame_processor->unit_slots_size)
+	if(packet->unit_index >= frame_processor->unit_slots_size)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Packet's unit index is too high");
 		return CHIAKI_ERR_INVALID_DATA;
@@ -168,33 +218,70 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	}
 
 	ChiakiFrameUnit *unit = frame_processor->unit_slots + packet->unit_index;
-	if(unit->data_size)
+	if(UNIT_RECEIVED(frame_processor, packet->unit_index))
 	{
 		CHIAKI_LOGW(frame_processor->log, "Received duplicate unit");
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
+	frame_processor->last_unit_us = chiaki_time_now_monotonic_us();
 	unit->data_size = packet->data_size;
+	UNIT_RECEIVED_SET(frame_processor, packet->unit_index);
 	if(!frame_processor->flushed)
 	{
-		memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
-				packet->data,
-				packet->data_size);
+		uint8_t *buf_ptr = frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit;
+		ChiakiErrorCode err = chiaki_takion_av_packet_read_data(packet, buf_ptr, packet->data_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			UNIT_RECEIVED_CLEAR(frame_processor, packet->unit_index);
+			return err;
+		}
+		// fec works on whole units
+		size_t tail_size = frame_processor->buf_size_per_unit - packet->data_size;
+		if(tail_size)
+		{
+			memset(buf_ptr + packet->data_size, 0, tail_size);
+			frame_processor->bytes_zeroed += tail_size;
+		}
 	}
 
 	if(packet->unit_index < frame_processor->units_source_expected)
 		frame_processor->units_source_received++;
 	else
 		frame_processor->units_fec_received++;
+	if(packet->unit_index >= frame_processor->unit_index_end)
+		frame_processor->unit_index_end = packet->unit_index + 1;
+	while(frame_processor->unit_first_missing < frame_processor->unit_slots_size
+			&& UNIT_RECEIVED(frame_processor, frame_processor->unit_first_missing))
+		frame_processor->unit_first_missing++;
+
+	if(!frame_processor->flushed && frame_processor->fec_progressive_enabled)
+		chiaki_frame_processor_fec_progressive_put(frame_processor, packet->unit_index);
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats)
+/**
+ * Restore the sizes of the source units after they have been recovered
+ */
+static ChiakiErrorCode chiaki_frame_processor_fec_restore(ChiakiFrameProcessor *frame_processor)
 {
-	uint64_t received = frame_processor->units_source_received + frame_processor->units_fec_received;
-	uint64_t expected = frame_processor->units_source_expected + frame_processor->units_fec_expected;
-	chiaki_packet_stats_push_generation(packet_stats, received, expected - received);
+	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	{
+		ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
+		uint8_t *buf_ptr = frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i;
+		uint16_t padding = ntohs(*((chiaki_unaligned_uint16_t *)buf_ptr));
+		if(padding >= frame_processor->buf_size_per_unit)
+		{
+			CHIAKI_LOGE(frame_processor->log, "Padding in unit (%#x) is larger or equals to the whole unit size (%#llx)",
+						(unsigned int)padding, frame_processor->buf_size_per_unit);
+			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_DEBUG, buf_ptr, 0x50);
+			continue;
+		}
+		slot->data_size = frame_processor->buf_size_per_unit - padding;
+		UNIT_RECEIVED_SET(frame_processor, i);
+	}
+	return CHIAKI_ERR_SUCCESS;
 }
 
 static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_processor)
@@ -204,6 +291,17 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 				frame_processor->units_source_expected, frame_processor->units_fec_expected);
 
 
+	if(frame_processor->fec_progressive_active)
+	{
+		if(chiaki_fec_progressive_decode(&frame_processor->fec_progressive) == CHIAKI_ERR_SUCCESS)
+		{
+			frame_processor->fec_stats.frames_progressive++;
+			return chiaki_frame_processor_fec_restore(frame_processor);
+		}
+		// the received units are untouched, so the full decode below can still try
+		frame_processor->fec_progressive_active = false;
+	}
+
 	size_t erasures_count = (frame_processor->units_source_expected + frame_processor->units_fec_expected)
 			- (frame_processor->units_source_received + frame_processor->units_fec_received);
 	unsigned int *erasures = calloc(erasures_count, sizeof(unsigned int));
@@ -213,8 +311,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	size_t erasure_index = 0;
 	for(size_t i=0; i<frame_processor->units_source_expected + frame_processor->units_fec_expected; i++)
 	{
-		ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-		if(!slot->data_size)
+		if(!UNIT_RECEIVED(frame_processor, i))
 		{
 			if(erasure_index >= erasures_count)
 			{
@@ -228,40 +325,18 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	}
 	assert(erasure_index == erasures_count);
 
-	ChiakiErrorCode err = chiaki_fec_decode(frame_processor->frame_buf,
+	ChiakiErrorCode err = chiaki_fec_cache_decode(&frame_processor->fec_cache, frame_processor->frame_buf,
 			frame_processor->buf_size_per_unit, frame_processor->buf_stride_per_unit,
 			frame_processor->units_source_expected, frame_processor->units_fec_expected,
 			erasures, erasures_count);
 
+	free(erasures);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		err = CHIAKI_ERR_FEC_FAILED;
 		CHIAKI_LOGE(frame_processor->log, "FEC failed");
+		return CHIAKI_ERR_FEC_FAILED;
 	}
-	else
-	{
-		err = CHIAKI_ERR_SUCCESS;
-		CHIAKI_LOGI(frame_processor->log, "FEC successful");
-
-		// restore unit sizes
-		for(size_t i=0; i<frame_processor->units_source_expected; i++)
-		{
-			ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-			uint8_t *buf_ptr = frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i;
-			uint16_t padding = ntohs(*((chiaki_unaligned_uint16_t *)buf_ptr));
-			if(padding >= frame_processor->buf_size_per_unit)
-			{
-				CHIAKI_LOGE(frame_processor->log, "Padding in unit (%#x) is larger or equals to the whole unit size (%#llx)",
-							(unsigned int)padding, frame_processor->buf_size_per_unit);
-				chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_DEBUG, buf_ptr, 0x50);
-				continue;
-			}
-			slot->data_size = frame_processor->buf_size_per_unit - padding;
-		}
-	}
-
-	free(erasures);
-	return err;
+	return chiaki_frame_processor_fec_restore(frame_processor);
 }
 
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
@@ -278,7 +353,22 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 	{
 		ChiakiErrorCode err = chiaki_frame_processor_fec(frame_processor);
 		if(err == CHIAKI_ERR_SUCCESS)
+		{
 			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS;
+			ChiakiFrameProcessorFecStats *fec_stats = &frame_processor->fec_stats;
+			uint64_t ready_us = chiaki_time_now_monotonic_us() - frame_processor->last_unit_us;
+			fec_stats->frames++;
+			fec_stats->ready_us_sum += ready_us;
+			if(ready_us > fec_stats->ready_us_max)
+				fec_stats->ready_us_max = ready_us;
+			ChiakiFecCacheStats *cache_stats = &frame_processor->fec_cache.stats;
+			CHIAKI_LOGI(frame_processor->log, "FEC successful%s, frame ready %llu us after the last unit (avg %llu us), decoding matrix cache hits: %llu/%llu",
+					frame_processor->fec_progressive_active ? " (progressive)" : "",
+					(unsigned long long)ready_us,
+					(unsigned long long)(fec_stats->ready_us_sum / fec_stats->frames),
+					(unsigned long long)cache_stats->decoding_hits,
+					(unsigned long long)(cache_stats->decoding_hits + cache_stats->decoding_misses));
+		}
 		else
 			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 	}
@@ -287,7 +377,7 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 	for(size_t i=0; i<frame_processor->units_source_expected; i++)
 	{
 		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
-		if(!unit->data_size)
+		if(!UNIT_RECEIVED(frame_processor, i))
 		{
 			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
 			continue;
@@ -304,6 +394,9 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 		cur += part_size;
 	}
 
+	memset(frame_processor->frame_buf + cur, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	frame_processor->bytes_zeroed += CHIAKI_VIDEO_BUFFER_PADDING_SIZE;
+
 	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur);
 
 	*frame = frame_processor->frame_buf;
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/frametrace.h>
+
+#include <string.h>
+
+static const char *stage_names[CHIAKI_FRAME_TRACE_STAGES_COUNT] = {
+	"first_unit",
+	"last_unit",
+	"fec_done",
+	"bitstream_done",
+	"decoder_submit",
+	"decoder_pull",
+	"presented"
+};
+
+static const double latency_buckets_ms[] = { 0.25, 0.5, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+CHIAKI_EXPORT const char *chiaki_frame_trace_stage_name(ChiakiFrameTraceStage stage)
+{
+	if(stage >= CHIAKI_FRAME_TRACE_STAGES_COUNT)
+		return "unknown";
+	return stage_names[stage];
+}
+
+static void trace_clear(ChiakiFrameTrace *trace)
+{
+	trace->frame_index = -1;
+	memset(trace->stages_us, 0, sizeof(trace->stages_us));
+}
+
+/**
+ * Aggregate and dump trace and free its slot, call with mutex locked
+ */
+static void tracer_finish(ChiakiFrameTracer *tracer, ChiakiFrameTrace *trace)
+{
+	uint64_t prev_us = 0;
+	for(size_t i=0; i<CHIAKI_FRAME_TRACE_STAGES_COUNT; i++)
+	{
+		uint64_t t = trace->stages_us[i];
+		if(!t)
+			continue;
+		if(prev_us)
+			chiaki_metric_observe(tracer->stage_latency[i], t > prev_us ? (double)(t - prev_us) / 1000.0 : 0.0);
+		prev_us = t;
+	}
+
+	uint64_t first_us = trace->stages_us[CHIAKI_FRAME_TRACE_FIRST_UNIT];
+	uint64_t presented_us = trace->stages_us[CHIAKI_FRAME_TRACE_PRESENTED];
+	if(!presented_us)
+		chiaki_metric_add(tracer->incomplete, 1);
+	else if(first_us)
+		chiaki_metric_observe(tracer->total_latency, presented_us > first_us ? (double)(presented_us - first_us) / 1000.0 : 0.0);
+
+	if(tracer->dump)
+	{
+		fprintf(tracer->dump, "%d", (int)trace->frame_index);
+		for(size_t i=0; i<CHIAKI_FRAME_TRACE_STAGES_COUNT; i++)
+		{
+			if(trace->stages_us[i])
+				fprintf(tracer->dump, ",%llu", (unsigned long long)trace->stages_us[i]);
+			else
+				fputc(',', tracer->dump);
+		}
+		fputc('\n', tracer->dump);
+	}
+
+	trace_clear(trace);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_tracer_init(ChiakiFrameTracer *tracer, ChiakiLog *log, ChiakiMetrics *metrics, const char *dump_path)
+{
+	tracer->log = log;
+	tracer->enabled = metrics || dump_path;
+	tracer->dump = NULL;
+	for(size_t i=0; i<CHIAKI_FRAME_TRACER_FRAMES; i++)
+		trace_clear(&tracer->traces[i]);
+
+	tracer->stage_latency[CHIAKI_FRAME_TRACE_FIRST_UNIT] = NULL;
+	for(size_t i=CHIAKI_FRAME_TRACE_FIRST_UNIT + 1; i<CHIAKI_FRAME_TRACE_STAGES_COUNT; i++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "chiaki_frame_latency_%s_ms", stage_names[i]);
+		char help[96];
+		snprintf(help, sizeof(help), "Time from %s to %s of video frames", stage_names[i - 1], stage_names[i]);
+		tracer->stage_latency[i] = chiaki_metrics_histogram(metrics, name, help,
+				latency_buckets_ms, sizeof(latency_buckets_ms) / sizeof(latency_buckets_ms[0]));
+	}
+	tracer->total_latency = chiaki_metrics_histogram(metrics, "chiaki_frame_latency_total_ms", "Time from the first unit received to presentation of video frames",
+			latency_buckets_ms, sizeof(latency_buckets_ms) / sizeof(latency_buckets_ms[0]));
+	tracer->incomplete = chiaki_metrics_counter(metrics, "chiaki_frame_traces_incomplete_total", "Video frames that were traced but never presented");
+
+	ChiakiErrorCode err = chiaki_mutex_init(&tracer->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	if(dump_path)
+	{
+		tracer->dump = fopen(dump_path, "w");
+		if(!tracer->dump)
+		{
+			// not worth failing the session for
+			CHIAKI_LOGE(log, "Failed to open frame trace file %s", dump_path);
+			tracer->enabled = metrics != NULL;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		fprintf(tracer->dump, "frame_index");
+		for(size_t i=0; i<CHIAKI_FRAME_TRACE_STAGES_COUNT; i++)
+			fprintf(tracer->dump, ",%s_us", stage_names[i]);
+		fputc('\n', tracer->dump);
+		CHIAKI_LOGI(log, "Writing frame traces to %s", dump_path);
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_frame_tracer_fini(ChiakiFrameTracer *tracer)
+{
+	if(tracer->enabled)
+	{
+		// oldest first, assuming no more than CHIAKI_FRAME_TRACER_FRAMES are in flight
+		size_t start = 0;
+		int32_t oldest = -1;
+		for(size_t i=0; i<CHIAKI_FRAME_TRACER_FRAMES; i++)
+		{
+			int32_t frame_index = tracer->traces[i].frame_index;
+			if(frame_index >= 0 && (oldest < 0 || (uint16_t)(frame_index - oldest) >= 0x8000))
+			{
+				oldest = frame_index;
+				start = i;
+			}
+		}
+		for(size_t i=0; i<CHIAKI_FRAME_TRACER_FRAMES; i++)
+		{
+			ChiakiFrameTrace *trace = &tracer->traces[(start + i) % CHIAKI_FRAME_TRACER_FRAMES];
+			if(trace->frame_index >= 0)
+				tracer_finish(tracer, trace);
+		}
+	}
+	if(tracer->dump)
+		fclose(tracer->dump);
+	chiaki_mutex_fini(&tracer->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_frame_tracer_begin(ChiakiFrameTracer *tracer, int32_t frame_index, uint64_t first_unit_us, uint64_t last_unit_us)
+{
+	if(!tracer || !tracer->enabled || frame_index < 0)
+		return;
+	chiaki_mutex_lock(&tracer->mutex);
+	ChiakiFrameTrace *trace = &tracer->traces[frame_index % CHIAKI_FRAME_TRACER_FRAMES];
+	if(trace->frame_index >= 0)
+		tracer_finish(tracer, trace);
+	trace->frame_index = frame_index;
+	trace->stages_us[CHIAKI_FRAME_TRACE_FIRST_UNIT] = first_unit_us;
+	trace->stages_us[CHIAKI_FRAME_TRACE_LAST_UNIT] = last_unit_us;
+	chiaki_mutex_unlock(&tracer->mutex);
+}
+
+/**
+ * Call with mutex locked
+ */
+static void tracer_mark(ChiakiFrameTracer *tracer, int32_t frame_index, ChiakiFrameTraceStage stage, uint64_t now_us)
+{
+	if(frame_index < 0 || stage >= CHIAKI_FRAME_TRACE_STAGES_COUNT)
+		return;
+	ChiakiFrameTrace *trace = &tracer->traces[frame_index % CHIAKI_FRAME_TRACER_FRAMES];
+	if(trace->frame_index != frame_index)
+		return;
+	trace->stages_us[stage] = now_us;
+	if(stage == CHIAKI_FRAME_TRACE_PRESENTED)
+		tracer_finish(tracer, trace);
+}
+
+CHIAKI_EXPORT void chiaki_frame_tracer_mark(ChiakiFrameTracer *tracer, int32_t frame_index, ChiakiFrameTraceStage stage, uint64_t now_us)
+{
+	if(!tracer || !tracer->enabled)
+		return;
+	chiaki_mutex_lock(&tracer->mutex);
+	tracer_mark(tracer, frame_index, stage, now_us);
+	chiaki_mutex_unlock(&tracer->mutex);
+}
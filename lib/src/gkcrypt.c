@@ -2,9 +2,12 @@
 
 #include <chiaki/gkcrypt.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdalign.h>
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 #include "mbedtls/aes.h"
@@ -20,45 +23,150 @@
 #include "utils.h"
 
 #define KEY_BUF_CHUNK_SIZE 0x1000
+#define KEY_RING_CACHE_LINE 64
+#define KEY_RING_NOT_READING UINT64_MAX
+
+/**
+ * Sizes of the key buffer in chunks, always a power of two and clamped to key_buf_size_max
+ */
+#define KEY_RING_CHUNKS_MIN 0x8
+#define KEY_RING_CHUNKS_INITIAL 0x20
+
+/**
+ * The key buffer is sized to hold the key stream needed for this long at the current key pos velocity ahead
+ * and the same amount behind for late packets.
+ */
+#define KEY_RING_LOOKAHEAD_MS 50
+
+#define KEY_RING_RATE_INTERVAL_US 100000
+#define KEY_RING_RATE_GAIN 0.25
+#define KEY_RING_SHRINK_DELAY_US 5000000
+#define KEY_RING_ADAPT_TIMEOUT_MS 1000 // so the producer notices when the key pos stops moving
+#define KEY_RING_MISS_WARN_INTERVAL_US 5000000
+
+/**
+ * Shared state of the key buffer between the thread generating the key stream (producer)
+ * and the caller of chiaki_gkcrypt_get_key_stream()/chiaki_gkcrypt_decrypt() (consumer).
+ *
+ * buf holds the key stream for [key_pos_min, key_pos_end), key pos p is at buf[p % size].
+ * The consumer publishes the key pos it is reading from in read_key_pos before checking key_pos_min.
+ * The producer advances key_pos_min before reusing any part of buf and then waits until read_key_pos is not below it.
+ * So either the consumer sees the new key_pos_min and does not use buf or the producer waits until it is done reading.
+ * key_pos_end is only advanced with release semantics after a new chunk has been written.
+ *
+ * buf and size are only replaced by the producer while the buffer is empty (key_pos_min == key_pos_end) and nobody is reading,
+ * the consumer loads them after key_pos_min and key_pos_end.
+ */
+typedef struct chiaki_gkcrypt_key_ring_t
+{
+	// written by the producer
+	alignas(KEY_RING_CACHE_LINE) atomic_uint_least64_t key_pos_min;
+	atomic_uint_least64_t key_pos_end;
+	atomic_bool thread_sleeping;
+	_Atomic(uint8_t *) buf;
+	atomic_uint_least64_t size;
+	atomic_uint_least64_t skips;
+	atomic_uint_least64_t resizes;
+	atomic_uint_least64_t key_pos_rate; // bytes/s
+
+	// only used by the producer
+	double rate; // smoothed key_pos_rate
+	uint64_t rate_key_pos;
+	uint64_t rate_time_us;
+	uint64_t shrink_since_us; // 0 if the buffer should not shrink
+	uint64_t misses_ahead_seen;
+
+	// written by the consumer
+	alignas(KEY_RING_CACHE_LINE) atomic_uint_least64_t last_key_pos; // last key pos that has been requested
+	atomic_uint_least64_t read_key_pos; // KEY_RING_NOT_READING if not reading from buf
+	atomic_uint_least64_t hits;
+	atomic_uint_least64_t misses_ahead;
+	atomic_uint_least64_t misses_late;
+	atomic_uint_least64_t miss_warn_us; // when misses were last warned about, 0 if never
+	atomic_uint_least64_t misses_warned; // misses_ahead + misses_late at that time
+} ChiakiGKCryptKeyRing;
+
+static uint64_t gkcrypt_key_ring_chunks_clamp(ChiakiGKCrypt *gkcrypt, uint64_t chunks)
+{
+	uint64_t chunks_max = gkcrypt->key_buf_size_max / KEY_BUF_CHUNK_SIZE;
+	uint64_t r = 1;
+	while(r < chunks && r < chunks_max)
+		r <<= 1;
+	if(r < KEY_RING_CHUNKS_MIN)
+		r = KEY_RING_CHUNKS_MIN;
+	return r < chunks_max ? r : chunks_max;
+}
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 static void *gkcrypt_thread_func(void *user);
+static void gkcrypt_gmac_ctx_fini(ChiakiGKCrypt *gkcrypt);
+static ChiakiErrorCode gkcrypt_key_stream_ctx_init(ChiakiGKCrypt *gkcrypt);
+static void gkcrypt_key_stream_ctx_fini(ChiakiGKCrypt *gkcrypt);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	gkcrypt->log = log;
 	gkcrypt->index = index;
 
-	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
-	gkcrypt->key_buf_populated = 0;
-	gkcrypt->key_buf_key_pos_min = 0;
-	gkcrypt->key_buf_start_offset = 0;
-	gkcrypt->last_key_pos = 0;
+	gkcrypt->key_buf_size_max = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
+	gkcrypt->key_ring = NULL;
 	gkcrypt->key_buf_thread_stop = false;
+#ifndef CHIAKI_LIB_ENABLE_MBEDTLS
+	gkcrypt->gmac_ctx = NULL;
+#endif
+	gkcrypt->gmac_ctx_valid = false;
+	gkcrypt->gmac_ctx_key_index = 0;
+	gkcrypt->key_stream_ctx_valid = false;
 
 	ChiakiErrorCode err;
-	if(gkcrypt->key_buf_size)
+	uint8_t *key_buf = NULL;
+	if(gkcrypt->key_buf_size_max)
 	{
-		gkcrypt->key_buf = chiaki_aligned_alloc(KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf_size);
-		if(!gkcrypt->key_buf)
+		uint64_t key_buf_size = gkcrypt_key_ring_chunks_clamp(gkcrypt, KEY_RING_CHUNKS_INITIAL) * KEY_BUF_CHUNK_SIZE;
+		key_buf = chiaki_aligned_alloc(KEY_BUF_CHUNK_SIZE, key_buf_size);
+		if(!key_buf)
 		{
 			err = CHIAKI_ERR_MEMORY;
 			goto error;
 		}
 
+		gkcrypt->key_ring = chiaki_aligned_alloc(KEY_RING_CACHE_LINE, sizeof(ChiakiGKCryptKeyRing));
+		if(!gkcrypt->key_ring)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_key_buf;
+		}
+		ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+		atomic_init(&ring->key_pos_min, 0);
+		atomic_init(&ring->key_pos_end, 0);
+		atomic_init(&ring->thread_sleeping, false);
+		atomic_init(&ring->buf, key_buf);
+		atomic_init(&ring->size, key_buf_size);
+		atomic_init(&ring->skips, 0);
+		atomic_init(&ring->resizes, 0);
+		atomic_init(&ring->key_pos_rate, 0);
+		ring->rate = 0.0;
+		ring->rate_key_pos = 0;
+		ring->rate_time_us = chiaki_time_now_monotonic_us();
+		ring->shrink_since_us = 0;
+		ring->misses_ahead_seen = 0;
+		atomic_init(&ring->last_key_pos, 0);
+		atomic_init(&ring->read_key_pos, KEY_RING_NOT_READING);
+		atomic_init(&ring->hits, 0);
+		atomic_init(&ring->misses_ahead, 0);
+		atomic_init(&ring->misses_late, 0);
+		atomic_init(&ring->miss_warn_us, 0);
+		atomic_init(&ring->misses_warned, 0);
+
 		err = chiaki_mutex_init(&gkcrypt->key_buf_mutex, false);
 		if(err != CHIAKI_ERR_SUCCESS)
-			goto error_key_buf;
+			goto error_key_ring;
 
 		err = chiaki_cond_init(&gkcrypt->key_buf_cond);
 		if(err != CHIAKI_ERR_SUCCESS)
 			goto error_key_buf_mutex;
 	}
-	else
-	{
-		gkcrypt->key_buf = NULL;
-	}
 	err = gkcrypt_gen_key_iv(gkcrypt, index, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -70,32 +178,45 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->key_gmac_index_current = 0;
 	memcpy(gkcrypt->key_gmac_current, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_current));
 
-	if(gkcrypt->key_buf)
+	err = gkcrypt_key_stream_ctx_init(gkcrypt);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to set up AES for the key stream");
+		goto error_key_buf_cond;
+	}
+
+	if(gkcrypt->key_ring)
 	{
 		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
-			goto error_key_buf_cond;
+			goto error_key_stream_ctx;
 
 		chiaki_thread_set_name(&gkcrypt->key_buf_thread, "Chiaki GKCrypt");
 	}
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_key_stream_ctx:
+	gkcrypt_key_stream_ctx_fini(gkcrypt);
 error_key_buf_cond:
-	if(gkcrypt->key_buf)
+	if(gkcrypt->key_ring)
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 error_key_buf_mutex:
-	if(gkcrypt->key_buf)
+	if(gkcrypt->key_ring)
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
+error_key_ring:
+	chiaki_aligned_free(gkcrypt->key_ring);
+	gkcrypt->key_ring = NULL;
 error_key_buf:
-	chiaki_aligned_free(gkcrypt->key_buf);
+	chiaki_aligned_free(key_buf);
 error:
 	return err;
 }
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 {
-	if(gkcrypt->key_buf)
+	gkcrypt_gmac_ctx_fini(gkcrypt);
+	if(gkcrypt->key_ring)
 	{
 		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 		gkcrypt->key_buf_thread_stop = true;
@@ -104,8 +225,11 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 		chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
-		chiaki_aligned_free(gkcrypt->key_buf);
+		chiaki_aligned_free(atomic_load_explicit(&gkcrypt->key_ring->buf, memory_order_relaxed));
+		chiaki_aligned_free(gkcrypt->key_ring);
+		gkcrypt->key_ring = NULL;
 	}
+	gkcrypt_key_stream_ctx_fini(gkcrypt);
 }
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
@@ -214,288 +338,850 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 		memcpy(key_out, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_base));
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+static inline uint64_t load_le64(const uint8_t *b)
 {
-	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
-	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t r;
+	memcpy(&r, b, sizeof(r));
+	return r;
+#else
+	uint64_t r = 0;
+	for(size_t i=0; i<8; i++)
+		r |= (uint64_t)b[i] << (i * 8);
+	return r;
+#endif
+}
+
+static inline void store_le64(uint8_t *b, uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(b, &v, sizeof(v));
+#else
+	for(size_t i=0; i<8; i++)
+		b[i] = (uint8_t)(v >> (i * 8));
+#endif
+}
+
+/**
+ * Write the counter blocks for key_pos to buf. The counter is a 128 bit little endian integer,
+ * so only the first block is built with counter_add() and the following ones are incremented as two 64 bit halves.
+ */
+static void gkcrypt_key_stream_counters(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	uint8_t first[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(first, gkcrypt->iv, key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
+	uint64_t low = load_le64(first);
+	uint64_t high = load_le64(first + 8);
+	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
+	{
+		store_le64(cur, low);
+		store_le64(cur + 8, high);
+		if(++low == 0)
+			high++;
+	}
+}
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls aes context
-	mbedtls_aes_context ctx;
-	mbedtls_aes_init(&ctx);
 
-	if(mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128) != 0)
+/*
+ * mbedtls only encrypts one block per call, so with AES-NI or the ARMv8 crypto extensions
+ * the key stream is encrypted here directly, 8 blocks at a time to keep the AES units busy.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GKCRYPT_AES_HW_AESNI
+#include <wmmintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define GKCRYPT_AES_HW_ARMV8
+#include <arm_neon.h>
+#endif
+
+#define GKCRYPT_AES_HW_PARALLEL 8
+
+#if defined(GKCRYPT_AES_HW_AESNI)
+
+#define AESNI_EXPAND_KEY(i, rcon) \
+	do { \
+		__m128i kg = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k, rcon), _MM_SHUFFLE(3, 3, 3, 3)); \
+		k = _mm_xor_si128(k, _mm_slli_si128(k, 4)); \
+		k = _mm_xor_si128(k, _mm_slli_si128(k, 4)); \
+		k = _mm_xor_si128(k, _mm_slli_si128(k, 4)); \
+		k = _mm_xor_si128(k, kg); \
+		_mm_storeu_si128((__m128i *)(round_keys + (i) * CHIAKI_GKCRYPT_BLOCK_SIZE), k); \
+	} while(0)
+
+__attribute__((target("aes,sse2")))
+static void gkcrypt_aes_hw_expand_key(const uint8_t *key, uint8_t *round_keys)
+{
+	__m128i k = _mm_loadu_si128((const __m128i *)key);
+	_mm_storeu_si128((__m128i *)round_keys, k);
+	AESNI_EXPAND_KEY(1, 0x01);
+	AESNI_EXPAND_KEY(2, 0x02);
+	AESNI_EXPAND_KEY(3, 0x04);
+	AESNI_EXPAND_KEY(4, 0x08);
+	AESNI_EXPAND_KEY(5, 0x10);
+	AESNI_EXPAND_KEY(6, 0x20);
+	AESNI_EXPAND_KEY(7, 0x40);
+	AESNI_EXPAND_KEY(8, 0x80);
+	AESNI_EXPAND_KEY(9, 0x1b);
+	AESNI_EXPAND_KEY(10, 0x36);
+}
+
+#undef AESNI_EXPAND_KEY
+
+__attribute__((target("aes,sse2")))
+static void gkcrypt_aes_hw_encrypt(const uint8_t *round_keys, uint8_t *buf, size_t blocks)
+{
+	__m128i rk[11];
+	for(size_t r=0; r<11; r++)
+		rk[r] = _mm_loadu_si128((const __m128i *)(round_keys + r * CHIAKI_GKCRYPT_BLOCK_SIZE));
+
+	size_t i=0;
+	for(; i + GKCRYPT_AES_HW_PARALLEL <= blocks; i += GKCRYPT_AES_HW_PARALLEL)
 	{
-		mbedtls_aes_free(&ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		__m128i b[GKCRYPT_AES_HW_PARALLEL];
+		for(size_t j=0; j<GKCRYPT_AES_HW_PARALLEL; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE)), rk[0]);
+		for(size_t r=1; r<10; r++)
+		{
+			for(size_t j=0; j<GKCRYPT_AES_HW_PARALLEL; j++)
+				b[j] = _mm_aesenc_si128(b[j], rk[r]);
+		}
+		for(size_t j=0; j<GKCRYPT_AES_HW_PARALLEL; j++)
+			_mm_storeu_si128((__m128i *)(buf + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE), _mm_aesenclast_si128(b[j], rk[10]));
 	}
 
-#else
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-		return CHIAKI_ERR_UNKNOWN;
+	for(; i<blocks; i++)
+	{
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE)), rk[0]);
+		for(size_t r=1; r<10; r++)
+			b = _mm_aesenc_si128(b, rk[r]);
+		_mm_storeu_si128((__m128i *)(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE), _mm_aesenclast_si128(b, rk[10]));
+	}
+}
+
+static bool gkcrypt_aes_hw_available(void)
+{
+	return __builtin_cpu_supports("aes");
+}
+
+#elif defined(GKCRYPT_AES_HW_ARMV8)
+
+static uint32_t gkcrypt_aes_hw_sub_word(uint32_t w)
+{
+	// AESE with a zero key is SubBytes + ShiftRows, which doesn't move anything if all columns are the same
+	uint8x16_t v = vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0));
+	return vgetq_lane_u32(vreinterpretq_u32_u8(v), 0);
+}
 
-	if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL))
+static void gkcrypt_aes_hw_expand_key(const uint8_t *key, uint8_t *round_keys)
+{
+	static const uint8_t rcon[] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+	uint32_t w[44];
+	memcpy(w, key, CHIAKI_GKCRYPT_BLOCK_SIZE);
+	for(size_t i=4; i<44; i++)
 	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		uint32_t t = w[i - 1];
+		if(i % 4 == 0)
+			t = gkcrypt_aes_hw_sub_word((t >> 8) | (t << 24)) ^ rcon[i / 4 - 1]; // RotWord on little endian words
+		w[i] = w[i - 4] ^ t;
 	}
+	memcpy(round_keys, w, CHIAKI_GKCRYPT_AES_ROUND_KEYS_SIZE);
+}
+
+static void gkcrypt_aes_hw_encrypt(const uint8_t *round_keys, uint8_t *buf, size_t blocks)
+{
+	uint8x16_t rk[11];
+	for(size_t r=0; r<11; r++)
+		rk[r] = vld1q_u8(round_keys + r * CHIAKI_GKCRYPT_BLOCK_SIZE);
 
-	if(!EVP_CIPHER_CTX_set_padding(ctx, 0))
+	size_t i=0;
+	for(; i + GKCRYPT_AES_HW_PARALLEL <= blocks; i += GKCRYPT_AES_HW_PARALLEL)
 	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		uint8x16_t b[GKCRYPT_AES_HW_PARALLEL];
+		for(size_t j=0; j<GKCRYPT_AES_HW_PARALLEL; j++)
+			b[j] = vld1q_u8(buf + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE);
+		for(size_t r=0; r<9; r++)
+		{
+			for(size_t j=0; j<GKCRYPT_AES_HW_PARALLEL; j++)
+				b[j] = vaesmcq_u8(vaeseq_u8(b[j], rk[r]));
+		}
+		for(size_t j=0; j<GKCRYPT_AES_HW_PARALLEL; j++)
+			vst1q_u8(buf + (i + j) * CHIAKI_GKCRYPT_BLOCK_SIZE, veorq_u8(vaeseq_u8(b[j], rk[9]), rk[10]));
+	}
+
+	for(; i<blocks; i++)
+	{
+		uint8x16_t b = vld1q_u8(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE);
+		for(size_t r=0; r<9; r++)
+			b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+		vst1q_u8(buf + i * CHIAKI_GKCRYPT_BLOCK_SIZE, veorq_u8(vaeseq_u8(b, rk[9]), rk[10]));
 	}
+}
+
+static bool gkcrypt_aes_hw_available(void)
+{
+	return true; // known at compile time
+}
+
 #endif
-	uint64_t counter_offset = (key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
 
-	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
-		counter_add(cur, gkcrypt->iv, counter_offset++);
+#endif
 
+static ChiakiErrorCode gkcrypt_key_stream_ctx_init(ChiakiGKCrypt *gkcrypt)
+{
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	for(int i = 0; i < buf_size; i = i + 16)
+	mbedtls_aes_init(&gkcrypt->key_stream_aes);
+	if(mbedtls_aes_setkey_enc(&gkcrypt->key_stream_aes, gkcrypt->key_base, 128) != 0)
 	{
-		// loop over all blocks of 16 bytes (128 bits)
-		if(mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
+		mbedtls_aes_free(&gkcrypt->key_stream_aes);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	gkcrypt->key_stream_aes_hw = false;
+#if defined(GKCRYPT_AES_HW_AESNI) || defined(GKCRYPT_AES_HW_ARMV8)
+	if(gkcrypt_aes_hw_available())
+	{
+		gkcrypt_aes_hw_expand_key(gkcrypt->key_base, gkcrypt->key_stream_round_keys);
+		gkcrypt->key_stream_aes_hw = true;
+	}
+#endif
+#else
+	EVP_CIPHER_CTX *ctxs[2] = { NULL, NULL };
+	for(size_t i=0; i<(gkcrypt->key_ring ? 2 : 1); i++)
+	{
+		ctxs[i] = EVP_CIPHER_CTX_new();
+		if(!ctxs[i]
+			|| !EVP_EncryptInit_ex(ctxs[i], EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL)
+			|| !EVP_CIPHER_CTX_set_padding(ctxs[i], 0))
 		{
-			mbedtls_aes_free(&ctx);
+			EVP_CIPHER_CTX_free(ctxs[0]);
+			EVP_CIPHER_CTX_free(ctxs[1]);
 			return CHIAKI_ERR_UNKNOWN;
 		}
 	}
+	gkcrypt->key_stream_ctx = ctxs[0];
+	gkcrypt->key_buf_thread_ctx = ctxs[1];
+#endif
+	gkcrypt->key_stream_ctx_valid = true;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	mbedtls_aes_free(&ctx);
+static void gkcrypt_key_stream_ctx_fini(ChiakiGKCrypt *gkcrypt)
+{
+	if(!gkcrypt->key_stream_ctx_valid)
+		return;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_free(&gkcrypt->key_stream_aes);
 #else
-	int outl;
-	EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size);
-	if(outl != buf_size)
+	EVP_CIPHER_CTX_free(gkcrypt->key_stream_ctx);
+	EVP_CIPHER_CTX_free(gkcrypt->key_buf_thread_ctx);
+#endif
+	gkcrypt->key_stream_ctx_valid = false;
+}
+
+/**
+ * Encrypt the counter blocks in buf in place.
+ *
+ * @param key_buf_thread whether this is called from the key buf thread, which has its own cipher ctx
+ */
+static ChiakiErrorCode gkcrypt_key_stream_encrypt(ChiakiGKCrypt *gkcrypt, bool key_buf_thread, uint8_t *buf, size_t buf_size)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	(void)key_buf_thread;
+#if defined(GKCRYPT_AES_HW_AESNI) || defined(GKCRYPT_AES_HW_ARMV8)
+	if(gkcrypt->key_stream_aes_hw)
 	{
-		EVP_CIPHER_CTX_free(ctx);
-		return CHIAKI_ERR_UNKNOWN;
+		gkcrypt_aes_hw_encrypt(gkcrypt->key_stream_round_keys, buf, buf_size / CHIAKI_GKCRYPT_BLOCK_SIZE);
+		return CHIAKI_ERR_SUCCESS;
+	}
+#endif
+	for(size_t i=0; i<buf_size; i+=CHIAKI_GKCRYPT_BLOCK_SIZE)
+	{
+		if(mbedtls_aes_crypt_ecb(&gkcrypt->key_stream_aes, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
+			return CHIAKI_ERR_UNKNOWN;
 	}
+#else
+	EVP_CIPHER_CTX *ctx = key_buf_thread ? gkcrypt->key_buf_thread_ctx : gkcrypt->key_stream_ctx;
+	// all blocks in one call, so OpenSSL can pipeline them
+	int outl;
+	if(!EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size) || outl != (int)buf_size)
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, bool key_buf_thread, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	if(!buf_size)
+		return CHIAKI_ERR_SUCCESS;
+
+	gkcrypt_key_stream_counters(gkcrypt, key_pos, buf, buf_size);
+
+	if(gkcrypt->key_stream_ctx_valid)
+		return gkcrypt_key_stream_encrypt(gkcrypt, key_buf_thread, buf, buf_size);
 
+	// not set up by chiaki_gkcrypt_init(), use a temporary ctx
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_context ctx;
+	mbedtls_aes_init(&ctx);
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	if(mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128) != 0)
+		err = CHIAKI_ERR_UNKNOWN;
+	for(size_t i=0; err == CHIAKI_ERR_SUCCESS && i<buf_size; i+=CHIAKI_GKCRYPT_BLOCK_SIZE)
+	{
+		if(mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
+			err = CHIAKI_ERR_UNKNOWN;
+	}
+	mbedtls_aes_free(&ctx);
+	return err;
+#else
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return CHIAKI_ERR_MEMORY;
+	int outl;
+	bool ok = EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL)
+		&& EVP_CIPHER_CTX_set_padding(ctx, 0)
+		&& EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size)
+		&& outl == (int)buf_size;
 	EVP_CIPHER_CTX_free(ctx);
+	return ok ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
 #endif
-	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	return gkcrypt_gen_key_stream(gkcrypt, false, key_pos, buf, buf_size);
+}
+
+static uint64_t gkcrypt_key_ring_populated(uint64_t key_pos_min, uint64_t key_pos_end)
+{
+	// key_pos_end is below key_pos_min for a moment while skipping ahead
+	return key_pos_end > key_pos_min ? key_pos_end - key_pos_min : 0;
+}
+
+/**
+ * How much key stream before the last requested key pos may stay in the buffer for late packets, in eighths of it.
+ * The consumer wakes up the producer when more than KEY_RING_BEHIND_WAKE is behind and the producer then keeps generating
+ * until at most KEY_RING_BEHIND_SLEEP is behind, so the mutex is only taken once for several chunks.
+ * At least one chunk is always kept, so a chunk is never dropped before the last requested key pos.
+ */
+#define KEY_RING_BEHIND_WAKE 5
+#define KEY_RING_BEHIND_SLEEP 3
+
+static uint64_t gkcrypt_key_ring_behind_max(uint64_t populated, uint64_t eighths)
+{
+	uint64_t r = populated * eighths / 8;
+	return r > KEY_BUF_CHUNK_SIZE ? r : KEY_BUF_CHUNK_SIZE;
+}
+
+/**
+ * Whether the consumer should wake up the sleeping producer
+ */
 static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
 {
-	return gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated / 2;
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	uint64_t key_pos_min = atomic_load(&ring->key_pos_min);
+	uint64_t populated = gkcrypt_key_ring_populated(key_pos_min, atomic_load(&ring->key_pos_end));
+	return atomic_load(&ring->last_key_pos) > key_pos_min + gkcrypt_key_ring_behind_max(populated, KEY_RING_BEHIND_WAKE);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+/**
+ * Called by the consumer after requesting key stream up to key_pos_end.
+ * Only takes the mutex if the producer is sleeping and should generate the next chunks.
+ */
+static void gkcrypt_key_buf_request(ChiakiGKCrypt *gkcrypt, uint64_t key_pos_end)
 {
-	if(!gkcrypt->key_buf)
-		return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	if(key_pos_end > atomic_load_explicit(&ring->last_key_pos, memory_order_relaxed))
+		atomic_store(&ring->last_key_pos, key_pos_end); // seq_cst, pairs with thread_sleeping
+
+	if(!atomic_load(&ring->thread_sleeping) || !gkcrypt_key_buf_should_generate(gkcrypt))
+		return;
 
 	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	chiaki_cond_signal(&gkcrypt->key_buf_cond);
+	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+}
 
-	if(key_pos + buf_size > gkcrypt->last_key_pos)
-		gkcrypt->last_key_pos = key_pos + buf_size;
-	bool signal = gkcrypt_key_buf_should_generate(gkcrypt);
+/**
+ * Misses are counted in the stats and make the producer grow the buffer,
+ * so only warn about them once in a while instead of for every packet.
+ */
+static void gkcrypt_key_buf_warn_misses(ChiakiGKCrypt *gkcrypt)
+{
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t warn_us = atomic_load_explicit(&ring->miss_warn_us, memory_order_relaxed);
+	if(warn_us && now_us - warn_us < KEY_RING_MISS_WARN_INTERVAL_US)
+		return;
+	if(!atomic_compare_exchange_strong_explicit(&ring->miss_warn_us, &warn_us, now_us, memory_order_relaxed, memory_order_relaxed))
+		return;
+	uint64_t misses = atomic_load_explicit(&ring->misses_ahead, memory_order_relaxed)
+		+ atomic_load_explicit(&ring->misses_late, memory_order_relaxed);
+	uint64_t misses_warned = atomic_exchange_explicit(&ring->misses_warned, misses, memory_order_relaxed);
+	CHIAKI_LOGW(gkcrypt->log, "Key stream for %llu requests on GKCrypt %d was not in the buffer since the last warning, key buf size %#llx",
+			(unsigned long long)(misses - misses_warned),
+			gkcrypt->index,
+			(unsigned long long)atomic_load_explicit(&ring->size, memory_order_relaxed));
+}
 
-	ChiakiErrorCode err;
-	if(key_pos < gkcrypt->key_buf_key_pos_min
-		|| key_pos + buf_size >= gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-	{
-		CHIAKI_LOGW(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
-				" key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx",
-				(unsigned long long)key_pos,
-				gkcrypt->index,
-				(unsigned long long)gkcrypt->key_buf_size,
-				(unsigned long long)gkcrypt->key_buf_start_offset,
-				(unsigned long long)gkcrypt->key_buf_populated,
-				(unsigned long long)gkcrypt->key_buf_key_pos_min,
-				(unsigned long long)gkcrypt->last_key_pos);
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-		err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
-	}
-	else
+/**
+ * Copy the key stream for [key_pos, key_pos + buf_size) from the key buffer into buf,
+ * or if src is not NULL, write src xor the key stream into buf (src may be buf).
+ * key_pos does not have to be block-aligned.
+ *
+ * @return false if the key stream is not in the buffer, nothing is done then
+ */
+static bool gkcrypt_key_buf_apply(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *buf, size_t buf_size)
+{
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+
+	atomic_store(&ring->read_key_pos, key_pos);
+	uint64_t key_pos_min = atomic_load(&ring->key_pos_min);
+	uint64_t key_pos_end = atomic_load_explicit(&ring->key_pos_end, memory_order_acquire);
+	// buf and size can only have been replaced before the key_pos_min or key_pos_end we just loaded
+	uint8_t *key_buf = atomic_load_explicit(&ring->buf, memory_order_relaxed);
+	uint64_t key_buf_size = atomic_load_explicit(&ring->size, memory_order_relaxed);
+	bool found = key_pos >= key_pos_min && key_pos + buf_size < key_pos_end;
+	if(found)
 	{
-		size_t offset_in_buf = key_pos - gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_start_offset;
-		offset_in_buf %= gkcrypt->key_buf_size;
-		size_t end = offset_in_buf + buf_size;
-		if(end > gkcrypt->key_buf_size)
+		size_t offset_in_buf = key_pos % key_buf_size;
+		size_t first_size = buf_size;
+		if(offset_in_buf + buf_size > key_buf_size)
+			first_size = key_buf_size - offset_in_buf; // wraps around the end of the ring
+		if(src)
 		{
-			size_t excess = end - gkcrypt->key_buf_size;
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
-			memcpy(buf + (buf_size - excess), gkcrypt->key_buf, excess);
+			xor_bytes_to(buf, src, key_buf + offset_in_buf, first_size);
+			xor_bytes_to(buf + first_size, src + first_size, key_buf, buf_size - first_size);
 		}
 		else
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size);
-		err = CHIAKI_ERR_SUCCESS;
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+		{
+			memcpy(buf, key_buf + offset_in_buf, first_size);
+			memcpy(buf + first_size, key_buf, buf_size - first_size);
+		}
 	}
+	atomic_store_explicit(&ring->read_key_pos, KEY_RING_NOT_READING, memory_order_release);
 
-	if(signal)
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+	if(found)
+		atomic_fetch_add_explicit(&ring->hits, 1, memory_order_relaxed);
+	else
+	{
+		atomic_fetch_add_explicit(key_pos < key_pos_min ? &ring->misses_late : &ring->misses_ahead, 1, memory_order_relaxed);
+		CHIAKI_LOGV(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
+				" key buf size %#llx, min key pos: %#llx, end key pos: %#llx, last key pos: %#llx",
+				(unsigned long long)key_pos,
+				gkcrypt->index,
+				(unsigned long long)key_buf_size,
+				(unsigned long long)key_pos_min,
+				(unsigned long long)key_pos_end,
+				(unsigned long long)atomic_load_explicit(&ring->last_key_pos, memory_order_relaxed));
+		gkcrypt_key_buf_warn_misses(gkcrypt);
+	}
 
-	return err;
+	gkcrypt_key_buf_request(gkcrypt, key_pos + buf_size);
+
+	return found;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+CHIAKI_EXPORT bool chiaki_gkcrypt_key_stream_buffered(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size)
 {
-	uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
-	size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	if(!gkcrypt->key_ring)
+		return false;
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	return key_pos >= atomic_load(&ring->key_pos_min)
+		&& key_pos + size < atomic_load_explicit(&ring->key_pos_end, memory_order_acquire);
+}
 
-	uint8_t *key_stream = malloc(full_size);
-	if(!key_stream)
-		return CHIAKI_ERR_MEMORY;
+CHIAKI_EXPORT void chiaki_gkcrypt_get_stats(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	if(!ring)
+		return;
+	stats->key_buf_hits = atomic_load_explicit(&ring->hits, memory_order_relaxed);
+	stats->key_buf_misses_ahead = atomic_load_explicit(&ring->misses_ahead, memory_order_relaxed);
+	stats->key_buf_misses_late = atomic_load_explicit(&ring->misses_late, memory_order_relaxed);
+	stats->key_buf_skips = atomic_load_explicit(&ring->skips, memory_order_relaxed);
+	stats->key_buf_resizes = atomic_load_explicit(&ring->resizes, memory_order_relaxed);
+	stats->key_buf_size = atomic_load_explicit(&ring->size, memory_order_relaxed);
+	stats->key_pos_rate = atomic_load_explicit(&ring->key_pos_rate, memory_order_relaxed);
+}
 
-	ChiakiErrorCode err = chiaki_gkcrypt_get_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		free(key_stream);
-		return err;
-	}
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	if(gkcrypt->key_ring && gkcrypt_key_buf_apply(gkcrypt, key_pos, NULL, buf, buf_size))
+		return CHIAKI_ERR_SUCCESS;
+	return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+}
 
-	xor_bytes(buf, key_stream + padding_pre, buf_size);
-	free(key_stream);
+/**
+ * Size of the key stream generated on the stack at once if it is not taken from the key buffer,
+ * enough for any single Takion packet.
+ */
+#define DECRYPT_KEY_STREAM_CHUNK_SIZE 0x800
 
-	return CHIAKI_ERR_SUCCESS;
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	return chiaki_gkcrypt_decrypt_to(gkcrypt, key_pos, buf, buf, buf_size);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt_to(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *src, uint8_t *buf, size_t buf_size)
 {
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+	if(gkcrypt->key_ring && gkcrypt_key_buf_apply(gkcrypt, key_pos, src, buf, buf_size))
+		return CHIAKI_ERR_SUCCESS;
 
-	uint8_t *gmac_key = gkcrypt->key_gmac_current;
-	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
-
-	if(key_index > gkcrypt->key_gmac_index_current)
+	uint8_t key_stream[DECRYPT_KEY_STREAM_CHUNK_SIZE];
+	while(buf_size)
 	{
-		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
-	}
-	else if(key_index < gkcrypt->key_gmac_index_current)
-	{
-		chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
-		gmac_key = gmac_key_tmp;
+		uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
+		size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		if(full_size > sizeof(key_stream))
+			full_size = sizeof(key_stream);
+		size_t size = full_size - padding_pre;
+		if(size > buf_size)
+			size = buf_size;
+
+		ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+
+		xor_bytes_to(buf, src, key_stream + padding_pre, size);
+		src += size;
+		buf += size;
+		buf_size -= size;
+		key_pos += size;
 	}
 
+	return CHIAKI_ERR_SUCCESS;
+}
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+typedef mbedtls_gcm_context GKCryptGmacCtx;
+#else
+typedef EVP_CIPHER_CTX GKCryptGmacCtx;
+#endif
+
+/**
+ * Expand gmac_key into ctx, which must already be initialized.
+ */
+static ChiakiErrorCode gkcrypt_gmac_ctx_set_key(GKCryptGmacCtx *ctx, const uint8_t *gmac_key)
+{
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls gcm context AES_128_GCM
-	// Encryption
-	mbedtls_gcm_context actx;
-	mbedtls_gcm_init(&actx);
 	// set gmac_key 128 bits key
-	if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
-	{
-		mbedtls_gcm_free(&actx);
+	if(mbedtls_gcm_setkey(ctx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
+		return CHIAKI_ERR_UNKNOWN;
+#else
+	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1))
 		return CHIAKI_ERR_UNKNOWN;
-	}
 
-	// encrypt without additional data
-	if(mbedtls_gcm_starts(&actx, MBEDTLS_GCM_ENCRYPT, iv, CHIAKI_GKCRYPT_BLOCK_SIZE) != 0)
-	{
-		mbedtls_gcm_free(&actx);
+	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
 		return CHIAKI_ERR_UNKNOWN;
-	}
+
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, NULL, 1))
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Calculate the gmac of buf with a ctx that already has its key set. Only the iv changes per call.
+ */
+static ChiakiErrorCode gkcrypt_gmac_ctx_calc(GKCryptGmacCtx *ctx, const uint8_t *iv, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 	// set "additional data" only whitout input nor output
 	// to get the same result as:
 	// EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
-	if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+	if(mbedtls_gcm_crypt_and_tag(ctx, MBEDTLS_GCM_ENCRYPT,
 		   0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
 		   buf, buf_size, NULL, NULL,
 		   CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out) != 0)
-	{
+		return CHIAKI_ERR_UNKNOWN;
+#else
+	// only set the iv, the expanded key stays in the context
+	if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1))
+		return CHIAKI_ERR_UNKNOWN;
 
-		mbedtls_gcm_free(&actx);
+	int len;
+	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
 		return CHIAKI_ERR_UNKNOWN;
-	}
 
-	mbedtls_gcm_free(&actx);
+	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
+		return CHIAKI_ERR_UNKNOWN;
 
+	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+		return CHIAKI_ERR_UNKNOWN;
+#endif
 	return CHIAKI_ERR_SUCCESS;
-#else
-	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+}
 
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-	{
-		ret = CHIAKI_ERR_MEMORY;
-		goto fail;
-	}
+/**
+ * Make sure gkcrypt->gmac_ctx is set up with key_gmac_current.
+ */
+static ChiakiErrorCode gkcrypt_gmac_ctx_update(ChiakiGKCrypt *gkcrypt)
+{
+	if(gkcrypt->gmac_ctx_valid && gkcrypt->gmac_ctx_key_index == gkcrypt->key_gmac_index_current)
+		return CHIAKI_ERR_SUCCESS;
 
-	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1))
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	// mbedtls_gcm_setkey() releases the previous key itself, so the context is only initialized once
+	if(!gkcrypt->gmac_ctx_valid)
+		mbedtls_gcm_init(&gkcrypt->gmac_ctx);
+	ChiakiErrorCode err = gkcrypt_gmac_ctx_set_key(&gkcrypt->gmac_ctx, gkcrypt->key_gmac_current);
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		mbedtls_gcm_free(&gkcrypt->gmac_ctx);
+		gkcrypt->gmac_ctx_valid = false;
+		return err;
 	}
-
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
+#else
+	if(!gkcrypt->gmac_ctx)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		gkcrypt->gmac_ctx = EVP_CIPHER_CTX_new();
+		if(!gkcrypt->gmac_ctx)
+			return CHIAKI_ERR_MEMORY;
 	}
-
-	if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, iv, 1))
+	ChiakiErrorCode err = gkcrypt_gmac_ctx_set_key(gkcrypt->gmac_ctx, gkcrypt->key_gmac_current);
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		gkcrypt->gmac_ctx_valid = false;
+		return err;
 	}
+#endif
 
-	int len;
-	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	gkcrypt->gmac_ctx_valid = true;
+	gkcrypt->gmac_ctx_key_index = gkcrypt->key_gmac_index_current;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+static void gkcrypt_gmac_ctx_fini(ChiakiGKCrypt *gkcrypt)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	if(gkcrypt->gmac_ctx_valid)
+		mbedtls_gcm_free(&gkcrypt->gmac_ctx);
+#else
+	EVP_CIPHER_CTX_free(gkcrypt->gmac_ctx);
+	gkcrypt->gmac_ctx = NULL;
+#endif
+	gkcrypt->gmac_ctx_valid = false;
+}
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+
+	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+
+	if(key_index > gkcrypt->key_gmac_index_current)
+		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
+
+	if(key_index == gkcrypt->key_gmac_index_current)
 	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
+		ChiakiErrorCode err = gkcrypt_gmac_ctx_update(gkcrypt);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+		return gkcrypt_gmac_ctx_calc(&gkcrypt->gmac_ctx, iv, buf, buf_size, gmac_out);
+#else
+		return gkcrypt_gmac_ctx_calc(gkcrypt->gmac_ctx, iv, buf, buf_size, gmac_out);
+#endif
 	}
 
-fail_cipher:
+	// late packet from before the last key rotation, use a one-off context for its key
+	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
+
+	ChiakiErrorCode err;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context ctx;
+	mbedtls_gcm_init(&ctx);
+	err = gkcrypt_gmac_ctx_set_key(&ctx, gmac_key_tmp);
+	if(err == CHIAKI_ERR_SUCCESS)
+		err = gkcrypt_gmac_ctx_calc(&ctx, iv, buf, buf_size, gmac_out);
+	mbedtls_gcm_free(&ctx);
+#else
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return CHIAKI_ERR_MEMORY;
+	err = gkcrypt_gmac_ctx_set_key(ctx, gmac_key_tmp);
+	if(err == CHIAKI_ERR_SUCCESS)
+		err = gkcrypt_gmac_ctx_calc(ctx, iv, buf, buf_size, gmac_out);
 	EVP_CIPHER_CTX_free(ctx);
-fail:
-	return ret;
 #endif
+	return err;
 }
 
+/**
+ * Whether the producer has something to do, see KEY_RING_BEHIND_SLEEP
+ */
 static bool key_buf_mutex_pred(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
 	if(gkcrypt->key_buf_thread_stop)
 		return true;
 
-	if(gkcrypt->key_buf_populated < gkcrypt->key_buf_size)
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	uint64_t key_pos_min = atomic_load_explicit(&ring->key_pos_min, memory_order_relaxed);
+	uint64_t populated = gkcrypt_key_ring_populated(key_pos_min, atomic_load_explicit(&ring->key_pos_end, memory_order_relaxed));
+	if(populated < atomic_load_explicit(&ring->size, memory_order_relaxed))
 		return true;
 
-	if(gkcrypt_key_buf_should_generate(gkcrypt))
-		return true;
+	return atomic_load(&ring->last_key_pos) > key_pos_min + gkcrypt_key_ring_behind_max(populated, KEY_RING_BEHIND_SLEEP);
+}
 
-	return false;
+/**
+ * Wait until the consumer is not reading below key_pos_min anymore
+ */
+static void gkcrypt_key_ring_wait_reader(ChiakiGKCryptKeyRing *ring, uint64_t key_pos_min)
+{
+	while(atomic_load(&ring->read_key_pos) < key_pos_min)
+		chiaki_thread_yield();
 }
 
-static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
+/**
+ * Replace the key buffer by one of new_size bytes, keeping as much of the newest key stream as fits.
+ * Only called by the producer.
+ */
+static void gkcrypt_key_ring_resize(ChiakiGKCrypt *gkcrypt, uint64_t new_size)
 {
-	assert(gkcrypt->key_buf_populated + KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
-	size_t buf_offset = (gkcrypt->key_buf_start_offset + gkcrypt->key_buf_populated) % gkcrypt->key_buf_size;
-	uint64_t key_pos = gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated;
-	uint8_t *buf_start = gkcrypt->key_buf + buf_offset;
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	uint8_t *new_buf = chiaki_aligned_alloc(KEY_BUF_CHUNK_SIZE, new_size);
+	if(!new_buf)
+	{
+		CHIAKI_LOGW(gkcrypt->log, "GKCrypt %d failed to allocate a key buffer of %#llx bytes",
+				(int)gkcrypt->index, (unsigned long long)new_size);
+		return;
+	}
 
-	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	uint8_t *old_buf = atomic_load_explicit(&ring->buf, memory_order_relaxed);
+	uint64_t old_size = atomic_load_explicit(&ring->size, memory_order_relaxed);
+	uint64_t key_pos_min = atomic_load_explicit(&ring->key_pos_min, memory_order_relaxed);
+	uint64_t key_pos_end = atomic_load_explicit(&ring->key_pos_end, memory_order_relaxed);
 
-	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, KEY_BUF_CHUNK_SIZE);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+	if(key_pos_end > key_pos_min)
+	{
+		// empty the buffer, so after this the consumer does not read from old_buf anymore
+		atomic_store(&ring->key_pos_min, key_pos_end);
+		gkcrypt_key_ring_wait_reader(ring, key_pos_end);
+	}
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	atomic_store_explicit(&ring->buf, new_buf, memory_order_relaxed);
+	atomic_store_explicit(&ring->size, new_size, memory_order_relaxed);
 
-	if(err == CHIAKI_ERR_SUCCESS)
-		gkcrypt->key_buf_populated += KEY_BUF_CHUNK_SIZE;
+	if(key_pos_end > key_pos_min)
+	{
+		if(key_pos_end - key_pos_min > new_size)
+			key_pos_min = key_pos_end - new_size;
+		for(uint64_t key_pos = key_pos_min; key_pos < key_pos_end; key_pos += KEY_BUF_CHUNK_SIZE)
+			memcpy(new_buf + key_pos % new_size, old_buf + key_pos % old_size, KEY_BUF_CHUNK_SIZE);
+		atomic_store(&ring->key_pos_min, key_pos_min); // publishes new_buf together with the copied key stream
+	}
 
-	return err;
+	chiaki_aligned_free(old_buf);
+	atomic_fetch_add_explicit(&ring->resizes, 1, memory_order_relaxed);
+	CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d resized key buffer from %#llx to %#llx bytes at %.0f bytes/s",
+			(int)gkcrypt->index, (unsigned long long)old_size, (unsigned long long)new_size, ring->rate);
+}
+
+/**
+ * Update the key pos velocity and grow or shrink the key buffer to match it.
+ * The buffer is grown right away when the consumer requested key stream beyond it,
+ * but only shrunk when it has been too large for KEY_RING_SHRINK_DELAY_US.
+ * Only called by the producer.
+ */
+static void gkcrypt_key_ring_adapt(ChiakiGKCrypt *gkcrypt)
+{
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	uint64_t size = atomic_load_explicit(&ring->size, memory_order_relaxed);
+	uint64_t new_size = size;
+
+	if(atomic_load_explicit(&ring->misses_ahead, memory_order_relaxed) != ring->misses_ahead_seen)
+	{
+		new_size = size * 2;
+		ring->shrink_since_us = 0;
+	}
+
+	if(now - ring->rate_time_us >= KEY_RING_RATE_INTERVAL_US)
+	{
+		uint64_t last_key_pos = atomic_load(&ring->last_key_pos);
+		double rate = (double)(last_key_pos - ring->rate_key_pos) * 1000000.0 / (double)(now - ring->rate_time_us);
+		ring->rate += (rate - ring->rate) * KEY_RING_RATE_GAIN;
+		ring->rate_key_pos = last_key_pos;
+		ring->rate_time_us = now;
+		atomic_store_explicit(&ring->key_pos_rate, (uint64_t)ring->rate, memory_order_relaxed);
+
+		// key stream for KEY_RING_LOOKAHEAD_MS ahead and the same behind
+		uint64_t target_size = (uint64_t)(ring->rate * KEY_RING_LOOKAHEAD_MS / 1000.0) * 2;
+		if(target_size > new_size)
+		{
+			new_size = target_size;
+			ring->shrink_since_us = 0;
+		}
+		else if(new_size == size && target_size <= size / 4)
+		{
+			if(!ring->shrink_since_us)
+				ring->shrink_since_us = now;
+			else if(now - ring->shrink_since_us >= KEY_RING_SHRINK_DELAY_US)
+			{
+				new_size = size / 2;
+				ring->shrink_since_us = now;
+			}
+		}
+		else
+			ring->shrink_since_us = 0;
+	}
+
+	new_size = gkcrypt_key_ring_chunks_clamp(gkcrypt, (new_size + KEY_BUF_CHUNK_SIZE - 1) / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+	if(new_size != size)
+		gkcrypt_key_ring_resize(gkcrypt, new_size);
+
+	// misses while resizing do not mean that the new size is too small
+	ring->misses_ahead_seen = atomic_load_explicit(&ring->misses_ahead, memory_order_relaxed);
+}
+
+static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
+{
+	ChiakiGKCryptKeyRing *ring = gkcrypt->key_ring;
+	uint64_t key_pos_min = atomic_load_explicit(&ring->key_pos_min, memory_order_relaxed);
+	uint64_t key_pos_end = atomic_load_explicit(&ring->key_pos_end, memory_order_relaxed);
+	uint64_t last_key_pos = atomic_load(&ring->last_key_pos);
+	uint8_t *key_buf = atomic_load_explicit(&ring->buf, memory_order_relaxed);
+	uint64_t key_buf_size = atomic_load_explicit(&ring->size, memory_order_relaxed);
+
+	if(last_key_pos > key_pos_end)
+	{
+		// skip ahead if the last key pos is already beyond our buffer
+		uint64_t key_pos = (last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+		CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
+					(unsigned long long)key_pos_min,
+					(unsigned long long)key_pos);
+		atomic_fetch_add_explicit(&ring->skips, 1, memory_order_relaxed);
+		// key_pos_end stays behind until the first new chunk is written, so the buffer is empty until then
+		key_pos_min = key_pos;
+		atomic_store(&ring->key_pos_min, key_pos_min);
+		gkcrypt_key_ring_wait_reader(ring, key_pos_min);
+	}
+	else if(gkcrypt_key_ring_populated(key_pos_min, key_pos_end) >= key_buf_size)
+	{
+		key_pos_min += KEY_BUF_CHUNK_SIZE;
+		atomic_store(&ring->key_pos_min, key_pos_min);
+		gkcrypt_key_ring_wait_reader(ring, key_pos_min);
+	}
+
+	uint64_t key_pos = key_pos_end > key_pos_min ? key_pos_end : key_pos_min;
+	ChiakiErrorCode err = gkcrypt_gen_key_stream(gkcrypt, true, key_pos, key_buf + key_pos % key_buf_size, KEY_BUF_CHUNK_SIZE);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+		return err;
+	}
+
+	atomic_store_explicit(&ring->key_pos_end, key_pos + KEY_BUF_CHUNK_SIZE, memory_order_release);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 static void *gkcrypt_thread_func(void *user)
@@ -507,39 +1193,19 @@ static void *gkcrypt_thread_func(void *user)
 	assert(err == CHIAKI_ERR_SUCCESS);
 	while(1)
 	{
-		err = chiaki_cond_wait_pred(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex, key_buf_mutex_pred, gkcrypt);
+		// set before checking the predicate, so a consumer that requested more after that will wake us up
+		atomic_store(&gkcrypt->key_ring->thread_sleeping, true);
+		err = chiaki_cond_timedwait_pred(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex, KEY_RING_ADAPT_TIMEOUT_MS, key_buf_mutex_pred, gkcrypt);
+		atomic_store(&gkcrypt->key_ring->thread_sleeping, false);
 
-		if(gkcrypt->key_buf_thread_stop || err != CHIAKI_ERR_SUCCESS)
+		if(gkcrypt->key_buf_thread_stop || (err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT))
 			break;
 
-		/*
-		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx, generating next chunk",
-					(int)gkcrypt->index,
-					(unsigned long long)gkcrypt->key_buf_size,
-					(unsigned long long)gkcrypt->key_buf_start_offset,
-					(unsigned long long)gkcrypt->key_buf_populated,
-					(unsigned long long)gkcrypt->key_buf_key_pos_min,
-					(unsigned long long)gkcrypt->last_key_pos);
-		*/
-
-		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-		{
-			// skip ahead if the last key pos is already beyond our buffer
-			uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
-			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
-						(unsigned long long)gkcrypt->key_buf_key_pos_min,
-						(unsigned long long)key_pos);
-			gkcrypt->key_buf_key_pos_min = key_pos;
-			gkcrypt->key_buf_start_offset = 0;
-			gkcrypt->key_buf_populated = 0;
-		}
-		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
-		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
-		}
-		err = gkcrypt_generate_next_chunk(gkcrypt);
+		// the key stream itself is generated without holding the mutex, the consumer never waits for it
+		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+		gkcrypt_key_ring_adapt(gkcrypt);
+		err = err == CHIAKI_ERR_TIMEOUT ? CHIAKI_ERR_SUCCESS : gkcrypt_generate_next_chunk(gkcrypt);
+		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 		if(err != CHIAKI_ERR_SUCCESS)
 			break;
 	}
@@ -0,0 +1,723 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/metrics.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+#define METRICS_UNIX_PREFIX "unix:"
+#define METRICS_SOCKET_TIMEOUT_MS 500
+
+struct chiaki_metric_t
+{
+	char *name;
+	char *help;
+	ChiakiMetricType type;
+	atomic_uint_least64_t value; // counter as integer, gauge as bits of a double
+
+	// histogram
+	double *buckets;
+	size_t buckets_count;
+	atomic_uint_least64_t *bucket_counts; // not cumulative, buckets_count + 1 for +Inf
+	atomic_uint_least64_t sum; // bits of a double
+};
+
+typedef struct metrics_collector_t
+{
+	ChiakiMetricsCollector cb;
+	void *user;
+} MetricsCollector;
+
+struct chiaki_metrics_t
+{
+	ChiakiMutex mutex; // protects registering and collectors, not updating values
+	ChiakiMetric **metrics;
+	size_t metrics_count;
+	size_t metrics_size;
+	MetricsCollector *collectors;
+	size_t collectors_count;
+	size_t collectors_size;
+};
+
+static uint64_t double_bits(double v)
+{
+	uint64_t r;
+	memcpy(&r, &v, sizeof(r));
+	return r;
+}
+
+static double bits_double(uint64_t v)
+{
+	double r;
+	memcpy(&r, &v, sizeof(r));
+	return r;
+}
+
+static char *metrics_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *r = malloc(len);
+	if(r)
+		memcpy(r, s, len);
+	return r;
+}
+
+CHIAKI_EXPORT ChiakiMetrics *chiaki_metrics_new(void)
+{
+	ChiakiMetrics *metrics = calloc(1, sizeof(ChiakiMetrics));
+	if(!metrics)
+		return NULL;
+	if(chiaki_mutex_init(&metrics->mutex, false) != CHIAKI_ERR_SUCCESS)
+	{
+		free(metrics);
+		return NULL;
+	}
+	return metrics;
+}
+
+static void metric_free(ChiakiMetric *metric)
+{
+	free(metric->name);
+	free(metric->help);
+	free(metric->buckets);
+	free(metric->bucket_counts);
+	free(metric);
+}
+
+CHIAKI_EXPORT void chiaki_metrics_free(ChiakiMetrics *metrics)
+{
+	if(!metrics)
+		return;
+	for(size_t i=0; i<metrics->metrics_count; i++)
+		metric_free(metrics->metrics[i]);
+	free(metrics->metrics);
+	free(metrics->collectors);
+	chiaki_mutex_fini(&metrics->mutex);
+	free(metrics);
+}
+
+/**
+ * [a-zA-Z_:][a-zA-Z0-9_:]*, which is also safe to put into JSON without escaping
+ */
+static bool metric_name_valid(const char *name)
+{
+	for(const char *c = name; *c; c++)
+	{
+		bool alpha = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_' || *c == ':';
+		if(!alpha && (c == name || *c < '0' || *c > '9'))
+			return false;
+	}
+	return *name != '\0';
+}
+
+static ChiakiMetric *metrics_register(ChiakiMetrics *metrics, ChiakiMetricType type, const char *name, const char *help, const double *buckets, size_t buckets_count)
+{
+	if(!metrics || !name || !metric_name_valid(name))
+		return NULL;
+
+	ChiakiMetric *metric = NULL;
+	chiaki_mutex_lock(&metrics->mutex);
+	for(size_t i=0; i<metrics->metrics_count; i++)
+	{
+		if(strcmp(metrics->metrics[i]->name, name) == 0)
+		{
+			if(metrics->metrics[i]->type == type)
+				metric = metrics->metrics[i];
+			goto beach;
+		}
+	}
+
+	if(metrics->metrics_count == metrics->metrics_size)
+	{
+		size_t size = metrics->metrics_size ? metrics->metrics_size * 2 : 32;
+		ChiakiMetric **m = realloc(metrics->metrics, size * sizeof(ChiakiMetric *));
+		if(!m)
+			goto beach;
+		metrics->metrics = m;
+		metrics->metrics_size = size;
+	}
+
+	metric = calloc(1, sizeof(ChiakiMetric));
+	if(!metric)
+		goto beach;
+	metric->type = type;
+	metric->name = metrics_strdup(name);
+	if(!metric->name)
+		goto error_metric;
+	if(help)
+	{
+		metric->help = metrics_strdup(help);
+		if(!metric->help)
+			goto error_metric;
+	}
+	if(type == CHIAKI_METRIC_HISTOGRAM)
+	{
+		metric->buckets_count = buckets_count;
+		if(buckets_count)
+		{
+			metric->buckets = malloc(buckets_count * sizeof(double));
+			if(!metric->buckets)
+				goto error_metric;
+			memcpy(metric->buckets, buckets, buckets_count * sizeof(double));
+		}
+		// zero-initialized atomics are valid atomics with value 0
+		metric->bucket_counts = calloc(buckets_count + 1, sizeof(atomic_uint_least64_t));
+		if(!metric->bucket_counts)
+			goto error_metric;
+	}
+	metrics->metrics[metrics->metrics_count++] = metric;
+	goto beach;
+
+error_metric:
+	metric_free(metric);
+	metric = NULL;
+beach:
+	chiaki_mutex_unlock(&metrics->mutex);
+	return metric;
+}
+
+CHIAKI_EXPORT ChiakiMetric *chiaki_metrics_counter(ChiakiMetrics *metrics, const char *name, const char *help)
+{
+	return metrics_register(metrics, CHIAKI_METRIC_COUNTER, name, help, NULL, 0);
+}
+
+CHIAKI_EXPORT ChiakiMetric *chiaki_metrics_gauge(ChiakiMetrics *metrics, const char *name, const char *help)
+{
+	return metrics_register(metrics, CHIAKI_METRIC_GAUGE, name, help, NULL, 0);
+}
+
+CHIAKI_EXPORT ChiakiMetric *chiaki_metrics_histogram(ChiakiMetrics *metrics, const char *name, const char *help, const double *buckets, size_t buckets_count)
+{
+	return metrics_register(metrics, CHIAKI_METRIC_HISTOGRAM, name, help, buckets, buckets_count);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_collector_add(ChiakiMetrics *metrics, ChiakiMetricsCollector cb, void *user)
+{
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	chiaki_mutex_lock(&metrics->mutex);
+	if(metrics->collectors_count == metrics->collectors_size)
+	{
+		size_t size = metrics->collectors_size ? metrics->collectors_size * 2 : 8;
+		MetricsCollector *c = realloc(metrics->collectors, size * sizeof(MetricsCollector));
+		if(!c)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto beach;
+		}
+		metrics->collectors = c;
+		metrics->collectors_size = size;
+	}
+	metrics->collectors[metrics->collectors_count].cb = cb;
+	metrics->collectors[metrics->collectors_count].user = user;
+	metrics->collectors_count++;
+beach:
+	chiaki_mutex_unlock(&metrics->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_metrics_collector_remove(ChiakiMetrics *metrics, ChiakiMetricsCollector cb, void *user)
+{
+	chiaki_mutex_lock(&metrics->mutex);
+	for(size_t i=0; i<metrics->collectors_count; i++)
+	{
+		if(metrics->collectors[i].cb != cb || metrics->collectors[i].user != user)
+			continue;
+		metrics->collectors_count--;
+		memmove(metrics->collectors + i, metrics->collectors + i + 1, (metrics->collectors_count - i) * sizeof(MetricsCollector));
+		break;
+	}
+	chiaki_mutex_unlock(&metrics->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_metric_add(ChiakiMetric *metric, uint64_t v)
+{
+	if(!metric)
+		return;
+	atomic_fetch_add_explicit(&metric->value, v, memory_order_relaxed);
+}
+
+CHIAKI_EXPORT void chiaki_metric_set(ChiakiMetric *metric, double v)
+{
+	if(!metric)
+		return;
+	if(metric->type == CHIAKI_METRIC_COUNTER)
+		atomic_store_explicit(&metric->value, v > 0.0 ? (uint64_t)v : 0, memory_order_relaxed);
+	else
+		atomic_store_explicit(&metric->value, double_bits(v), memory_order_relaxed);
+}
+
+CHIAKI_EXPORT void chiaki_metric_observe(ChiakiMetric *metric, double v)
+{
+	if(!metric || metric->type != CHIAKI_METRIC_HISTOGRAM)
+		return;
+	size_t bucket = 0;
+	while(bucket < metric->buckets_count && v > metric->buckets[bucket])
+		bucket++;
+	atomic_fetch_add_explicit(&metric->bucket_counts[bucket], 1, memory_order_relaxed);
+
+	uint64_t sum = atomic_load_explicit(&metric->sum, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&metric->sum, &sum, double_bits(bits_double(sum) + v),
+				memory_order_relaxed, memory_order_relaxed));
+}
+
+static uint64_t metrics_now_ms(void)
+{
+#ifdef _WIN32
+	FILETIME ft;
+	GetSystemTimePreciseAsFileTime(&ft);
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	// 100 ns intervals since 1601-01-01
+	return t / 10000 - 11644473600000ULL;
+#else
+	struct timespec ts;
+	if(clock_gettime(CLOCK_REALTIME, &ts) != 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_snapshot(ChiakiMetrics *metrics, ChiakiMetricsSnapshot *snapshot)
+{
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	snapshot->timestamp_ms = metrics_now_ms();
+	snapshot->metrics_count = 0;
+
+	chiaki_mutex_lock(&metrics->mutex);
+	for(size_t i=0; i<metrics->collectors_count; i++)
+		metrics->collectors[i].cb(metrics, metrics->collectors[i].user);
+
+	snapshot->metrics = calloc(metrics->metrics_count ? metrics->metrics_count : 1, sizeof(ChiakiMetricSnapshot));
+	if(!snapshot->metrics)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto beach;
+	}
+	for(size_t i=0; i<metrics->metrics_count; i++)
+	{
+		ChiakiMetric *metric = metrics->metrics[i];
+		ChiakiMetricSnapshot *s = &snapshot->metrics[i];
+		s->name = metric->name;
+		s->help = metric->help;
+		s->type = metric->type;
+		uint64_t value = atomic_load_explicit(&metric->value, memory_order_relaxed);
+		switch(metric->type)
+		{
+			case CHIAKI_METRIC_COUNTER:
+				s->value = (double)value;
+				break;
+			case CHIAKI_METRIC_GAUGE:
+				s->value = bits_double(value);
+				break;
+			case CHIAKI_METRIC_HISTOGRAM:
+				s->buckets = metric->buckets;
+				s->buckets_count = metric->buckets_count;
+				s->bucket_counts = calloc(metric->buckets_count ? metric->buckets_count : 1, sizeof(uint64_t));
+				if(!s->bucket_counts)
+				{
+					err = CHIAKI_ERR_MEMORY;
+					goto beach;
+				}
+				// count is derived from the buckets, so the snapshot is consistent in itself
+				for(size_t b=0; b<=metric->buckets_count; b++)
+				{
+					s->count += atomic_load_explicit(&metric->bucket_counts[b], memory_order_relaxed);
+					if(b < metric->buckets_count)
+						s->bucket_counts[b] = s->count;
+				}
+				s->sum = bits_double(atomic_load_explicit(&metric->sum, memory_order_relaxed));
+				break;
+		}
+		snapshot->metrics_count++;
+	}
+beach:
+	chiaki_mutex_unlock(&metrics->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		chiaki_metrics_snapshot_fini(snapshot);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_metrics_snapshot_fini(ChiakiMetricsSnapshot *snapshot)
+{
+	if(!snapshot->metrics)
+		return;
+	for(size_t i=0; i<snapshot->metrics_count; i++)
+		free(snapshot->metrics[i].bucket_counts);
+	free(snapshot->metrics);
+	snapshot->metrics = NULL;
+	snapshot->metrics_count = 0;
+}
+
+typedef struct metrics_buf_t
+{
+	char *buf;
+	size_t size;
+	size_t capacity;
+	bool failed;
+} MetricsBuf;
+
+static void buf_printf(MetricsBuf *buf, const char *fmt, ...)
+{
+	if(buf->failed)
+		return;
+	while(true)
+	{
+		va_list args;
+		va_start(args, fmt);
+		int r = vsnprintf(buf->buf + buf->size, buf->capacity - buf->size, fmt, args);
+		va_end(args);
+		if(r < 0)
+		{
+			buf->failed = true;
+			return;
+		}
+		if((size_t)r < buf->capacity - buf->size)
+		{
+			buf->size += (size_t)r;
+			return;
+		}
+		size_t capacity = buf->capacity * 2;
+		while(capacity - buf->size <= (size_t)r)
+			capacity *= 2;
+		char *b = realloc(buf->buf, capacity);
+		if(!b)
+		{
+			buf->failed = true;
+			return;
+		}
+		buf->buf = b;
+		buf->capacity = capacity;
+	}
+}
+
+/**
+ * JSON has no representation for nan and infinity
+ */
+static void buf_json_double(MetricsBuf *buf, double v)
+{
+	if(isfinite(v))
+		buf_printf(buf, "%.10g", v);
+	else
+		buf_printf(buf, "null");
+}
+
+static void buf_prometheus_double(MetricsBuf *buf, double v)
+{
+	if(isnan(v))
+		buf_printf(buf, "NaN");
+	else if(isinf(v))
+		buf_printf(buf, v > 0 ? "+Inf" : "-Inf");
+	else
+		buf_printf(buf, "%.10g", v);
+}
+
+static void format_json(MetricsBuf *buf, ChiakiMetricsSnapshot *snapshot)
+{
+	buf_printf(buf, "{\"timestamp_ms\":%llu,\"metrics\":{", (unsigned long long)snapshot->timestamp_ms);
+	for(size_t i=0; i<snapshot->metrics_count; i++)
+	{
+		ChiakiMetricSnapshot *m = &snapshot->metrics[i];
+		// names are validated on registration to need no escaping
+		buf_printf(buf, "%s\"%s\":", i ? "," : "", m->name);
+		if(m->type != CHIAKI_METRIC_HISTOGRAM)
+		{
+			buf_json_double(buf, m->value);
+			continue;
+		}
+		buf_printf(buf, "{\"count\":%llu,\"sum\":", (unsigned long long)m->count);
+		buf_json_double(buf, m->sum);
+		buf_printf(buf, ",\"buckets\":[");
+		for(size_t b=0; b<m->buckets_count; b++)
+		{
+			buf_printf(buf, "%s[", b ? "," : "");
+			buf_json_double(buf, m->buckets[b]);
+			buf_printf(buf, ",%llu]", (unsigned long long)m->bucket_counts[b]);
+		}
+		buf_printf(buf, "]}");
+	}
+	buf_printf(buf, "}}\n");
+}
+
+static void format_prometheus(MetricsBuf *buf, ChiakiMetricsSnapshot *snapshot)
+{
+	static const char *type_names[] = { "counter", "gauge", "histogram" };
+	for(size_t i=0; i<snapshot->metrics_count; i++)
+	{
+		ChiakiMetricSnapshot *m = &snapshot->metrics[i];
+		if(m->help)
+		{
+			buf_printf(buf, "# HELP %s ", m->name);
+			for(const char *c = m->help; *c; c++)
+			{
+				if(*c == '\\')
+					buf_printf(buf, "\\\\");
+				else if(*c == '\n')
+					buf_printf(buf, "\\n");
+				else
+					buf_printf(buf, "%c", *c);
+			}
+			buf_printf(buf, "\n");
+		}
+		buf_printf(buf, "# TYPE %s %s\n", m->name, type_names[m->type]);
+		if(m->type != CHIAKI_METRIC_HISTOGRAM)
+		{
+			buf_printf(buf, "%s ", m->name);
+			buf_prometheus_double(buf, m->value);
+			buf_printf(buf, "\n");
+			continue;
+		}
+		for(size_t b=0; b<m->buckets_count; b++)
+		{
+			buf_printf(buf, "%s_bucket{le=\"", m->name);
+			buf_prometheus_double(buf, m->buckets[b]);
+			buf_printf(buf, "\"} %llu\n", (unsigned long long)m->bucket_counts[b]);
+		}
+		buf_printf(buf, "%s_bucket{le=\"+Inf\"} %llu\n", m->name, (unsigned long long)m->count);
+		buf_printf(buf, "%s_sum ", m->name);
+		buf_prometheus_double(buf, m->sum);
+		buf_printf(buf, "\n%s_count %llu\n", m->name, (unsigned long long)m->count);
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_format(ChiakiMetricsSnapshot *snapshot, ChiakiMetricsFormat format, char **out, size_t *out_size)
+{
+	MetricsBuf buf = { 0 };
+	buf.capacity = 4096;
+	buf.buf = malloc(buf.capacity);
+	if(!buf.buf)
+		return CHIAKI_ERR_MEMORY;
+	buf.buf[0] = '\0';
+
+	switch(format)
+	{
+		case CHIAKI_METRICS_FORMAT_JSON_LINES:
+			format_json(&buf, snapshot);
+			break;
+		case CHIAKI_METRICS_FORMAT_PROMETHEUS:
+			format_prometheus(&buf, snapshot);
+			break;
+		default:
+			buf.failed = true;
+			break;
+	}
+
+	if(buf.failed)
+	{
+		free(buf.buf);
+		return CHIAKI_ERR_MEMORY;
+	}
+	*out = buf.buf;
+	if(out_size)
+		*out_size = buf.size;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode exporter_write_socket(ChiakiMetricsExporter *exporter, const char *buf, size_t size)
+{
+#ifdef _WIN32
+	return CHIAKI_ERR_UNKNOWN;
+#else
+	if(CHIAKI_SOCKET_IS_INVALID(exporter->sock))
+	{
+		struct sockaddr_un addr = { 0 };
+		addr.sun_family = AF_UNIX;
+		const char *path = exporter->path + strlen(METRICS_UNIX_PREFIX);
+		if(strlen(path) >= sizeof(addr.sun_path))
+			return CHIAKI_ERR_INVALID_DATA;
+		strcpy(addr.sun_path, path);
+		exporter->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(CHIAKI_SOCKET_IS_INVALID(exporter->sock))
+			return CHIAKI_ERR_NETWORK;
+#ifdef SO_NOSIGPIPE
+		int nosigpipe = 1;
+		setsockopt(exporter->sock, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+		// also bounds connect() on Linux, a reader that stops reading only loses samples
+		struct timeval timeout;
+		timeout.tv_sec = METRICS_SOCKET_TIMEOUT_MS / 1000;
+		timeout.tv_usec = (METRICS_SOCKET_TIMEOUT_MS % 1000) * 1000;
+		setsockopt(exporter->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if(connect(exporter->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			CHIAKI_SOCKET_CLOSE(exporter->sock);
+			exporter->sock = CHIAKI_INVALID_SOCKET;
+			return CHIAKI_ERR_CONNECTION_REFUSED;
+		}
+	}
+
+#ifdef MSG_NOSIGNAL
+	int flags = MSG_NOSIGNAL;
+#else
+	int flags = 0;
+#endif
+	while(size)
+	{
+		ssize_t r = send(exporter->sock, buf, size, flags);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			// timed out or gone, reconnect next time so the reader never sees a partial snapshot
+			CHIAKI_SOCKET_CLOSE(exporter->sock);
+			exporter->sock = CHIAKI_INVALID_SOCKET;
+			return CHIAKI_ERR_DISCONNECTED;
+		}
+		buf += r;
+		size -= (size_t)r;
+	}
+	return CHIAKI_ERR_SUCCESS;
+#endif
+}
+
+static ChiakiErrorCode exporter_write_file(ChiakiMetricsExporter *exporter, const char *buf, size_t size)
+{
+	if(exporter->format == CHIAKI_METRICS_FORMAT_JSON_LINES)
+	{
+		if(!exporter->file)
+		{
+			exporter->file = fopen(exporter->path, "a");
+			if(!exporter->file)
+				return CHIAKI_ERR_UNKNOWN;
+		}
+		if(fwrite(buf, 1, size, exporter->file) != size || fflush(exporter->file) != 0)
+			return CHIAKI_ERR_UNKNOWN;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	// write to a temporary file and rename it so readers never see a partial file
+	size_t path_len = strlen(exporter->path);
+	char *tmp_path = malloc(path_len + 5);
+	if(!tmp_path)
+		return CHIAKI_ERR_MEMORY;
+	memcpy(tmp_path, exporter->path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", 5);
+	ChiakiErrorCode err = CHIAKI_ERR_UNKNOWN;
+	FILE *f = fopen(tmp_path, "w");
+	if(!f)
+		goto beach;
+	bool written = fwrite(buf, 1, size, f) == size;
+	if(fclose(f) != 0 || !written)
+		goto beach;
+#ifdef _WIN32
+	remove(exporter->path);
+#endif
+	if(rename(tmp_path, exporter->path) != 0)
+		goto beach;
+	err = CHIAKI_ERR_SUCCESS;
+beach:
+	free(tmp_path);
+	return err;
+}
+
+static void exporter_export(ChiakiMetricsExporter *exporter)
+{
+	ChiakiMetricsSnapshot snapshot;
+	ChiakiErrorCode err = chiaki_metrics_snapshot(exporter->metrics, &snapshot);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(exporter->log, "Metrics exporter failed to take snapshot");
+		return;
+	}
+	char *buf;
+	size_t size;
+	err = chiaki_metrics_format(&snapshot, exporter->format, &buf, &size);
+	chiaki_metrics_snapshot_fini(&snapshot);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(exporter->log, "Metrics exporter failed to format snapshot");
+		return;
+	}
+	err = exporter->unix_socket
+		? exporter_write_socket(exporter, buf, size)
+		: exporter_write_file(exporter, buf, size);
+	free(buf);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGV(exporter->log, "Metrics exporter failed to write to %s: %s", exporter->path, chiaki_error_string(err));
+}
+
+static void *exporter_thread_func(void *user)
+{
+	ChiakiMetricsExporter *exporter = user;
+
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&exporter->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(true)
+	{
+		err = chiaki_bool_pred_cond_timedwait(&exporter->stop_cond, exporter->interval_ms);
+		// don't block stop while writing, pred stays set if it is signaled in the meantime
+		chiaki_bool_pred_cond_unlock(&exporter->stop_cond);
+		exporter_export(exporter);
+		if(err != CHIAKI_ERR_TIMEOUT)
+			break;
+		if(chiaki_bool_pred_cond_lock(&exporter->stop_cond) != CHIAKI_ERR_SUCCESS)
+			break;
+	}
+
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_exporter_start(ChiakiMetricsExporter *exporter, ChiakiMetrics *metrics, ChiakiLog *log,
+		ChiakiMetricsFormat format, const char *path, uint64_t interval_ms)
+{
+	exporter->metrics = metrics;
+	exporter->log = log;
+	exporter->format = format;
+	exporter->interval_ms = interval_ms;
+	exporter->file = NULL;
+	exporter->sock = CHIAKI_INVALID_SOCKET;
+	exporter->unix_socket = strncmp(path, METRICS_UNIX_PREFIX, strlen(METRICS_UNIX_PREFIX)) == 0;
+#ifdef _WIN32
+	if(exporter->unix_socket)
+	{
+		CHIAKI_LOGE(log, "Metrics exporter does not support Unix sockets on this platform");
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+#endif
+	exporter->path = metrics_strdup(path);
+	if(!exporter->path)
+		return CHIAKI_ERR_MEMORY;
+
+	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&exporter->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_path;
+
+	err = chiaki_thread_create(&exporter->thread, exporter_thread_func, exporter);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_cond;
+
+	chiaki_thread_set_name(&exporter->thread, "Chiaki Metrics Exporter");
+	CHIAKI_LOGI(log, "Exporting metrics to %s every %llu ms", path, (unsigned long long)interval_ms);
+	return CHIAKI_ERR_SUCCESS;
+
+error_stop_cond:
+	chiaki_bool_pred_cond_fini(&exporter->stop_cond);
+error_path:
+	free(exporter->path);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_metrics_exporter_stop(ChiakiMetricsExporter *exporter)
+{
+	chiaki_bool_pred_cond_signal(&exporter->stop_cond);
+	chiaki_thread_join(&exporter->thread, NULL);
+	chiaki_bool_pred_cond_fini(&exporter->stop_cond);
+	if(exporter->file)
+		fclose(exporter->file);
+	if(!CHIAKI_SOCKET_IS_INVALID(exporter->sock))
+		CHIAKI_SOCKET_CLOSE(exporter->sock);
+	free(exporter->path);
+}
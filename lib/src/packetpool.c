@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/packetpool.h>
+
+#include <assert.h>
+#include <string.h>
+
+typedef struct chiaki_packet_pool_buf_header_t
+{
+	ChiakiPacketPool *pool;
+	struct chiaki_packet_pool_buf_header_t *next; // only valid while in the free list
+	unsigned int refcount;
+	bool heap; // allocated outside of the slab because the pool was exhausted
+} ChiakiPacketPoolBufHeader;
+
+// keep the data behind the header 16-byte aligned
+#define HEADER_SIZE ((sizeof(ChiakiPacketPoolBufHeader) + 0xf) & ~(size_t)0xf)
+#define STRIDE(pool) (HEADER_SIZE + (((pool)->buf_size + 0xf) & ~(size_t)0xf))
+
+#define HEADER_OF(buf) ((ChiakiPacketPoolBufHeader *)((buf) - HEADER_SIZE))
+#define DATA_OF(header) (((uint8_t *)(header)) + HEADER_SIZE)
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t buf_size, size_t count)
+{
+	pool->buf_size = buf_size;
+	pool->count = count;
+	pool->free_list = NULL;
+	memset(&pool->stats, 0, sizeof(pool->stats));
+
+	ChiakiErrorCode err = chiaki_mutex_init(&pool->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	pool->slab = chiaki_aligned_alloc(16, STRIDE(pool) * count);
+	if(!pool->slab)
+	{
+		chiaki_mutex_fini(&pool->mutex);
+		return CHIAKI_ERR_MEMORY;
+	}
+
+	// build the free list backwards so buffers are handed out in slab order
+	for(size_t i=count; i>0; i--)
+	{
+		ChiakiPacketPoolBufHeader *header = (ChiakiPacketPoolBufHeader *)(pool->slab + STRIDE(pool) * (i - 1));
+		header->pool = pool;
+		header->refcount = 0;
+		header->heap = false;
+		header->next = pool->free_list;
+		pool->free_list = header;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool)
+{
+	assert(pool->stats.in_use == 0);
+	chiaki_aligned_free(pool->slab);
+	chiaki_mutex_fini(&pool->mutex);
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_packet_pool_alloc(ChiakiPacketPool *pool)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiPacketPoolBufHeader *header = pool->free_list;
+	if(header)
+	{
+		pool->free_list = header->next;
+		pool->stats.hits++;
+	}
+	else
+	{
+		header = chiaki_aligned_alloc(16, STRIDE(pool));
+		if(!header)
+		{
+			chiaki_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		header->pool = pool;
+		header->heap = true;
+		pool->stats.misses++;
+	}
+	header->next = NULL;
+	header->refcount = 1;
+	pool->stats.in_use++;
+	if(pool->stats.in_use > pool->stats.high_water)
+		pool->stats.high_water = pool->stats.in_use;
+	chiaki_mutex_unlock(&pool->mutex);
+	return DATA_OF(header);
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_ref(uint8_t *buf)
+{
+	ChiakiPacketPoolBufHeader *header = HEADER_OF(buf);
+	ChiakiPacketPool *pool = header->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	assert(header->refcount > 0);
+	header->refcount++;
+	chiaki_mutex_unlock(&pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_unref(uint8_t *buf)
+{
+	ChiakiPacketPoolBufHeader *header = HEADER_OF(buf);
+	ChiakiPacketPool *pool = header->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	assert(header->refcount > 0);
+	if(--header->refcount > 0)
+	{
+		chiaki_mutex_unlock(&pool->mutex);
+		return;
+	}
+	pool->stats.in_use--;
+	if(header->heap)
+	{
+		chiaki_mutex_unlock(&pool->mutex);
+		chiaki_aligned_free(header);
+		return;
+	}
+	header->next = pool->free_list;
+	pool->free_list = header;
+	chiaki_mutex_unlock(&pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_get_stats(ChiakiPacketPool *pool, ChiakiPacketPoolStats *stats, bool reset)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	if(reset)
+	{
+		pool->stats.hits = 0;
+		pool->stats.misses = 0;
+		pool->stats.high_water = pool->stats.in_use;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+}
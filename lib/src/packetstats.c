@@ -3,19 +3,75 @@
 #include <chiaki/packetstats.h>
 #include <chiaki/log.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+static const unsigned int frame_loss_bucket_max[CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS] = { 0, 1, 2, 5, 10, 20, 50, 100 };
+
+/**
+ * Every counter has a single writer, so it is updated with a plain load and store instead of a locked add.
+ * Readers may see counters of different groups at slightly different points in time.
+ */
+struct chiaki_packet_stats_counters_t
+{
+	// written by the thread pushing generations
+	atomic_uint_least64_t gen_received;
+	atomic_uint_least64_t gen_lost;
+	atomic_uint_least64_t gen_loss_bursts[CHIAKI_PACKET_STATS_BURST_BUCKETS];
+	atomic_uint_least64_t frame_loss[CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS];
+	uint64_t gen_burst; // lost packets at the end of the last generation, burst may continue
+
+	// written by the thread pushing sequential packets
+	atomic_uint_least64_t seq_received;
+	atomic_uint_least64_t seq_lost; // sum of all gaps, unlike the loss between resets not reduced by late packets
+	atomic_uint_least16_t seq_max;
+	atomic_uint_least64_t seq_loss_bursts[CHIAKI_PACKET_STATS_BURST_BUCKETS];
+	bool seq_valid; // whether any sequential packet was pushed yet
+
+	// written by the thread pushing local drops
+	atomic_uint_least64_t local_dropped;
+};
+
+static void counter_add(atomic_uint_least64_t *counter, uint64_t v)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static uint64_t counter_get(atomic_uint_least64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void burst_push(atomic_uint_least64_t *buckets, uint64_t len)
+{
+	size_t bucket = 0;
+	while(len > 1 && bucket < CHIAKI_PACKET_STATS_BURST_BUCKETS - 1)
+	{
+		len >>= 1;
+		bucket++;
+	}
+	counter_add(&buckets[bucket], 1);
+}
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats)
 {
+	// zero-initialized atomics are valid atomics with value 0
+	stats->counters = calloc(1, sizeof(ChiakiPacketStatsCounters));
+	if(!stats->counters)
+		return CHIAKI_ERR_MEMORY;
 	ChiakiErrorCode err = chiaki_mutex_init(&stats->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		free(stats->counters);
 		return err;
+	}
 	err = chiaki_mutex_lock(&stats->mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
+	stats->gen_received_reset = 0;
+	stats->gen_lost_reset = 0;
 	stats->seq_min = 0;
-	stats->seq_max = 0;
-	stats->seq_received = 0;
+	stats->seq_received_reset = 0;
+	stats->local_dropped_reset = 0;
 	err = chiaki_mutex_unlock(&stats->mutex);
 	return err;
 }
@@ -23,61 +79,144 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats)
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats)
 {
 	chiaki_mutex_fini(&stats->mutex);
+	free(stats->counters);
 }
 
-static void reset_stats(ChiakiPacketStats *stats)
+/**
+ * Current counters relative to the last reset, call with mutex locked
+ */
+static void stats_since_reset(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost, uint64_t *local_dropped)
 {
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
-	stats->seq_min = stats->seq_max;
-	stats->seq_received = 0;
+	ChiakiPacketStatsCounters *c = stats->counters;
+	uint64_t gen_received = counter_get(&c->gen_received);
+	uint64_t gen_lost = counter_get(&c->gen_lost);
+	uint64_t seq_received = counter_get(&c->seq_received);
+	ChiakiSeqNum16 seq_max = atomic_load_explicit(&c->seq_max, memory_order_relaxed);
+	uint64_t dropped_total = counter_get(&c->local_dropped);
+
+	// gen
+	*received = gen_received - stats->gen_received_reset;
+	*lost = gen_lost - stats->gen_lost_reset;
+
+	// seq
+	uint64_t seq_received_since = seq_received - stats->seq_received_reset;
+	uint64_t seq_diff = seq_max - stats->seq_min; // overflow on purpose if max < min
+	uint64_t seq_lost = seq_received_since > seq_diff ? seq_diff : seq_diff - seq_received_since;
+	*received += seq_received_since;
+	*lost += seq_lost;
+
+	// local drops were counted as lost above, they must not look like network congestion
+	uint64_t dropped = dropped_total - stats->local_dropped_reset;
+	*lost = *lost > dropped ? *lost - dropped : 0;
+	if(local_dropped)
+		*local_dropped = dropped;
+
+	if(reset)
+	{
+		stats->gen_received_reset = gen_received;
+		stats->gen_lost_reset = gen_lost;
+		stats->seq_min = seq_max;
+		stats->seq_received_reset = seq_received;
+		stats->local_dropped_reset = dropped_total;
+	}
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats)
 {
+	uint64_t received, lost;
 	chiaki_mutex_lock(&stats->mutex);
-	reset_stats(stats);
+	stats_since_reset(stats, true, &received, &lost, NULL);
 	chiaki_mutex_unlock(&stats->mutex);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost)
 {
-	chiaki_mutex_lock(&stats->mutex);
-	stats->gen_received += received;
-	stats->gen_lost += lost;
-	chiaki_mutex_unlock(&stats->mutex);
+	ChiakiPacketStatsCounters *c = stats->counters;
+	counter_add(&c->gen_received, received);
+	counter_add(&c->gen_lost, lost);
+
+	uint64_t total = received + lost;
+	if(!total)
+		return;
+	size_t bucket = 0;
+	if(lost)
+	{
+		bucket = 1;
+		while(bucket < CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS - 1 && lost * 100 > frame_loss_bucket_max[bucket] * total)
+			bucket++;
+	}
+	counter_add(&c->frame_loss[bucket], 1);
 }
 
-CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num)
+CHIAKI_EXPORT void chiaki_packet_stats_push_generation_units(ChiakiPacketStats *stats, const uint64_t *units_received, size_t units_expected)
 {
-	stats->seq_received++;
-	if(chiaki_seq_num_16_gt(seq_num, stats->seq_max))
-		stats->seq_max = seq_num;
+	ChiakiPacketStatsCounters *c = stats->counters;
+	uint64_t lost = 0;
+	uint64_t burst = c->gen_burst;
+	for(size_t i=0; i<units_expected; i++)
+	{
+		if((units_received[i / 64] >> (i % 64)) & 1)
+		{
+			if(burst)
+				burst_push(c->gen_loss_bursts, burst);
+			burst = 0;
+		}
+		else
+		{
+			burst++;
+			lost++;
+		}
+	}
+	c->gen_burst = burst;
+	chiaki_packet_stats_push_generation(stats, units_expected - lost, lost);
 }
 
-CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost)
+CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num)
 {
-	chiaki_mutex_lock(&stats->mutex);
-
-	// gen
-	*received = stats->gen_received;
-	*lost = stats->gen_lost;
+	ChiakiPacketStatsCounters *c = stats->counters;
+	counter_add(&c->seq_received, 1);
+	ChiakiSeqNum16 seq_max = atomic_load_explicit(&c->seq_max, memory_order_relaxed);
+	if(chiaki_seq_num_16_gt(seq_num, seq_max))
+	{
+		ChiakiSeqNum16 gap = seq_num - seq_max - 1;
+		if(c->seq_valid && gap)
+		{
+			counter_add(&c->seq_lost, gap);
+			burst_push(c->seq_loss_bursts, gap);
+		}
+		atomic_store_explicit(&c->seq_max, seq_num, memory_order_relaxed);
+	}
+	c->seq_valid = true;
+}
 
-	//CHIAKI_LOGD(NULL, "gen received: %llu, lost: %llu",
-	//		(unsigned long long)stats->gen_received,
-	//		(unsigned long long)stats->gen_lost);
+CHIAKI_EXPORT void chiaki_packet_stats_push_local_drops(ChiakiPacketStats *stats, uint64_t dropped)
+{
+	counter_add(&stats->counters->local_dropped, dropped);
+}
 
-	// seq
-	uint64_t seq_diff = stats->seq_max - stats->seq_min; // overflow on purpose if max < min
-	uint64_t seq_lost = stats->seq_received > seq_diff ? seq_diff : seq_diff - stats->seq_received;
-	*received += stats->seq_received;
-	*lost += seq_lost;
+CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost, uint64_t *local_dropped)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	stats_since_reset(stats, reset, received, lost, local_dropped);
+	chiaki_mutex_unlock(&stats->mutex);
+}
 
-	//CHIAKI_LOGD(NULL, "seq received: %llu, lost: %llu",
-	//		(unsigned long long)stats->seq_received,
-	//		(unsigned long long)seq_lost);
+CHIAKI_EXPORT void chiaki_packet_stats_snapshot(ChiakiPacketStats *stats, ChiakiPacketStatsSnapshot *snapshot)
+{
+	ChiakiPacketStatsCounters *c = stats->counters;
+	snapshot->received = counter_get(&c->gen_received) + counter_get(&c->seq_received);
+	snapshot->local_dropped = counter_get(&c->local_dropped);
+	uint64_t lost = counter_get(&c->gen_lost) + counter_get(&c->seq_lost);
+	snapshot->lost = lost > snapshot->local_dropped ? lost - snapshot->local_dropped : 0;
+	for(size_t i=0; i<CHIAKI_PACKET_STATS_BURST_BUCKETS; i++)
+		snapshot->loss_bursts[i] = counter_get(&c->gen_loss_bursts[i]) + counter_get(&c->seq_loss_bursts[i]);
+	for(size_t i=0; i<CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS; i++)
+		snapshot->frame_loss[i] = counter_get(&c->frame_loss[i]);
+}
 
-	if(reset)
-		reset_stats(stats);
-	chiaki_mutex_unlock(&stats->mutex);
+CHIAKI_EXPORT unsigned int chiaki_packet_stats_frame_loss_bucket_max(size_t bucket)
+{
+	if(bucket >= CHIAKI_PACKET_STATS_FRAME_LOSS_BUCKETS)
+		return 100;
+	return frame_loss_bucket_max[bucket];
 }
@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/reactor.h>
+#include <chiaki/time.h>
+
+#include <assert.h>
+
+static void *reactor_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_init(ChiakiReactor *reactor)
+{
+	reactor->should_stop = false;
+	reactor->timers = NULL;
+	reactor->running = NULL;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&reactor->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&reactor->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&reactor->thread, reactor_thread_func, reactor);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	chiaki_thread_set_name(&reactor->thread, "Chiaki Reactor");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&reactor->cond);
+error_mutex:
+	chiaki_mutex_fini(&reactor->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_reactor_fini(ChiakiReactor *reactor)
+{
+	chiaki_mutex_lock(&reactor->mutex);
+	assert(!reactor->timers);
+	reactor->should_stop = true;
+	chiaki_cond_broadcast(&reactor->cond);
+	chiaki_mutex_unlock(&reactor->mutex);
+
+	chiaki_thread_join(&reactor->thread, NULL);
+	chiaki_cond_fini(&reactor->cond);
+	chiaki_mutex_fini(&reactor->mutex);
+}
+
+static uint64_t due_after(uint64_t delay_ms)
+{
+	if(delay_ms == CHIAKI_REACTOR_TIMER_IDLE)
+		return CHIAKI_REACTOR_TIMER_IDLE;
+	return chiaki_time_now_monotonic_ms() + delay_ms;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_timer_add(ChiakiReactor *reactor, ChiakiReactorTimer *timer, ChiakiReactorTimerCb cb, void *user, uint64_t delay_ms)
+{
+	timer->cb = cb;
+	timer->user = user;
+	timer->due_ms = due_after(delay_ms);
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&reactor->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	timer->next = reactor->timers;
+	reactor->timers = timer;
+	chiaki_cond_broadcast(&reactor->cond);
+	chiaki_mutex_unlock(&reactor->mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_reactor_timer_remove(ChiakiReactor *reactor, ChiakiReactorTimer *timer)
+{
+	chiaki_mutex_lock(&reactor->mutex);
+	for(ChiakiReactorTimer **t = &reactor->timers; *t; t = &(*t)->next)
+	{
+		if(*t == timer)
+		{
+			*t = timer->next;
+			break;
+		}
+	}
+	timer->next = NULL;
+	while(reactor->running == timer)
+		chiaki_cond_wait(&reactor->cond, &reactor->mutex);
+	chiaki_mutex_unlock(&reactor->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_reactor_timer_schedule(ChiakiReactor *reactor, ChiakiReactorTimer *timer, uint64_t delay_ms)
+{
+	uint64_t due = due_after(delay_ms);
+	chiaki_mutex_lock(&reactor->mutex);
+	if(due < timer->due_ms)
+	{
+		timer->due_ms = due;
+		chiaki_cond_broadcast(&reactor->cond);
+	}
+	chiaki_mutex_unlock(&reactor->mutex);
+}
+
+static void *reactor_thread_func(void *user)
+{
+	ChiakiReactor *reactor = user;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&reactor->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(!reactor->should_stop)
+	{
+		ChiakiReactorTimer *next = NULL;
+		for(ChiakiReactorTimer *t = reactor->timers; t; t = t->next)
+		{
+			if(!next || t->due_ms < next->due_ms)
+				next = t;
+		}
+
+		if(!next || next->due_ms == CHIAKI_REACTOR_TIMER_IDLE)
+		{
+			chiaki_cond_wait(&reactor->cond, &reactor->mutex);
+			continue;
+		}
+
+		uint64_t now = chiaki_time_now_monotonic_ms();
+		if(next->due_ms > now)
+		{
+			chiaki_cond_timedwait(&reactor->cond, &reactor->mutex, next->due_ms - now);
+			continue;
+		}
+
+		// schedule calls during the callback can only move due_ms earlier from here
+		next->due_ms = CHIAKI_REACTOR_TIMER_IDLE;
+		reactor->running = next;
+		chiaki_mutex_unlock(&reactor->mutex);
+		uint64_t delay_ms = next->cb(next->user);
+		chiaki_mutex_lock(&reactor->mutex);
+		reactor->running = NULL;
+
+		uint64_t due = due_after(delay_ms);
+		if(due < next->due_ms)
+			next->due_ms = due;
+
+		// wake up anyone waiting in chiaki_reactor_timer_remove()
+		chiaki_cond_broadcast(&reactor->cond);
+	}
+
+	chiaki_mutex_unlock(&reactor->mutex);
+	return NULL;
+}
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/recvtiming.h>
+#include <chiaki/takion.h>
+
+#include <string.h>
+
+#define RECV_TIMING_JITTER_GAIN (1.0 / 16.0) // same as RFC 3550
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recv_timing_init(ChiakiRecvTiming *timing)
+{
+	memset(&timing->stats, 0, sizeof(timing->stats));
+	timing->queue_delay_sum_us = 0;
+	timing->frame_spread_sum_us = 0;
+	timing->frame_arrival_prev_us = 0;
+	timing->frame_interarrival_prev_us = -1;
+	return chiaki_mutex_init(&timing->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_recv_timing_fini(ChiakiRecvTiming *timing)
+{
+	chiaki_mutex_fini(&timing->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recv_timing_push_packet(ChiakiRecvTiming *timing, const ChiakiTakionRecvTime *recv_time)
+{
+	chiaki_mutex_lock(&timing->mutex);
+	timing->stats.packets++;
+	if(recv_time->kernel)
+	{
+		uint64_t delay = recv_time->read_us - recv_time->arrival_us;
+		timing->stats.packets_kernel++;
+		timing->queue_delay_sum_us += delay;
+		if(delay > timing->stats.queue_delay_max_us)
+			timing->stats.queue_delay_max_us = delay;
+	}
+	chiaki_mutex_unlock(&timing->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recv_timing_push_frame(ChiakiRecvTiming *timing, uint64_t first_arrival_us, uint64_t last_arrival_us)
+{
+	chiaki_mutex_lock(&timing->mutex);
+	uint64_t spread = last_arrival_us > first_arrival_us ? last_arrival_us - first_arrival_us : 0;
+	timing->stats.frames++;
+	timing->frame_spread_sum_us += spread;
+	if(spread > timing->stats.frame_spread_max_us)
+		timing->stats.frame_spread_max_us = spread;
+
+	if(timing->frame_arrival_prev_us && first_arrival_us >= timing->frame_arrival_prev_us)
+	{
+		int64_t interarrival = (int64_t)(first_arrival_us - timing->frame_arrival_prev_us);
+		if(timing->frame_interarrival_prev_us >= 0)
+		{
+			int64_t d = interarrival - timing->frame_interarrival_prev_us;
+			if(d < 0)
+				d = -d;
+			timing->stats.jitter_us += ((double)d - timing->stats.jitter_us) * RECV_TIMING_JITTER_GAIN;
+		}
+		timing->frame_interarrival_prev_us = interarrival;
+	}
+	timing->frame_arrival_prev_us = first_arrival_us;
+	chiaki_mutex_unlock(&timing->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recv_timing_get(ChiakiRecvTiming *timing, ChiakiRecvTimingStats *stats, bool reset)
+{
+	chiaki_mutex_lock(&timing->mutex);
+	*stats = timing->stats;
+	stats->queue_delay_avg_us = stats->packets_kernel ? timing->queue_delay_sum_us / stats->packets_kernel : 0;
+	stats->frame_spread_avg_us = stats->frames ? timing->frame_spread_sum_us / stats->frames : 0;
+	if(reset)
+	{
+		double jitter_us = timing->stats.jitter_us;
+		memset(&timing->stats, 0, sizeof(timing->stats));
+		timing->stats.jitter_us = jitter_us;
+		timing->queue_delay_sum_us = 0;
+		timing->frame_spread_sum_us = 0;
+	}
+	chiaki_mutex_unlock(&timing->mutex);
+}
@@ -150,6 +150,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	else
 		takion_info.close_socket = false;
 	takion_info.ip_dontfrag = true;
+	takion_info.reactor = NULL;
+	takion_info.enable_recv_timestamps = false;
+	takion_info.rcvbuf_bitrate = 0;
+	takion_info.packet_stats = NULL;
+	takion_info.send_coalesce_ms = 0; // would distort the measured rtt
+	takion_info.rtt_initial_us = 0;
 
 	takion_info.enable_crypt = false;
 	takion_info.enable_dualsense = session->connect_info.enable_dualsense;
@@ -181,6 +181,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	memset(session, 0, sizeof(ChiakiSession));
 
 	session->log = log;
+	session->metrics = connect_info->metrics;
 	session->quit_reason = CHIAKI_QUIT_REASON_NONE;
 	session->target = connect_info->ps5 ? CHIAKI_TARGET_PS5_1 : CHIAKI_TARGET_PS4_10;
 	session->holepunch_session = connect_info->holepunch_session;
@@ -198,6 +199,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_mutex;
 
+	session->reactor_enabled = connect_info->single_reactor;
+	if(session->reactor_enabled)
+	{
+		err = chiaki_reactor_init(&session->reactor);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_stop_pipe;
+	}
+
 	chiaki_mutex_lock(&session->state_mutex);
 	session->should_stop = false;
 	session->ctrl_session_id_received = false;
@@ -209,11 +218,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->login_pin_size = 0;
 	chiaki_mutex_unlock(&session->state_mutex);
 
+	err = chiaki_frame_tracer_init(&session->frame_tracer, session->log, session->metrics, connect_info->frame_trace_path);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_reactor;
+
 	err = chiaki_ctrl_init(&session->ctrl, session);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "Ctrl init failed");
-		goto error_stop_pipe;
+		goto error_frame_tracer;
 	}
 
 	err = chiaki_stream_connection_init(&session->stream_connection, session, connect_info->packet_loss_max);
@@ -261,11 +274,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
 	session->connect_info.enable_dualsense = connect_info->enable_dualsense;
+	session->connect_info.enable_recv_timestamps = connect_info->enable_recv_timestamps;
+	session->connect_info.send_coalesce_ms = connect_info->send_coalesce_ms;
 
 	return CHIAKI_ERR_SUCCESS;
 
 error_ctrl:
 	chiaki_ctrl_fini(&session->ctrl);
+error_frame_tracer:
+	chiaki_frame_tracer_fini(&session->frame_tracer);
+error_reactor:
+	if(session->reactor_enabled)
+		chiaki_reactor_fini(&session->reactor);
 error_stop_pipe:
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 error_state_mutex:
@@ -289,10 +309,13 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 	chiaki_mutex_unlock(&session->state_mutex);
 	chiaki_stream_connection_fini(&session->stream_connection);
 	chiaki_ctrl_fini(&session->ctrl);
+	chiaki_frame_tracer_fini(&session->frame_tracer);
 	if(session->rudp)
 		chiaki_rudp_fini(session->rudp);
 	if(session->holepunch_session)
 		chiaki_holepunch_session_fini(session->holepunch_session);
+	if(session->reactor_enabled)
+		chiaki_reactor_fini(&session->reactor);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
@@ -612,7 +635,10 @@ ctrl_failed:
 	chiaki_senkusha_fini(&senkusha);
 
 	if(err == CHIAKI_ERR_SUCCESS)
+	{
 		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
+		session->rtt_measured = true;
+	}
 	else if(err == CHIAKI_ERR_CANCELED)
 		QUIT(quit_ctrl);
 	else
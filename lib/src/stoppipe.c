@@ -13,6 +13,12 @@
 #include <sys/select.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <limits.h>
+#endif
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
@@ -44,6 +50,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 		close(stop_pipe->fd);
 		return CHIAKI_ERR_UNKNOWN;
 	}
+#elif defined(__linux__)
+	stop_pipe->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(stop_pipe->fd < 0)
+		return CHIAKI_ERR_UNKNOWN;
 #else
 	int r = pipe(stop_pipe->fds);
 	if(r < 0)
@@ -63,7 +73,7 @@ CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
 	WSACloseEvent(stop_pipe->event);
-#elif defined(__SWITCH__)
+#elif defined(__SWITCH__) || defined(__linux__)
 	close(stop_pipe->fd);
 #else
 	close(stop_pipe->fds[0]);
@@ -79,6 +89,9 @@ CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe)
 	// send to local socket (FIXME MSG_CONFIRM)
 	sendto(stop_pipe->fd, "\x00", 1, 0,
 		(struct sockaddr*)&stop_pipe->addr, sizeof(struct sockaddr_in));
+#elif defined(__linux__)
+	uint64_t v = 1;
+	write(stop_pipe->fd, &v, sizeof(v));
 #else
 	write(stop_pipe->fds[1], "\x00", 1);
 #endif
@@ -116,6 +129,39 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *sto
 		default:
 			return CHIAKI_ERR_UNKNOWN;
 	}
+#elif defined(__linux__)
+	// poll() instead of select(), no fd_set to rebuild and no FD_SETSIZE limit
+	struct pollfd pfds[2];
+	nfds_t nfds = 1;
+	pfds[0].fd = stop_pipe->fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	if(!CHIAKI_SOCKET_IS_INVALID(fd))
+	{
+		pfds[1].fd = fd;
+		pfds[1].events = write ? POLLOUT : POLLIN;
+		pfds[1].revents = 0;
+		nfds = 2;
+	}
+
+	int timeout = timeout_ms == UINT64_MAX ? -1 : (timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms);
+	int r;
+	do
+	{
+		r = poll(pfds, nfds, timeout);
+	} while(r < 0 && errno == EINTR);
+
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+
+	if(pfds[0].revents & POLLIN)
+		return CHIAKI_ERR_CANCELED;
+
+	// errors and hangups are reported as ready so the following recv/send picks them up, like select() does
+	if(nfds == 2 && pfds[1].revents)
+		return CHIAKI_ERR_SUCCESS;
+
+	return CHIAKI_ERR_TIMEOUT;
 #else
 	fd_set rfds;
 	FD_ZERO(&rfds);
@@ -259,11 +305,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe)
 	uint8_t v;
 	int r;
 	while((r = read(stop_pipe->fd, &v, sizeof(v))) > 0);
-	return r < 0 ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+	return r < 0 && errno != EAGAIN ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+#elif defined(__linux__)
+	uint64_t v;
+	if(read(stop_pipe->fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
 #else
 	uint8_t v;
 	int r;
 	while((r = read(stop_pipe->fds[0], &v, sizeof(v))) > 0);
-	return r < 0 ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+	return r < 0 && errno != EAGAIN ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
 #endif
 }
@@ -8,6 +8,7 @@
 #include <chiaki/base64.h>
 #include <chiaki/audio.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <inttypes.h>
@@ -56,6 +57,8 @@ static ChiakiErrorCode stream_connection_enable_microphone(ChiakiStreamConnectio
 static ChiakiErrorCode stream_connection_send_disconnect(ChiakiStreamConnection *stream_connection);
 static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
 static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
+static void stream_connection_metrics_collect(ChiakiMetrics *metrics, void *user);
+static void stream_connection_crypt_metrics_collect(ChiakiMetrics *metrics, void *user);
 static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode stream_connection_send_streaminfo_ack(ChiakiStreamConnection *stream_connection);
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet);
@@ -84,13 +87,57 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
 
+	err = chiaki_recv_timing_init(&stream_connection->video_recv_timing);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_packet_stats;
+
+	err = chiaki_recv_timing_init(&stream_connection->audio_recv_timing);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_video_recv_timing;
+
+	err = chiaki_stream_stats_history_init(&stream_connection->video_stats_history);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_audio_recv_timing;
+
+	err = chiaki_congestion_control_init(&stream_connection->congestion_control, packet_loss_max);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_video_stats_history;
+
 	stream_connection->video_receiver = NULL;
 	stream_connection->audio_receiver = NULL;
 	stream_connection->haptics_receiver = NULL;
 
 	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_packet_stats;
+		goto error_congestion_control;
+
+	ChiakiMetrics *metrics = session->metrics;
+	stream_connection->metrics.packets_received = chiaki_metrics_counter(metrics, "chiaki_packets_received_total", "Received stream packets");
+	stream_connection->metrics.packets_lost = chiaki_metrics_counter(metrics, "chiaki_packets_lost_total", "Stream packets lost on the network");
+	stream_connection->metrics.packets_local_dropped = chiaki_metrics_counter(metrics, "chiaki_packets_local_dropped_total", "Stream packets dropped locally");
+	stream_connection->metrics.packet_loss = chiaki_metrics_gauge(metrics, "chiaki_congestion_packet_loss", "Packet loss of the last congestion control interval");
+	stream_connection->metrics.congestion_state = chiaki_metrics_gauge(metrics, "chiaki_congestion_state", "Delay gradient state, 0 normal, 1 underuse, 2 overuse");
+	stream_connection->metrics.video_bitrate = chiaki_metrics_gauge(metrics, "chiaki_video_bitrate_bps", "Video bitrate of the last completed second");
+	stream_connection->metrics.video_bitrate_ewma = chiaki_metrics_gauge(metrics, "chiaki_video_bitrate_ewma_bps", "Moving average of the video bitrate over completed seconds");
+	stream_connection->metrics.video_bitrate_p95 = chiaki_metrics_gauge(metrics, "chiaki_video_bitrate_p95_bps", "95th percentile of the video bitrate over the last minute");
+	stream_connection->metrics.video_fps_ewma = chiaki_metrics_gauge(metrics, "chiaki_video_fps_ewma", "Moving average of assembled video frames per second");
+	stream_connection->metrics.video_frame_size_max_p95 = chiaki_metrics_gauge(metrics, "chiaki_video_frame_size_max_p95_bytes", "95th percentile of the largest video frame of each second over the last minute");
+	stream_connection->metrics.video_keyframe_size_ewma = chiaki_metrics_gauge(metrics, "chiaki_video_keyframe_size_ewma_bytes", "Moving average of the video keyframe size");
+	stream_connection->metrics.video_jitter = chiaki_metrics_gauge(metrics, "chiaki_video_jitter_us", "Interarrival jitter of video frames");
+	stream_connection->metrics.audio_jitter = chiaki_metrics_gauge(metrics, "chiaki_audio_jitter_us", "Interarrival jitter of audio frames");
+	stream_connection->metrics.key_buf_hits = chiaki_metrics_counter(metrics, "chiaki_crypt_key_buf_hits_total", "Remote key stream requests served from the key buffer");
+	stream_connection->metrics.key_buf_misses_ahead = chiaki_metrics_counter(metrics, "chiaki_crypt_key_buf_misses_ahead_total", "Remote key stream requests beyond the key buffer, generated on the receiving thread");
+	stream_connection->metrics.key_buf_misses_late = chiaki_metrics_counter(metrics, "chiaki_crypt_key_buf_misses_late_total", "Remote key stream requests for key stream already dropped from the key buffer");
+	stream_connection->metrics.key_buf_skips = chiaki_metrics_counter(metrics, "chiaki_crypt_key_buf_skips_total", "Times the key buffer thread skipped ahead to the requested key pos");
+	stream_connection->metrics.key_buf_resizes = chiaki_metrics_counter(metrics, "chiaki_crypt_key_buf_resizes_total", "Resizes of the remote key buffer");
+	stream_connection->metrics.key_buf_size = chiaki_metrics_gauge(metrics, "chiaki_crypt_key_buf_bytes", "Current size of the remote key buffer");
+	stream_connection->metrics.key_pos_rate = chiaki_metrics_gauge(metrics, "chiaki_crypt_key_pos_rate_bytes", "Smoothed velocity of the remote key pos per second");
+	if(metrics)
+	{
+		err = chiaki_metrics_collector_add(metrics, stream_connection_metrics_collect, stream_connection);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_feedback_sender_mutex;
+	}
 
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
@@ -101,6 +148,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_feedback_sender_mutex:
+	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
+error_congestion_control:
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
+error_video_stats_history:
+	chiaki_stream_stats_history_fini(&stream_connection->video_stats_history);
+error_audio_recv_timing:
+	chiaki_recv_timing_fini(&stream_connection->audio_recv_timing);
+error_video_recv_timing:
+	chiaki_recv_timing_fini(&stream_connection->video_recv_timing);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -113,6 +170,12 @@ error:
 
 CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_connection)
 {
+	if(stream_connection->session->metrics)
+	{
+		chiaki_metrics_collector_remove(stream_connection->session->metrics, stream_connection_metrics_collect, stream_connection);
+		chiaki_metrics_collector_remove(stream_connection->session->metrics, stream_connection_crypt_metrics_collect, stream_connection);
+	}
+
 	free(stream_connection->remote_disconnect_reason);
 
 	chiaki_gkcrypt_free(stream_connection->gkcrypt_remote);
@@ -121,7 +184,11 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	free(stream_connection->ecdh_secret);
 	if (stream_connection->congestion_control.thread.thread)
 		chiaki_congestion_control_stop(&stream_connection->congestion_control);
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
+	chiaki_stream_stats_history_fini(&stream_connection->video_stats_history);
 
+	chiaki_recv_timing_fini(&stream_connection->audio_recv_timing);
+	chiaki_recv_timing_fini(&stream_connection->video_recv_timing);
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
@@ -130,6 +197,83 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	chiaki_mutex_fini(&stream_connection->state_mutex);
 }
 
+static void stream_connection_metrics_collect(ChiakiMetrics *metrics, void *user)
+{
+	(void)metrics;
+	ChiakiStreamConnection *stream_connection = user;
+
+	ChiakiPacketStatsSnapshot packet_stats;
+	chiaki_packet_stats_snapshot(&stream_connection->packet_stats, &packet_stats);
+	chiaki_metric_set(stream_connection->metrics.packets_received, (double)packet_stats.received);
+	chiaki_metric_set(stream_connection->metrics.packets_lost, (double)packet_stats.lost);
+	chiaki_metric_set(stream_connection->metrics.packets_local_dropped, (double)packet_stats.local_dropped);
+
+	ChiakiCongestionControl *control = &stream_connection->congestion_control;
+	chiaki_metric_set(stream_connection->metrics.packet_loss, control->packet_loss);
+	chiaki_mutex_lock(&control->controller_mutex);
+	ChiakiDelayGradientState state = control->delay_gradient.state;
+	chiaki_mutex_unlock(&control->controller_mutex);
+	chiaki_metric_set(stream_connection->metrics.congestion_state, (double)state);
+
+	ChiakiStreamStatsHistory *history = &stream_connection->video_stats_history;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	ChiakiStreamStatsSample sample;
+	if(chiaki_stream_stats_history_samples(history, now_us, &sample, 1))
+		chiaki_metric_set(stream_connection->metrics.video_bitrate, (double)sample.bytes * 8.0);
+	double value;
+	if(chiaki_stream_stats_history_ewma(history, now_us, CHIAKI_STREAM_STATS_METRIC_BITRATE, &value))
+		chiaki_metric_set(stream_connection->metrics.video_bitrate_ewma, value);
+	if(chiaki_stream_stats_history_percentile(history, now_us, CHIAKI_STREAM_STATS_METRIC_BITRATE, 95.0, &value))
+		chiaki_metric_set(stream_connection->metrics.video_bitrate_p95, value);
+	if(chiaki_stream_stats_history_ewma(history, now_us, CHIAKI_STREAM_STATS_METRIC_FRAMES, &value))
+		chiaki_metric_set(stream_connection->metrics.video_fps_ewma, value);
+	if(chiaki_stream_stats_history_percentile(history, now_us, CHIAKI_STREAM_STATS_METRIC_FRAME_SIZE_MAX, 95.0, &value))
+		chiaki_metric_set(stream_connection->metrics.video_frame_size_max_p95, value);
+	if(chiaki_stream_stats_history_ewma(history, now_us, CHIAKI_STREAM_STATS_METRIC_KEYFRAME_SIZE, &value))
+		chiaki_metric_set(stream_connection->metrics.video_keyframe_size_ewma, value);
+
+	ChiakiRecvTimingStats timing;
+	chiaki_recv_timing_get(&stream_connection->video_recv_timing, &timing, false);
+	chiaki_metric_set(stream_connection->metrics.video_jitter, timing.jitter_us);
+	chiaki_recv_timing_get(&stream_connection->audio_recv_timing, &timing, false);
+	chiaki_metric_set(stream_connection->metrics.audio_jitter, timing.jitter_us);
+}
+
+/**
+ * Only added once gkcrypt_remote exists, so it can be read without the state mutex,
+ * which is held while registering metrics, e.g. by the video receiver on stream info.
+ */
+static void stream_connection_crypt_metrics_collect(ChiakiMetrics *metrics, void *user)
+{
+	(void)metrics;
+	ChiakiStreamConnection *stream_connection = user;
+
+	ChiakiGKCryptStats crypt_stats;
+	chiaki_gkcrypt_get_stats(stream_connection->gkcrypt_remote, &crypt_stats);
+	chiaki_metric_set(stream_connection->metrics.key_buf_hits, (double)crypt_stats.key_buf_hits);
+	chiaki_metric_set(stream_connection->metrics.key_buf_misses_ahead, (double)crypt_stats.key_buf_misses_ahead);
+	chiaki_metric_set(stream_connection->metrics.key_buf_misses_late, (double)crypt_stats.key_buf_misses_late);
+	chiaki_metric_set(stream_connection->metrics.key_buf_skips, (double)crypt_stats.key_buf_skips);
+	chiaki_metric_set(stream_connection->metrics.key_buf_resizes, (double)crypt_stats.key_buf_resizes);
+	chiaki_metric_set(stream_connection->metrics.key_buf_size, (double)crypt_stats.key_buf_size);
+	chiaki_metric_set(stream_connection->metrics.key_pos_rate, (double)crypt_stats.key_pos_rate);
+}
+
+static void stream_connection_heartbeat(ChiakiStreamConnection *stream_connection)
+{
+	ChiakiErrorCode err = stream_connection_send_heartbeat(stream_connection);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
+	else
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
+}
+
+static uint64_t stream_connection_heartbeat_timer_cb(void *user)
+{
+	stream_connection_heartbeat(user);
+	return HEARTBEAT_INTERVAL_MS;
+}
+
 static bool state_finished_cond_check(void *user)
 {
 	ChiakiStreamConnection *stream_connection = user;
@@ -162,6 +306,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
+	takion_info.reactor = session->reactor_enabled ? &session->reactor : NULL;
+	takion_info.enable_recv_timestamps = session->connect_info.enable_recv_timestamps;
+	takion_info.rcvbuf_bitrate = session->connect_info.video_profile.bitrate;
+	takion_info.packet_stats = &stream_connection->packet_stats;
+	takion_info.send_coalesce_ms = session->connect_info.send_coalesce_ms;
+	takion_info.rtt_initial_us = session->rtt_measured ? session->rtt_us : 0;
 
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
@@ -212,7 +362,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_video_receiver;
 	}
 
-	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats, stream_connection->packet_loss_max);
+	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats,
+			session->connect_info.video_profile.max_fps);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to start Congestion Control");
@@ -221,7 +372,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
-	CHECK_STOP(close_takion);
+	CHECK_STOP(err_congestion_control);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection Takion connect failed");
@@ -299,17 +450,23 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
-	while(true)
+	ChiakiReactor *reactor = stream_connection->takion.reactor;
+	if(reactor && chiaki_reactor_timer_add(reactor, &stream_connection->heartbeat_timer, stream_connection_heartbeat_timer_cb, stream_connection, HEARTBEAT_INTERVAL_MS) == CHIAKI_ERR_SUCCESS)
 	{
-		err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, HEARTBEAT_INTERVAL_MS, state_finished_cond_check, stream_connection);
-		if(err != CHIAKI_ERR_TIMEOUT)
-			break;
+		err = chiaki_cond_wait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, state_finished_cond_check, stream_connection);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		chiaki_reactor_timer_remove(reactor, &stream_connection->heartbeat_timer);
+	}
+	else
+	{
+		while(true)
+		{
+			err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, HEARTBEAT_INTERVAL_MS, state_finished_cond_check, stream_connection);
+			if(err != CHIAKI_ERR_TIMEOUT)
+				break;
 
-		err = stream_connection_send_heartbeat(stream_connection);
-		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
-		else
-			CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
+			stream_connection_heartbeat(stream_connection);
+		}
 	}
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
@@ -612,9 +769,57 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 			 q.target_bitrate, q.upstream_bitrate,
 			 q.upstream_loss,
 			 q.disable_upstream_audio, q.rtt, q.loss);
-		stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_connection->video_receiver->frame_processor.stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
+		ChiakiStreamStats stream_stats;
+		chiaki_video_receiver_stream_stats(stream_connection->video_receiver, &stream_stats, true);
+		// prefer the bits actually received in the last second over an average assuming a fixed framerate
+		ChiakiStreamStatsSample stats_sample;
+		if(chiaki_stream_stats_history_samples(&stream_connection->video_stats_history, chiaki_time_now_monotonic_us(), &stats_sample, 1))
+			stream_connection->measured_bitrate = stats_sample.bytes * 8 / 1000000.0;
+		else
+			stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
 		CHIAKI_LOGV(stream_connection->log, "StreamConnection measured bitrate: %.4f MBit/s", stream_connection->measured_bitrate);
-		chiaki_stream_stats_reset(&stream_connection->video_receiver->frame_processor.stream_stats);
+		ChiakiVideoReceiverQueueStats queue_stats;
+		chiaki_video_receiver_queue_stats(stream_connection->video_receiver, &queue_stats);
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection video assembly queue: depth=%llu max=%llu, %llu frames queued, %llu dropped",
+			(unsigned long long)queue_stats.depth, (unsigned long long)queue_stats.depth_max,
+			(unsigned long long)queue_stats.frames_queued, (unsigned long long)queue_stats.frames_dropped);
+		ChiakiVideoReceiverWindowStats window_stats;
+		chiaki_video_receiver_window_stats(stream_connection->video_receiver, &window_stats);
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection video reorder window: %llu frames rescued, %llu incomplete, %llu late packets",
+			(unsigned long long)window_stats.frames_rescued, (unsigned long long)window_stats.frames_incomplete,
+			(unsigned long long)window_stats.packets_late);
+		ChiakiPacketStatsSnapshot packet_stats;
+		chiaki_packet_stats_snapshot(&stream_connection->packet_stats, &packet_stats);
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection packet loss bursts of 1/2+/4+/8+/16+/32+/64+/128+ packets: "
+			"%llu/%llu/%llu/%llu/%llu/%llu/%llu/%llu, frames by lost packets 0/<=1/<=2/<=5/<=10/<=20/<=50/<=100%%: "
+			"%llu/%llu/%llu/%llu/%llu/%llu/%llu/%llu",
+			(unsigned long long)packet_stats.loss_bursts[0], (unsigned long long)packet_stats.loss_bursts[1],
+			(unsigned long long)packet_stats.loss_bursts[2], (unsigned long long)packet_stats.loss_bursts[3],
+			(unsigned long long)packet_stats.loss_bursts[4], (unsigned long long)packet_stats.loss_bursts[5],
+			(unsigned long long)packet_stats.loss_bursts[6], (unsigned long long)packet_stats.loss_bursts[7],
+			(unsigned long long)packet_stats.frame_loss[0], (unsigned long long)packet_stats.frame_loss[1],
+			(unsigned long long)packet_stats.frame_loss[2], (unsigned long long)packet_stats.frame_loss[3],
+			(unsigned long long)packet_stats.frame_loss[4], (unsigned long long)packet_stats.frame_loss[5],
+			(unsigned long long)packet_stats.frame_loss[6], (unsigned long long)packet_stats.frame_loss[7]);
+		ChiakiRecvTimingStats timing;
+		chiaki_recv_timing_get(&stream_connection->video_recv_timing, &timing, false);
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection video receive timing: jitter=%.0fus, "
+			"frame spread avg=%lluus max=%lluus, queueing delay avg=%lluus max=%lluus (%llu/%llu packets with kernel timestamps)",
+			timing.jitter_us,
+			(unsigned long long)timing.frame_spread_avg_us, (unsigned long long)timing.frame_spread_max_us,
+			(unsigned long long)timing.queue_delay_avg_us, (unsigned long long)timing.queue_delay_max_us,
+			(unsigned long long)timing.packets_kernel, (unsigned long long)timing.packets);
+		if(stream_connection->gkcrypt_remote)
+		{
+			ChiakiGKCryptStats crypt_stats;
+			chiaki_gkcrypt_get_stats(stream_connection->gkcrypt_remote, &crypt_stats);
+			CHIAKI_LOGV(stream_connection->log, "StreamConnection remote key stream: buffer %llu KiB at %llu KiB/s, "
+				"hits=%llu, misses ahead=%llu, misses late=%llu, skips=%llu, resizes=%llu",
+				(unsigned long long)(crypt_stats.key_buf_size / 1024), (unsigned long long)(crypt_stats.key_pos_rate / 1024),
+				(unsigned long long)crypt_stats.key_buf_hits, (unsigned long long)crypt_stats.key_buf_misses_ahead,
+				(unsigned long long)crypt_stats.key_buf_misses_late, (unsigned long long)crypt_stats.key_buf_skips,
+				(unsigned long long)crypt_stats.key_buf_resizes);
+		}
 		break;
 	}
 	case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
@@ -650,6 +855,9 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 
 	chiaki_takion_set_crypt(&stream_connection->takion, stream_connection->gkcrypt_local, stream_connection->gkcrypt_remote);
 
+	if(session->metrics && chiaki_metrics_collector_add(session->metrics, stream_connection_crypt_metrics_collect, stream_connection) != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGW(stream_connection->log, "StreamConnection failed to add GKCrypt metrics collector");
+
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -1132,11 +1340,17 @@ static ChiakiErrorCode stream_connection_send_disconnect(ChiakiStreamConnection
 
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet)
 {
-	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
-
 	if(packet->is_video)
+	{
+		// decrypted by the frame processor straight into the frame, only if the unit is actually used
+		packet->gkcrypt = stream_connection->gkcrypt_remote;
 		chiaki_video_receiver_av_packet(stream_connection->video_receiver, packet);
-	else if(packet->is_haptics)
+		return;
+	}
+
+	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
+
+	if(packet->is_haptics)
 	    chiaki_audio_receiver_av_packet(stream_connection->haptics_receiver, packet);
 	else
 		chiaki_audio_receiver_av_packet(stream_connection->audio_receiver, packet);
@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/streamstats.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define STREAM_STATS_SECOND_US 1000000
+#define STREAM_STATS_EWMA_GAIN 0.25
+
+CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats)
+{
+	stats->frames = 0;
+	stats->bytes = 0;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size)
+{
+	stats->frames++;
+	stats->bytes += size;
+	//float br = (float)chiaki_stream_stats_bitrate(stats, 60) / 1000000.0f;
+	//CHIAKI_LOGD(NULL, "bitrate: %f", br);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate)
+{
+	if (stats->frames == 0)
+		return 0;
+	return (stats->bytes * 8 * framerate) / stats->frames;
+}
+
+/**
+ * @return false if metric has no value for sample
+ */
+static bool sample_metric(const ChiakiStreamStatsSample *sample, ChiakiStreamStatsMetric metric, double *value)
+{
+	switch(metric)
+	{
+		case CHIAKI_STREAM_STATS_METRIC_BITRATE:
+			*value = (double)sample->bytes * 8.0;
+			return true;
+		case CHIAKI_STREAM_STATS_METRIC_FRAMES:
+			*value = (double)sample->frames;
+			return true;
+		case CHIAKI_STREAM_STATS_METRIC_FRAME_SIZE_MAX:
+			*value = (double)sample->frame_size_max;
+			return true;
+		case CHIAKI_STREAM_STATS_METRIC_KEYFRAME_SIZE:
+			if(!sample->keyframes)
+				return false;
+			*value = (double)sample->keyframe_bytes / sample->keyframes;
+			return true;
+		case CHIAKI_STREAM_STATS_METRIC_FRAMES_FEC_RECOVERED:
+			*value = (double)sample->frames_fec_recovered;
+			return true;
+		case CHIAKI_STREAM_STATS_METRIC_FRAMES_FAILED:
+			*value = (double)sample->frames_failed;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void history_complete_sample(ChiakiStreamStatsHistory *history, const ChiakiStreamStatsSample *sample)
+{
+	history->samples[history->samples_next] = *sample;
+	history->samples_next = (history->samples_next + 1) % CHIAKI_STREAM_STATS_HISTORY_SECONDS;
+	if(history->samples_count < CHIAKI_STREAM_STATS_HISTORY_SECONDS)
+		history->samples_count++;
+
+	for(size_t i=0; i<CHIAKI_STREAM_STATS_METRIC_COUNT; i++)
+	{
+		double v;
+		if(!sample_metric(sample, (ChiakiStreamStatsMetric)i, &v))
+			continue;
+		if(history->ewma_valid[i])
+			history->ewma[i] += (v - history->ewma[i]) * STREAM_STATS_EWMA_GAIN;
+		else
+			history->ewma[i] = v;
+		history->ewma_valid[i] = true;
+	}
+}
+
+/**
+ * Complete all seconds before now_us, call with mutex locked
+ */
+static void history_advance(ChiakiStreamStatsHistory *history, uint64_t now_us)
+{
+	if(!history->cur.start_us || now_us < history->cur.start_us + STREAM_STATS_SECOND_US)
+		return;
+
+	history_complete_sample(history, &history->cur);
+	uint64_t start_us = history->cur.start_us + STREAM_STATS_SECOND_US;
+
+	// seconds without any frames, more than fit into the ring would be overwritten anyway
+	uint64_t empty = (now_us - start_us) / STREAM_STATS_SECOND_US;
+	if(empty > CHIAKI_STREAM_STATS_HISTORY_SECONDS)
+	{
+		start_us += (empty - CHIAKI_STREAM_STATS_HISTORY_SECONDS) * STREAM_STATS_SECOND_US;
+		empty = CHIAKI_STREAM_STATS_HISTORY_SECONDS;
+	}
+	memset(&history->cur, 0, sizeof(history->cur));
+	for(uint64_t i=0; i<empty; i++)
+	{
+		history->cur.start_us = start_us;
+		history_complete_sample(history, &history->cur);
+		start_us += STREAM_STATS_SECOND_US;
+	}
+	history->cur.start_us = start_us;
+}
+
+/**
+ * Advance and get the second in progress, starting the first one if necessary, call with mutex locked
+ */
+static ChiakiStreamStatsSample *history_cur(ChiakiStreamStatsHistory *history, uint64_t now_us)
+{
+	if(!history->cur.start_us)
+		history->cur.start_us = now_us ? now_us : 1;
+	history_advance(history, now_us);
+	return &history->cur;
+}
+
+static void history_clear(ChiakiStreamStatsHistory *history)
+{
+	history->samples_count = 0;
+	history->samples_next = 0;
+	memset(&history->cur, 0, sizeof(history->cur));
+	for(size_t i=0; i<CHIAKI_STREAM_STATS_METRIC_COUNT; i++)
+	{
+		history->ewma[i] = 0.0;
+		history->ewma_valid[i] = false;
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_stats_history_init(ChiakiStreamStatsHistory *history)
+{
+	history_clear(history);
+	return chiaki_mutex_init(&history->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_history_fini(ChiakiStreamStatsHistory *history)
+{
+	chiaki_mutex_fini(&history->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_history_reset(ChiakiStreamStatsHistory *history)
+{
+	chiaki_mutex_lock(&history->mutex);
+	history_clear(history);
+	chiaki_mutex_unlock(&history->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_history_frame(ChiakiStreamStatsHistory *history, uint64_t now_us, uint64_t size, bool keyframe, bool fec_recovered)
+{
+	chiaki_mutex_lock(&history->mutex);
+	ChiakiStreamStatsSample *cur = history_cur(history, now_us);
+	cur->frames++;
+	cur->bytes += size;
+	if(size > cur->frame_size_max)
+		cur->frame_size_max = size;
+	if(keyframe)
+	{
+		cur->keyframes++;
+		cur->keyframe_bytes += size;
+	}
+	if(fec_recovered)
+		cur->frames_fec_recovered++;
+	chiaki_mutex_unlock(&history->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_history_frame_failed(ChiakiStreamStatsHistory *history, uint64_t now_us)
+{
+	chiaki_mutex_lock(&history->mutex);
+	history_cur(history, now_us)->frames_failed++;
+	chiaki_mutex_unlock(&history->mutex);
+}
+
+CHIAKI_EXPORT size_t chiaki_stream_stats_history_samples(ChiakiStreamStatsHistory *history, uint64_t now_us, ChiakiStreamStatsSample *samples, size_t samples_max)
+{
+	chiaki_mutex_lock(&history->mutex);
+	history_advance(history, now_us);
+	size_t count = history->samples_count < samples_max ? history->samples_count : samples_max;
+	size_t first = (history->samples_next + CHIAKI_STREAM_STATS_HISTORY_SECONDS - count) % CHIAKI_STREAM_STATS_HISTORY_SECONDS;
+	for(size_t i=0; i<count; i++)
+		samples[i] = history->samples[(first + i) % CHIAKI_STREAM_STATS_HISTORY_SECONDS];
+	chiaki_mutex_unlock(&history->mutex);
+	return count;
+}
+
+CHIAKI_EXPORT bool chiaki_stream_stats_history_ewma(ChiakiStreamStatsHistory *history, uint64_t now_us, ChiakiStreamStatsMetric metric, double *value)
+{
+	if(metric >= CHIAKI_STREAM_STATS_METRIC_COUNT)
+		return false;
+	chiaki_mutex_lock(&history->mutex);
+	history_advance(history, now_us);
+	bool valid = history->ewma_valid[metric];
+	if(valid)
+		*value = history->ewma[metric];
+	chiaki_mutex_unlock(&history->mutex);
+	return valid;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+CHIAKI_EXPORT bool chiaki_stream_stats_history_percentile(ChiakiStreamStatsHistory *history, uint64_t now_us, ChiakiStreamStatsMetric metric, double percentile, double *value)
+{
+	double values[CHIAKI_STREAM_STATS_HISTORY_SECONDS];
+	size_t count = 0;
+
+	chiaki_mutex_lock(&history->mutex);
+	history_advance(history, now_us);
+	for(size_t i=0; i<history->samples_count; i++)
+	{
+		if(sample_metric(&history->samples[i], metric, &values[count]))
+			count++;
+	}
+	chiaki_mutex_unlock(&history->mutex);
+
+	if(!count)
+		return false;
+	qsort(values, count, sizeof(double), double_cmp);
+	if(percentile < 0.0)
+		percentile = 0.0;
+	else if(percentile > 100.0)
+		percentile = 100.0;
+	size_t rank = (size_t)ceil(percentile / 100.0 * count);
+	*value = values[rank ? rank - 1 : 0];
+	return true;
+}
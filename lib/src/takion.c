@@ -1,5 +1,9 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg
+#endif
+
 #include "chiaki/feedback.h"
 #include <chiaki/takion.h>
 #include <chiaki/congestioncontrol.h>
@@ -13,6 +17,7 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #ifdef __APPLE__
 #include <CoreServices/CoreServices.h>
@@ -30,12 +35,17 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <sys/socket.h>
+#include <time.h>
 #endif
 
 
 // VERY similar to SCTP, see RFC 4960
 
 #define TAKION_A_RWND 0x19000
+
+// how much of the stream the socket receive buffer should be able to hold while the receive thread is stalled
+#define TAKION_RCVBUF_BUFFERED_MS 250
+#define TAKION_RCVBUF_MAX (16 * 1024 * 1024)
 #define TAKION_OUTBOUND_STREAMS 0x64
 #define TAKION_INBOUND_STREAMS 0x64
 
@@ -50,6 +60,25 @@
 
 #define TAKION_EXPECT_TIMEOUT_MS 5000
 
+#define TAKION_RECV_BUF_SIZE 1500
+
+/**
+ * Size of a slot in the send queue, larger datagrams are sent on their own
+ */
+#define TAKION_SEND_SLOT_SIZE 1500
+
+/**
+ * Enough buffers for a full receive batch plus everything that may be held back
+ * in the reorder queue or as postponed packets, so the pool never runs dry in steady state.
+ */
+#define TAKION_PACKET_POOL_SIZE (CHIAKI_TAKION_RECV_BATCH_SIZE + (1 << TAKION_REORDER_QUEUE_SIZE_EXP) + TAKION_POSTPONE_PACKETS_SIZE)
+
+/**
+ * When the socket never runs dry, the stop pipe would never be looked at,
+ * so it is polled explicitly after this many consecutive full batches.
+ */
+#define TAKION_RECV_FULL_BATCHES_STOP_CHECK 8
+
 /**
  * Base type of Takion packets. Lower nibble of the first byte in datagrams.
  */
@@ -158,10 +187,34 @@ typedef struct chiaki_takion_postponed_packet_t
 {
 	uint8_t *buf;
 	size_t buf_size;
+	ChiakiTakionRecvTime recv_time;
 } ChiakiTakionPostponedPacket;
 
+/**
+ * Receive slots, backed by buffers from the Takion packet pool.
+ * Packets are borrowed from here while being handled and referenced if they must be kept,
+ * in which case the slot is refilled from the pool before the next batch.
+ */
+typedef struct takion_recv_batch_t
+{
+	uint8_t *bufs[CHIAKI_TAKION_RECV_BATCH_SIZE];
+	size_t sizes[CHIAKI_TAKION_RECV_BATCH_SIZE];
+	ChiakiTakionRecvTime times[CHIAKI_TAKION_RECV_BATCH_SIZE];
+	size_t count;
+	unsigned int full_batches;
+#ifdef __linux__
+	struct iovec iovecs[CHIAKI_TAKION_RECV_BATCH_SIZE];
+	struct mmsghdr msgs[CHIAKI_TAKION_RECV_BATCH_SIZE];
+	union
+	{
+		uint8_t buf[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))]; // SO_TIMESTAMPNS and SO_RXQ_OVFL
+		struct cmsghdr align;
+	} controls[CHIAKI_TAKION_RECV_BATCH_SIZE];
+#endif
+} TakionRecvBatch;
+
 static void *takion_thread_func(void *user);
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, const ChiakiTakionRecvTime *recv_time);
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
 static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
@@ -170,11 +223,21 @@ static ChiakiErrorCode takion_parse_message(ChiakiTakion *takion, uint8_t *buf,
 static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size);
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
+static ChiakiErrorCode takion_register_sock(ChiakiTakion *takion);
+static ChiakiErrorCode takion_set_rcvbuf(ChiakiTakion *takion, unsigned int bitrate);
+static void takion_enable_recv_overflow(ChiakiTakion *takion);
+static void takion_enable_recv_timestamps(ChiakiTakion *takion);
+static ChiakiErrorCode takion_wait_readable(ChiakiTakion *takion, uint64_t timeout_ms);
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv_batch_init(ChiakiTakion *takion, TakionRecvBatch *batch);
+static void takion_recv_batch_fini(TakionRecvBatch *batch);
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, TakionRecvBatch *batch);
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size, const ChiakiTakionRecvTime *recv_time);
 static ChiakiErrorCode takion_read_extra_sock_messages(ChiakiTakion *takion);
+static ChiakiErrorCode takion_send_queue_init(ChiakiTakion *takion, unsigned int coalesce_ms);
+static void takion_send_queue_fini(ChiakiTakion *takion);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info, chiaki_socket_t *sock)
 {
@@ -182,6 +245,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 
 	takion->log = info->log;
 	takion->close_socket = info->close_socket;
+	takion->reactor = info->reactor;
+	takion->recv_timestamps = false;
+	takion->recv_overflow = false;
+	takion->recv_overflow_count = 0;
+	takion->packet_stats = info->packet_stats;
+	takion->rtt_initial_us = info->rtt_initial_us;
 	takion->version = info->protocol_version;
 
 	switch(takion->version)
@@ -217,6 +286,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_gkcrypt_local_mutex;
 	takion->tag_remote = 0;
 
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+	ret = chiaki_mutex_init(&takion->recv_stats_mutex, false);
+	if(ret != CHIAKI_ERR_SUCCESS)
+		goto error_seq_num_local_mutex;
+
+	ret = chiaki_packet_pool_init(&takion->packet_pool, TAKION_RECV_BUF_SIZE, TAKION_PACKET_POOL_SIZE);
+	if(ret != CHIAKI_ERR_SUCCESS)
+		goto error_recv_stats_mutex;
+
+	ret = takion_send_queue_init(takion, info->send_coalesce_ms);
+	if(ret != CHIAKI_ERR_SUCCESS)
+		goto error_packet_pool;
+
 	takion->enable_crypt = info->enable_crypt;
 	takion->postponed_packets = NULL;
 	takion->postponed_packets_size = 0;
@@ -226,30 +308,38 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
 	bool mac_dontfrag = true;
 
-	ChiakiErrorCode err = chiaki_stop_pipe_init(&takion->stop_pipe);
+	ChiakiErrorCode err = chiaki_event_loop_init(&takion->event_loop);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		CHIAKI_LOGE(takion->log, "Takion failed to create stop pipe");
-		goto error_seq_num_local_mutex;
+		CHIAKI_LOGE(takion->log, "Takion failed to create event loop");
+		goto error_send_queue;
 	}
 
 	if(sock)
 	{
 		takion->sock = *sock;
+		err = takion_register_sock(takion);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			ret = err;
+			goto error_sock;
+		}
 		err = takion_read_extra_sock_messages(takion);
 		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
 		{
 			CHIAKI_LOGE(takion->log, "Takion had problem reading extra messages from socket using PSN Connection with error: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
 			goto error_sock;
 		}
-		const int rcvbuf_val = takion->a_rwnd;
-		int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const CHIAKI_SOCKET_BUF_TYPE)&rcvbuf_val, sizeof(rcvbuf_val));
-		if(r < 0)
+		err = takion_set_rcvbuf(takion, info->rcvbuf_bitrate);
+		if(err != CHIAKI_ERR_SUCCESS)
 		{
-			CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-			ret = CHIAKI_ERR_NETWORK;
+			ret = err;
 			goto error_sock;
 		}
+		takion_enable_recv_overflow(takion);
+		if(info->enable_recv_timestamps)
+			takion_enable_recv_timestamps(takion);
+		int r = 0;
 
 #if defined(__APPLE__)
 		SInt32 majorVersion;
@@ -328,16 +418,24 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		{
 			CHIAKI_LOGE(takion->log, "Takion failed to create socket");
 			ret = CHIAKI_ERR_NETWORK;
-			goto error_pipe;
+			goto error_event_loop;
 		}
-		const int rcvbuf_val = takion->a_rwnd;
-		int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const CHIAKI_SOCKET_BUF_TYPE)&rcvbuf_val, sizeof(rcvbuf_val));
-		if(r < 0)
+		err = takion_register_sock(takion);
+		if(err != CHIAKI_ERR_SUCCESS)
 		{
-			CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-			ret = CHIAKI_ERR_NETWORK;
+			ret = err;
+			goto error_sock;
+		}
+		err = takion_set_rcvbuf(takion, info->rcvbuf_bitrate);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			ret = err;
 			goto error_sock;
 		}
+		takion_enable_recv_overflow(takion);
+		if(info->enable_recv_timestamps)
+			takion_enable_recv_timestamps(takion);
+		int r = 0;
 		if(info->ip_dontfrag)
 		{
 #if defined(__APPLE__)
@@ -405,8 +503,14 @@ error_sock:
 		CHIAKI_SOCKET_CLOSE(takion->sock);
 		takion->sock = CHIAKI_INVALID_SOCKET;
 	}
-error_pipe:
-	chiaki_stop_pipe_fini(&takion->stop_pipe);
+error_event_loop:
+	chiaki_event_loop_fini(&takion->event_loop);
+error_send_queue:
+	takion_send_queue_fini(takion);
+error_packet_pool:
+	chiaki_packet_pool_fini(&takion->packet_pool);
+error_recv_stats_mutex:
+	chiaki_mutex_fini(&takion->recv_stats_mutex);
 error_seq_num_local_mutex:
 	chiaki_mutex_fini(&takion->seq_num_local_mutex);
 error_gkcrypt_local_mutex:
@@ -416,13 +520,62 @@ error_gkcrypt_local_mutex:
 
 CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion)
 {
-	chiaki_stop_pipe_stop(&takion->stop_pipe);
+	chiaki_event_loop_stop(&takion->event_loop);
 	chiaki_thread_join(&takion->thread, NULL);
-	chiaki_stop_pipe_fini(&takion->stop_pipe);
+	chiaki_event_loop_fini(&takion->event_loop);
+	takion_send_queue_fini(takion);
+	chiaki_packet_pool_fini(&takion->packet_pool);
+	chiaki_mutex_fini(&takion->recv_stats_mutex);
 	chiaki_mutex_fini(&takion->seq_num_local_mutex);
 	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
 }
 
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats, bool reset)
+{
+	chiaki_mutex_lock(&takion->recv_stats_mutex);
+	*stats = takion->recv_stats;
+	if(reset)
+		memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+	chiaki_mutex_unlock(&takion->recv_stats_mutex);
+}
+
+/**
+ * Counters behind ChiakiTakionSendStats, updated without holding send_queue.mutex
+ */
+typedef struct chiaki_takion_send_counters_t
+{
+	atomic_uint_least64_t datagrams;
+	atomic_uint_least64_t syscalls;
+	atomic_uint_least64_t batch_max;
+	atomic_uint_least64_t flushes_full;
+	atomic_uint_least64_t flushes_deadline;
+	atomic_uint_least64_t delay_max_us;
+} TakionSendCounters;
+
+static uint64_t takion_counter_get(atomic_uint_least64_t *counter, bool reset)
+{
+	return reset
+		? atomic_exchange_explicit(counter, 0, memory_order_relaxed)
+		: atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void takion_counter_max(atomic_uint_least64_t *counter, uint64_t value)
+{
+	uint64_t cur = atomic_load_explicit(counter, memory_order_relaxed);
+	while(value > cur && !atomic_compare_exchange_weak_explicit(counter, &cur, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+CHIAKI_EXPORT void chiaki_takion_get_send_stats(ChiakiTakion *takion, ChiakiTakionSendStats *stats, bool reset)
+{
+	TakionSendCounters *counters = takion->send_queue.counters;
+	stats->datagrams = takion_counter_get(&counters->datagrams, reset);
+	stats->syscalls = takion_counter_get(&counters->syscalls, reset);
+	stats->batch_max = takion_counter_get(&counters->batch_max, reset);
+	stats->flushes_full = takion_counter_get(&counters->flushes_full, reset);
+	stats->flushes_deadline = takion_counter_get(&counters->flushes_deadline, reset);
+	stats->delay_max_us = takion_counter_get(&counters->delay_max_us, reset);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, uint64_t *key_pos)
 {
 	data_size += data_size % CHIAKI_GKCRYPT_BLOCK_SIZE;
@@ -449,7 +602,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+static void takion_send_stats_add(ChiakiTakion *takion, size_t count)
+{
+	TakionSendCounters *counters = takion->send_queue.counters;
+	atomic_fetch_add_explicit(&counters->syscalls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters->datagrams, count, memory_order_relaxed);
+	takion_counter_max(&counters->batch_max, count);
+}
+
+static ChiakiErrorCode takion_send_direct(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
 {
 	int r = send(takion->sock, buf, buf_size, 0);
 	if(r < 0)
@@ -460,6 +621,279 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Send all queued datagrams, with as few system calls as possible.
+ * A datagram that fails to send is dropped, like it would have been by the network.
+ *
+ * send_queue.mutex must be held
+ */
+static ChiakiErrorCode takion_send_queue_flush(ChiakiTakion *takion)
+{
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+	if(!queue->count)
+		return CHIAKI_ERR_SUCCESS;
+
+	takion_counter_max(&queue->counters->delay_max_us, chiaki_time_now_monotonic_us() - queue->oldest_us);
+
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	size_t sent = 0;
+	while(sent < queue->count)
+	{
+#ifdef __linux__
+		struct iovec iovecs[CHIAKI_TAKION_SEND_BATCH_SIZE];
+		struct mmsghdr msgs[CHIAKI_TAKION_SEND_BATCH_SIZE];
+		size_t count = queue->count - sent;
+		for(size_t i=0; i<count; i++)
+		{
+			iovecs[i].iov_base = queue->bufs + (sent + i) * TAKION_SEND_SLOT_SIZE;
+			iovecs[i].iov_len = queue->sizes[sent + i];
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int r = sendmmsg(takion->sock, msgs, count, 0);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+		{
+			atomic_fetch_add_explicit(&queue->counters->syscalls, 1, memory_order_relaxed);
+			CHIAKI_LOGE(takion->log, "Takion failed to send batch: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			ret = CHIAKI_ERR_NETWORK;
+			sent++;
+			continue;
+		}
+		takion_send_stats_add(takion, r);
+		sent += r;
+#else
+		if(takion_send_direct(takion, queue->bufs + sent * TAKION_SEND_SLOT_SIZE, queue->sizes[sent]) != CHIAKI_ERR_SUCCESS)
+			ret = CHIAKI_ERR_NETWORK;
+		else
+			takion_send_stats_add(takion, 1);
+		sent++;
+#endif
+	}
+	queue->count = 0;
+	return ret;
+}
+
+static void *takion_send_queue_thread_func(void *user)
+{
+	ChiakiTakion *takion = user;
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(!queue->should_stop)
+	{
+		if(!queue->count)
+		{
+			chiaki_cond_wait(&queue->cond, &queue->mutex);
+			continue;
+		}
+
+		uint64_t deadline_us = queue->oldest_us + queue->coalesce_ms * 1000;
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(now_us < deadline_us)
+		{
+			chiaki_cond_timedwait(&queue->cond, &queue->mutex, (deadline_us - now_us + 999) / 1000);
+			continue;
+		}
+
+		atomic_fetch_add_explicit(&queue->counters->flushes_deadline, 1, memory_order_relaxed);
+		takion_send_queue_flush(takion);
+	}
+
+	chiaki_mutex_unlock(&queue->mutex);
+	return NULL;
+}
+
+static uint64_t takion_send_queue_timer_cb(void *user)
+{
+	ChiakiTakion *takion = user;
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+
+	uint64_t delay_ms = CHIAKI_REACTOR_TIMER_IDLE;
+	chiaki_mutex_lock(&queue->mutex);
+	if(queue->count)
+	{
+		uint64_t deadline_us = queue->oldest_us + queue->coalesce_ms * 1000;
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(now_us < deadline_us)
+			delay_ms = (deadline_us - now_us + 999) / 1000;
+		else
+		{
+			atomic_fetch_add_explicit(&queue->counters->flushes_deadline, 1, memory_order_relaxed);
+			takion_send_queue_flush(takion);
+		}
+	}
+	chiaki_mutex_unlock(&queue->mutex);
+	return delay_ms;
+}
+
+static ChiakiErrorCode takion_send_queue_init(ChiakiTakion *takion, unsigned int coalesce_ms)
+{
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+	queue->counters = malloc(sizeof(TakionSendCounters));
+	if(!queue->counters)
+		return CHIAKI_ERR_MEMORY;
+	atomic_init(&queue->counters->datagrams, 0);
+	atomic_init(&queue->counters->syscalls, 0);
+	atomic_init(&queue->counters->batch_max, 0);
+	atomic_init(&queue->counters->flushes_full, 0);
+	atomic_init(&queue->counters->flushes_deadline, 0);
+	atomic_init(&queue->counters->delay_max_us, 0);
+#ifdef __linux__
+	queue->coalesce_ms = coalesce_ms;
+#else
+	// without sendmmsg, holding datagrams back would only add latency
+	queue->coalesce_ms = 0;
+#endif
+	queue->bufs = NULL;
+	queue->count = 0;
+	queue->oldest_us = 0;
+	queue->should_stop = false;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&queue->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_counters;
+
+	if(!queue->coalesce_ms)
+		return CHIAKI_ERR_SUCCESS;
+
+	err = chiaki_cond_init(&queue->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	queue->bufs = malloc(CHIAKI_TAKION_SEND_BATCH_SIZE * TAKION_SEND_SLOT_SIZE);
+	if(!queue->bufs)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_cond;
+	}
+
+	if(takion->reactor)
+		err = chiaki_reactor_timer_add(takion->reactor, &queue->timer, takion_send_queue_timer_cb, takion, CHIAKI_REACTOR_TIMER_IDLE);
+	else
+	{
+		err = chiaki_thread_create(&queue->thread, takion_send_queue_thread_func, takion);
+		if(err == CHIAKI_ERR_SUCCESS)
+			chiaki_thread_set_name(&queue->thread, "Chiaki Takion Send");
+	}
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_bufs;
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_bufs:
+	free(queue->bufs);
+error_cond:
+	chiaki_cond_fini(&queue->cond);
+error_mutex:
+	chiaki_mutex_fini(&queue->mutex);
+error_counters:
+	free(queue->counters);
+	return err;
+}
+
+static void takion_send_queue_fini(ChiakiTakion *takion)
+{
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+	if(queue->coalesce_ms)
+	{
+		if(takion->reactor)
+			chiaki_reactor_timer_remove(takion->reactor, &queue->timer);
+		else
+		{
+			chiaki_mutex_lock(&queue->mutex);
+			queue->should_stop = true;
+			chiaki_cond_signal(&queue->cond);
+			chiaki_mutex_unlock(&queue->mutex);
+			chiaki_thread_join(&queue->thread, NULL);
+		}
+		// nothing can flush anymore, so send what is left while the socket is still there
+		chiaki_mutex_lock(&queue->mutex);
+		if(queue->count)
+		{
+			if(!CHIAKI_SOCKET_IS_INVALID(takion->sock))
+				takion_send_queue_flush(takion);
+			else
+			{
+				CHIAKI_LOGW(takion->log, "Takion dropped %zu queued datagrams because the socket is already closed", queue->count);
+				queue->count = 0;
+			}
+		}
+		chiaki_mutex_unlock(&queue->mutex);
+		free(queue->bufs);
+		chiaki_cond_fini(&queue->cond);
+	}
+	chiaki_mutex_fini(&queue->mutex);
+	free(queue->counters);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+	ChiakiErrorCode err;
+	if(!queue->coalesce_ms)
+	{
+		err = takion_send_direct(takion, buf, buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		takion_send_stats_add(takion, 1);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	err = chiaki_mutex_lock(&queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	if(buf_size > TAKION_SEND_SLOT_SIZE)
+	{
+		// flush first to keep the order of datagrams
+		takion_send_queue_flush(takion);
+		err = takion_send_direct(takion, buf, buf_size);
+		if(err == CHIAKI_ERR_SUCCESS)
+			takion_send_stats_add(takion, 1);
+		goto beach;
+	}
+
+	if(!queue->count)
+	{
+		queue->oldest_us = chiaki_time_now_monotonic_us();
+		if(takion->reactor)
+			chiaki_reactor_timer_schedule(takion->reactor, &queue->timer, queue->coalesce_ms);
+		else
+			chiaki_cond_signal(&queue->cond);
+	}
+	memcpy(queue->bufs + queue->count * TAKION_SEND_SLOT_SIZE, buf, buf_size);
+	queue->sizes[queue->count++] = buf_size;
+
+	if(queue->count == CHIAKI_TAKION_SEND_BATCH_SIZE)
+	{
+		atomic_fetch_add_explicit(&queue->counters->flushes_full, 1, memory_order_relaxed);
+		err = takion_send_queue_flush(takion);
+	}
+
+beach:
+	chiaki_mutex_unlock(&queue->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_flush(ChiakiTakion *takion)
+{
+	ChiakiTakionSendQueue *queue = &takion->send_queue;
+	if(!queue->coalesce_ms)
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode err = chiaki_mutex_lock(&queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = takion_send_queue_flush(takion);
+	chiaki_mutex_unlock(&queue->mutex);
+	return err;
+}
+
 static ChiakiErrorCode chiaki_takion_packet_read_key_pos(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t *key_pos_out)
 {
 	if(buf_size < 1)
@@ -536,6 +970,43 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *
 	return chiaki_takion_send_raw(takion, buf, buf_size);
 }
 
+/**
+ * Put the next local seq num at the start of msg_payload, send packet_buf and push it into the send buffer.
+ * The seq num is only used up if the packet actually went out, so the remote never waits for one that was never sent.
+ * Takes ownership of packet_buf.
+ */
+static ChiakiErrorCode takion_send_message_data_seq(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_size, uint8_t *msg_payload, uint64_t key_pos, ChiakiSeqNum32 *seq_num)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		free(packet_buf);
+		return err;
+	}
+	ChiakiSeqNum32 seq_num_val = takion->seq_num_local;
+	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num_val);
+
+	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_mutex_unlock(&takion->seq_num_local_mutex);
+		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
+		free(packet_buf);
+		return err;
+	}
+	takion->seq_num_local++;
+	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
+
+	if(seq_num)
+		*seq_num = seq_num_val;
+
+	err = chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "Takion failed to push data packet %#llx into send buffer, it will not be re-sent: %s",
+				(unsigned long long)seq_num_val, chiaki_error_string(err));
+	return err;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *takion, uint8_t chunk_flags, uint16_t channel, uint8_t *buf, size_t buf_size, ChiakiSeqNum32 *seq_num)
 {
 	// TODO: can we make this more memory-efficient?
@@ -556,32 +1027,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 
 	uint8_t *msg_payload = packet_buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
 
-	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
-	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
-
-	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num_val);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 4)) = htons(channel);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 6)) = 0;
 	*(msg_payload + 8) = 0;
 	memcpy(msg_payload + 9, buf, buf_size);
 
-	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
-		return err;
-	}
-
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
-
-	if(seq_num)
-		*seq_num = seq_num_val;
-
-	return err;
+	return takion_send_message_data_seq(takion, packet_buf, packet_size, msg_payload, key_pos, seq_num);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data_cont(ChiakiTakion *takion, uint8_t chunk_flags, uint16_t channel, uint8_t *buf, size_t buf_size, ChiakiSeqNum32 *seq_num)
@@ -604,31 +1055,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data_cont(ChiakiTakion
 
 	uint8_t *msg_payload = packet_buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
 
-	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
-	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
-
-	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num_val);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 4)) = htons(channel);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 6)) = 0;
 	memcpy(msg_payload + 8, buf, buf_size);
 
-	err = chiaki_takion_send(takion, packet_buf, packet_size, key_pos); // will alter packet_buf with gmac
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
-		return err;
-	}
-
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
-
-	if(seq_num)
-		*seq_num = seq_num_val;
-
-	return err;
+	return takion_send_message_data_seq(takion, packet_buf, packet_size, msg_payload, key_pos, seq_num);
 }
 
 static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion, uint32_t seq_num)
@@ -862,10 +1293,57 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
 	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
+	chiaki_packet_pool_unref(entry->packet_buf);
 	free(entry);
 }
 
+static void takion_check_crypt(ChiakiTakion *takion, bool *crypt_available)
+{
+	if(takion->enable_crypt && !*crypt_available && takion->gkcrypt_remote)
+	{
+		*crypt_available = true;
+		CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
+		for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
+		{
+			TakionDataPacketEntry *packet;
+			bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
+			if(!peeked)
+				continue;
+			if(packet->packet_size == 0)
+				continue;
+			uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+			if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+				chiaki_reorder_queue_drop(&takion->data_queue, i);
+			}
+		}
+
+	}
+
+	if(takion->postponed_packets && takion->gkcrypt_remote)
+	{
+		// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+
+		CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+
+		// detach first, handling the packets must not postpone them again
+		ChiakiTakionPostponedPacket *packets = takion->postponed_packets;
+		size_t packets_count = takion->postponed_packets_count;
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
+
+		for(size_t i=0; i<packets_count; i++)
+		{
+			ChiakiTakionPostponedPacket *packet = &packets[i];
+			takion_handle_packet(takion, packet->buf, packet->buf_size, &packet->recv_time);
+			chiaki_packet_pool_unref(packet->buf);
+		}
+		free(packets);
+	}
+}
+
 static void *takion_thread_func(void *user)
 {
 	ChiakiTakion *takion = user;
@@ -891,74 +1369,54 @@ static void *takion_thread_func(void *user)
 		takion->cb(&event, takion->cb_user);
 	}
 
+	TakionRecvBatch recv_batch;
+	if(takion_recv_batch_init(takion, &recv_batch) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to allocate receive buffers");
+		goto error_send_buffer;
+	}
+
 	bool crypt_available = takion->gkcrypt_remote ? true : false;
 
 	while(true)
 	{
-		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
-		{
-			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
-			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
-			}
-
-		}
+		ChiakiErrorCode err = takion_recv_batch(takion, &recv_batch);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
 
-		if(takion->postponed_packets && takion->gkcrypt_remote)
+		for(size_t i=0; i<recv_batch.count; i++)
 		{
-			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+			if(!recv_batch.sizes[i])
+				continue;
+			// crypt may become available from inside the callback for any packet of the batch
+			takion_check_crypt(takion, &crypt_available);
+			takion_handle_packet(takion, recv_batch.bufs[i], recv_batch.sizes[i], &recv_batch.times[i]);
+		}
 
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+		// acks for the whole batch, and whatever else is queued by now, go out together
+		chiaki_takion_send_flush(takion);
+	}
 
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
-			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
-			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
-		}
+	takion_recv_batch_fini(&recv_batch);
 
-		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
-		if(!buf)
-			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			free(buf);
-			break;
-		}
-		uint8_t *resized_buf = realloc(buf, received_size);
-		if(!resized_buf)
-		{
-			free(buf);
-			continue;
-		}
-		takion_handle_packet(takion, resized_buf, received_size);
+	if(takion->postponed_packets)
+	{
+		for(size_t i=0; i<takion->postponed_packets_count; i++)
+			chiaki_packet_pool_unref(takion->postponed_packets[i].buf);
+		free(takion->postponed_packets);
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
 	}
 
+error_send_buffer:
 	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 
 error_reoder_queue:
 	chiaki_reorder_queue_fini(&takion->data_queue);
 
 beach:
+	chiaki_takion_send_flush(takion);
 	if(takion->cb)
 	{
 		ChiakiTakionEvent event = { 0 };
@@ -976,18 +1434,145 @@ beach:
 	return NULL;
 }
 
-static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+static ChiakiErrorCode takion_register_sock(ChiakiTakion *takion)
 {
-	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	// registered once for the lifetime of the connection, readers drain the socket before waiting again
+	ChiakiErrorCode err = chiaki_event_loop_add(&takion->event_loop, takion->sock, CHIAKI_EVENT_LOOP_READ | CHIAKI_EVENT_LOOP_EDGE, NULL);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "Takion failed to register socket with event loop");
+	return err;
+}
+
+/**
+ * Size the socket receive buffer to hold TAKION_RCVBUF_BUFFERED_MS of a stream with the given bitrate,
+ * but not less than the advertised receiver window.
+ *
+ * @param bitrate in kbit/s as in ChiakiConnectVideoProfile, 0 if unknown
+ */
+static ChiakiErrorCode takion_set_rcvbuf(ChiakiTakion *takion, unsigned int bitrate)
+{
+	uint64_t size = (uint64_t)bitrate * 1000 / 8 * TAKION_RCVBUF_BUFFERED_MS / 1000;
+	if(size > TAKION_RCVBUF_MAX)
+		size = TAKION_RCVBUF_MAX;
+	if(size < takion->a_rwnd)
+		size = takion->a_rwnd;
+	const int rcvbuf_val = (int)size;
+
+	int r = -1;
+#if defined(__linux__) && defined(SO_RCVBUFFORCE)
+	// ignores net.core.rmem_max, but requires CAP_NET_ADMIN
+	r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf_val, sizeof(rcvbuf_val));
+#endif
+	if(r < 0)
+		r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const CHIAKI_SOCKET_BUF_TYPE)&rcvbuf_val, sizeof(rcvbuf_val));
+	if(r < 0)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	int actual_val = 0;
+	socklen_t actual_len = sizeof(actual_val);
+	if(getsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (CHIAKI_SOCKET_BUF_TYPE)&actual_val, &actual_len) == 0)
+	{
+#ifdef __linux__
+		actual_val /= 2; // Linux reports the doubled value including bookkeeping overhead
+#endif
+		if(actual_val < rcvbuf_val)
+			CHIAKI_LOGW(takion->log, "Takion socket receive buffer is %d bytes instead of %d, consider raising net.core.rmem_max", actual_val, rcvbuf_val);
+		else
+			CHIAKI_LOGI(takion->log, "Takion socket receive buffer is %d bytes", actual_val);
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Ask the kernel to report the number of datagrams it dropped because the receive buffer was full
+ */
+static void takion_enable_recv_overflow(ChiakiTakion *takion)
+{
+#if defined(__linux__) && defined(SO_RXQ_OVFL)
+	const int ovfl_val = 1;
+	int r = setsockopt(takion->sock, SOL_SOCKET, SO_RXQ_OVFL, &ovfl_val, sizeof(ovfl_val));
+	if(r < 0)
+	{
+		CHIAKI_LOGW(takion->log, "Takion failed to setsockopt SO_RXQ_OVFL, kernel drops will count as network loss: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return;
+	}
+	takion->recv_overflow = true;
+#else
+	(void)takion;
+#endif
+}
+
+static void takion_enable_recv_timestamps(ChiakiTakion *takion)
+{
+#if defined(__linux__) && defined(SO_TIMESTAMPNS)
+	const int timestamp_val = 1;
+	int r = setsockopt(takion->sock, SOL_SOCKET, SO_TIMESTAMPNS, &timestamp_val, sizeof(timestamp_val));
+	if(r < 0)
+	{
+		CHIAKI_LOGW(takion->log, "Takion failed to setsockopt SO_TIMESTAMPNS, falling back to userspace receive times: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return;
+	}
+	takion->recv_timestamps = true;
+	CHIAKI_LOGI(takion->log, "Takion enabled kernel receive timestamps");
+#else
+	CHIAKI_LOGW(takion->log, "Kernel receive timestamps are not supported on this platform, falling back to userspace receive times");
+#endif
+}
+
+/**
+ * Wait until the socket becomes readable.
+ * The socket is registered edge-triggered, so on Linux this must only be called after reading returned EAGAIN.
+ */
+static ChiakiErrorCode takion_wait_readable(ChiakiTakion *takion, uint64_t timeout_ms)
+{
+	ChiakiEventLoopEvent event;
+	size_t events_count;
+	ChiakiErrorCode err = chiaki_event_loop_wait(&takion->event_loop, &event, 1, &events_count, timeout_ms);
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
 		return err;
 	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "Takion event loop wait failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+	return err;
+}
+
+static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+{
+	ChiakiErrorCode err;
+	CHIAKI_SSIZET_TYPE received_sz;
+#ifdef __linux__
+	// wakeups without a datagram to read must not extend the timeout
+	uint64_t deadline_us = timeout_ms == UINT64_MAX ? UINT64_MAX : chiaki_time_now_monotonic_us() + timeout_ms * 1000;
+	while(true)
 	{
-		CHIAKI_LOGE(takion->log, "Takion select failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-		return err;
+		received_sz = recv(takion->sock, buf, *buf_size, MSG_DONTWAIT);
+		if(received_sz >= 0)
+			break;
+		if(errno == EINTR)
+			continue;
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			break;
+		uint64_t wait_ms = UINT64_MAX;
+		if(deadline_us != UINT64_MAX)
+		{
+			uint64_t now_us = chiaki_time_now_monotonic_us();
+			if(now_us >= deadline_us)
+				return CHIAKI_ERR_TIMEOUT;
+			wait_ms = (deadline_us - now_us + 999) / 1000;
+		}
+		err = takion_wait_readable(takion, wait_ms);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 	}
+#else
+	err = takion_wait_readable(takion, timeout_ms);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	received_sz = recv(takion->sock, buf, *buf_size, 0);
+#endif
 
-	CHIAKI_SSIZET_TYPE received_sz = recv(takion->sock, buf, *buf_size, 0);
 	if(received_sz <= 0)
 	{
 		if(received_sz < 0)
@@ -1000,6 +1585,222 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 	return CHIAKI_ERR_SUCCESS;
 }
 
+static void takion_recv_batch_set_slot(TakionRecvBatch *batch, size_t i, uint8_t *buf)
+{
+	batch->bufs[i] = buf;
+#ifdef __linux__
+	batch->iovecs[i].iov_base = buf;
+	batch->iovecs[i].iov_len = TAKION_RECV_BUF_SIZE;
+	batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+	batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	batch->msgs[i].msg_hdr.msg_control = batch->controls[i].buf;
+#endif
+}
+
+static ChiakiErrorCode takion_recv_batch_init(ChiakiTakion *takion, TakionRecvBatch *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+	for(size_t i=0; i<CHIAKI_TAKION_RECV_BATCH_SIZE; i++)
+	{
+		uint8_t *buf = chiaki_packet_pool_alloc(&takion->packet_pool);
+		if(!buf)
+		{
+			takion_recv_batch_fini(batch);
+			return CHIAKI_ERR_MEMORY;
+		}
+		takion_recv_batch_set_slot(batch, i, buf);
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void takion_recv_batch_fini(TakionRecvBatch *batch)
+{
+	for(size_t i=0; i<CHIAKI_TAKION_RECV_BATCH_SIZE; i++)
+	{
+		if(batch->bufs[i])
+			chiaki_packet_pool_unref(batch->bufs[i]);
+	}
+}
+
+/**
+ * Give back the slots of the last batch and take fresh ones.
+ * Slots that nobody kept a reference to go straight back into the pool and are handed out again.
+ */
+static ChiakiErrorCode takion_recv_batch_recycle(ChiakiTakion *takion, TakionRecvBatch *batch)
+{
+	for(size_t i=0; i<batch->count; i++)
+	{
+		chiaki_packet_pool_unref(batch->bufs[i]);
+		uint8_t *buf = chiaki_packet_pool_alloc(&takion->packet_pool);
+		takion_recv_batch_set_slot(batch, i, buf);
+		if(!buf)
+			return CHIAKI_ERR_MEMORY;
+	}
+	batch->count = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void takion_recv_stats_add(ChiakiTakion *takion, size_t count, bool waited)
+{
+	chiaki_mutex_lock(&takion->recv_stats_mutex);
+	ChiakiTakionRecvStats *stats = &takion->recv_stats;
+	if(waited)
+		stats->waits++;
+	if(count)
+	{
+		stats->batches++;
+		stats->packets += count;
+		if(count > stats->batch_max)
+			stats->batch_max = count;
+		if(count == CHIAKI_TAKION_RECV_BATCH_SIZE)
+			stats->batches_full++;
+	}
+	chiaki_mutex_unlock(&takion->recv_stats_mutex);
+}
+
+/**
+ * Fill batch->times for the batch->count datagrams that were just read
+ * and account for datagrams the kernel dropped before them.
+ */
+static void takion_recv_batch_control(ChiakiTakion *takion, TakionRecvBatch *batch)
+{
+	uint64_t read_us = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<batch->count; i++)
+	{
+		batch->times[i].arrival_us = read_us;
+		batch->times[i].read_us = read_us;
+		batch->times[i].kernel = false;
+	}
+#ifdef __linux__
+	if(!takion->recv_timestamps && !takion->recv_overflow)
+		return;
+
+	// kernel timestamps are CLOCK_REALTIME, shift them into the monotonic domain
+	struct timespec realtime;
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	int64_t realtime_offset_us = ((int64_t)realtime.tv_sec * 1000000 + realtime.tv_nsec / 1000) - (int64_t)read_us;
+
+	uint32_t overflow_count = takion->recv_overflow_count;
+	for(size_t i=0; i<batch->count; i++)
+	{
+		struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+		for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg))
+		{
+			if(cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+#ifdef SO_TIMESTAMPNS
+			if(cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				struct timespec ts;
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				int64_t arrival_us = ((int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000) - realtime_offset_us;
+				// clock steps between the two samples could place arrival after reading
+				if(arrival_us > 0 && (uint64_t)arrival_us <= read_us)
+				{
+					batch->times[i].arrival_us = (uint64_t)arrival_us;
+					batch->times[i].kernel = true;
+				}
+			}
+#endif
+#ifdef SO_RXQ_OVFL
+			if(cmsg->cmsg_type == SO_RXQ_OVFL)
+			{
+				// total drops of the socket at the time this datagram was queued, only sent once non-zero
+				uint32_t count;
+				memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+				if((int32_t)(count - overflow_count) > 0)
+					overflow_count = count;
+			}
+#endif
+		}
+	}
+
+	uint32_t dropped = overflow_count - takion->recv_overflow_count;
+	if(dropped)
+	{
+		takion->recv_overflow_count = overflow_count;
+		CHIAKI_LOGW(takion->log, "Takion socket receive buffer overflowed, the kernel dropped %u datagrams", (unsigned int)dropped);
+		chiaki_mutex_lock(&takion->recv_stats_mutex);
+		takion->recv_stats.kernel_drops += dropped;
+		chiaki_mutex_unlock(&takion->recv_stats_mutex);
+		if(takion->packet_stats)
+			chiaki_packet_stats_push_local_drops(takion->packet_stats, dropped);
+	}
+#else
+	(void)takion;
+#endif
+}
+
+/**
+ * Receive as many datagrams as are available, up to CHIAKI_TAKION_RECV_BATCH_SIZE, blocking until at least one arrives.
+ * The received datagrams are valid until the next call.
+ */
+static ChiakiErrorCode takion_recv_batch(ChiakiTakion *takion, TakionRecvBatch *batch)
+{
+	ChiakiErrorCode err = takion_recv_batch_recycle(takion, batch);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to get receive buffers");
+		return err;
+	}
+#ifdef __linux__
+	if(batch->full_batches >= TAKION_RECV_FULL_BATCHES_STOP_CHECK)
+	{
+		batch->full_batches = 0;
+		err = takion_wait_readable(takion, 0);
+		if(err == CHIAKI_ERR_CANCELED)
+			return err;
+	}
+
+	bool waited = false;
+	while(true)
+	{
+		// the kernel overwrites msg_controllen with the size actually used
+		for(size_t i=0; i<CHIAKI_TAKION_RECV_BATCH_SIZE; i++)
+			batch->msgs[i].msg_hdr.msg_controllen = (takion->recv_timestamps || takion->recv_overflow) ? sizeof(batch->controls[i].buf) : 0;
+
+		// only block when the socket has run dry, saving one syscall per datagram under load
+		int r = recvmmsg(takion->sock, batch->msgs, CHIAKI_TAKION_RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if(r > 0)
+		{
+			for(int i=0; i<r; i++)
+				batch->sizes[i] = batch->msgs[i].msg_len; // empty datagrams are skipped by the caller
+			batch->count = (size_t)r;
+			takion_recv_batch_control(takion, batch);
+			if(r == CHIAKI_TAKION_RECV_BATCH_SIZE)
+				batch->full_batches++;
+			else
+				batch->full_batches = 0;
+			takion_recv_stats_add(takion, batch->count, waited);
+			return CHIAKI_ERR_SUCCESS;
+		}
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			CHIAKI_LOGE(takion->log, "Takion recvmmsg failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			return CHIAKI_ERR_NETWORK;
+		}
+
+		waited = true;
+		batch->full_batches = 0;
+		err = takion_wait_readable(takion, UINT64_MAX);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+#else
+	size_t received_size = TAKION_RECV_BUF_SIZE;
+	err = takion_recv(takion, batch->bufs[0], &received_size, UINT64_MAX);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	batch->sizes[0] = received_size;
+	batch->count = 1;
+	takion_recv_batch_control(takion, batch);
+	takion_recv_stats_add(takion, 1, true);
+	return CHIAKI_ERR_SUCCESS;
+#endif
+}
+
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
 {
 	if(!takion->gkcrypt_remote)
@@ -1037,7 +1838,7 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, const ChiakiTakionRecvTime *recv_time)
 {
 	if(!takion->postponed_packets)
 	{
@@ -1054,25 +1855,26 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 		return;
 	}
 
+	chiaki_packet_pool_ref(buf);
+
 	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
 	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[takion->postponed_packets_count++];
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	packet->recv_time = *recv_time;
 }
 
 /**
- * @param buf ownership of this buf is taken.
+ * @param buf buffer from takion->packet_pool, borrowed for the duration of this call.
+ * Anything that keeps it longer takes its own reference.
  */
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, const ChiakiTakionRecvTime *recv_time)
 {
 	assert(buf_size > 0);
 	uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
 
 	if(takion_handle_packet_mac(takion, base_type, buf, buf_size) != CHIAKI_ERR_SUCCESS)
-	{
-		free(buf);
 		return;
-	}
 
 	switch(base_type)
 	{
@@ -1082,17 +1884,13 @@ static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_
 		case TAKION_PACKET_TYPE_VIDEO:
 		case TAKION_PACKET_TYPE_AUDIO:
 			if(takion->enable_crypt && !takion->gkcrypt_remote)
-				takion_postpone_packet(takion, buf, buf_size);
+				takion_postpone_packet(takion, buf, buf_size, recv_time);
 			else
-			{
-				takion_handle_packet_av(takion, base_type, buf, buf_size);
-				free(buf);
-			}
+				takion_handle_packet_av(takion, base_type, buf, buf_size, recv_time);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion packet with unknown type %#x received", base_type);
 			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, buf, buf_size);
-			free(buf);
 			break;
 	}
 }
@@ -1103,10 +1901,7 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	TakionMessage msg;
 	ChiakiErrorCode err = takion_parse_message(takion, buf+1, buf_size-1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		free(buf);
 		return;
-	}
 
 	//CHIAKI_LOGD(takion->log, "Takion received message with tag %#x, key pos %#x, type (%#x, %#x), payload size %#x, payload:", msg.tag, msg.key_pos, msg.type_a, msg.type_b, msg.payload_size);
 	//chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, buf, buf_size);
@@ -1118,11 +1913,9 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 			break;
 		case TAKION_CHUNK_TYPE_DATA_ACK:
 			takion_handle_packet_message_data_ack(takion, msg.chunk_flags, msg.payload, msg.payload_size);
-			free(buf);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion received message with unknown chunk type = %#x", msg.chunk_type);
-			free(buf);
 			break;
 	}
 }
@@ -1141,7 +1934,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 
 		if(entry->payload_size < 9)
 		{
-			free(entry->packet_buf);
+			chiaki_packet_pool_unref(entry->packet_buf);
 			free(entry);
 			continue;
 		}
@@ -1170,7 +1963,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
+		chiaki_packet_pool_unref(entry->packet_buf);
 		free(entry);
 	}
 
@@ -1193,6 +1986,9 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	if(!entry)
 		return;
 
+	// the entry may wait in the reorder queue beyond the current receive batch
+	chiaki_packet_pool_ref(packet_buf);
+
 	entry->type_b = type_b;
 	entry->packet_buf = packet_buf;
 	entry->packet_size = packet_buf_size;
@@ -1310,7 +2106,10 @@ static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMess
 	*((chiaki_unaligned_uint16_t *)(pl + 0xa)) = htons(payload->inbound_streams);
 	*((chiaki_unaligned_uint32_t *)(pl + 0xc)) = htonl(payload->initial_seq_num);
 
-	return chiaki_takion_send_raw(takion, message, sizeof(message));
+	ChiakiErrorCode err = chiaki_takion_send_raw(takion, message, sizeof(message));
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return chiaki_takion_send_flush(takion);
 }
 
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie)
@@ -1319,7 +2118,10 @@ static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t
 	message[0] = TAKION_PACKET_TYPE_CONTROL;
 	takion_write_message_header(message + 1, takion->tag_remote, 0, TAKION_CHUNK_TYPE_COOKIE, 0, TAKION_COOKIE_SIZE);
 	memcpy(message + 1 + TAKION_MESSAGE_HEADER_SIZE, cookie, TAKION_COOKIE_SIZE);
-	return chiaki_takion_send_raw(takion, message, sizeof(message));
+	ChiakiErrorCode err = chiaki_takion_send_raw(takion, message, sizeof(message));
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return chiaki_takion_send_flush(takion);
 }
 
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload)
@@ -1416,7 +2218,7 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size, const ChiakiTakionRecvTime *recv_time)
 {
 	// HHIxIIx
 
@@ -1430,6 +2232,7 @@ static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uin
 			CHIAKI_LOGE(takion->log, "Takion received AV packet that was too small");
 		return;
 	}
+	packet.recv_time = *recv_time;
 
 	if(takion->cb)
 	{
@@ -1659,11 +2462,9 @@ static ChiakiErrorCode takion_read_extra_sock_messages(ChiakiTakion *takion)
 		if(now > expired)
 			return CHIAKI_ERR_TIMEOUT;
 		uint8_t buf[1500];
-		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, 200);
+		size_t len = sizeof(buf);
+		ChiakiErrorCode err = takion_recv(takion, buf, &len, 200);
 		if(err != CHIAKI_ERR_SUCCESS)
 			return err;
-        CHIAKI_SSIZET_TYPE len = recv(takion->sock, (CHIAKI_SOCKET_BUF_TYPE) buf, sizeof(buf), 0);
-        if (len < 0)
-            return CHIAKI_ERR_NETWORK;
 	}
 }
\ No newline at end of file
@@ -9,10 +9,16 @@
 #include <string.h>
 #include <assert.h>
 
-#define TAKION_DATA_RESEND_TIMEOUT_MS 200
-#define TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS (TAKION_DATA_RESEND_TIMEOUT_MS/2)
+#define TAKION_DATA_RESEND_TIMEOUT_MS 200 // until the rtt is known
+#define TAKION_DATA_RESEND_TIMEOUT_MIN_MS 20
+#define TAKION_DATA_RESEND_TIMEOUT_MAX_MS 1000
 #define TAKION_DATA_RESEND_TRIES_MAX 10
-#define TAKION_SEND_BUFFER_SIZE 16
+
+#define TAKION_SEND_BUFFER_WHEEL_TICK_US 4000
+static_assert(CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS * TAKION_SEND_BUFFER_WHEEL_TICK_US > TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000,
+		"Takion Send Buffer timer wheel must cover the max resend timeout");
+static_assert(!(CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS & (CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS - 1)),
+		"CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS must be a power of two");
 
 #endif
 
@@ -20,25 +26,56 @@ struct chiaki_takion_send_buffer_packet_t
 {
 	ChiakiSeqNum32 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
-	uint8_t *buf;
+	uint64_t last_send_us;
+	uint64_t due_us; // time of the next resend
+	uint8_t *buf; // NULL if the slot is free
 	size_t buf_size;
+	ChiakiTakionSendBufferPacket *wheel_prev;
+	ChiakiTakionSendBufferPacket *wheel_next;
 }; // ChiakiTakionSendBufferPacket
 
 #ifndef CHIAKI_UNIT_TEST
 
 static void *takion_send_buffer_thread_func(void *user);
+static uint64_t takion_send_buffer_timer_cb(void *user);
+
+static uint64_t takion_send_buffer_clock_default(void *user)
+{
+	return chiaki_time_now_monotonic_us();
+}
+
+static void takion_send_buffer_rtt_seed(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size)
 {
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
 
-	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
+	size_t alloc = 1;
+	while(alloc < size)
+		alloc <<= 1;
+	send_buffer->packets = calloc(alloc, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
+	send_buffer->packets_alloc = alloc;
 	send_buffer->packets_size = size;
 	send_buffer->packets_count = 0;
+	send_buffer->seq_num_begin = 0;
+	send_buffer->seq_num_end = 0;
+
+	memset(send_buffer->wheel, 0, sizeof(send_buffer->wheel));
+	send_buffer->clock = takion_send_buffer_clock_default;
+	send_buffer->clock_user = NULL;
+	send_buffer->wheel_tick = send_buffer->clock(send_buffer->clock_user) / TAKION_SEND_BUFFER_WHEEL_TICK_US;
+
+	send_buffer->rtt_valid = false;
+	send_buffer->srtt_us = 0;
+	send_buffer->rttvar_us = 0;
+	send_buffer->rto_us = TAKION_DATA_RESEND_TIMEOUT_MS * 1000;
+	if(takion && takion->rtt_initial_us)
+		takion_send_buffer_rtt_seed(send_buffer, takion->rtt_initial_us);
+	send_buffer->resends = 0;
+	send_buffer->give_ups = 0;
 
 	send_buffer->should_stop = false;
 
@@ -50,6 +87,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuf
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
+	send_buffer->reactor = takion ? takion->reactor : NULL;
+	if(send_buffer->reactor)
+	{
+		err = chiaki_reactor_timer_add(send_buffer->reactor, &send_buffer->resend_timer, takion_send_buffer_timer_cb, send_buffer, CHIAKI_REACTOR_TIMER_IDLE);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_cond;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	err = chiaki_thread_create(&send_buffer->thread, takion_send_buffer_thread_func, send_buffer);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
@@ -68,13 +114,20 @@ error_packets:
 
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer)
 {
-	send_buffer->should_stop = true;
-	ChiakiErrorCode err = chiaki_cond_signal(&send_buffer->cond);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_thread_join(&send_buffer->thread, NULL);
-	assert(err == CHIAKI_ERR_SUCCESS);
+	if(send_buffer->reactor)
+		chiaki_reactor_timer_remove(send_buffer->reactor, &send_buffer->resend_timer);
+	else
+	{
+		chiaki_mutex_lock(&send_buffer->mutex);
+		send_buffer->should_stop = true;
+		ChiakiErrorCode err = chiaki_cond_signal(&send_buffer->cond);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		chiaki_mutex_unlock(&send_buffer->mutex);
+		err = chiaki_thread_join(&send_buffer->thread, NULL);
+		assert(err == CHIAKI_ERR_SUCCESS);
+	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	for(size_t i=0; i<send_buffer->packets_alloc; i++)
 		free(send_buffer->packets[i].buf);
 
 	chiaki_cond_fini(&send_buffer->cond);
@@ -82,43 +135,131 @@ CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_b
 	free(send_buffer->packets);
 }
 
+static ChiakiTakionSendBufferPacket *takion_send_buffer_slot(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	return &send_buffer->packets[seq_num & (send_buffer->packets_alloc - 1)];
+}
+
+static void takion_send_buffer_wheel_insert(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferPacket *packet)
+{
+	ChiakiTakionSendBufferPacket **bucket = &send_buffer->wheel[(packet->due_us / TAKION_SEND_BUFFER_WHEEL_TICK_US) & (CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS - 1)];
+	packet->wheel_prev = NULL;
+	packet->wheel_next = *bucket;
+	if(*bucket)
+		(*bucket)->wheel_prev = packet;
+	*bucket = packet;
+}
+
+static void takion_send_buffer_wheel_remove(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferPacket *packet)
+{
+	if(packet->wheel_prev)
+		packet->wheel_prev->wheel_next = packet->wheel_next;
+	else
+		send_buffer->wheel[(packet->due_us / TAKION_SEND_BUFFER_WHEEL_TICK_US) & (CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS - 1)] = packet->wheel_next;
+	if(packet->wheel_next)
+		packet->wheel_next->wheel_prev = packet->wheel_prev;
+	packet->wheel_prev = NULL;
+	packet->wheel_next = NULL;
+}
+
+/**
+ * Resend timeout for a packet that has been sent tries times already
+ */
+static uint64_t takion_send_buffer_packet_rto_us(ChiakiTakionSendBuffer *send_buffer, uint64_t tries)
+{
+	uint64_t rto_us = send_buffer->rto_us;
+	for(uint64_t i=0; i<tries && rto_us < TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000; i++)
+		rto_us *= 2;
+	if(rto_us > TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000)
+		rto_us = TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000;
+	return rto_us;
+}
+
+static void takion_send_buffer_rto_update(ChiakiTakionSendBuffer *send_buffer)
+{
+	uint64_t var_us = 4 * send_buffer->rttvar_us;
+	if(var_us < TAKION_SEND_BUFFER_WHEEL_TICK_US)
+		var_us = TAKION_SEND_BUFFER_WHEEL_TICK_US;
+	uint64_t rto_us = send_buffer->srtt_us + var_us;
+	if(rto_us < TAKION_DATA_RESEND_TIMEOUT_MIN_MS * 1000)
+		rto_us = TAKION_DATA_RESEND_TIMEOUT_MIN_MS * 1000;
+	if(rto_us > TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000)
+		rto_us = TAKION_DATA_RESEND_TIMEOUT_MAX_MS * 1000;
+	send_buffer->rto_us = rto_us;
+}
+
+static void takion_send_buffer_rtt_seed(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
+{
+	send_buffer->rtt_valid = true;
+	send_buffer->srtt_us = rtt_us;
+	send_buffer->rttvar_us = rtt_us / 2;
+	takion_send_buffer_rto_update(send_buffer);
+}
+
+static void takion_send_buffer_rtt_sample(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
+{
+	if(!send_buffer->rtt_valid)
+	{
+		takion_send_buffer_rtt_seed(send_buffer, rtt_us);
+		return;
+	}
+	uint64_t err_us = send_buffer->srtt_us > rtt_us ? send_buffer->srtt_us - rtt_us : rtt_us - send_buffer->srtt_us;
+	send_buffer->rttvar_us = (3 * send_buffer->rttvar_us + err_us) / 4;
+	send_buffer->srtt_us = (7 * send_buffer->srtt_us + rtt_us) / 8;
+	takion_send_buffer_rto_update(send_buffer);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	if(send_buffer->packets_count >= send_buffer->packets_size)
+	ChiakiSeqNum32 begin = seq_num;
+	ChiakiSeqNum32 end = seq_num + 1;
+	if(send_buffer->packets_count)
+	{
+		if(chiaki_seq_num_32_lt(send_buffer->seq_num_begin, begin))
+			begin = send_buffer->seq_num_begin;
+		if(chiaki_seq_num_32_gt(send_buffer->seq_num_end, end))
+			end = send_buffer->seq_num_end;
+	}
+
+	if(send_buffer->packets_count >= send_buffer->packets_size || (ChiakiSeqNum32)(end - begin) > send_buffer->packets_size)
 	{
 		CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer overflow");
 		err = CHIAKI_ERR_OVERFLOW;
 		goto beach;
 	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, seq_num);
+	if(packet->buf)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num)
-		{
-			CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
-			err = CHIAKI_ERR_INVALID_DATA;
-			goto beach;
-		}
+		// inside of the window, the slot can only be taken by the same seq num
+		CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
 	}
 
-	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
+	uint64_t now_us = send_buffer->clock(send_buffer->clock_user);
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
+	packet->last_send_us = now_us;
+	packet->due_us = now_us + send_buffer->rto_us;
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	takion_send_buffer_wheel_insert(send_buffer, packet);
+	send_buffer->packets_count++;
+	send_buffer->seq_num_begin = begin;
+	send_buffer->seq_num_end = end;
 
 	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
 
-	if(send_buffer->packets_count == 1)
-	{
-		// buffer was empty before, so it will sleep without timeout => WAKE UP!!
+	// the thread or timer might sleep longer than the new packet's timeout => WAKE UP!!
+	if(send_buffer->reactor)
+		chiaki_reactor_timer_schedule(send_buffer->reactor, &send_buffer->resend_timer, (send_buffer->rto_us + 999) / 1000);
+	else
 		chiaki_cond_signal(&send_buffer->cond);
-	}
 
 beach:
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -127,6 +268,41 @@ beach:
 	return err;
 }
 
+/**
+ * mutex must be held
+ *
+ * @return number of packets removed
+ */
+static size_t takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count, uint64_t now_us)
+{
+	if(!send_buffer->packets_count || chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_begin))
+		return 0;
+
+	size_t count = 0;
+	ChiakiSeqNum32 s;
+	for(s = send_buffer->seq_num_begin; s != send_buffer->seq_num_end && !chiaki_seq_num_32_gt(s, seq_num); s++)
+	{
+		ChiakiTakionSendBufferPacket *packet = takion_send_buffer_slot(send_buffer, s);
+		if(!packet->buf || packet->seq_num != s)
+			continue;
+
+		// Karn's algorithm: the ack of a re-sent packet is ambiguous
+		if(s == seq_num && !packet->tries)
+			takion_send_buffer_rtt_sample(send_buffer, now_us - packet->last_send_us);
+
+		if(acked_seq_nums && acked_seq_nums_count)
+			acked_seq_nums[(*acked_seq_nums_count)++] = s;
+
+		takion_send_buffer_wheel_remove(send_buffer, packet);
+		free(packet->buf);
+		packet->buf = NULL;
+		send_buffer->packets_count--;
+		count++;
+	}
+	send_buffer->seq_num_begin = s;
+	return count;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
@@ -136,71 +312,93 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 	if(acked_seq_nums_count)
 		*acked_seq_nums_count = 0;
 
-	size_t i;
-	size_t shift = 0; // amount to shift back
-	size_t shift_start = SIZE_MAX;
-	for(i=0; i<send_buffer->packets_count; i++)
+	takion_send_buffer_ack(send_buffer, seq_num, acked_seq_nums, acked_seq_nums_count, send_buffer->clock(send_buffer->clock_user));
+
+	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
+
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	return err;
+}
+
+/**
+ * mutex must be held
+ */
+static uint64_t takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
+{
+	uint64_t now_us = send_buffer->clock(send_buffer->clock_user);
+	uint64_t now_tick = now_us / TAKION_SEND_BUFFER_WHEEL_TICK_US;
+
+	uint64_t tick = send_buffer->wheel_tick;
+	if(tick > now_tick || now_tick - tick >= CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num || chiaki_seq_num_32_lt(send_buffer->packets[i].seq_num, seq_num))
-		{
-			if(acked_seq_nums && acked_seq_nums_count)
-				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
+		// every bucket once is enough
+		tick = now_tick >= CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS ? now_tick - CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS + 1 : 0;
+	}
 
-			free(send_buffer->packets[i].buf);
-			if(shift_start == SIZE_MAX)
-			{
-				// first shift
-				shift_start = i;
-				shift = 1;
-			}
-			else if(shift_start + shift == i)
+	for(; tick <= now_tick; tick++)
+	{
+		ChiakiTakionSendBufferPacket **bucket = &send_buffer->wheel[tick & (CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS - 1)];
+		ChiakiTakionSendBufferPacket *packet = *bucket;
+		while(packet)
+		{
+			ChiakiTakionSendBufferPacket *next = packet->wheel_next;
+			if(packet->due_us > now_us)
 			{
-				// still in the same gap
-				shift++;
+				packet = next;
+				continue;
 			}
-			else
+
+			if(packet->tries >= TAKION_DATA_RESEND_TRIES_MAX)
 			{
-				// new gap, do shift
-				memmove(send_buffer->packets + shift_start,
-						send_buffer->packets + shift_start + shift,
-						(i - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
-				// start new shift
-				shift_start = i - shift;
-				shift++;
+				CHIAKI_LOGI(send_buffer->log, "Hit max retries of %d tries... giving up on packet with seqnum %#llx", TAKION_DATA_RESEND_TRIES_MAX, (unsigned long long)packet->seq_num);
+				send_buffer->give_ups += takion_send_buffer_ack(send_buffer, packet->seq_num, NULL, NULL, now_us);
+				// may have removed more than one packet from this bucket
+				packet = *bucket;
+				continue;
 			}
+
+			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
+			takion_send_buffer_wheel_remove(send_buffer, packet);
+			packet->tries++;
+			packet->last_send_us = now_us;
+			packet->due_us = now_us + takion_send_buffer_packet_rto_us(send_buffer, packet->tries);
+			takion_send_buffer_wheel_insert(send_buffer, packet);
+			if(send_buffer->takion)
+				chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
+			send_buffer->resends++;
+			packet = next;
 		}
 	}
+	// packets due later in the current tick are still in its bucket
+	send_buffer->wheel_tick = now_tick;
+
+	if(!send_buffer->packets_count)
+		return CHIAKI_REACTOR_TIMER_IDLE;
 
-	if(shift_start != SIZE_MAX)
+	for(tick = now_tick; tick < now_tick + CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS; tick++)
 	{
-		// do final shift
-		if(shift_start + shift < send_buffer->packets_count)
+		uint64_t due_us = UINT64_MAX;
+		for(ChiakiTakionSendBufferPacket *packet = send_buffer->wheel[tick & (CHIAKI_TAKION_SEND_BUFFER_WHEEL_SLOTS - 1)]; packet; packet = packet->wheel_next)
 		{
-			memmove(send_buffer->packets + shift_start,
-					send_buffer->packets + shift_start + shift,
-					(send_buffer->packets_count - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
+			if(packet->due_us / TAKION_SEND_BUFFER_WHEEL_TICK_US == tick && packet->due_us < due_us)
+				due_us = packet->due_us;
 		}
-		send_buffer->packets_count -= shift;
+		if(due_us != UINT64_MAX)
+			return (due_us - now_us + 999) / 1000;
 	}
 
-	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
-
-	chiaki_mutex_unlock(&send_buffer->mutex);
-	return err;
-}
-
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
-
-static bool takion_send_buffer_check_pred_packets(void *user)
-{
-	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop;
+	// can't happen as long as the wheel covers TAKION_DATA_RESEND_TIMEOUT_MAX_MS
+	return TAKION_DATA_RESEND_TIMEOUT_MAX_MS;
 }
 
-static bool takion_send_buffer_check_pred_no_packets(void *user)
+CHIAKI_EXPORT uint64_t chiaki_takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
 {
-	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop || send_buffer->packets_count;
+	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return TAKION_DATA_RESEND_TIMEOUT_MIN_MS;
+	uint64_t next = takion_send_buffer_resend(send_buffer);
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	return next;
 }
 
 static void *takion_send_buffer_thread_func(void *user)
@@ -211,12 +409,14 @@ static void *takion_send_buffer_thread_func(void *user)
 	if(err != CHIAKI_ERR_SUCCESS)
 		return NULL;
 
-	while(true)
+	uint64_t next = CHIAKI_REACTOR_TIMER_IDLE;
+	while(!send_buffer->should_stop)
 	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS, takion_send_buffer_check_pred_packets, send_buffer);
-		else // if not, wait without timeout, but also wakeup if packets become available
-			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, takion_send_buffer_check_pred_no_packets, send_buffer);
+		// any wakeup, e.g. by a push, recalculates when the next packet is due
+		if(next == CHIAKI_REACTOR_TIMER_IDLE)
+			err = chiaki_cond_wait(&send_buffer->cond, &send_buffer->mutex);
+		else if(next)
+			err = chiaki_cond_timedwait(&send_buffer->cond, &send_buffer->mutex, next);
 
 		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
 			break;
@@ -224,43 +424,17 @@ static void *takion_send_buffer_thread_func(void *user)
 		if(send_buffer->should_stop)
 			break;
 
-		takion_send_buffer_resend(send_buffer);
+		if(send_buffer->takion)
+			next = takion_send_buffer_resend(send_buffer);
 	}
 	chiaki_mutex_unlock(&send_buffer->mutex);
 
 	return NULL;
 }
 
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
+static uint64_t takion_send_buffer_timer_cb(void *user)
 {
-	if(!send_buffer->takion)
-		return;
-
-	uint64_t now = chiaki_time_now_monotonic_ms();
-
-	for(size_t i=0; i<send_buffer->packets_count; i++)
-	{
-		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > TAKION_DATA_RESEND_TIMEOUT_MS)
-		{
-			if(packet->tries >= TAKION_DATA_RESEND_TRIES_MAX)
-			{
-				CHIAKI_LOGI(send_buffer->log, "Hit max retries of %d tries... giving up on packet with seqnum %#llx", TAKION_DATA_RESEND_TRIES_MAX, (unsigned long long)packet->seq_num);
-				ChiakiSeqNum32 ack_seq_nums[TAKION_SEND_BUFFER_SIZE];
-				size_t ack_seq_nums_count;
-				chiaki_mutex_unlock(&send_buffer->mutex);
-				chiaki_takion_send_buffer_ack(send_buffer, packet->seq_num, ack_seq_nums, &ack_seq_nums_count);
-				chiaki_mutex_lock(&send_buffer->mutex);
-				if(i > 0)
-					i-= 1;
-				continue;
-			}
-			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
-			packet->last_send_ms = now;
-			chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
-			packet->tries++;
-		}
-	}
+	return chiaki_takion_send_buffer_resend(user);
 }
 
 #endif
@@ -21,6 +21,7 @@
 #endif
 
 #include <stdint.h>
+#include <string.h>
 
 static inline ChiakiErrorCode set_port(struct sockaddr *sa, uint16_t port)
 {
@@ -93,15 +94,78 @@ static inline int sendto_broadcast(ChiakiLog *log, chiaki_socket_t s, const void
 	return sendto(s, (CHIAKI_SOCKET_BUF_TYPE) msg, len, flags, to, tolen);
 }
 
-static inline void xor_bytes(uint8_t *dst, uint8_t *src, size_t sz)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHIAKI_XOR_BYTES_SSE2
+#endif
+
+#if defined(CHIAKI_XOR_BYTES_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// compiled for avx2 regardless of the target flags, only used if the cpu supports it
+#define CHIAKI_XOR_BYTES_AVX2
+#include <immintrin.h>
+#elif defined(CHIAKI_XOR_BYTES_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CHIAKI_XOR_BYTES_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef CHIAKI_XOR_BYTES_AVX2
+__attribute__((target("avx2")))
+static inline size_t xor_bytes_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t sz)
+{
+	size_t i = 0;
+	for(; i + 32 <= sz; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(x, y));
+	}
+	return i;
+}
+#endif
+
+/**
+ * dst = a ^ b for sz bytes. dst may be the same as a, but must not overlap b otherwise.
+ * Uses AVX2 if the cpu supports it, else SSE2 or NEON if available, else 64 bits at a time.
+ */
+static inline void xor_bytes_to(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t sz)
 {
-	while(sz > 0)
+	size_t i = 0;
+#ifdef CHIAKI_XOR_BYTES_AVX2
+	if(sz >= 64 && __builtin_cpu_supports("avx2"))
+		i = xor_bytes_avx2(dst, a, b, sz);
+#endif
+#if defined(CHIAKI_XOR_BYTES_SSE2)
+	for(; i + 16 <= sz; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(x, y));
+	}
+#elif defined(CHIAKI_XOR_BYTES_NEON)
+	for(; i + 16 <= sz; i += 16)
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+#endif
+	for(; i + 8 <= sz; i += 8)
 	{
-		*dst ^= *src;
-		dst++;
-		src++;
-		sz--;
+		uint64_t x, y;
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		x ^= y;
+		memcpy(dst + i, &x, sizeof(x));
 	}
+	for(; i < sz; i++)
+		dst[i] = a[i] ^ b[i];
+}
+
+/**
+ * dst ^= src for sz bytes, dst and src must not overlap.
+ */
+static inline void xor_bytes(uint8_t *dst, const uint8_t *src, size_t sz)
+{
+	xor_bytes_to(dst, dst, src, sz);
 }
 
 static inline int8_t nibble_value(char c)
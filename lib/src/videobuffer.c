@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/videobuffer.h>
+#include <chiaki/thread.h>
+
+#include <assert.h>
+#include <string.h>
+
+struct chiaki_video_buffer_pool_t
+{
+	ChiakiMutex mutex;
+	size_t count;
+	size_t count_max;
+	size_t free_count;
+	struct chiaki_video_buffer_header_t *free_list;
+	bool owned; // false after chiaki_video_buffer_pool_free(), the pool is then destroyed with its last buffer
+	ChiakiVideoBufferPoolStats stats;
+};
+
+typedef struct chiaki_video_buffer_header_t
+{
+	ChiakiVideoBufferPool *pool;
+	struct chiaki_video_buffer_header_t *next; // only valid while in the free list
+	size_t size;
+	unsigned int refcount;
+} ChiakiVideoBufferHeader;
+
+// keep the data behind the header aligned for simd in the decoder
+#define HEADER_SIZE ((sizeof(ChiakiVideoBufferHeader) + 0x3f) & ~(size_t)0x3f)
+#define HEADER_OF(buf) ((ChiakiVideoBufferHeader *)((buf) - HEADER_SIZE))
+#define DATA_OF(header) (((uint8_t *)(header)) + HEADER_SIZE)
+
+// frame sizes jitter a lot, so round up to avoid reallocating for every slightly bigger frame
+#define SIZE_GRANULARITY 0x10000
+
+CHIAKI_EXPORT ChiakiVideoBufferPool *chiaki_video_buffer_pool_new(size_t count)
+{
+	ChiakiVideoBufferPool *pool = CHIAKI_NEW(ChiakiVideoBufferPool);
+	if(!pool)
+		return NULL;
+	if(chiaki_mutex_init(&pool->mutex, false) != CHIAKI_ERR_SUCCESS)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->count = count;
+	pool->count_max = count;
+	pool->free_count = 0;
+	pool->free_list = NULL;
+	pool->owned = true;
+	memset(&pool->stats, 0, sizeof(pool->stats));
+	return pool;
+}
+
+CHIAKI_EXPORT void chiaki_video_buffer_pool_set_count_max(ChiakiVideoBufferPool *pool, size_t count_max)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	pool->count_max = count_max > pool->count ? count_max : pool->count;
+	chiaki_mutex_unlock(&pool->mutex);
+}
+
+static void video_buffer_pool_destroy(ChiakiVideoBufferPool *pool)
+{
+	while(pool->free_list)
+	{
+		ChiakiVideoBufferHeader *header = pool->free_list;
+		pool->free_list = header->next;
+		chiaki_aligned_free(header);
+	}
+	chiaki_mutex_fini(&pool->mutex);
+	free(pool);
+}
+
+CHIAKI_EXPORT void chiaki_video_buffer_pool_free(ChiakiVideoBufferPool *pool)
+{
+	if(!pool)
+		return;
+	chiaki_mutex_lock(&pool->mutex);
+	pool->owned = false;
+	bool destroy = pool->stats.in_use == 0;
+	chiaki_mutex_unlock(&pool->mutex);
+	if(destroy)
+		video_buffer_pool_destroy(pool);
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_video_buffer_alloc(ChiakiVideoBufferPool *pool, size_t size)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiVideoBufferHeader *header = pool->free_list;
+	if(header)
+	{
+		pool->free_list = header->next;
+		pool->free_count--;
+	}
+	if(header && header->size >= size)
+		pool->stats.hits++;
+	else
+	{
+		pool->stats.misses++;
+		// all kept buffers are in use, so keep the new one too once it is released
+		if(!header && pool->stats.in_use >= pool->count && pool->count < pool->count_max)
+			pool->count++;
+		chiaki_mutex_unlock(&pool->mutex);
+		chiaki_aligned_free(header);
+		size_t alloc_size = ((size + SIZE_GRANULARITY - 1) / SIZE_GRANULARITY) * SIZE_GRANULARITY;
+		header = chiaki_aligned_alloc(0x40, HEADER_SIZE + alloc_size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		if(!header)
+			return NULL;
+		header->pool = pool;
+		header->size = alloc_size;
+		chiaki_mutex_lock(&pool->mutex);
+	}
+	header->next = NULL;
+	header->refcount = 1;
+	pool->stats.in_use++;
+	if(pool->stats.in_use > pool->stats.high_water)
+		pool->stats.high_water = pool->stats.in_use;
+	chiaki_mutex_unlock(&pool->mutex);
+	return DATA_OF(header);
+}
+
+CHIAKI_EXPORT size_t chiaki_video_buffer_size(uint8_t *buf)
+{
+	return HEADER_OF(buf)->size;
+}
+
+CHIAKI_EXPORT void chiaki_video_buffer_ref(uint8_t *buf)
+{
+	ChiakiVideoBufferHeader *header = HEADER_OF(buf);
+	ChiakiVideoBufferPool *pool = header->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	assert(header->refcount > 0);
+	header->refcount++;
+	chiaki_mutex_unlock(&pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_buffer_unref(uint8_t *buf)
+{
+	ChiakiVideoBufferHeader *header = HEADER_OF(buf);
+	ChiakiVideoBufferPool *pool = header->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	assert(header->refcount > 0);
+	if(--header->refcount > 0)
+	{
+		chiaki_mutex_unlock(&pool->mutex);
+		return;
+	}
+	pool->stats.in_use--;
+	if(pool->owned && pool->free_count < pool->count)
+	{
+		header->next = pool->free_list;
+		pool->free_list = header;
+		pool->free_count++;
+		chiaki_mutex_unlock(&pool->mutex);
+		return;
+	}
+	bool destroy = !pool->owned && pool->stats.in_use == 0;
+	chiaki_mutex_unlock(&pool->mutex);
+	chiaki_aligned_free(header);
+	if(destroy)
+		video_buffer_pool_destroy(pool);
+}
+
+CHIAKI_EXPORT bool chiaki_video_buffer_unique(uint8_t *buf)
+{
+	ChiakiVideoBufferHeader *header = HEADER_OF(buf);
+	ChiakiVideoBufferPool *pool = header->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	bool r = header->refcount == 1;
+	chiaki_mutex_unlock(&pool->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_video_buffer_av_free(void *opaque, uint8_t *data)
+{
+	(void)data;
+	chiaki_video_buffer_unref(opaque);
+}
+
+CHIAKI_EXPORT void chiaki_video_buffer_pool_get_stats(ChiakiVideoBufferPool *pool, ChiakiVideoBufferPoolStats *stats, bool reset)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	stats->count = pool->count;
+	if(reset)
+	{
+		pool->stats.hits = 0;
+		pool->stats.misses = 0;
+		pool->stats.high_water = pool->stats.in_use;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+}
@@ -2,10 +2,14 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
+#include <stdatomic.h>
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+typedef struct video_receiver_frame_t VideoReceiverFrame;
+
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, VideoReceiverFrame *frame_slot);
 
 static void add_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
 {
@@ -33,7 +37,56 @@ static bool have_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
 	return false;
 }
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
+// every frame in the window or the queue has its own frame processor
+#define FRAME_PROCESSORS_COUNT (CHIAKI_VIDEO_RECEIVER_QUEUE_SIZE + CHIAKI_VIDEO_RECEIVER_WINDOW_MAX)
+#define QUEUE_SLOTS FRAME_PROCESSORS_COUNT
+
+struct video_receiver_frame_t
+{
+	ChiakiFrameProcessor *frame_processor;
+	int32_t frame_index;
+	int profile;
+};
+
+/**
+ * Single producer (whoever holds the window mutex, usually the receive thread), single consumer (assembly thread) ring of frames.
+ * There are as many slots as frame processors, so pushing never fails.
+ * The producer takes the frame processors of frames the assembly thread is done with back
+ * by following tail, in the same order it pushed them.
+ */
+typedef struct chiaki_video_receiver_queue_t
+{
+	ChiakiFrameProcessor frame_processors[FRAME_PROCESSORS_COUNT];
+	VideoReceiverFrame slots[QUEUE_SLOTS];
+
+	// only accessed with the window mutex locked
+	ChiakiFrameProcessor *frame_processors_free[FRAME_PROCESSORS_COUNT];
+	size_t frame_processors_free_count;
+	uint64_t reclaimed; // frames whose frame processor has been taken back
+
+	// written with the window mutex locked
+	atomic_uint_least64_t head; // frames handed over
+	atomic_uint_least64_t frames_dropped;
+	atomic_uint_least64_t depth_max;
+	atomic_uint_least64_t frames_rescued;
+	atomic_uint_least64_t frames_incomplete;
+	atomic_uint_least64_t packets_late;
+	atomic_uint_least64_t window_deadline_us; // when the front frame of the window is handed over without more packets, 0 if not
+
+	// written by the assembly thread
+	atomic_uint_least64_t tail; // frames done with
+	atomic_bool thread_sleeping;
+} ChiakiVideoReceiverQueue;
+
+static void *video_receiver_assembly_thread_func(void *user);
+
+static ChiakiErrorCode video_receiver_send_corrupt_frame(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user)
+{
+	ChiakiSession *session = user;
+	return stream_connection_send_corrupt_frame(&session->stream_connection, start, end);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	video_receiver->session = session;
 	video_receiver->log = session->log;
@@ -41,23 +94,194 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->profiles_count = 0;
 	video_receiver->profile_cur = -1;
 
-	video_receiver->frame_index_cur = -1;
 	video_receiver->frame_index_prev = -1;
-	video_receiver->frame_index_prev_complete = 0;
-
-	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
+	video_receiver->window_count = 0;
+	video_receiver->window_done_count = 0;
+	video_receiver->window_size = CHIAKI_VIDEO_RECEIVER_WINDOW_DEFAULT;
+	video_receiver->reorder_tolerance_us = CHIAKI_VIDEO_RECEIVER_REORDER_TOLERANCE_US_DEFAULT;
 	video_receiver->packet_stats = packet_stats;
+	video_receiver->recv_timing = &session->stream_connection.video_recv_timing;
+	video_receiver->congestion_control = &session->stream_connection.congestion_control;
+	video_receiver->stats_history = &session->stream_connection.video_stats_history;
+	video_receiver->frame_tracer = &session->frame_tracer;
+
+	static const double frame_bytes_buckets[] = { 4096, 16384, 32768, 65536, 131072, 262144, 524288, 1048576 };
+	ChiakiMetrics *metrics = session->metrics;
+	video_receiver->metrics.frames = chiaki_metrics_counter(metrics, "chiaki_video_frames_total", "Assembled video frames");
+	video_receiver->metrics.frames_failed = chiaki_metrics_counter(metrics, "chiaki_video_frames_failed_total", "Video frames that could not be assembled");
+	video_receiver->metrics.frames_fec_recovered = chiaki_metrics_counter(metrics, "chiaki_video_frames_fec_recovered_total", "Video frames that could only be assembled with FEC");
+	video_receiver->metrics.frames_lost = chiaki_metrics_counter(metrics, "chiaki_video_frames_lost_total", "Video frames lost before the decoder, as reported to it");
+	video_receiver->metrics.frame_bytes = chiaki_metrics_histogram(metrics, "chiaki_video_frame_bytes", "Size of assembled video frames",
+			frame_bytes_buckets, sizeof(frame_bytes_buckets) / sizeof(frame_bytes_buckets[0]));
+	video_receiver->metrics.buffer_pool_misses = chiaki_metrics_counter(metrics, "chiaki_video_buffer_pool_misses_total", "Video frame buffers that had to be allocated because none was free in the pool");
 
+	video_receiver->frame_index_prev_complete = 0;
+	video_receiver->frame_assembled = false;
+	video_receiver->profile_assembled = -1;
 	video_receiver->frames_lost = 0;
+	video_receiver->window_deadline_seen_us = 0;
 	memset(video_receiver->reference_frames, -1, sizeof(video_receiver->reference_frames));
+	video_receiver->corrupt_frame_cb = video_receiver_send_corrupt_frame;
+	video_receiver->corrupt_frame_cb_user = session;
 	chiaki_bitstream_init(&video_receiver->bitstream, video_receiver->log, video_receiver->session->connect_info.video_profile.codec);
+	chiaki_stream_stats_reset(&video_receiver->stream_stats);
+
+	ChiakiErrorCode err = chiaki_mutex_init(&video_receiver->stream_stats_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_mutex_init(&video_receiver->window_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stream_stats_mutex;
+
+	ChiakiVideoReceiverQueue *queue = calloc(1, sizeof(ChiakiVideoReceiverQueue));
+	if(!queue)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_window_mutex;
+	}
+	for(size_t i=0; i<FRAME_PROCESSORS_COUNT; i++)
+	{
+		chiaki_frame_processor_init(&queue->frame_processors[i], video_receiver->log);
+		queue->frame_processors_free[i] = &queue->frame_processors[i];
+	}
+	queue->frame_processors_free_count = FRAME_PROCESSORS_COUNT;
+	queue->reclaimed = 0;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->frames_dropped, 0);
+	atomic_init(&queue->depth_max, 0);
+	atomic_init(&queue->frames_rescued, 0);
+	atomic_init(&queue->frames_incomplete, 0);
+	atomic_init(&queue->packets_late, 0);
+	atomic_init(&queue->window_deadline_us, 0);
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->thread_sleeping, false);
+	video_receiver->queue = queue;
+
+	err = chiaki_mutex_init(&video_receiver->assembly_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_queue;
+	err = chiaki_cond_init(&video_receiver->assembly_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_assembly_mutex;
+
+	video_receiver->assembly_thread_stop = false;
+	err = chiaki_thread_create(&video_receiver->assembly_thread, video_receiver_assembly_thread_func, video_receiver);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_assembly_cond;
+	chiaki_thread_set_name(&video_receiver->assembly_thread, "Chiaki Video");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_assembly_cond:
+	chiaki_cond_fini(&video_receiver->assembly_cond);
+error_assembly_mutex:
+	chiaki_mutex_fini(&video_receiver->assembly_mutex);
+error_queue:
+	for(size_t i=0; i<FRAME_PROCESSORS_COUNT; i++)
+		chiaki_frame_processor_fini(&queue->frame_processors[i]);
+	free(queue);
+error_window_mutex:
+	chiaki_mutex_fini(&video_receiver->window_mutex);
+error_stream_stats_mutex:
+	chiaki_mutex_fini(&video_receiver->stream_stats_mutex);
+	return err;
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
+	chiaki_mutex_lock(&video_receiver->assembly_mutex);
+	video_receiver->assembly_thread_stop = true;
+	chiaki_mutex_unlock(&video_receiver->assembly_mutex);
+	chiaki_cond_signal(&video_receiver->assembly_cond);
+	chiaki_thread_join(&video_receiver->assembly_thread, NULL);
+	chiaki_cond_fini(&video_receiver->assembly_cond);
+	chiaki_mutex_fini(&video_receiver->assembly_mutex);
+
+	for(size_t i=0; i<FRAME_PROCESSORS_COUNT; i++)
+		chiaki_frame_processor_fini(&video_receiver->queue->frame_processors[i]);
+	free(video_receiver->queue);
+	chiaki_mutex_fini(&video_receiver->window_mutex);
+	chiaki_mutex_fini(&video_receiver->stream_stats_mutex);
+
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
 		free(video_receiver->profiles[i].header);
-	chiaki_frame_processor_fini(&video_receiver->frame_processor);
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_set_reorder_window(ChiakiVideoReceiver *video_receiver, size_t window_size, uint64_t reorder_tolerance_us)
+{
+	if(window_size < 1)
+		window_size = 1;
+	if(window_size > CHIAKI_VIDEO_RECEIVER_WINDOW_MAX)
+		window_size = CHIAKI_VIDEO_RECEIVER_WINDOW_MAX;
+	video_receiver->window_size = window_size;
+	video_receiver->reorder_tolerance_us = reorder_tolerance_us;
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_stream_stats(ChiakiVideoReceiver *video_receiver, ChiakiStreamStats *stats, bool reset)
+{
+	chiaki_mutex_lock(&video_receiver->stream_stats_mutex);
+	*stats = video_receiver->stream_stats;
+	if(reset)
+		chiaki_stream_stats_reset(&video_receiver->stream_stats);
+	chiaki_mutex_unlock(&video_receiver->stream_stats_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_queue_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverQueueStats *stats)
+{
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	uint64_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	stats->frames_queued = head;
+	stats->frames_dropped = atomic_load_explicit(&queue->frames_dropped, memory_order_relaxed);
+	stats->depth = head >= tail ? head - tail : 0;
+	stats->depth_max = atomic_load_explicit(&queue->depth_max, memory_order_relaxed);
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_window_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverWindowStats *stats)
+{
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	stats->frames_rescued = atomic_load_explicit(&queue->frames_rescued, memory_order_relaxed);
+	stats->frames_incomplete = atomic_load_explicit(&queue->frames_incomplete, memory_order_relaxed);
+	stats->packets_late = atomic_load_explicit(&queue->packets_late, memory_order_relaxed);
+}
+
+/**
+ * Window mutex locked: get a frame processor to fill a new frame
+ * @return NULL if all of them are in the window or queued
+ */
+static ChiakiFrameProcessor *video_receiver_queue_acquire(ChiakiVideoReceiverQueue *queue)
+{
+	uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	for(; queue->reclaimed < tail; queue->reclaimed++)
+		queue->frame_processors_free[queue->frame_processors_free_count++] = queue->slots[queue->reclaimed % QUEUE_SLOTS].frame_processor;
+	if(!queue->frame_processors_free_count)
+		return NULL;
+	return queue->frame_processors_free[--queue->frame_processors_free_count];
+}
+
+/**
+ * Window mutex locked: hand a frame processor from video_receiver_queue_acquire() over to the assembly thread
+ */
+static void video_receiver_queue_push(ChiakiVideoReceiver *video_receiver, ChiakiFrameProcessor *frame_processor, int32_t frame_index, int profile)
+{
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	VideoReceiverFrame *frame = &queue->slots[head % QUEUE_SLOTS];
+	frame->frame_processor = frame_processor;
+	frame->frame_index = frame_index;
+	frame->profile = profile;
+	atomic_store(&queue->head, head + 1); // seq_cst, pairs with thread_sleeping
+
+	uint64_t depth = head + 1 - atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if(depth > atomic_load_explicit(&queue->depth_max, memory_order_relaxed))
+		atomic_store_explicit(&queue->depth_max, depth, memory_order_relaxed);
+
+	if(!atomic_load(&queue->thread_sleeping))
+		return;
+	chiaki_mutex_lock(&video_receiver->assembly_mutex);
+	chiaki_cond_signal(&video_receiver->assembly_cond);
+	chiaki_mutex_unlock(&video_receiver->assembly_mutex);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count)
@@ -80,18 +304,164 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 	}
 }
 
-CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+static bool window_frame_complete(ChiakiVideoReceiverWindowFrame *frame)
 {
-	// old frame?
-	ChiakiSeqNum16 frame_index = packet->frame_index;
-	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
-	if(video_receiver->frame_index_cur >= 0
-		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	return !frame->frame_processor || chiaki_frame_processor_flush_possible(frame->frame_processor);
+}
+
+/**
+ * Window mutex locked: account for a frame that no more units are expected for
+ */
+static void video_receiver_frame_stats(ChiakiVideoReceiver *video_receiver, ChiakiVideoReceiverWindowFrame *frame)
+{
+	if(video_receiver->packet_stats && frame->units_expected)
+		chiaki_packet_stats_push_generation_units(video_receiver->packet_stats, frame->units_seen, frame->units_expected);
+	if(frame->first_arrival_us)
 	{
-		CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
+		chiaki_recv_timing_push_frame(video_receiver->recv_timing, frame->first_arrival_us, frame->last_arrival_us);
+		chiaki_congestion_control_push_frame(video_receiver->congestion_control, (ChiakiSeqNum16)frame->frame_index, frame->first_arrival_us);
+	}
+}
+
+/**
+ * Window mutex locked: hand the oldest frame of the window over to the assembly thread
+ */
+static void video_receiver_window_retire(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	ChiakiVideoReceiverWindowFrame *frame = &video_receiver->window[0];
+
+	if(frame->frame_processor)
+	{
+		frame->incomplete = !chiaki_frame_processor_flush_possible(frame->frame_processor);
+		if(frame->incomplete)
+			atomic_fetch_add_explicit(&queue->frames_incomplete, 1, memory_order_relaxed);
+		else if(frame->overtaken)
+			atomic_fetch_add_explicit(&queue->frames_rescued, 1, memory_order_relaxed);
+		if(frame->first_arrival_us)
+			chiaki_frame_tracer_begin(video_receiver->frame_tracer, frame->frame_index, frame->first_arrival_us, frame->last_arrival_us);
+		video_receiver_queue_push(video_receiver, frame->frame_processor, frame->frame_index, frame->profile);
+		frame->frame_processor = NULL;
+	}
+	video_receiver->frame_index_prev = frame->frame_index;
+
+	// the remaining fec units usually arrive after the frame is handed over
+	if(video_receiver->window_done_count == CHIAKI_VIDEO_RECEIVER_WINDOW_MAX)
+	{
+		video_receiver_frame_stats(video_receiver, &video_receiver->window_done[0]);
+		video_receiver->window_done_count--;
+		memmove(video_receiver->window_done, video_receiver->window_done + 1, video_receiver->window_done_count * sizeof(ChiakiVideoReceiverWindowFrame));
+	}
+	video_receiver->window_done[video_receiver->window_done_count++] = *frame;
+
+	video_receiver->window_count--;
+	memmove(video_receiver->window, video_receiver->window + 1, video_receiver->window_count * sizeof(ChiakiVideoReceiverWindowFrame));
+}
+
+/**
+ * Window mutex locked: hand over as many frames from the front of the window as possible
+ * and tell the assembly thread when to come back for the rest if no more packets arrive.
+ */
+static void video_receiver_window_advance(ChiakiVideoReceiver *video_receiver, uint64_t now_us)
+{
+	uint64_t deadline_us = 0;
+	while(video_receiver->window_count)
+	{
+		ChiakiVideoReceiverWindowFrame *frame = &video_receiver->window[0];
+		if(!window_frame_complete(frame))
+		{
+			// missing units may still be on their way, unless they had enough time to overtake the ones seen after them
+			if(!frame->last_unit_seen && video_receiver->window_count < 2)
+				break;
+			if(now_us - frame->last_put_us < video_receiver->reorder_tolerance_us)
+			{
+				deadline_us = frame->last_put_us + video_receiver->reorder_tolerance_us;
+				break;
+			}
+		}
+		video_receiver_window_retire(video_receiver);
+	}
+
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	uint64_t deadline_prev_us = atomic_load_explicit(&queue->window_deadline_us, memory_order_relaxed);
+	if(deadline_us == deadline_prev_us)
+		return;
+	atomic_store(&queue->window_deadline_us, deadline_us); // seq_cst, pairs with thread_sleeping like head
+	// a later deadline is picked up when the assembly thread wakes up for the earlier one
+	if(!deadline_us || (deadline_prev_us && deadline_us > deadline_prev_us) || !atomic_load(&queue->thread_sleeping))
 		return;
+	chiaki_mutex_lock(&video_receiver->assembly_mutex);
+	chiaki_cond_signal(&video_receiver->assembly_cond);
+	chiaki_mutex_unlock(&video_receiver->assembly_mutex);
+}
+
+/**
+ * Window mutex locked: find the frame of packet in the window or start it
+ * @return NULL if the packet is too late
+ */
+static ChiakiVideoReceiverWindowFrame *video_receiver_window_frame(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+{
+	ChiakiSeqNum16 frame_index = packet->frame_index;
+	if(video_receiver->frame_index_prev >= 0
+		&& !chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_prev))
+		return NULL;
+
+	size_t i;
+	for(i=0; i<video_receiver->window_count; i++)
+	{
+		ChiakiVideoReceiverWindowFrame *frame = &video_receiver->window[i];
+		if(frame->frame_index == frame_index)
+			return frame;
+		if(chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)frame->frame_index))
+			break;
+	}
+
+	if(video_receiver->window_count >= video_receiver->window_size)
+	{
+		// all frames in the window are later than this one, it can't be handed over in order anymore
+		if(i == 0)
+			return NULL;
+		CHIAKI_LOGV(video_receiver->log, "Video receiver window full, handing over frame %d", (int)video_receiver->window[0].frame_index);
+		video_receiver_window_retire(video_receiver);
+		i--;
 	}
 
+	for(size_t j=0; j<i; j++)
+	{
+		if(!window_frame_complete(&video_receiver->window[j]))
+			video_receiver->window[j].overtaken = true;
+	}
+
+	memmove(video_receiver->window + i + 1, video_receiver->window + i, (video_receiver->window_count - i) * sizeof(ChiakiVideoReceiverWindowFrame));
+	video_receiver->window_count++;
+
+	ChiakiVideoReceiverWindowFrame *frame = &video_receiver->window[i];
+	memset(frame, 0, sizeof(*frame));
+	frame->frame_index = frame_index;
+	frame->profile = video_receiver->profile_cur;
+	unsigned int units_fec = packet->units_in_frame_fec ? packet->units_in_frame_fec : 1; // like ChiakiFrameProcessor
+	frame->units_expected = packet->units_in_frame_total >= packet->units_in_frame_fec
+		? packet->units_in_frame_total - packet->units_in_frame_fec + units_fec
+		: 0;
+
+	frame->frame_processor = video_receiver_queue_acquire(video_receiver->queue);
+	if(!frame->frame_processor)
+	{
+		// the assembly thread is too far behind, it will report the missing frame once it catches up
+		atomic_fetch_add_explicit(&video_receiver->queue->frames_dropped, 1, memory_order_relaxed);
+		CHIAKI_LOGW(video_receiver->log, "Video receiver dropping frame %d because assembly is behind", (int)frame_index);
+	}
+	else
+	{
+		ChiakiErrorCode err = chiaki_frame_processor_alloc_frame(frame->frame_processor, packet);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGW(video_receiver->log, "Video receiver could not allocate frame for packet.");
+	}
+	return frame;
+}
+
+CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+{
 	// check adaptive stream index
 	if(video_receiver->profile_cur < 0 || video_receiver->profile_cur != packet->adaptive_stream_index)
 	{
@@ -106,62 +476,196 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
-			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, 0, false, video_receiver->session->video_sample_cb_user);
-		if(!chiaki_bitstream_header(&video_receiver->bitstream, profile->header, profile->header_sz))
-			CHIAKI_LOGW(video_receiver->log, "Failed to parse video header");
 	}
 
-	// next frame?
-	if(video_receiver->frame_index_cur < 0 ||
-		chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	chiaki_mutex_lock(&video_receiver->window_mutex);
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	ChiakiVideoReceiverWindowFrame *frame = video_receiver_window_frame(video_receiver, packet);
+	if(!frame)
 	{
-		if(video_receiver->packet_stats)
-			chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
+		for(size_t i=0; i<video_receiver->window_done_count; i++)
+		{
+			if(video_receiver->window_done[i].frame_index == packet->frame_index)
+			{
+				frame = &video_receiver->window_done[i];
+				break;
+			}
+		}
+		if(!frame || frame->incomplete)
+		{
+			atomic_fetch_add_explicit(&video_receiver->queue->packets_late, 1, memory_order_relaxed);
+			CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
+		}
+		if(!frame)
+		{
+			video_receiver_window_advance(video_receiver, now_us);
+			chiaki_mutex_unlock(&video_receiver->window_mutex);
+			return;
+		}
+	}
 
-		// last frame not flushed yet?
-		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
-			err = chiaki_video_receiver_flush_frame(video_receiver);
+	chiaki_recv_timing_push_packet(video_receiver->recv_timing, &packet->recv_time);
+	uint64_t arrival_us = packet->recv_time.arrival_us;
+	if(!frame->first_arrival_us || arrival_us < frame->first_arrival_us)
+		frame->first_arrival_us = arrival_us;
+	if(arrival_us > frame->last_arrival_us)
+		frame->last_arrival_us = arrival_us;
 
+	if(packet->unit_index < CHIAKI_FEC_UNITS_MAX && packet->data_size
+		&& !((frame->units_seen[packet->unit_index / 64] >> (packet->unit_index % 64)) & 1))
+	{
+		frame->units_seen[packet->unit_index / 64] |= (uint64_t)1 << (packet->unit_index % 64);
+		frame->units_received++;
+	}
+	if(packet->unit_index == packet->units_in_frame_total - 1)
+		frame->last_unit_seen = true;
+	frame->last_put_us = now_us;
+
+	if(frame->frame_processor)
+	{
+		ChiakiErrorCode err = chiaki_frame_processor_put_unit(frame->frame_processor, packet);
 		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGW(video_receiver->log, "Video receiver could not flush frame.");
+			CHIAKI_LOGW(video_receiver->log, "Video receiver could not put unit.");
+	}
+
+	video_receiver_window_advance(video_receiver, now_us);
+	chiaki_mutex_unlock(&video_receiver->window_mutex);
+}
+
+static bool assembly_cond_pred(void *user)
+{
+	ChiakiVideoReceiver *video_receiver = user;
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	return video_receiver->assembly_thread_stop
+		|| atomic_load(&queue->head) != atomic_load_explicit(&queue->tail, memory_order_relaxed)
+		|| atomic_load(&queue->window_deadline_us) != video_receiver->window_deadline_seen_us;
+}
+
+/**
+ * Assembly thread, assembly mutex locked: sleep until a frame is queued or the window deadline passed
+ * @return CHIAKI_ERR_TIMEOUT if the deadline passed
+ */
+static ChiakiErrorCode video_receiver_assembly_wait(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+	atomic_store(&queue->thread_sleeping, true); // seq_cst, so either this or the receive thread sees the other
+	ChiakiErrorCode err;
+	uint64_t deadline_us = atomic_load(&queue->window_deadline_us);
+	video_receiver->window_deadline_seen_us = deadline_us;
+	if(deadline_us)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		err = deadline_us <= now_us
+			? CHIAKI_ERR_TIMEOUT
+			: chiaki_cond_timedwait_pred(&video_receiver->assembly_cond, &video_receiver->assembly_mutex,
+					(deadline_us - now_us + 999) / 1000, assembly_cond_pred, video_receiver);
+	}
+	else
+		err = chiaki_cond_wait_pred(&video_receiver->assembly_cond, &video_receiver->assembly_mutex, assembly_cond_pred, video_receiver);
+	atomic_store(&queue->thread_sleeping, false);
+	return err;
+}
+
+static void chiaki_video_receiver_assemble_frame(ChiakiVideoReceiver *video_receiver, VideoReceiverFrame *frame);
+
+static void *video_receiver_assembly_thread_func(void *user)
+{
+	ChiakiVideoReceiver *video_receiver = user;
+	ChiakiVideoReceiverQueue *queue = video_receiver->queue;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&video_receiver->assembly_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+	while(!video_receiver->assembly_thread_stop)
+	{
+		uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		if(atomic_load_explicit(&queue->head, memory_order_acquire) == tail)
+		{
+			err = video_receiver_assembly_wait(video_receiver);
+			if(err == CHIAKI_ERR_TIMEOUT)
+			{
+				// no packet came in to hand over the front frame of the window, e.g. because the stream stalled
+				chiaki_mutex_unlock(&video_receiver->assembly_mutex);
+				chiaki_mutex_lock(&video_receiver->window_mutex);
+				video_receiver_window_advance(video_receiver, chiaki_time_now_monotonic_us());
+				chiaki_mutex_unlock(&video_receiver->window_mutex);
+				chiaki_mutex_lock(&video_receiver->assembly_mutex);
+			}
+			else if(err != CHIAKI_ERR_SUCCESS)
+				break;
+			continue;
+		}
+		chiaki_mutex_unlock(&video_receiver->assembly_mutex);
+
+		chiaki_video_receiver_assemble_frame(video_receiver, &queue->slots[tail % QUEUE_SLOTS]);
+		atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+		chiaki_mutex_lock(&video_receiver->assembly_mutex);
+	}
+	chiaki_mutex_unlock(&video_receiver->assembly_mutex);
+	return NULL;
+}
 
-		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
-			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
+/**
+ * Assembly thread
+ */
+static void chiaki_video_receiver_assemble_frame(ChiakiVideoReceiver *video_receiver, VideoReceiverFrame *frame)
+{
+	if(frame->profile != video_receiver->profile_assembled)
+	{
+		ChiakiVideoProfile *profile = video_receiver->profiles + frame->profile;
+		if(video_receiver->session->video_sample_cb)
 		{
-			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			err = stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
-			if(err != CHIAKI_ERR_SUCCESS)
-				CHIAKI_LOGW(video_receiver->log, "Error sending corrupt frame.");
+			// samples are always passed as video buffers, so the decoder can keep them without copying
+			uint8_t *header = frame->frame_processor->buffer_pool
+				? chiaki_video_buffer_alloc(frame->frame_processor->buffer_pool, profile->header_sz)
+				: NULL;
+			if(header)
+			{
+				memcpy(header, profile->header, profile->header_sz);
+				memset(header + profile->header_sz, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+				video_receiver->session->video_sample_cb(header, profile->header_sz, 0, false, -1, video_receiver->session->video_sample_cb_user);
+				chiaki_video_buffer_unref(header);
+			}
+			else
+				CHIAKI_LOGE(video_receiver->log, "Failed to allocate buffer for video header");
 		}
+		if(!chiaki_bitstream_header(&video_receiver->bitstream, profile->header, profile->header_sz))
+			CHIAKI_LOGW(video_receiver->log, "Failed to parse video header");
+		video_receiver->profile_assembled = frame->profile;
+	}
 
-		video_receiver->frame_index_cur = frame_index;
-		err = chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)frame->frame_index;
+	ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
+	if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
+		&& !(frame_index == 1 && !video_receiver->frame_assembled)) // ok for frame 1
+	{
+		CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
+		ChiakiErrorCode err = video_receiver->corrupt_frame_cb(next_frame_expected, frame_index - 1, video_receiver->corrupt_frame_cb_user);
 		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGW(video_receiver->log, "Video receiver could not allocate frame for packet.");
+			CHIAKI_LOGW(video_receiver->log, "Error sending corrupt frame.");
 	}
+	video_receiver->frame_assembled = true;
 
-	err = chiaki_frame_processor_put_unit(&video_receiver->frame_processor, packet);
+	ChiakiErrorCode err = chiaki_video_receiver_flush_frame(video_receiver, frame);
 	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGW(video_receiver->log, "Video receiver could not put unit.");
+		CHIAKI_LOGW(video_receiver->log, "Video receiver could not flush frame.");
 
-	// if we are currently building up a frame
-	if(video_receiver->frame_index_cur != video_receiver->frame_index_prev)
+	if(frame->frame_processor->buffer_pool && video_receiver->metrics.buffer_pool_misses)
 	{
-		// if we already have enough for the whole frame, flush it already
-		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor) || packet->unit_index == packet->units_in_frame_total - 1)
-			err = chiaki_video_receiver_flush_frame(video_receiver);
-		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGW(video_receiver->log, "Video receiver could not flush frame.");
+		ChiakiVideoBufferPoolStats pool_stats;
+		chiaki_video_buffer_pool_get_stats(frame->frame_processor->buffer_pool, &pool_stats, true);
+		chiaki_metric_add(video_receiver->metrics.buffer_pool_misses, pool_stats.misses);
 	}
 }
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, VideoReceiverFrame *frame_slot)
 {
+	int32_t frame_index_cur = frame_slot->frame_index;
 	uint8_t *frame;
 	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(frame_slot->frame_processor, &frame, &frame_size);
+	chiaki_frame_tracer_mark(video_receiver->frame_tracer, frame_index_cur, CHIAKI_FRAME_TRACE_FEC_DONE, chiaki_time_now_monotonic_us());
 
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
 		|| flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
@@ -169,34 +673,50 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		if (flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
 		{
 			ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, video_receiver->frame_index_cur);
-			video_receiver->frames_lost += video_receiver->frame_index_cur - next_frame_expected + 1;
-			video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+			video_receiver->corrupt_frame_cb(next_frame_expected, (ChiakiSeqNum16)frame_index_cur, video_receiver->corrupt_frame_cb_user);
+			int32_t lost = frame_index_cur - next_frame_expected + 1;
+			video_receiver->frames_lost += lost;
+			if(lost > 0)
+				chiaki_metric_add(video_receiver->metrics.frames_lost, (uint64_t)lost);
 		}
-		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index_cur);
+		chiaki_stream_stats_history_frame_failed(video_receiver->stats_history, chiaki_time_now_monotonic_us());
+		chiaki_metric_add(video_receiver->metrics.frames_failed, 1);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
+	chiaki_mutex_lock(&video_receiver->stream_stats_mutex);
+	chiaki_stream_stats_frame(&video_receiver->stream_stats, (uint64_t)frame_size);
+	chiaki_mutex_unlock(&video_receiver->stream_stats_mutex);
+	chiaki_metric_add(video_receiver->metrics.frames, 1);
+	chiaki_metric_observe(video_receiver->metrics.frame_bytes, (double)frame_size);
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+		chiaki_metric_add(video_receiver->metrics.frames_fec_recovered, 1);
+
 	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 	bool recovered = false;
 
 	ChiakiBitstreamSlice slice;
-	if(chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice))
+	bool slice_valid = chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice);
+	chiaki_stream_stats_history_frame(video_receiver->stats_history, chiaki_time_now_monotonic_us(), (uint64_t)frame_size,
+			slice_valid && slice.slice_type == CHIAKI_BITSTREAM_SLICE_I,
+			flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS);
+	if(slice_valid)
 	{
 		if(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P)
 		{
-			ChiakiSeqNum16 ref_frame_index = video_receiver->frame_index_cur - slice.reference_frame - 1;
+			ChiakiSeqNum16 ref_frame_index = frame_index_cur - slice.reference_frame - 1;
 			if(slice.reference_frame != 0xff && !have_ref_frame(video_receiver, ref_frame_index))
 			{
 				for(unsigned i=slice.reference_frame+1; i<16; i++)
 				{
-					ChiakiSeqNum16 ref_frame_index_new = video_receiver->frame_index_cur - i - 1;
+					ChiakiSeqNum16 ref_frame_index_new = frame_index_cur - i - 1;
 					if(have_ref_frame(video_receiver, ref_frame_index_new))
 					{
 						if(chiaki_bitstream_slice_set_reference_frame(&video_receiver->bitstream, frame, frame_size, i))
 						{
 							recovered = true;
-							CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur, (int)ref_frame_index_new);
+							CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d", (int)ref_frame_index, (int)frame_index_cur, (int)ref_frame_index_new);
 						}
 						break;
 					}
@@ -205,7 +725,8 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 				{
 					succ = false;
 					video_receiver->frames_lost++;
-					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur);
+					chiaki_metric_add(video_receiver->metrics.frames_lost, 1);
+					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)frame_index_cur);
 				}
 			}
 		}
@@ -213,7 +734,8 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 
 	if(succ && video_receiver->session->video_sample_cb)
 	{
-		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->frames_lost, recovered, video_receiver->session->video_sample_cb_user);
+		chiaki_frame_tracer_mark(video_receiver->frame_tracer, frame_index_cur, CHIAKI_FRAME_TRACE_BITSTREAM_DONE, chiaki_time_now_monotonic_us());
+		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->frames_lost, recovered, frame_index_cur, video_receiver->session->video_sample_cb_user);
 		video_receiver->frames_lost = 0;
 		if(!cb_succ)
 		{
@@ -222,15 +744,13 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		}
 		else
 		{
-			add_ref_frame(video_receiver, video_receiver->frame_index_cur);
-			CHIAKI_LOGV(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)video_receiver->frame_index_cur);
+			add_ref_frame(video_receiver, frame_index_cur);
+			CHIAKI_LOGV(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)frame_index_cur);
 		}
 	}
 
-	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
-
 	if(succ)
-		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
+		video_receiver->frame_index_prev_complete = frame_index_cur;
 
 	return CHIAKI_ERR_SUCCESS;
 }
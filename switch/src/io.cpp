@@ -205,7 +205,7 @@ void IO::DumpProgramError(GLuint prog, const char *func, const char *file, int l
 	}
 #endif
 
-bool IO::VideoCB(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
+bool IO::VideoCB(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, int32_t frame_index, void *user)
 {
 	// callback function to decode video buffer
 
@@ -0,0 +1,902 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/**
+ * Micro-benchmarks for chiaki-lib, not run as part of ctest.
+ *
+ * Usage: chiaki-bench <benchmark> [args...]
+ */
+
+#include <chiaki/reactor.h>
+#include <chiaki/gkcrypt.h>
+#include <chiaki/fec.h>
+#include <chiaki/frameprocessor.h>
+#include <chiaki/base64.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#else
+#include <openssl/evp.h>
+#endif
+
+typedef struct bench_usage_t
+{
+	uint64_t wall_us;
+	uint64_t cpu_us;
+	uint64_t ctx_switches;
+	long threads; // -1 if unknown
+} BenchUsage;
+
+static long bench_thread_count(void)
+{
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/status", "r");
+	if(!f)
+		return -1;
+	char line[256];
+	long threads = -1;
+	while(fgets(line, sizeof(line), f))
+	{
+		if(!strncmp(line, "Threads:", 8))
+		{
+			threads = strtol(line + 8, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return threads;
+#else
+	return -1;
+#endif
+}
+
+static void bench_usage_get(BenchUsage *usage)
+{
+	usage->wall_us = chiaki_time_now_monotonic_us();
+	usage->cpu_us = 0;
+	usage->ctx_switches = 0;
+#ifndef _WIN32
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) == 0)
+	{
+		usage->cpu_us = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec
+			+ (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+		usage->ctx_switches = (uint64_t)ru.ru_nvcsw + ru.ru_nivcsw;
+	}
+#endif
+	usage->threads = bench_thread_count();
+}
+
+static void bench_sleep_ms(uint64_t ms)
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	chiaki_mutex_init(&mutex, false);
+	chiaki_cond_init(&cond);
+	chiaki_mutex_lock(&mutex);
+	uint64_t end = chiaki_time_now_monotonic_ms() + ms;
+	for(uint64_t now = chiaki_time_now_monotonic_ms(); now < end; now = chiaki_time_now_monotonic_ms())
+		chiaki_cond_timedwait(&cond, &mutex, end - now);
+	chiaki_mutex_unlock(&mutex);
+	chiaki_cond_fini(&cond);
+	chiaki_mutex_fini(&mutex);
+}
+
+/*
+ * reactor: the periodic workers of a stream connection, as a thread each or as timers on one reactor
+ */
+
+// send buffer resend, congestion control, feedback sender, heartbeat
+static const uint64_t reactor_bench_intervals_ms[] = { 100, 200, 200, 1000 };
+#define REACTOR_BENCH_WORKERS (sizeof(reactor_bench_intervals_ms) / sizeof(reactor_bench_intervals_ms[0]))
+
+typedef struct reactor_bench_worker_t
+{
+	uint64_t interval_ms;
+	ChiakiThread thread;
+	ChiakiBoolPredCond stop_cond;
+	ChiakiReactorTimer timer;
+	volatile uint64_t ticks;
+} ReactorBenchWorker;
+
+static void *reactor_bench_thread_func(void *user)
+{
+	ReactorBenchWorker *worker = user;
+	chiaki_bool_pred_cond_lock(&worker->stop_cond);
+	while(chiaki_bool_pred_cond_timedwait(&worker->stop_cond, worker->interval_ms) == CHIAKI_ERR_TIMEOUT)
+		worker->ticks++;
+	chiaki_bool_pred_cond_unlock(&worker->stop_cond);
+	return NULL;
+}
+
+static uint64_t reactor_bench_timer_cb(void *user)
+{
+	ReactorBenchWorker *worker = user;
+	worker->ticks++;
+	return worker->interval_ms;
+}
+
+static int reactor_bench_run(size_t sessions, uint64_t duration_ms, bool use_reactor)
+{
+	ReactorBenchWorker *workers = calloc(sessions * REACTOR_BENCH_WORKERS, sizeof(ReactorBenchWorker));
+	ChiakiReactor *reactors = use_reactor ? calloc(sessions, sizeof(ChiakiReactor)) : NULL;
+	if(!workers || (use_reactor && !reactors))
+	{
+		free(workers);
+		free(reactors);
+		return 1;
+	}
+
+	BenchUsage start, end;
+	bench_usage_get(&start);
+
+	for(size_t s=0; s<sessions; s++)
+	{
+		if(use_reactor && chiaki_reactor_init(&reactors[s]) != CHIAKI_ERR_SUCCESS)
+			abort();
+		for(size_t w=0; w<REACTOR_BENCH_WORKERS; w++)
+		{
+			ReactorBenchWorker *worker = &workers[s * REACTOR_BENCH_WORKERS + w];
+			worker->interval_ms = reactor_bench_intervals_ms[w];
+			if(use_reactor)
+				chiaki_reactor_timer_add(&reactors[s], &worker->timer, reactor_bench_timer_cb, worker, worker->interval_ms);
+			else
+			{
+				chiaki_bool_pred_cond_init(&worker->stop_cond);
+				if(chiaki_thread_create(&worker->thread, reactor_bench_thread_func, worker) != CHIAKI_ERR_SUCCESS)
+					abort();
+			}
+		}
+	}
+
+	bench_sleep_ms(duration_ms);
+	bench_usage_get(&end);
+
+	uint64_t ticks = 0;
+	for(size_t s=0; s<sessions; s++)
+	{
+		for(size_t w=0; w<REACTOR_BENCH_WORKERS; w++)
+		{
+			ReactorBenchWorker *worker = &workers[s * REACTOR_BENCH_WORKERS + w];
+			if(use_reactor)
+				chiaki_reactor_timer_remove(&reactors[s], &worker->timer);
+			else
+			{
+				chiaki_bool_pred_cond_signal(&worker->stop_cond);
+				chiaki_thread_join(&worker->thread, NULL);
+				chiaki_bool_pred_cond_fini(&worker->stop_cond);
+			}
+			ticks += worker->ticks;
+		}
+		if(use_reactor)
+			chiaki_reactor_fini(&reactors[s]);
+	}
+
+	uint64_t wall_us = end.wall_us - start.wall_us;
+	printf("%-8s sessions: %4zu  threads: %5ld  ticks: %8llu  cpu: %6.2f%%  ctx switches/s: %8.1f\n",
+		use_reactor ? "reactor" : "threads",
+		sessions,
+		end.threads,
+		(unsigned long long)ticks,
+		100.0 * (double)(end.cpu_us - start.cpu_us) / (double)wall_us,
+		(double)(end.ctx_switches - start.ctx_switches) * 1000000.0 / (double)wall_us);
+
+	free(workers);
+	free(reactors);
+	return 0;
+}
+
+static int bench_reactor(int argc, char **argv)
+{
+	size_t sessions = argc > 0 ? strtoul(argv[0], NULL, 0) : 16;
+	uint64_t duration_ms = argc > 1 ? strtoull(argv[1], NULL, 0) : 5000;
+	if(!sessions || !duration_ms)
+	{
+		fprintf(stderr, "usage: chiaki-bench reactor [sessions] [duration_ms]\n");
+		return 1;
+	}
+	int r = reactor_bench_run(sessions, duration_ms, false);
+	if(r)
+		return r;
+	return reactor_bench_run(sessions, duration_ms, true);
+}
+
+// same as counter_add() in gkcrypt.c
+static void bench_counter_add(uint8_t *out, const uint8_t *base, uint64_t v)
+{
+	for(size_t i=0; i<CHIAKI_GKCRYPT_BLOCK_SIZE; i++)
+	{
+		uint64_t r = base[i] + v;
+		out[i] = (uint8_t)(r & 0xff);
+		v = r >> 8;
+	}
+}
+
+/*
+ * gmac: per-packet Takion gmacs with a cached GCM context against a fresh context for every packet
+ */
+
+/**
+ * How chiaki_gkcrypt_gmac() worked before caching the context, set up a new one for every packet.
+ */
+static ChiakiErrorCode gmac_bench_ref(const uint8_t *key, const uint8_t *iv, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context ctx;
+	mbedtls_gcm_init(&ctx);
+	int r = mbedtls_gcm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8);
+	if(r == 0)
+		r = mbedtls_gcm_crypt_and_tag(&ctx, MBEDTLS_GCM_ENCRYPT, 0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
+				buf, buf_size, NULL, NULL, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out);
+	mbedtls_gcm_free(&ctx);
+	return r == 0 ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+#else
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return CHIAKI_ERR_MEMORY;
+	int len;
+	bool ok = EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL)
+		&& EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, 1)
+		&& EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
+		&& EVP_EncryptFinal_ex(ctx, NULL, &len)
+		&& EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out);
+	EVP_CIPHER_CTX_free(ctx);
+	return ok ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+#endif
+}
+
+static void gmac_bench_print(const char *name, size_t packets, size_t packet_size, uint64_t us)
+{
+	double s = (double)us / 1000000.0;
+	printf("%-10s packets: %8zu  size: %5zu  MACs/s: %10.0f  MB/s: %8.1f\n",
+		name, packets, packet_size, (double)packets / s, (double)(packets * packet_size) / (1000000.0 * s));
+}
+
+static int bench_gmac(int argc, char **argv)
+{
+	size_t packet_size = argc > 0 ? strtoul(argv[0], NULL, 0) : 1400;
+	size_t packets = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+	if(!packet_size || !packets)
+	{
+		fprintf(stderr, "usage: chiaki-bench gmac [packet_size] [packets]\n");
+		return 1;
+	}
+
+	static const uint8_t handshake_key[0x10] = { 0 };
+	static const uint8_t ecdh_secret[0x20] = { 0 };
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+	ChiakiGKCrypt gkcrypt;
+	if(chiaki_gkcrypt_init(&gkcrypt, &log, 0, 2, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return 1;
+
+	uint8_t *buf = malloc(packet_size);
+	uint8_t (*gmacs)[CHIAKI_GKCRYPT_GMAC_SIZE] = malloc(packets * CHIAKI_GKCRYPT_GMAC_SIZE);
+	if(!buf || !gmacs)
+		abort();
+	for(size_t i=0; i<packet_size; i++)
+		buf[i] = (uint8_t)i;
+
+	// key positions advance like the payloads of consecutive packets, so keys rotate as in a stream
+	uint8_t key[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint64_t key_index = UINT64_MAX;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<packets; i++)
+	{
+		uint64_t key_pos = (uint64_t)i * packet_size;
+		uint64_t index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+		if(index != key_index)
+		{
+			if(index)
+				chiaki_gkcrypt_gen_gmac_key(index, gkcrypt.key_gmac_base, gkcrypt.iv, key);
+			else
+				memcpy(key, gkcrypt.key_gmac_base, sizeof(key));
+			key_index = index;
+		}
+		uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		bench_counter_add(iv, gkcrypt.iv, key_pos / 0x10);
+		if(gmac_bench_ref(key, iv, buf, packet_size, gmacs[i]) != CHIAKI_ERR_SUCCESS)
+			abort();
+	}
+	gmac_bench_print("per-packet", packets, packet_size, chiaki_time_now_monotonic_us() - start_us);
+
+	size_t mismatches = 0;
+	start_us = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<packets; i++)
+	{
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		if(chiaki_gkcrypt_gmac(&gkcrypt, (uint64_t)i * packet_size, buf, packet_size, gmac) != CHIAKI_ERR_SUCCESS)
+			abort();
+		mismatches += memcmp(gmac, gmacs[i], sizeof(gmac)) != 0;
+	}
+	gmac_bench_print("cached", packets, packet_size, chiaki_time_now_monotonic_us() - start_us);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	free(gmacs);
+	free(buf);
+
+	if(mismatches)
+	{
+		fprintf(stderr, "%zu gmacs differ from the reference\n", mismatches);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * keystream: AES-CTR key stream generation with the persistent context against a new context for every call
+ */
+
+/**
+ * How chiaki_gkcrypt_gen_key_stream() worked before keeping the context, set up a new one and build every counter separately.
+ */
+static ChiakiErrorCode keystream_bench_ref(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	uint64_t counter_offset = key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE;
+	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
+		bench_counter_add(cur, gkcrypt->iv, counter_offset++);
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_context ctx;
+	mbedtls_aes_init(&ctx);
+	int r = mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128);
+	for(size_t i=0; r == 0 && i<buf_size; i+=CHIAKI_GKCRYPT_BLOCK_SIZE)
+		r = mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i);
+	mbedtls_aes_free(&ctx);
+	return r == 0 ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+#else
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return CHIAKI_ERR_MEMORY;
+	int outl;
+	bool ok = EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL)
+		&& EVP_CIPHER_CTX_set_padding(ctx, 0)
+		&& EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size);
+	EVP_CIPHER_CTX_free(ctx);
+	return ok ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+#endif
+}
+
+static int bench_keystream(int argc, char **argv)
+{
+	size_t chunk_size = argc > 0 ? strtoul(argv[0], NULL, 0) : 0x1000;
+	size_t total_mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 256;
+	if(!chunk_size || chunk_size % CHIAKI_GKCRYPT_BLOCK_SIZE || !total_mb)
+	{
+		fprintf(stderr, "usage: chiaki-bench keystream [chunk_size] [total_mb]\n");
+		return 1;
+	}
+
+	static const uint8_t handshake_key[0x10] = { 0 };
+	static const uint8_t ecdh_secret[0x20] = { 0 };
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+	ChiakiGKCrypt gkcrypt;
+	if(chiaki_gkcrypt_init(&gkcrypt, &log, 0, 2, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return 1;
+
+	uint8_t *buf = malloc(chunk_size);
+	uint8_t *buf_ref = malloc(chunk_size);
+	if(!buf || !buf_ref)
+		abort();
+
+	size_t chunks = total_mb * 1000000 / chunk_size;
+	if(!chunks)
+		chunks = 1;
+	double gb = (double)(chunks * chunk_size) / 1e9;
+	uint64_t ref_us = 0, us = 0;
+	size_t mismatches = 0;
+	for(size_t i=0; i<chunks; i++)
+	{
+		uint64_t key_pos = (uint64_t)i * chunk_size;
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		if(keystream_bench_ref(&gkcrypt, key_pos, buf_ref, chunk_size) != CHIAKI_ERR_SUCCESS)
+			abort();
+		uint64_t mid_us = chiaki_time_now_monotonic_us();
+		if(chiaki_gkcrypt_gen_key_stream(&gkcrypt, key_pos, buf, chunk_size) != CHIAKI_ERR_SUCCESS)
+			abort();
+		uint64_t end_us = chiaki_time_now_monotonic_us();
+		ref_us += mid_us - start_us;
+		us += end_us - mid_us;
+		mismatches += memcmp(buf, buf_ref, chunk_size) != 0;
+	}
+
+	printf("%-10s chunk: %6zu  GB/s: %6.2f\n", "per-call", chunk_size, gb / ((double)ref_us / 1e6));
+	printf("%-10s chunk: %6zu  GB/s: %6.2f\n", "persistent", chunk_size, gb / ((double)us / 1e6));
+
+	size_t key_buf_size = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT * 0x1000;
+	double fill_us = (double)key_buf_size * ((double)us / (double)(chunks * chunk_size));
+	printf("filling the largest default key buffer (%zu bytes) takes %.1f us\n", key_buf_size, fill_us);
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	free(buf_ref);
+	free(buf);
+
+	if(mismatches)
+	{
+		fprintf(stderr, "%zu chunks differ from the reference\n", mismatches);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * fec: decoding the frames from test/fec_test_cases.inl with and without ChiakiFecCache and with each ChiakiFecSimd,
+ * and the time from the last unit to the recovered frame with ChiakiFecProgressive against a full decode
+ */
+
+typedef struct fec_test_case_t
+{
+	unsigned int k;
+	unsigned int m;
+	const int erasures[0x10];
+	const char *frame_buffer_b64;
+	const size_t unit_size;
+} FECTestCase;
+
+#include "fec_test_cases.inl"
+
+#define FEC_BENCH_CASES_COUNT (sizeof(fec_test_cases) / sizeof(fec_test_cases[0]))
+
+typedef struct fec_bench_frame_t
+{
+	const FECTestCase *test_case;
+	uint8_t *buf;
+	size_t stride;
+	size_t erasures_count;
+} FECBenchFrame;
+
+/**
+ * @param cache NULL to decode without cache
+ * @param repeat how many times each frame is decoded in a row before the next one
+ */
+static uint64_t fec_bench_run(FECBenchFrame *frames, ChiakiFecCache *cache, size_t rounds, size_t repeat)
+{
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	for(size_t round=0; round<rounds; round++)
+	{
+		for(size_t i=0; i<FEC_BENCH_CASES_COUNT; i++)
+		{
+			FECBenchFrame *frame = &frames[i];
+			const FECTestCase *tc = frame->test_case;
+			for(size_t j=0; j<repeat; j++)
+			{
+				// decoding only overwrites the erased units, so the same buffer can be decoded again
+				ChiakiErrorCode err = cache
+					? chiaki_fec_cache_decode(cache, frame->buf, tc->unit_size, frame->stride, tc->k, tc->m, (const unsigned int *)tc->erasures, frame->erasures_count)
+					: chiaki_fec_decode(frame->buf, tc->unit_size, frame->stride, tc->k, tc->m, (const unsigned int *)tc->erasures, frame->erasures_count);
+				if(err != CHIAKI_ERR_SUCCESS)
+					abort();
+			}
+		}
+	}
+	return chiaki_time_now_monotonic_us() - start_us;
+}
+
+/**
+ * Put the units of each frame except the erased ones in order into progressive and decode.
+ * @param last_us receives the time spent on putting the last unit and decoding, summed over all frames
+ * @return time spent on everything
+ */
+static uint64_t fec_bench_run_progressive(FECBenchFrame *frames, ChiakiFecProgressive *progressive, size_t rounds, size_t repeat, uint64_t *last_us)
+{
+	*last_us = 0;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	for(size_t round=0; round<rounds; round++)
+	{
+		for(size_t i=0; i<FEC_BENCH_CASES_COUNT; i++)
+		{
+			FECBenchFrame *frame = &frames[i];
+			const FECTestCase *tc = frame->test_case;
+			unsigned int units_count = tc->k + tc->m;
+			for(size_t j=0; j<repeat; j++)
+			{
+				if(chiaki_fec_progressive_start(progressive, frame->buf, tc->k, tc->m, tc->unit_size, frame->stride) != CHIAKI_ERR_SUCCESS)
+					abort();
+				unsigned int last = units_count;
+				unsigned int erased_passed = 0;
+				for(unsigned int u=0; u<units_count; u++)
+				{
+					bool erased = false;
+					for(size_t e=0; e<frame->erasures_count; e++)
+						erased |= (unsigned int)tc->erasures[e] == u;
+					if(erased)
+					{
+						// like ChiakiFrameProcessor, keep a row for every source unit known to be lost
+						if(u < tc->k)
+							erased_passed++;
+						continue;
+					}
+					if(last < units_count)
+					{
+						chiaki_fec_progressive_put(progressive, last);
+						chiaki_fec_progressive_reserve(progressive, erased_passed);
+					}
+					last = u;
+				}
+				uint64_t last_start_us = chiaki_time_now_monotonic_us();
+				chiaki_fec_progressive_put(progressive, last);
+				if(chiaki_fec_progressive_decode(progressive) != CHIAKI_ERR_SUCCESS)
+					abort();
+				*last_us += chiaki_time_now_monotonic_us() - last_start_us;
+			}
+		}
+	}
+	return chiaki_time_now_monotonic_us() - start_us;
+}
+
+/**
+ * @param recovered_bytes payload recovered by all decodes
+ */
+static void fec_bench_print(const char *name, size_t decodes, size_t recovered_bytes, uint64_t us, const ChiakiFecCache *cache)
+{
+	printf("%-24s %8.2f us/decode %8.1f MB/s", name, (double)us / (double)decodes, (double)recovered_bytes / (double)us);
+	if(cache)
+	{
+		const ChiakiFecCacheStats *stats = &cache->stats;
+		printf("  coding hits: %5.1f%%  decoding hits: %5.1f%%",
+				100.0 * (double)stats->coding_hits / (double)(stats->coding_hits + stats->coding_misses),
+				100.0 * (double)stats->decoding_hits / (double)(stats->decoding_hits + stats->decoding_misses));
+	}
+	printf("\n");
+}
+
+static int bench_fec(int argc, char **argv)
+{
+	size_t rounds = argc > 0 ? strtoul(argv[0], NULL, 0) : 20;
+	size_t repeat = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+	if(!rounds || !repeat)
+	{
+		fprintf(stderr, "usage: chiaki-bench fec [rounds] [repeat]\n");
+		return 1;
+	}
+
+	(void)fec_test_case_ids; // only used by the unit tests
+
+	FECBenchFrame frames[FEC_BENCH_CASES_COUNT];
+	size_t recovered_bytes = 0; // by decoding each frame once
+	for(size_t i=0; i<FEC_BENCH_CASES_COUNT; i++)
+	{
+		const FECTestCase *tc = &fec_test_cases[i];
+		FECBenchFrame *frame = &frames[i];
+		frame->test_case = tc;
+		frame->stride = ((tc->unit_size + 0xf) / 0x10) * 0x10;
+		size_t b64len = strlen(tc->frame_buffer_b64);
+		uint8_t *ref = malloc(b64len);
+		frame->buf = malloc(frame->stride * (tc->k + tc->m));
+		if(!ref || !frame->buf)
+			abort();
+		if(chiaki_base64_decode(tc->frame_buffer_b64, b64len, ref, &b64len) != CHIAKI_ERR_SUCCESS)
+			abort();
+		for(size_t j=0; j<tc->k + tc->m; j++)
+			memcpy(frame->buf + j * frame->stride, ref + j * tc->unit_size, tc->unit_size);
+		free(ref);
+		for(frame->erasures_count = 0; tc->erasures[frame->erasures_count] >= 0; frame->erasures_count++);
+		recovered_bytes += frame->erasures_count * tc->unit_size;
+	}
+
+	// each frame decoded several times in a row, like a stream where the same units keep getting lost,
+	// and each frame once per round, which is more different patterns than fit into the cache
+	size_t decodes_repeat = rounds * FEC_BENCH_CASES_COUNT * repeat;
+	size_t decodes_cycle = rounds * FEC_BENCH_CASES_COUNT;
+
+	size_t recovered_repeat = rounds * repeat * recovered_bytes;
+	size_t recovered_cycle = rounds * recovered_bytes;
+
+	printf("simd: %s\n", chiaki_fec_simd_string(chiaki_fec_simd_best()));
+	fec_bench_print("uncached", decodes_repeat, recovered_repeat, fec_bench_run(frames, NULL, rounds, repeat), NULL);
+
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+	uint64_t us = fec_bench_run(frames, &cache, rounds, repeat);
+	fec_bench_print("cached, repeated", decodes_repeat, recovered_repeat, us, &cache);
+	chiaki_fec_cache_fini(&cache);
+
+	chiaki_fec_cache_init(&cache);
+	us = fec_bench_run(frames, &cache, rounds, 1);
+	fec_bench_print("cached, cycling", decodes_cycle, recovered_cycle, us, &cache);
+	chiaki_fec_cache_fini(&cache);
+
+	for(ChiakiFecSimd simd=CHIAKI_FEC_SIMD_NONE; simd<=CHIAKI_FEC_SIMD_NEON; simd++)
+	{
+		if(!chiaki_fec_simd_supported(simd))
+			continue;
+		chiaki_fec_cache_init(&cache);
+		cache.simd = simd;
+		us = fec_bench_run(frames, &cache, rounds, repeat);
+		char name[32];
+		snprintf(name, sizeof(name), "cached, repeated, %s", chiaki_fec_simd_string(simd));
+		fec_bench_print(name, decodes_repeat, recovered_repeat, us, NULL);
+		chiaki_fec_cache_fini(&cache);
+	}
+
+	// a full decode only starts after the last unit, so all of its time is between the last unit and the frame
+	chiaki_fec_cache_init(&cache);
+	us = fec_bench_run(frames, &cache, rounds, repeat);
+	printf("%-24s %8.2f us from the last unit to the frame\n", "full decode", (double)us / (double)decodes_repeat);
+	ChiakiFecProgressive progressive;
+	chiaki_fec_progressive_init(&progressive, &cache);
+	uint64_t last_us;
+	us = fec_bench_run_progressive(frames, &progressive, rounds, repeat, &last_us);
+	printf("%-24s %8.2f us from the last unit to the frame, %8.2f us for all units\n", "progressive",
+			(double)last_us / (double)decodes_repeat, (double)us / (double)decodes_repeat);
+	chiaki_fec_progressive_fini(&progressive);
+	chiaki_fec_cache_fini(&cache);
+
+	for(size_t i=0; i<FEC_BENCH_CASES_COUNT; i++)
+		free(frames[i].buf);
+	return 0;
+}
+
+/*
+ * framebuf: feeding frames through ChiakiFrameProcessor while the previous frame is still held like by the decoder,
+ * reporting the bytes zeroed per frame against zeroing the whole frame buffer
+ */
+
+static int bench_framebuf(int argc, char **argv)
+{
+	size_t units = argc > 0 ? strtoul(argv[0], NULL, 0) : 160; // about 4K at 100 MBit/s and 60 fps
+	size_t frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 5000;
+	size_t loss_interval = argc > 2 ? strtoul(argv[2], NULL, 0) : 10; // every n-th frame loses a unit
+	const size_t unit_size = 1408;
+	const size_t units_fec = 16;
+	if(!units || units + units_fec > CHIAKI_FEC_UNITS_MAX || !frames)
+	{
+		fprintf(stderr, "usage: chiaki-bench framebuf [units] [frames] [loss_interval]\n");
+		return 1;
+	}
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+
+	size_t total_units = units + units_fec;
+	uint8_t *buf = calloc(total_units, unit_size);
+	if(!buf)
+		return 1;
+	for(size_t u=0; u<units; u++)
+	{
+		uint8_t *unit = buf + u * unit_size;
+		unit[0] = unit[1] = 0; // no padding
+		for(size_t i=2; i<unit_size; i++)
+			unit[i] = (uint8_t)(u + i);
+	}
+	if(chiaki_fec_encode(buf, unit_size, unit_size, units, units_fec) != CHIAKI_ERR_SUCCESS)
+		return 1;
+
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, &log);
+	uint8_t *held = NULL;
+	size_t frame_size_sum = 0;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	for(size_t f=0; f<frames; f++)
+	{
+		size_t lost = loss_interval && f % loss_interval == 0 ? f % units : SIZE_MAX;
+		for(size_t u=0; u<total_units; u++)
+		{
+			if(u == lost)
+				continue;
+			ChiakiTakionAVPacket packet = { 0 };
+			packet.is_video = true;
+			packet.frame_index = (ChiakiSeqNum16)f;
+			packet.unit_index = (ChiakiSeqNum16)u;
+			packet.units_in_frame_total = (uint16_t)total_units;
+			packet.units_in_frame_fec = (uint16_t)units_fec;
+			packet.data = buf + u * unit_size;
+			packet.data_size = unit_size;
+			if(u == 0 || (lost == 0 && u == 1))
+				chiaki_frame_processor_alloc_frame(&frame_processor, &packet);
+			chiaki_frame_processor_put_unit(&frame_processor, &packet);
+			if(chiaki_frame_processor_flush_possible(&frame_processor))
+				break;
+		}
+		uint8_t *frame;
+		size_t frame_size;
+		if(chiaki_frame_processor_flush(&frame_processor, &frame, &frame_size) != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS
+			&& lost == SIZE_MAX)
+			abort();
+		frame_size_sum += frame_size;
+		chiaki_video_buffer_ref(frame);
+		if(held)
+			chiaki_video_buffer_unref(held);
+		held = frame;
+	}
+	uint64_t us = chiaki_time_now_monotonic_us() - start_us;
+
+	size_t stride = ((unit_size + 0xf) / 0x10) * 0x10;
+	size_t full_bytes = total_units * stride + CHIAKI_VIDEO_BUFFER_PADDING_SIZE + total_units * sizeof(size_t);
+	ChiakiVideoBufferPoolStats pool_stats;
+	chiaki_video_buffer_pool_get_stats(frame_processor.buffer_pool, &pool_stats, false);
+	printf("%zu units of %zu bytes, %zu KiB frames, fec every %zu frames\n", total_units, unit_size, frame_size_sum / frames / 1024, loss_interval);
+	printf("%-24s %8.2f us/frame\n", "frame processor", (double)us / (double)frames);
+	printf("%-24s %8llu bytes/frame zeroed, zeroing the whole frame buffer and unit slots would be %zu\n", "",
+			(unsigned long long)(frame_processor.bytes_zeroed / frames), full_bytes);
+	printf("%-24s %8llu buffer allocations from the heap, %llu from the pool\n", "",
+			(unsigned long long)pool_stats.misses, (unsigned long long)pool_stats.hits);
+
+	chiaki_video_buffer_unref(held);
+	chiaki_frame_processor_fini(&frame_processor);
+	free(buf);
+	return 0;
+}
+
+/*
+ * fecloss: feeding lossy frames through ChiakiFrameProcessor with and without progressive fec,
+ * reporting the time spent on receiving the units, from the last unit to the frame and in total.
+ * Frames without loss, but with reordered units, show what progressive fec costs when nothing is lost.
+ */
+
+typedef struct fec_loss_bench_result_t
+{
+	uint64_t receive_us; // putting all units but the last
+	uint64_t ready_us; // putting the last unit and flushing
+	uint64_t progressive_frames;
+} FECLossBenchResult;
+
+static void fec_loss_bench_run(ChiakiLog *log, uint8_t *buf, size_t unit_size, size_t units, size_t units_fec, size_t erasures,
+		bool reorder, size_t frames, bool progressive, FECLossBenchResult *result)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, log);
+	frame_processor.fec_progressive_enabled = progressive;
+	size_t total_units = units + units_fec;
+	memset(result, 0, sizeof(*result));
+	for(size_t f=0; f<frames; f++)
+	{
+		// the order in which the units arrive, with erasures spread over the source units
+		size_t order[CHIAKI_FEC_UNITS_MAX];
+		size_t order_count = 0;
+		for(size_t u=0; u<total_units; u++)
+		{
+			bool lost = false;
+			for(size_t e=0; e<erasures; e++)
+				lost |= u == (f * 7 + e * units / erasures) % units;
+			if(!lost)
+				order[order_count++] = u;
+		}
+		if(reorder)
+		{
+			// only source units, a fec unit overtaking one would make the frame flushable before it arrived
+			for(size_t i=f % 2; i+1<order_count && order[i + 1]<units; i+=3)
+			{
+				size_t tmp = order[i];
+				order[i] = order[i + 1];
+				order[i + 1] = tmp;
+			}
+		}
+
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		uint64_t last_us = start_us;
+		for(size_t i=0; i<order_count; i++)
+		{
+			size_t u = order[i];
+			ChiakiTakionAVPacket packet = { 0 };
+			packet.is_video = true;
+			packet.frame_index = (ChiakiSeqNum16)f;
+			packet.unit_index = (ChiakiSeqNum16)u;
+			packet.units_in_frame_total = (uint16_t)total_units;
+			packet.units_in_frame_fec = (uint16_t)units_fec;
+			packet.data = buf + u * unit_size;
+			packet.data_size = unit_size;
+			if(i == 0)
+				chiaki_frame_processor_alloc_frame(&frame_processor, &packet);
+			// the unit that makes the frame complete or flushable
+			bool last = i + 1 == order_count
+				|| frame_processor.units_source_received + frame_processor.units_fec_received + 1 >= units;
+			if(last)
+				last_us = chiaki_time_now_monotonic_us();
+			chiaki_frame_processor_put_unit(&frame_processor, &packet);
+			if(last)
+				break;
+		}
+		uint8_t *frame;
+		size_t frame_size;
+		ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&frame_processor, &frame, &frame_size);
+		if(flush_result != (erasures ? CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS : CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS))
+			abort();
+		uint64_t end_us = chiaki_time_now_monotonic_us();
+		result->receive_us += last_us - start_us;
+		result->ready_us += end_us - last_us;
+	}
+	result->progressive_frames = frame_processor.fec_stats.frames_progressive;
+	chiaki_frame_processor_fini(&frame_processor);
+}
+
+static void fec_loss_bench_print(const char *name, size_t frames, const FECLossBenchResult *result)
+{
+	printf("%-24s %8.2f us receiving %8.2f us from the last unit to the frame %8.2f us total  (%llu progressive)\n", name,
+			(double)result->receive_us / (double)frames, (double)result->ready_us / (double)frames,
+			(double)(result->receive_us + result->ready_us) / (double)frames,
+			(unsigned long long)result->progressive_frames);
+}
+
+static int bench_fecloss(int argc, char **argv)
+{
+	size_t units = argc > 0 ? strtoul(argv[0], NULL, 0) : 160; // about 4K at 100 MBit/s and 60 fps
+	size_t units_fec = argc > 1 ? strtoul(argv[1], NULL, 0) : 16;
+	size_t erasures = argc > 2 ? strtoul(argv[2], NULL, 0) : 2;
+	size_t frames = argc > 3 ? strtoul(argv[3], NULL, 0) : 2000;
+	const size_t unit_size = 1408;
+	if(!units || !units_fec || units + units_fec > CHIAKI_FEC_UNITS_MAX || erasures > units_fec || erasures > units || !frames)
+	{
+		fprintf(stderr, "usage: chiaki-bench fecloss [units] [fec_units] [erasures] [frames]\n");
+		return 1;
+	}
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+
+	size_t total_units = units + units_fec;
+	uint8_t *buf = calloc(total_units, unit_size);
+	if(!buf)
+		return 1;
+	for(size_t u=0; u<units; u++)
+	{
+		uint8_t *unit = buf + u * unit_size;
+		unit[0] = unit[1] = 0; // no padding
+		for(size_t i=2; i<unit_size; i++)
+			unit[i] = (uint8_t)(u * 31 + i);
+	}
+	if(chiaki_fec_encode(buf, unit_size, unit_size, units, units_fec) != CHIAKI_ERR_SUCCESS)
+		return 1;
+
+	printf("%zu + %zu units of %zu bytes, %zu lost per frame, simd: %s\n", units, units_fec, unit_size, erasures,
+			chiaki_fec_simd_string(chiaki_fec_simd_best()));
+	FECLossBenchResult result;
+	fec_loss_bench_run(&log, buf, unit_size, units, units_fec, erasures, false, frames, false, &result);
+	fec_loss_bench_print("lossy, full decode", frames, &result);
+	fec_loss_bench_run(&log, buf, unit_size, units, units_fec, erasures, false, frames, true, &result);
+	fec_loss_bench_print("lossy, progressive", frames, &result);
+	fec_loss_bench_run(&log, buf, unit_size, units, units_fec, erasures, true, frames, false, &result);
+	fec_loss_bench_print("lossy, reordered, full", frames, &result);
+	fec_loss_bench_run(&log, buf, unit_size, units, units_fec, erasures, true, frames, true, &result);
+	fec_loss_bench_print("lossy, reordered, prog.", frames, &result);
+	fec_loss_bench_run(&log, buf, unit_size, units, units_fec, 0, true, frames, false, &result);
+	fec_loss_bench_print("reordered, full decode", frames, &result);
+	fec_loss_bench_run(&log, buf, unit_size, units, units_fec, 0, true, frames, true, &result);
+	fec_loss_bench_print("reordered, progressive", frames, &result);
+
+	free(buf);
+	return 0;
+}
+
+typedef struct bench_t
+{
+	const char *name;
+	const char *args;
+	int (*func)(int argc, char **argv);
+} Bench;
+
+static const Bench benches[] = {
+	{ "reactor", "[sessions] [duration_ms]", bench_reactor },
+	{ "gmac", "[packet_size] [packets]", bench_gmac },
+	{ "keystream", "[chunk_size] [total_mb]", bench_keystream },
+	{ "fec", "[rounds] [repeat]", bench_fec },
+	{ "framebuf", "[units] [frames] [loss_interval]", bench_framebuf },
+	{ "fecloss", "[units] [fec_units] [erasures] [frames]", bench_fecloss },
+};
+
+int main(int argc, char **argv)
+{
+	if(argc >= 2)
+	{
+		for(size_t i=0; i<sizeof(benches) / sizeof(benches[0]); i++)
+		{
+			if(!strcmp(argv[1], benches[i].name))
+				return benches[i].func(argc - 2, argv + 2);
+		}
+	}
+
+	fprintf(stderr, "usage: %s <benchmark> [args...]\n\nbenchmarks:\n", argv[0]);
+	for(size_t i=0; i<sizeof(benches) / sizeof(benches[0]); i++)
+		fprintf(stderr, "  %s %s\n", benches[i].name, benches[i].args);
+	return 1;
+}
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/delaygradient.h>
+
+#define SIM_FRAME_INTERVAL_US 16667
+#define SIM_PACKET_SIZE 1400
+#define SIM_BASE_DELAY_US 5000
+#define SIM_REPORT_FRAMES 12 // about every 200ms like the congestion control
+
+/**
+ * Frames of the same size sent at a fixed rate through a bottleneck link with a fifo queue
+ */
+typedef struct sim_t
+{
+	ChiakiDelayGradient dg;
+	uint64_t frame_index;
+	double link_free_us; // when the link is done with everything queued so far
+	double capacity_bps;
+	uint64_t frame_size;
+	uint32_t rng;
+	uint64_t jitter_us; // random extra delay of up to this, not caused by the queue
+	uint64_t received;
+	uint64_t lost;
+	unsigned int reports_overuse;
+	ChiakiTakionCongestionPacket packet;
+} Sim;
+
+static void sim_init(Sim *sim, double capacity_bps)
+{
+	chiaki_delay_gradient_init(&sim->dg, 0.05);
+	sim->frame_index = 0;
+	sim->link_free_us = 0.0;
+	sim->capacity_bps = capacity_bps;
+	sim->frame_size = 40000; // ~19.2 Mbps at 60 fps
+	sim->rng = 1;
+	sim->jitter_us = 0;
+	sim->received = 0;
+	sim->lost = 0;
+	sim->reports_overuse = 0;
+}
+
+static uint32_t sim_rand(Sim *sim)
+{
+	sim->rng = sim->rng * 1103515245 + 12345;
+	return sim->rng >> 16;
+}
+
+/**
+ * Run the trace for the given number of frames, with one report every SIM_REPORT_FRAMES frames.
+ * Every 10th packet is lost, which must not be mistaken for congestion.
+ * @return the state after the last frame
+ */
+static ChiakiDelayGradientState sim_run(Sim *sim, unsigned int frames)
+{
+	for(unsigned int i=0; i<frames; i++)
+	{
+		uint64_t send_us = sim->frame_index * SIM_FRAME_INTERVAL_US;
+		double start_us = sim->link_free_us > send_us ? sim->link_free_us : (double)send_us;
+		double first_us = start_us + SIM_PACKET_SIZE * 8 * 1000000.0 / sim->capacity_bps;
+		sim->link_free_us = start_us + sim->frame_size * 8 * 1000000.0 / sim->capacity_bps;
+		uint64_t arrival_us = 1000000 + (uint64_t)first_us + SIM_BASE_DELAY_US;
+		if(sim->jitter_us)
+			arrival_us += sim_rand(sim) % sim->jitter_us;
+		chiaki_delay_gradient_push_frame(&sim->dg, send_us, arrival_us);
+
+		uint64_t packets = (sim->frame_size + SIM_PACKET_SIZE - 1) / SIM_PACKET_SIZE;
+		sim->lost += packets / 10;
+		sim->received += packets - packets / 10;
+		sim->frame_index++;
+		if(sim->frame_index % SIM_REPORT_FRAMES == 0)
+		{
+			chiaki_delay_gradient_report(&sim->dg, sim->received, sim->lost, &sim->packet);
+			munit_assert_uint64(sim->packet.received + sim->packet.lost, ==, sim->received + sim->lost);
+			if(sim->packet.lost * 20 > sim->received + sim->lost) // more than packet_loss_max
+				sim->reports_overuse++;
+			sim->received = 0;
+			sim->lost = 0;
+		}
+	}
+	return sim->dg.state;
+}
+
+static MunitResult test_steady(const MunitParameter params[], void *user)
+{
+	Sim sim;
+	sim_init(&sim, 30000000.0);
+	sim.jitter_us = 3000;
+	sim_run(&sim, 60 * 30);
+	munit_assert_uint64(sim.dg.overuse_detected, ==, 0);
+	munit_assert_uint(sim.reports_overuse, ==, 0);
+	// 10% random loss is clamped to packet_loss_max
+	munit_assert_uint16(sim.packet.lost, ==, 17);
+	munit_assert_uint16(sim.packet.received, ==, 331);
+	return MUNIT_OK;
+}
+
+static MunitResult test_congestion(const MunitParameter params[], void *user)
+{
+	Sim sim;
+	sim_init(&sim, 30000000.0);
+	munit_assert_int(sim_run(&sim, 60 * 5), ==, CHIAKI_DELAY_GRADIENT_NORMAL);
+	munit_assert_uint(sim.reports_overuse, ==, 0);
+
+	// bottleneck drops below the stream bitrate, the queue grows by ~4.6ms every frame
+	sim.capacity_bps = 15000000.0;
+	unsigned int frames;
+	for(frames=0; frames<60; frames++)
+	{
+		if(sim_run(&sim, 1) == CHIAKI_DELAY_GRADIENT_OVERUSE)
+			break;
+	}
+	munit_assert_uint(frames, <, 30); // detected within half a second
+	munit_assert_uint64(sim.dg.overuse_detected, ==, 1);
+
+	// reported loss increases while the queue keeps growing
+	sim_run(&sim, SIM_REPORT_FRAMES - sim.frame_index % SIM_REPORT_FRAMES);
+	uint16_t lost_first = sim.packet.lost;
+	munit_assert_uint16(lost_first, ==, 35); // at least 10%
+	sim_run(&sim, SIM_REPORT_FRAMES);
+	munit_assert_int(sim.dg.state, ==, CHIAKI_DELAY_GRADIENT_OVERUSE);
+	munit_assert_uint16(sim.packet.lost, >, lost_first);
+
+	// console reduced the bitrate, the queue drains
+	sim.frame_size = 20000;
+	munit_assert_int(sim_run(&sim, 30), ==, CHIAKI_DELAY_GRADIENT_UNDERUSE);
+
+	// queue is empty again, back to clamping random loss
+	sim_run(&sim, 60 * 10);
+	munit_assert_int(sim.dg.state, ==, CHIAKI_DELAY_GRADIENT_NORMAL);
+	munit_assert_uint64(sim.dg.overuse_detected, ==, 1);
+	munit_assert_uint16(sim.packet.lost, ==, 9);
+	munit_assert_uint16(sim.packet.received, ==, 171);
+	return MUNIT_OK;
+}
+
+static MunitResult test_gap(const MunitParameter params[], void *user)
+{
+	ChiakiDelayGradient dg;
+	chiaki_delay_gradient_init(&dg, 0.05);
+
+	// frames arriving ever later, but with a pause in between that must not count as queuing
+	uint64_t send_us = 0;
+	uint64_t arrival_us = 5000;
+	for(int i=0; i<200; i++)
+	{
+		chiaki_delay_gradient_push_frame(&dg, send_us, arrival_us);
+		send_us += SIM_FRAME_INTERVAL_US;
+		arrival_us += SIM_FRAME_INTERVAL_US;
+		if(i == 100)
+			arrival_us += 3000000;
+	}
+	munit_assert_int(dg.state, ==, CHIAKI_DELAY_GRADIENT_NORMAL);
+	munit_assert_uint64(dg.overuse_detected, ==, 0);
+
+	// reordered frames are ignored
+	chiaki_delay_gradient_push_frame(&dg, send_us - 5 * SIM_FRAME_INTERVAL_US, arrival_us);
+	munit_assert_uint64(dg.deltas, ==, 98);
+
+	ChiakiTakionCongestionPacket packet;
+	chiaki_delay_gradient_report(&dg, 0, 0, &packet);
+	munit_assert_uint16(packet.received, ==, 0);
+	munit_assert_uint16(packet.lost, ==, 0);
+	return MUNIT_OK;
+}
+
+MunitTest tests_delay_gradient[] = {
+	{
+		"/steady",
+		test_steady,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/congestion",
+		test_congestion,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gap",
+		test_gap,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
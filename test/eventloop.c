@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/eventloop.h>
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#endif
+
+static chiaki_socket_t udp_loopback_socket(struct sockaddr_in *addr)
+{
+	chiaki_socket_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(sock));
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = 0;
+	munit_assert_int(bind(sock, (struct sockaddr *)addr, sizeof(*addr)), ==, 0);
+	socklen_t addr_len = sizeof(*addr);
+	munit_assert_int(getsockname(sock, (struct sockaddr *)addr, &addr_len), ==, 0);
+	return sock;
+}
+
+static MunitResult test_event_loop(const MunitParameter params[], void *user)
+{
+	ChiakiEventLoop loop;
+	ChiakiErrorCode err = chiaki_event_loop_init(&loop);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	struct sockaddr_in addr_a, addr_b;
+	chiaki_socket_t a = udp_loopback_socket(&addr_a);
+	chiaki_socket_t b = udp_loopback_socket(&addr_b);
+
+	err = chiaki_event_loop_add(&loop, a, CHIAKI_EVENT_LOOP_READ, &addr_a);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_add(&loop, b, CHIAKI_EVENT_LOOP_READ | CHIAKI_EVENT_LOOP_EDGE, &addr_b);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_add(&loop, b, CHIAKI_EVENT_LOOP_READ, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	ChiakiEventLoopEvent events[4];
+	size_t events_count;
+	err = chiaki_event_loop_wait(&loop, events, 4, &events_count, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+	munit_assert_size(events_count, ==, 0);
+
+	// a sends to b, only b becomes readable
+	uint8_t buf[4] = { 1, 2, 3, 4 };
+	munit_assert_int(sendto(a, (const CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)&addr_b, sizeof(addr_b)), ==, sizeof(buf));
+	err = chiaki_event_loop_wait(&loop, events, 4, &events_count, 1000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(events_count, ==, 1);
+	munit_assert(events[0].fd == b);
+	munit_assert_uint32(events[0].events, ==, CHIAKI_EVENT_LOOP_READ);
+	munit_assert_ptr_equal(events[0].user, &addr_b);
+	uint8_t recv_buf[4];
+	munit_assert_int(recv(b, (CHIAKI_SOCKET_BUF_TYPE)recv_buf, sizeof(recv_buf), 0), ==, sizeof(buf));
+
+	err = chiaki_event_loop_remove(&loop, b);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(sendto(a, (const CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)&addr_b, sizeof(addr_b)), ==, sizeof(buf));
+	err = chiaki_event_loop_wait(&loop, events, 4, &events_count, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	// stop wins over ready fds and stays until reset
+	munit_assert_int(sendto(b, (const CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)&addr_a, sizeof(addr_a)), ==, sizeof(buf));
+	chiaki_event_loop_stop(&loop);
+	err = chiaki_event_loop_wait(&loop, events, 4, &events_count, 1000);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+	err = chiaki_event_loop_wait(&loop, events, 4, &events_count, 1000);
+	munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+	err = chiaki_event_loop_reset(&loop);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_event_loop_wait(&loop, events, 4, &events_count, 1000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(events_count, ==, 1);
+	munit_assert(events[0].fd == a);
+
+	CHIAKI_SOCKET_CLOSE(a);
+	CHIAKI_SOCKET_CLOSE(b);
+	chiaki_event_loop_fini(&loop);
+	return MUNIT_OK;
+}
+
+MunitTest tests_event_loop[] = {
+	{
+		"/event_loop",
+		test_event_loop,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -16,7 +16,7 @@ typedef struct fec_test_case_t
 
 #include "fec_test_cases.inl"
 
-static MunitResult test_fec_case(FECTestCase *test_case)
+static MunitResult test_fec_case(FECTestCase *test_case, ChiakiFecCache *cache)
 {
 	size_t b64len = strlen(test_case->frame_buffer_b64);
 	uint8_t *frame_buffer_ref = malloc(b64len);
@@ -45,7 +45,10 @@ static MunitResult test_fec_case(FECTestCase *test_case)
 		memset(frame_buffer + stride * e, 0x42, test_case->unit_size);
 	}
 
-	err = chiaki_fec_decode(frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
+	if(cache)
+		err = chiaki_fec_cache_decode(cache, frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
+	else
+		err = chiaki_fec_decode(frame_buffer, test_case->unit_size, stride, test_case->k, test_case->m, (const unsigned int *)test_case->erasures, erasures_count);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 
 	for(size_t i=0; i<test_case->k; i++)
@@ -64,7 +67,173 @@ static MunitParameterEnum fec_params[] = {
 static MunitResult test_fec(const MunitParameter params[], void *test_user)
 {
 	unsigned long test_case_id = strtoul(params[0].value, NULL, 0);
-	return test_fec_case(&fec_test_cases[test_case_id]);
+	return test_fec_case(&fec_test_cases[test_case_id], NULL);
+}
+
+static MunitResult test_fec_cache(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+
+	// all cases twice through the same cache, the second time around the decoding matrices
+	// are partly taken from the cache and partly evicted already, both must give the same result
+	size_t cases_count = sizeof(fec_test_cases) / sizeof(fec_test_cases[0]);
+	for(size_t round=0; round<2; round++)
+	{
+		for(size_t i=0; i<cases_count; i++)
+		{
+			MunitResult r = test_fec_case(&fec_test_cases[i], &cache);
+			if(r != MUNIT_OK)
+			{
+				chiaki_fec_cache_fini(&cache);
+				return r;
+			}
+		}
+	}
+
+	// the same case right after itself must always hit
+	munit_assert_int(test_fec_case(&fec_test_cases[0], &cache), ==, MUNIT_OK);
+	ChiakiFecCacheStats stats_before = cache.stats;
+	munit_assert_int(test_fec_case(&fec_test_cases[0], &cache), ==, MUNIT_OK);
+	munit_assert_uint64(cache.stats.coding_hits, ==, stats_before.coding_hits + 1);
+	munit_assert_uint64(cache.stats.decoding_hits, ==, stats_before.decoding_hits + 1);
+
+	munit_assert_uint64(cache.stats.coding_hits + cache.stats.coding_misses, ==, cases_count * 2 + 2);
+	munit_assert_uint64(cache.stats.coding_hits, >, 0);
+	munit_assert_uint64(cache.stats.decoding_hits, >, 0);
+	munit_assert_uint64(cache.stats.decoding_misses, >, 0);
+
+	chiaki_fec_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_simd(const MunitParameter params[], void *test_user)
+{
+	static const ChiakiFecSimd simds[] = { CHIAKI_FEC_SIMD_SSSE3, CHIAKI_FEC_SIMD_AVX2, CHIAKI_FEC_SIMD_NEON };
+	munit_assert_true(chiaki_fec_simd_supported(CHIAKI_FEC_SIMD_NONE));
+	munit_assert_true(chiaki_fec_simd_supported(chiaki_fec_simd_best()));
+
+	// every supported implementation against the scalar one, with sizes and offsets that leave tails
+	uint8_t src[0x90], dst[0x90], dst_ref[0x90];
+	for(size_t i=0; i<sizeof(src); i++)
+		src[i] = (uint8_t)munit_rand_uint32();
+	for(size_t s=0; s<sizeof(simds) / sizeof(simds[0]); s++)
+	{
+		if(!chiaki_fec_simd_supported(simds[s]))
+			continue;
+		for(unsigned int c=0; c<0x100; c+=7)
+		{
+			for(size_t size=0; size<0x80; size+=5)
+			{
+				size_t offset = c % 0x10;
+				for(int accumulate=0; accumulate<2; accumulate++)
+				{
+					for(size_t i=0; i<sizeof(dst); i++)
+						dst[i] = dst_ref[i] = (uint8_t)(i * c);
+					chiaki_fec_region_mul(CHIAKI_FEC_SIMD_NONE, dst_ref + offset, src + offset, (uint8_t)c, size, accumulate);
+					chiaki_fec_region_mul(simds[s], dst + offset, src + offset, (uint8_t)c, size, accumulate);
+					munit_assert_memory_equal(sizeof(dst), dst, dst_ref);
+				}
+			}
+		}
+	}
+
+	// all test vectors with every supported implementation
+	for(ChiakiFecSimd simd=CHIAKI_FEC_SIMD_NONE; simd<=CHIAKI_FEC_SIMD_NEON; simd++)
+	{
+		if(!chiaki_fec_simd_supported(simd))
+			continue;
+		ChiakiFecCache cache;
+		chiaki_fec_cache_init(&cache);
+		cache.simd = simd;
+		for(size_t i=0; i<sizeof(fec_test_cases) / sizeof(fec_test_cases[0]); i++)
+			munit_assert_int(test_fec_case(&fec_test_cases[i], &cache), ==, MUNIT_OK);
+		chiaki_fec_cache_fini(&cache);
+	}
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_progressive(const MunitParameter params[], void *test_user)
+{
+	ChiakiFecCache cache;
+	chiaki_fec_cache_init(&cache);
+	ChiakiFecProgressive progressive;
+	chiaki_fec_progressive_init(&progressive, &cache);
+
+	for(size_t c=0; c<sizeof(fec_test_cases) / sizeof(fec_test_cases[0]); c++)
+	{
+		FECTestCase *test_case = &fec_test_cases[c];
+		unsigned int units_count = test_case->k + test_case->m;
+		size_t b64len = strlen(test_case->frame_buffer_b64);
+		uint8_t *frame_buffer_ref = malloc(b64len);
+		munit_assert_not_null(frame_buffer_ref);
+		ChiakiErrorCode err = chiaki_base64_decode(test_case->frame_buffer_b64, b64len, frame_buffer_ref, &b64len);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		size_t stride = ((test_case->unit_size + 0xf) / 0x10) * 0x10;
+		uint8_t *frame_buffer = malloc(stride * units_count);
+		munit_assert_not_null(frame_buffer);
+		memset(frame_buffer, 0x42, stride * units_count);
+
+		// all units that are not erased, in random order like out of order packets
+		unsigned int order[CHIAKI_FEC_UNITS_MAX];
+		unsigned int order_count = 0;
+		for(unsigned int i=0; i<units_count; i++)
+		{
+			bool erased = false;
+			for(const int *e = test_case->erasures; *e >= 0; e++)
+				erased |= (unsigned int)*e == i;
+			if(!erased)
+				order[order_count++] = i;
+		}
+		for(unsigned int i=order_count; i>1; i--)
+		{
+			unsigned int j = munit_rand_int_range(0, i - 1);
+			unsigned int tmp = order[i - 1];
+			order[i - 1] = order[j];
+			order[j] = tmp;
+		}
+
+		err = chiaki_fec_progressive_start(&progressive, frame_buffer, test_case->k, test_case->m, test_case->unit_size, stride);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		for(unsigned int i=0; i<order_count; i++)
+		{
+			memcpy(frame_buffer + stride * order[i], frame_buffer_ref + order[i] * test_case->unit_size, test_case->unit_size);
+			err = chiaki_fec_progressive_put(&progressive, order[i]);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			// some rows kept up to date from halfway on, the rest caught up on decode
+			if(i == order_count / 2)
+				chiaki_fec_progressive_reserve(&progressive, 1 + c % 2);
+		}
+		err = chiaki_fec_progressive_decode(&progressive);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		for(size_t i=0; i<test_case->k; i++)
+			munit_assert_memory_equal(test_case->unit_size, frame_buffer + i * stride, frame_buffer_ref + i * test_case->unit_size);
+
+		free(frame_buffer);
+		free(frame_buffer_ref);
+	}
+
+	// too few units
+	FECTestCase *test_case = &fec_test_cases[0];
+	size_t stride = ((test_case->unit_size + 0xf) / 0x10) * 0x10;
+	uint8_t *frame_buffer = calloc(test_case->k + test_case->m, stride);
+	munit_assert_not_null(frame_buffer);
+	ChiakiErrorCode err = chiaki_fec_progressive_start(&progressive, frame_buffer, test_case->k, test_case->m, test_case->unit_size, stride);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(unsigned int i=1; i<test_case->k; i++)
+		chiaki_fec_progressive_put(&progressive, i);
+	err = chiaki_fec_progressive_decode(&progressive);
+	munit_assert_int(err, ==, CHIAKI_ERR_FEC_FAILED);
+	free(frame_buffer);
+
+	munit_assert_uint64(cache.stats.decoding_misses, >, 0);
+
+	chiaki_fec_progressive_fini(&progressive);
+	chiaki_fec_cache_fini(&cache);
+	return MUNIT_OK;
 }
 
 MunitTest tests_fec[] = {
@@ -76,5 +245,29 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/fec_cache",
+		test_fec_cache,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_simd",
+		test_fec_simd,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_progressive",
+		test_fec_progressive,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/frametrace.h>
+
+#include <string.h>
+
+static ChiakiMetricSnapshot *snapshot_find(ChiakiMetricsSnapshot *snapshot, const char *name)
+{
+	for(size_t i=0; i<snapshot->metrics_count; i++)
+	{
+		if(strcmp(snapshot->metrics[i].name, name) == 0)
+			return &snapshot->metrics[i];
+	}
+	return NULL;
+}
+
+static void trace_frame(ChiakiFrameTracer *tracer, int32_t frame_index, uint64_t t, bool present)
+{
+	chiaki_frame_tracer_begin(tracer, frame_index, t, t + 1000);
+	chiaki_frame_tracer_mark(tracer, frame_index, CHIAKI_FRAME_TRACE_FEC_DONE, t + 1500);
+	chiaki_frame_tracer_mark(tracer, frame_index, CHIAKI_FRAME_TRACE_BITSTREAM_DONE, t + 1600);
+	chiaki_frame_tracer_mark(tracer, frame_index, CHIAKI_FRAME_TRACE_DECODER_SUBMIT, t + 1700);
+	chiaki_frame_tracer_mark(tracer, frame_index, CHIAKI_FRAME_TRACE_DECODER_PULL, t + 5700);
+	if(present)
+		chiaki_frame_tracer_mark(tracer, frame_index, CHIAKI_FRAME_TRACE_PRESENTED, t + 6000);
+}
+
+static MunitResult test_stages(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+	const char *path = "chiaki-frametrace-test.csv";
+	ChiakiFrameTracer tracer;
+	ChiakiErrorCode err = chiaki_frame_tracer_init(&tracer, NULL, metrics, path);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// NULL tracers are ignored
+	chiaki_frame_tracer_mark(NULL, 0, CHIAKI_FRAME_TRACE_PRESENTED, 1);
+	chiaki_frame_tracer_begin(NULL, 0, 1, 2);
+
+	trace_frame(&tracer, 10, 1000000, true);
+	// dropped before presentation, finished when its slot is reused
+	trace_frame(&tracer, 11, 1016000, false);
+	trace_frame(&tracer, 11 + CHIAKI_FRAME_TRACER_FRAMES, 2000000, true);
+	// stages of frames that are not traced are ignored
+	chiaki_frame_tracer_mark(&tracer, 11, CHIAKI_FRAME_TRACE_PRESENTED, 3000000);
+	// still in flight on fini
+	chiaki_frame_tracer_begin(&tracer, 12, 4000000, 4000500);
+	chiaki_frame_tracer_fini(&tracer);
+
+	ChiakiMetricsSnapshot snapshot;
+	munit_assert_int(chiaki_metrics_snapshot(metrics, &snapshot), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiMetricSnapshot *m = snapshot_find(&snapshot, "chiaki_frame_latency_total_ms");
+	munit_assert_not_null(m);
+	munit_assert_uint64(m->count, ==, 2);
+	munit_assert_double(m->sum, ==, 12.0);
+	m = snapshot_find(&snapshot, "chiaki_frame_latency_decoder_pull_ms");
+	munit_assert_not_null(m);
+	munit_assert_uint64(m->count, ==, 3);
+	munit_assert_double(m->sum, ==, 12.0);
+	m = snapshot_find(&snapshot, "chiaki_frame_latency_last_unit_ms");
+	munit_assert_uint64(m->count, ==, 4);
+	munit_assert_double(m->sum, ==, 3.5);
+	m = snapshot_find(&snapshot, "chiaki_frame_latency_presented_ms");
+	munit_assert_uint64(m->count, ==, 2);
+	m = snapshot_find(&snapshot, "chiaki_frame_traces_incomplete_total");
+	munit_assert_double(m->value, ==, 2.0);
+	chiaki_metrics_snapshot_fini(&snapshot);
+	chiaki_metrics_free(metrics);
+
+	FILE *f = fopen(path, "r");
+	munit_assert_not_null(f);
+	char buf[1024];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[size] = '\0';
+	fclose(f);
+	remove(path);
+	munit_assert_string_equal(buf,
+			"frame_index,first_unit_us,last_unit_us,fec_done_us,bitstream_done_us,decoder_submit_us,decoder_pull_us,presented_us\n"
+			"10,1000000,1001000,1001500,1001600,1001700,1005700,1006000\n"
+			"11,1016000,1017000,1017500,1017600,1017700,1021700,\n"
+			"75,2000000,2001000,2001500,2001600,2001700,2005700,2006000\n"
+			"12,4000000,4000500,,,,,\n");
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_disabled(const MunitParameter params[], void *user)
+{
+	ChiakiFrameTracer tracer;
+	ChiakiErrorCode err = chiaki_frame_tracer_init(&tracer, NULL, NULL, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_frame_tracer_begin(&tracer, 1, 1000, 2000);
+	chiaki_frame_tracer_mark(&tracer, 1, CHIAKI_FRAME_TRACE_DECODER_SUBMIT, 3000);
+	munit_assert_int32(tracer.traces[1].frame_index, ==, -1);
+	chiaki_frame_tracer_fini(&tracer);
+	return MUNIT_OK;
+}
+
+MunitTest tests_frame_trace[] = {
+	{
+		"/stages",
+		test_stages,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/disabled",
+		test_disabled,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -5,6 +5,8 @@
 #include <chiaki/ecdh.h>
 #include <chiaki/gkcrypt.h>
 
+#include "../lib/src/utils.h"
+
 static MunitResult test_ecdh(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0xfc, 0x5d, 0x4b, 0xa0, 0x3a, 0x35, 0x3a, 0xbb, 0x6a, 0x7f, 0xac, 0x79, 0x1b, 0x17, 0xbb, 0x34 };
@@ -169,6 +171,228 @@ static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 	return MUNIT_OK;
 }
 
+static MunitResult test_xor_bytes(const MunitParameter params[], void *user)
+{
+	uint8_t a[0x100 + 7], b[0x100 + 7], expected[0x100 + 7];
+	for(size_t i=0; i<sizeof(a); i++)
+	{
+		a[i] = (uint8_t)(i * 13 + 1);
+		b[i] = (uint8_t)(i * 31 + 7);
+	}
+
+	// all sizes and misalignments around the vector widths
+	for(size_t offset=0; offset<7; offset++)
+	{
+		for(size_t sz=0; sz + offset <= sizeof(a) && sz <= 0x100; sz++)
+		{
+			uint8_t dst[sizeof(a)];
+			memcpy(dst, a, sizeof(dst));
+			memcpy(expected, a, sizeof(expected));
+			for(size_t i=0; i<sz; i++)
+				expected[offset + i] ^= b[i];
+			xor_bytes(dst + offset, b, sz);
+			munit_assert_memory_equal(sizeof(dst), dst, expected);
+		}
+	}
+
+	return MUNIT_OK;
+}
+
+static bool key_buf_wait(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, size_t size)
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	chiaki_mutex_init(&mutex, false);
+	chiaki_cond_init(&cond);
+	chiaki_mutex_lock(&mutex);
+	bool available = false;
+	for(int i=0; i<1000 && !available; i++)
+	{
+		available = chiaki_gkcrypt_key_stream_buffered(gkcrypt, key_pos, size);
+		if(!available)
+			chiaki_cond_timedwait(&cond, &mutex, 1);
+	}
+	chiaki_mutex_unlock(&mutex);
+	chiaki_cond_fini(&cond);
+	chiaki_mutex_fini(&mutex);
+	return available;
+}
+
+static MunitResult test_decrypt_key_buf(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ERROR, NULL, NULL);
+
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 2, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiGKCrypt gkcrypt_ref;
+	err = chiaki_gkcrypt_init(&gkcrypt_ref, &log, 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// unaligned packets that walk through the ring several times, so some of them wrap around its end
+	uint8_t buf[0x5a3];
+	uint8_t buf_ref[sizeof(buf)];
+	uint8_t src[sizeof(buf)];
+	uint64_t key_pos = 0x3;
+	for(size_t i=0; i<0x40; i++)
+	{
+		size_t size = sizeof(buf) - (i * 0x35) % 0x200;
+		for(size_t j=0; j<size; j++)
+			src[j] = (uint8_t)(i + j);
+		memcpy(buf, src, size);
+		memcpy(buf_ref, src, size);
+
+		// give the thread time to generate the key stream, otherwise decrypt would just fall back
+		munit_assert_true(key_buf_wait(&gkcrypt, key_pos, size));
+
+		// every other packet is decrypted out of place, as the frame processor does
+		if(i % 2)
+			err = chiaki_gkcrypt_decrypt_to(&gkcrypt, key_pos, src, buf, size);
+		else
+			err = chiaki_gkcrypt_decrypt(&gkcrypt, key_pos, buf, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		if(i % 4 == 1)
+			err = chiaki_gkcrypt_decrypt_to(&gkcrypt_ref, key_pos, src, buf_ref, size);
+		else
+			err = chiaki_gkcrypt_decrypt(&gkcrypt_ref, key_pos, buf_ref, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(size, buf, buf_ref);
+
+		key_pos += size;
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt_ref);
+	chiaki_gkcrypt_fini(&gkcrypt);
+	return MUNIT_OK;
+}
+
+static MunitResult test_key_buf_stress(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	ChiakiLog log;
+	chiaki_log_init(&log, 0, NULL, NULL);
+
+	// smallest possible ring, so the thread constantly reuses the memory that is being read
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 2, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiGKCrypt gkcrypt_ref;
+	err = chiaki_gkcrypt_init(&gkcrypt_ref, &log, 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t buf[0x5b0];
+	uint8_t buf_ref[sizeof(buf)];
+	uint64_t key_pos = 0;
+	for(size_t i=0; i<20000; i++)
+	{
+		// mostly consecutive packets, some late ones and a few jumps ahead
+		int r = munit_rand_int_range(0, 99);
+		uint64_t pos = key_pos;
+		if(r < 2)
+			key_pos = pos = key_pos + (uint64_t)munit_rand_int_range(0x4000, 0x20000);
+		else if(r < 10)
+			pos = key_pos - (uint64_t)munit_rand_int_range(0, key_pos < 0x3000 ? (int)key_pos : 0x3000);
+
+		bool decrypt = i % 2 == 0;
+		size_t size;
+		if(decrypt)
+			size = (size_t)munit_rand_int_range(1, 0x5a0);
+		else
+		{
+			// key stream is only generated in whole blocks
+			pos -= pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
+			size = (size_t)munit_rand_int_range(1, 0x5a) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		}
+
+		if(decrypt)
+		{
+			for(size_t j=0; j<size; j++)
+				buf[j] = buf_ref[j] = (uint8_t)(i + j);
+			err = chiaki_gkcrypt_decrypt(&gkcrypt, pos, buf, size);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			err = chiaki_gkcrypt_decrypt(&gkcrypt_ref, pos, buf_ref, size);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+		else
+		{
+			err = chiaki_gkcrypt_get_key_stream(&gkcrypt, pos, buf, size);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+			err = chiaki_gkcrypt_gen_key_stream(&gkcrypt_ref, pos, buf_ref, size);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+		munit_assert_memory_equal(size, buf, buf_ref);
+
+		if(pos + size > key_pos)
+			key_pos = pos + size;
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt_ref);
+	chiaki_gkcrypt_fini(&gkcrypt);
+	return MUNIT_OK;
+}
+
+static MunitResult test_key_buf_grow(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x14, 0xf1, 0xe6, 0x94, 0x6c, 0x5d, 0xce, 0xa8, 0xb7, 0xaa, 0x48, 0x50, 0xf6, 0x4d, 0x21, 0xac };
+	static const uint8_t ecdh_secret[] = { 0xc, 0xeb, 0x77, 0x9, 0x83, 0x4d, 0x7a, 0xfc, 0x50, 0xb8, 0x46, 0x8c, 0xc6, 0x3c, 0x1e, 0x7c, 0x4e, 0x4a, 0x88, 0x93, 0x42, 0x80, 0xc1, 0x28, 0xe6, 0x1e, 0xe9, 0xd4, 0x1b, 0x8c, 0x69, 0x36 };
+
+	ChiakiLog log;
+	chiaki_log_init(&log, 0, NULL, NULL);
+
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0x80, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiGKCrypt gkcrypt_ref;
+	err = chiaki_gkcrypt_init(&gkcrypt_ref, &log, 0, 42, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiGKCryptStats stats;
+	chiaki_gkcrypt_get_stats(&gkcrypt, &stats);
+	uint64_t size_initial = stats.key_buf_size;
+	munit_assert_uint64(size_initial, <, 0x80 * 0x1000);
+
+	uint8_t buf[0x5a3];
+	uint8_t buf_ref[sizeof(buf)];
+	uint64_t key_pos = 0;
+	for(size_t i=0; i<0x800; i++)
+	{
+		// jump beyond the buffered key stream every now and then, which must make the buffer grow
+		if(i % 0x200 == 0x100)
+			key_pos += 0x100000;
+
+		size_t size = sizeof(buf) - (i * 0x35) % 0x200;
+		for(size_t j=0; j<size; j++)
+			buf[j] = buf_ref[j] = (uint8_t)(i + j);
+
+		err = chiaki_gkcrypt_decrypt(&gkcrypt, key_pos, buf, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		err = chiaki_gkcrypt_decrypt(&gkcrypt_ref, key_pos, buf_ref, size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(size, buf, buf_ref);
+
+		key_pos += size;
+	}
+
+	// the buffer grows asynchronously, wait for it to catch up with the last jump
+	munit_assert_true(key_buf_wait(&gkcrypt, key_pos, sizeof(buf)));
+	chiaki_gkcrypt_get_stats(&gkcrypt, &stats);
+	munit_assert_uint64(stats.key_buf_misses_ahead, >, 0);
+	munit_assert_uint64(stats.key_buf_hits, >, 0);
+	munit_assert_uint64(stats.key_buf_resizes, >, 0);
+	munit_assert_uint64(stats.key_buf_size, >, size_initial);
+	munit_assert_uint64(stats.key_buf_size, <=, 0x80 * 0x1000);
+
+	chiaki_gkcrypt_fini(&gkcrypt_ref);
+	chiaki_gkcrypt_fini(&gkcrypt);
+	return MUNIT_OK;
+}
+
 static MunitResult test_gmac(const MunitParameter params[], void *user)
 {
 	static const uint8_t gkcrypt_key[] = {	0xb6, 0x4b, 0x1e, 0x65, 0x3f, 0xbb, 0xa7, 0xab, 0x80, 0xb3, 0x1e, 0x5a, 0x32, 0x4d, 0xec, 0xc0 };
@@ -205,8 +429,8 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
 	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
 
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
+	gkcrypt.key_ring = NULL;
+	gkcrypt.key_buf_size_max = 0;
 	gkcrypt.key_gmac_index_current = 0;
 
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
@@ -215,14 +439,15 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	// High
 	memset(&gkcrypt, 0, sizeof(gkcrypt));
 	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
 	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
 
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
+	gkcrypt.key_ring = NULL;
+	gkcrypt.key_buf_size_max = 0;
 	gkcrypt.key_gmac_index_current = 0;
 
 	err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos_high, buf, sizeof(buf), gmac);
@@ -230,6 +455,7 @@ static MunitResult test_gmac(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected_high);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	return MUNIT_OK;
 }
@@ -306,8 +532,8 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 
 	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
 	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
+	gkcrypt.key_ring = NULL;
+	gkcrypt.key_buf_size_max = 0;
 	gkcrypt.key_gmac_index_current = 0;
 
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
@@ -316,14 +542,15 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	// High
 	memset(&gkcrypt, 0, sizeof(gkcrypt));
 
 	memcpy(gkcrypt.key_gmac_current, gkcrypt_key, sizeof(gkcrypt.key_gmac_current));
 	memcpy(gkcrypt.iv, gkcrypt_iv, sizeof(gkcrypt.iv));
-	gkcrypt.key_buf = NULL;
-	gkcrypt.key_buf_size = 0;
+	gkcrypt.key_ring = NULL;
+	gkcrypt.key_buf_size_max = 0;
 	gkcrypt.key_gmac_index_current = 0;
 
 	err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos_high, buf, sizeof(buf), gmac);
@@ -331,6 +558,7 @@ static MunitResult test_gmac_split(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 
 	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected_high);
+	chiaki_gkcrypt_fini(&gkcrypt);
 
 	return MUNIT_OK;
 }
@@ -379,6 +607,57 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 	return MUNIT_OK;
 }
 
+static MunitResult test_gmac_key_rotation(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+	static const uint8_t crypt_index = 3;
+
+	// key indices 0, 0, 2, 0 (late packet before the rotation), 2, 1 (late), 3
+	static const uint64_t key_pos[] = {
+		0x10,
+		0x1000,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS * 2 + 0x20,
+		0x2000,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS * 2 + 0x100,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x30,
+		CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS * 3 + 0x10
+	};
+
+	uint8_t data[0x100];
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)(i * 7);
+
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt;
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(size_t i = 0; i < sizeof(key_pos) / sizeof(key_pos[0]); i++)
+	{
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos[i], data, sizeof(data), gmac);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		// the same gmac from a fresh instance that never reused a context
+		ChiakiGKCrypt gkcrypt_ref;
+		err = chiaki_gkcrypt_init(&gkcrypt_ref, &log, 0, crypt_index, handshake_key, ecdh_secret);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		uint8_t gmac_ref[CHIAKI_GKCRYPT_GMAC_SIZE];
+		err = chiaki_gkcrypt_gmac(&gkcrypt_ref, key_pos[i], data, sizeof(data), gmac_ref);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		chiaki_gkcrypt_fini(&gkcrypt_ref);
+
+		munit_assert_memory_equal(sizeof(gmac), gmac, gmac_ref);
+	}
+
+	munit_assert_uint64(gkcrypt.key_gmac_index_current, ==, 3);
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
+
 
 MunitTest tests_gkcrypt[] = {
 	{
@@ -405,6 +684,38 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/xor_bytes",
+		test_xor_bytes,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/decrypt_key_buf",
+		test_decrypt_key_buf,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf_stress",
+		test_key_buf_stress,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf_grow",
+		test_key_buf_grow,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/gmac",
 		test_gmac,
@@ -437,5 +748,13 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/gmac_key_rotation",
+		test_gmac_key_rotation,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
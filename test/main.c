@@ -5,6 +5,16 @@
 extern MunitTest tests_seq_num[];
 extern MunitTest tests_key_state[];
 extern MunitTest tests_reorder_queue[];
+extern MunitTest tests_packet_pool[];
+extern MunitTest tests_video_buffer[];
+extern MunitTest tests_event_loop[];
+extern MunitTest tests_reactor[];
+extern MunitTest tests_recv_timing[];
+extern MunitTest tests_packet_stats[];
+extern MunitTest tests_stream_stats[];
+extern MunitTest tests_metrics[];
+extern MunitTest tests_frame_trace[];
+extern MunitTest tests_delay_gradient[];
 extern MunitTest tests_http[];
 extern MunitTest tests_rpcrypt[];
 extern MunitTest tests_gkcrypt[];
@@ -12,6 +22,7 @@ extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
 extern MunitTest tests_regist[];
 extern MunitTest tests_bitstream[];
+extern MunitTest tests_video_receiver[];
 
 static MunitSuite suites[] = {
 	{
@@ -35,6 +46,76 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/packet_pool",
+		tests_packet_pool,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_buffer",
+		tests_video_buffer,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/event_loop",
+		tests_event_loop,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/reactor",
+		tests_reactor,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/recv_timing",
+		tests_recv_timing,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/packet_stats",
+		tests_packet_stats,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/stream_stats",
+		tests_stream_stats,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/metrics",
+		tests_metrics,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/frame_trace",
+		tests_frame_trace,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/delay_gradient",
+		tests_delay_gradient,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{
 		"/http",
 		tests_http,
@@ -84,6 +165,13 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/video_receiver",
+		tests_video_receiver,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
 };
 
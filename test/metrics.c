@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/metrics.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static ChiakiMetricSnapshot *snapshot_find(ChiakiMetricsSnapshot *snapshot, const char *name)
+{
+	for(size_t i=0; i<snapshot->metrics_count; i++)
+	{
+		if(strcmp(snapshot->metrics[i].name, name) == 0)
+			return &snapshot->metrics[i];
+	}
+	return NULL;
+}
+
+static void collect(ChiakiMetrics *metrics, void *user)
+{
+	(void)metrics;
+	ChiakiMetric *gauge = user;
+	chiaki_metric_set(gauge, 42.0);
+}
+
+static MunitResult test_registry(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+
+	ChiakiMetric *counter = chiaki_metrics_counter(metrics, "test_total", "A counter");
+	munit_assert_not_null(counter);
+	munit_assert_ptr_equal(chiaki_metrics_counter(metrics, "test_total", NULL), counter);
+	munit_assert_null(chiaki_metrics_gauge(metrics, "test_total", NULL));
+	munit_assert_null(chiaki_metrics_counter(NULL, "test_total", NULL));
+	munit_assert_null(chiaki_metrics_counter(metrics, "", NULL));
+	munit_assert_null(chiaki_metrics_counter(metrics, "0test", NULL));
+	munit_assert_null(chiaki_metrics_counter(metrics, "test\"total", NULL));
+	munit_assert_null(chiaki_metrics_gauge(metrics, "test-gauge", NULL));
+	munit_assert_not_null(chiaki_metrics_gauge(metrics, "_test:gauge9", NULL));
+	ChiakiMetric *gauge = chiaki_metrics_gauge(metrics, "test_gauge", NULL);
+	munit_assert_not_null(gauge);
+	ChiakiMetric *collected = chiaki_metrics_gauge(metrics, "test_collected", NULL);
+	munit_assert_not_null(collected);
+
+	chiaki_metric_add(counter, 3);
+	chiaki_metric_add(counter, 4);
+	chiaki_metric_set(gauge, -1.5);
+	chiaki_metric_add(NULL, 1);
+	munit_assert_int(chiaki_metrics_collector_add(metrics, collect, collected), ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiMetricsSnapshot snapshot;
+	munit_assert_int(chiaki_metrics_snapshot(metrics, &snapshot), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(snapshot.metrics_count, ==, 4);
+	munit_assert_uint64(snapshot.timestamp_ms, >, 0);
+	ChiakiMetricSnapshot *m = snapshot_find(&snapshot, "test_total");
+	munit_assert_not_null(m);
+	munit_assert_int(m->type, ==, CHIAKI_METRIC_COUNTER);
+	munit_assert_double(m->value, ==, 7.0);
+	munit_assert_string_equal(m->help, "A counter");
+	m = snapshot_find(&snapshot, "test_gauge");
+	munit_assert_double(m->value, ==, -1.5);
+	m = snapshot_find(&snapshot, "test_collected");
+	munit_assert_double(m->value, ==, 42.0);
+	chiaki_metrics_snapshot_fini(&snapshot);
+
+	// removed collectors are not called anymore
+	chiaki_metrics_collector_remove(metrics, collect, collected);
+	chiaki_metric_set(collected, 1.0);
+	munit_assert_int(chiaki_metrics_snapshot(metrics, &snapshot), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_double(snapshot_find(&snapshot, "test_collected")->value, ==, 1.0);
+	chiaki_metrics_snapshot_fini(&snapshot);
+
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+static MunitResult test_histogram(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+	static const double buckets[] = { 1.0, 5.0, 10.0 };
+	ChiakiMetric *hist = chiaki_metrics_histogram(metrics, "test_hist", NULL, buckets, 3);
+	munit_assert_not_null(hist);
+
+	static const double values[] = { 0.5, 1.0, 2.0, 5.0, 7.0, 100.0 };
+	for(size_t i=0; i<sizeof(values) / sizeof(values[0]); i++)
+		chiaki_metric_observe(hist, values[i]);
+
+	ChiakiMetricsSnapshot snapshot;
+	munit_assert_int(chiaki_metrics_snapshot(metrics, &snapshot), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiMetricSnapshot *m = snapshot_find(&snapshot, "test_hist");
+	munit_assert_not_null(m);
+	munit_assert_uint64(m->count, ==, 6);
+	munit_assert_double(m->sum, ==, 115.5);
+	munit_assert_size(m->buckets_count, ==, 3);
+	// cumulative, bounds are inclusive
+	munit_assert_uint64(m->bucket_counts[0], ==, 2);
+	munit_assert_uint64(m->bucket_counts[1], ==, 4);
+	munit_assert_uint64(m->bucket_counts[2], ==, 5);
+
+	char *out;
+	size_t out_size;
+	munit_assert_int(chiaki_metrics_format(&snapshot, CHIAKI_METRICS_FORMAT_PROMETHEUS, &out, &out_size), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_string_equal(out,
+			"# TYPE test_hist histogram\n"
+			"test_hist_bucket{le=\"1\"} 2\n"
+			"test_hist_bucket{le=\"5\"} 4\n"
+			"test_hist_bucket{le=\"10\"} 5\n"
+			"test_hist_bucket{le=\"+Inf\"} 6\n"
+			"test_hist_sum 115.5\n"
+			"test_hist_count 6\n");
+	munit_assert_size(out_size, ==, strlen(out));
+	free(out);
+
+	snapshot.timestamp_ms = 1234;
+	munit_assert_int(chiaki_metrics_format(&snapshot, CHIAKI_METRICS_FORMAT_JSON_LINES, &out, &out_size), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_string_equal(out,
+			"{\"timestamp_ms\":1234,\"metrics\":{\"test_hist\":{\"count\":6,\"sum\":115.5,\"buckets\":[[1,2],[5,4],[10,5]]}}}\n");
+	free(out);
+
+	chiaki_metrics_snapshot_fini(&snapshot);
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+static MunitResult test_format(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+	chiaki_metric_add(chiaki_metrics_counter(metrics, "test_total", "Line\nbreak"), 12);
+	chiaki_metric_set(chiaki_metrics_gauge(metrics, "test_nan", NULL), NAN);
+
+	ChiakiMetricsSnapshot snapshot;
+	munit_assert_int(chiaki_metrics_snapshot(metrics, &snapshot), ==, CHIAKI_ERR_SUCCESS);
+	snapshot.timestamp_ms = 1;
+
+	char *out;
+	munit_assert_int(chiaki_metrics_format(&snapshot, CHIAKI_METRICS_FORMAT_PROMETHEUS, &out, NULL), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_string_equal(out,
+			"# HELP test_total Line\\nbreak\n"
+			"# TYPE test_total counter\n"
+			"test_total 12\n"
+			"# TYPE test_nan gauge\n"
+			"test_nan NaN\n");
+	free(out);
+
+	munit_assert_int(chiaki_metrics_format(&snapshot, CHIAKI_METRICS_FORMAT_JSON_LINES, &out, NULL), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_string_equal(out, "{\"timestamp_ms\":1,\"metrics\":{\"test_total\":12,\"test_nan\":null}}\n");
+	free(out);
+
+	chiaki_metrics_snapshot_fini(&snapshot);
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+static MunitResult test_export_file(const MunitParameter params[], void *user)
+{
+	const char *path = "chiaki-metrics-test.prom";
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+	chiaki_metric_add(chiaki_metrics_counter(metrics, "test_total", NULL), 5);
+
+	ChiakiMetricsExporter exporter;
+	// interval long enough that only the last snapshot on stop is written
+	ChiakiErrorCode err = chiaki_metrics_exporter_start(&exporter, metrics, NULL, CHIAKI_METRICS_FORMAT_PROMETHEUS, path, 60000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_metrics_exporter_stop(&exporter);
+
+	FILE *f = fopen(path, "r");
+	munit_assert_not_null(f);
+	char buf[256];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[size] = '\0';
+	fclose(f);
+	munit_assert_string_equal(buf, "# TYPE test_total counter\ntest_total 5\n");
+
+	remove(path);
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+MunitTest tests_metrics[] = {
+	{
+		"/registry",
+		test_registry,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/histogram",
+		test_histogram,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/format",
+		test_format,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/export_file",
+		test_export_file,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/packetpool.h>
+
+#include <string.h>
+
+static MunitResult test_packet_pool(const MunitParameter params[], void *test_user)
+{
+	ChiakiPacketPool pool;
+	ChiakiErrorCode err = chiaki_packet_pool_init(&pool, 1500, 2);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t *a = chiaki_packet_pool_alloc(&pool);
+	munit_assert_not_null(a);
+	memset(a, 0x42, 1500);
+	uint8_t *b = chiaki_packet_pool_alloc(&pool);
+	munit_assert_not_null(b);
+	munit_assert_ptr_not_equal(a, b);
+
+	// exhausted, falls back to the heap
+	uint8_t *c = chiaki_packet_pool_alloc(&pool);
+	munit_assert_not_null(c);
+	memset(c, 0x42, 1500);
+
+	ChiakiPacketPoolStats stats;
+	chiaki_packet_pool_get_stats(&pool, &stats, false);
+	munit_assert_uint64(stats.hits, ==, 2);
+	munit_assert_uint64(stats.misses, ==, 1);
+	munit_assert_size(stats.in_use, ==, 3);
+	munit_assert_size(stats.high_water, ==, 3);
+
+	// a is still referenced after the first unref
+	chiaki_packet_pool_ref(a);
+	chiaki_packet_pool_unref(a);
+	chiaki_packet_pool_get_stats(&pool, &stats, false);
+	munit_assert_size(stats.in_use, ==, 3);
+	munit_assert_uint8(a[1499], ==, 0x42);
+
+	chiaki_packet_pool_unref(a);
+	chiaki_packet_pool_unref(c);
+	chiaki_packet_pool_get_stats(&pool, &stats, true);
+	munit_assert_size(stats.in_use, ==, 1);
+	munit_assert_size(stats.high_water, ==, 3);
+
+	// released buffer is handed out again
+	uint8_t *d = chiaki_packet_pool_alloc(&pool);
+	munit_assert_ptr_equal(d, a);
+
+	chiaki_packet_pool_get_stats(&pool, &stats, false);
+	munit_assert_uint64(stats.hits, ==, 1);
+	munit_assert_uint64(stats.misses, ==, 0);
+	munit_assert_size(stats.in_use, ==, 2);
+	munit_assert_size(stats.high_water, ==, 2);
+
+	chiaki_packet_pool_unref(b);
+	chiaki_packet_pool_unref(d);
+	chiaki_packet_pool_fini(&pool);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_packet_pool[] = {
+	{
+		"/packet_pool",
+		test_packet_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/packetstats.h>
+
+static MunitResult test_get(const MunitParameter params[], void *user)
+{
+	ChiakiPacketStats stats;
+	ChiakiErrorCode err = chiaki_packet_stats_init(&stats);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_packet_stats_push_generation(&stats, 8, 2);
+	chiaki_packet_stats_push_seq(&stats, 1);
+	chiaki_packet_stats_push_seq(&stats, 2);
+	chiaki_packet_stats_push_seq(&stats, 5);
+	chiaki_packet_stats_push_local_drops(&stats, 1);
+
+	uint64_t received, lost, local_dropped;
+	chiaki_packet_stats_get(&stats, true, &received, &lost, &local_dropped);
+	munit_assert_uint64(received, ==, 11);
+	munit_assert_uint64(lost, ==, 3); // 2 + 5 - 3 sequential, minus the local drop
+	munit_assert_uint64(local_dropped, ==, 1);
+
+	chiaki_packet_stats_push_seq(&stats, 6);
+	chiaki_packet_stats_push_seq(&stats, 8);
+	chiaki_packet_stats_get(&stats, false, &received, &lost, &local_dropped);
+	munit_assert_uint64(received, ==, 2);
+	munit_assert_uint64(lost, ==, 1);
+	munit_assert_uint64(local_dropped, ==, 0);
+
+	// snapshot does not reset and covers everything since init
+	ChiakiPacketStatsSnapshot snapshot;
+	chiaki_packet_stats_snapshot(&stats, &snapshot);
+	munit_assert_uint64(snapshot.received, ==, 13);
+	munit_assert_uint64(snapshot.lost, ==, 4);
+	munit_assert_uint64(snapshot.local_dropped, ==, 1);
+	chiaki_packet_stats_get(&stats, true, &received, &lost, &local_dropped);
+	munit_assert_uint64(received, ==, 2);
+
+	chiaki_packet_stats_fini(&stats);
+	return MUNIT_OK;
+}
+
+static void units_set(uint64_t *units, const char *pattern)
+{
+	units[0] = units[1] = 0;
+	for(size_t i=0; pattern[i]; i++)
+		if(pattern[i] == 'x')
+			units[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static MunitResult test_histograms(const MunitParameter params[], void *user)
+{
+	ChiakiPacketStats stats;
+	ChiakiErrorCode err = chiaki_packet_stats_init(&stats);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// x = received, . = lost
+	uint64_t units[2];
+	units_set(units, "xxxxxxxxxxxxxxxxxxxx");
+	chiaki_packet_stats_push_generation_units(&stats, units, 20);
+	units_set(units, "x.xxxxxxxxxxxxxxxxxx");
+	chiaki_packet_stats_push_generation_units(&stats, units, 20);
+	units_set(units, "xx..xxxxxxxxxxxxx...");
+	chiaki_packet_stats_push_generation_units(&stats, units, 20);
+	// burst continues from the end of the previous generation
+	units_set(units, ".....xxxxxxxxxxxxxxx");
+	chiaki_packet_stats_push_generation_units(&stats, units, 20);
+	units_set(units, "xxxxxxxxxx........................................................................................xx");
+	chiaki_packet_stats_push_generation_units(&stats, units, 100);
+
+	// gap of 2 in sequential packets
+	chiaki_packet_stats_push_seq(&stats, 100);
+	chiaki_packet_stats_push_seq(&stats, 103);
+
+	ChiakiPacketStatsSnapshot snapshot;
+	chiaki_packet_stats_snapshot(&stats, &snapshot);
+	munit_assert_uint64(snapshot.received, ==, 20 + 19 + 15 + 15 + 12 + 2);
+	munit_assert_uint64(snapshot.lost, ==, 1 + 5 + 5 + 88 + 2);
+
+	munit_assert_uint64(snapshot.loss_bursts[0], ==, 1); // 1
+	munit_assert_uint64(snapshot.loss_bursts[1], ==, 2); // 2, 2
+	munit_assert_uint64(snapshot.loss_bursts[2], ==, 0);
+	munit_assert_uint64(snapshot.loss_bursts[3], ==, 1); // 3 + 5
+	munit_assert_uint64(snapshot.loss_bursts[6], ==, 1); // 88
+	munit_assert_uint64(snapshot.loss_bursts[7], ==, 0);
+
+	munit_assert_uint(chiaki_packet_stats_frame_loss_bucket_max(3), ==, 5);
+	munit_assert_uint(chiaki_packet_stats_frame_loss_bucket_max(7), ==, 100);
+	munit_assert_uint64(snapshot.frame_loss[0], ==, 1); // 0%
+	munit_assert_uint64(snapshot.frame_loss[3], ==, 1); // 5%
+	munit_assert_uint64(snapshot.frame_loss[5], ==, 0);
+	munit_assert_uint64(snapshot.frame_loss[6], ==, 2); // 25% twice
+	munit_assert_uint64(snapshot.frame_loss[7], ==, 1); // 88%
+
+	chiaki_packet_stats_fini(&stats);
+	return MUNIT_OK;
+}
+
+MunitTest tests_packet_stats[] = {
+	{
+		"/get",
+		test_get,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/histograms",
+		test_histograms,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
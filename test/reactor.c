@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/reactor.h>
+
+typedef struct reactor_test_timer_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	unsigned int runs;
+	uint64_t interval_ms;
+} ReactorTestTimer;
+
+static uint64_t test_timer_cb(void *user)
+{
+	ReactorTestTimer *t = user;
+	chiaki_mutex_lock(&t->mutex);
+	t->runs++;
+	chiaki_cond_signal(&t->cond);
+	chiaki_mutex_unlock(&t->mutex);
+	return t->interval_ms;
+}
+
+static void test_timer_init(ReactorTestTimer *t, uint64_t interval_ms)
+{
+	chiaki_mutex_init(&t->mutex, false);
+	chiaki_cond_init(&t->cond);
+	t->runs = 0;
+	t->interval_ms = interval_ms;
+}
+
+static void test_timer_fini(ReactorTestTimer *t)
+{
+	chiaki_cond_fini(&t->cond);
+	chiaki_mutex_fini(&t->mutex);
+}
+
+static bool test_timer_runs_pred(void *user)
+{
+	ReactorTestTimer *t = user;
+	return t->runs >= 3;
+}
+
+static unsigned int test_timer_runs(ReactorTestTimer *t)
+{
+	chiaki_mutex_lock(&t->mutex);
+	unsigned int r = t->runs;
+	chiaki_mutex_unlock(&t->mutex);
+	return r;
+}
+
+static MunitResult test_reactor(const MunitParameter params[], void *user)
+{
+	ChiakiReactor reactor;
+	ChiakiErrorCode err = chiaki_reactor_init(&reactor);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ReactorTestTimer periodic, idle;
+	test_timer_init(&periodic, 5);
+	test_timer_init(&idle, CHIAKI_REACTOR_TIMER_IDLE);
+
+	ChiakiReactorTimer periodic_timer, idle_timer;
+	err = chiaki_reactor_timer_add(&reactor, &periodic_timer, test_timer_cb, &periodic, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_reactor_timer_add(&reactor, &idle_timer, test_timer_cb, &idle, CHIAKI_REACTOR_TIMER_IDLE);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// periodic timer keeps re-arming itself
+	chiaki_mutex_lock(&periodic.mutex);
+	err = chiaki_cond_timedwait_pred(&periodic.cond, &periodic.mutex, 5000, test_timer_runs_pred, &periodic);
+	chiaki_mutex_unlock(&periodic.mutex);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// parked timer only runs when scheduled, once per schedule
+	munit_assert_uint(test_timer_runs(&idle), ==, 0);
+	chiaki_reactor_timer_schedule(&reactor, &idle_timer, 0);
+	chiaki_mutex_lock(&idle.mutex);
+	while(idle.runs < 1)
+		chiaki_cond_wait(&idle.cond, &idle.mutex);
+	chiaki_mutex_unlock(&idle.mutex);
+
+	// removed timers never run again
+	chiaki_reactor_timer_remove(&reactor, &periodic_timer);
+	unsigned int periodic_runs = test_timer_runs(&periodic);
+	chiaki_reactor_timer_remove(&reactor, &idle_timer);
+	chiaki_reactor_timer_schedule(&reactor, &idle_timer, 0);
+
+	ChiakiCond sleep_cond;
+	ChiakiMutex sleep_mutex;
+	chiaki_cond_init(&sleep_cond);
+	chiaki_mutex_init(&sleep_mutex, false);
+	chiaki_mutex_lock(&sleep_mutex);
+	chiaki_cond_timedwait(&sleep_cond, &sleep_mutex, 30);
+	chiaki_mutex_unlock(&sleep_mutex);
+	chiaki_mutex_fini(&sleep_mutex);
+	chiaki_cond_fini(&sleep_cond);
+
+	munit_assert_uint(test_timer_runs(&periodic), ==, periodic_runs);
+	munit_assert_uint(test_timer_runs(&idle), ==, 1);
+
+	chiaki_reactor_fini(&reactor);
+	test_timer_fini(&periodic);
+	test_timer_fini(&idle);
+	return MUNIT_OK;
+}
+
+MunitTest tests_reactor[] = {
+	{
+		"/reactor",
+		test_reactor,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/recvtiming.h>
+#include <chiaki/takion.h>
+
+static MunitResult test_recv_timing(const MunitParameter params[], void *user)
+{
+	ChiakiRecvTiming timing;
+	ChiakiErrorCode err = chiaki_recv_timing_init(&timing);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiTakionRecvTime t = { 1000, 1300, true };
+	chiaki_recv_timing_push_packet(&timing, &t);
+	t.arrival_us = 2000;
+	t.read_us = 2100;
+	chiaki_recv_timing_push_packet(&timing, &t);
+	t.arrival_us = t.read_us = 5000;
+	t.kernel = false;
+	chiaki_recv_timing_push_packet(&timing, &t);
+
+	// perfectly periodic frames have no jitter
+	for(uint64_t i=1; i<=4; i++)
+		chiaki_recv_timing_push_frame(&timing, i * 16000, i * 16000 + 2000 * i);
+
+	ChiakiRecvTimingStats stats;
+	chiaki_recv_timing_get(&timing, &stats, true);
+	munit_assert_uint64(stats.packets, ==, 3);
+	munit_assert_uint64(stats.packets_kernel, ==, 2);
+	munit_assert_uint64(stats.queue_delay_avg_us, ==, 200);
+	munit_assert_uint64(stats.queue_delay_max_us, ==, 300);
+	munit_assert_uint64(stats.frames, ==, 4);
+	munit_assert_uint64(stats.frame_spread_avg_us, ==, 5000);
+	munit_assert_uint64(stats.frame_spread_max_us, ==, 8000);
+	munit_assert_double(stats.jitter_us, ==, 0.0);
+
+	// one frame 1600us late: interarrival varies by 1600, then by 3200
+	// => jitter 1600/16 = 100, then 100 + (3200 - 100)/16 = 293.75
+	chiaki_recv_timing_push_frame(&timing, 5 * 16000 + 1600, 5 * 16000 + 1600);
+	chiaki_recv_timing_push_frame(&timing, 6 * 16000, 6 * 16000);
+	chiaki_recv_timing_get(&timing, &stats, false);
+	munit_assert_uint64(stats.packets, ==, 0);
+	munit_assert_uint64(stats.frames, ==, 2);
+	munit_assert_double(stats.jitter_us, ==, 293.75);
+
+	chiaki_recv_timing_fini(&timing);
+	return MUNIT_OK;
+}
+
+MunitTest tests_recv_timing[] = {
+	{
+		"/recv_timing",
+		test_recv_timing,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
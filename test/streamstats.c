@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/streamstats.h>
+
+#define SECOND_US 1000000
+
+static MunitResult test_history(const MunitParameter params[], void *user)
+{
+	ChiakiStreamStatsHistory history;
+	ChiakiErrorCode err = chiaki_stream_stats_history_init(&history);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint64_t t0 = 5 * SECOND_US;
+	double v;
+	munit_assert_false(chiaki_stream_stats_history_ewma(&history, t0, CHIAKI_STREAM_STATS_METRIC_BITRATE, &v));
+
+	// second 0: 10 frames of 1000 bytes, one of them a keyframe of 5000
+	for(int i=0; i<10; i++)
+		chiaki_stream_stats_history_frame(&history, t0 + i * 1000, i == 0 ? 5000 : 1000, i == 0, i == 3);
+	chiaki_stream_stats_history_frame_failed(&history, t0 + 20000);
+	// only completed seconds count
+	munit_assert_false(chiaki_stream_stats_history_percentile(&history, t0 + 900000, CHIAKI_STREAM_STATS_METRIC_BITRATE, 50.0, &v));
+
+	// second 1: 20 frames of 2000 bytes, second 2 and 3 empty, second 4: 1 frame of 4000 bytes
+	for(int i=0; i<20; i++)
+		chiaki_stream_stats_history_frame(&history, t0 + SECOND_US + i * 1000, 2000, false, false);
+	chiaki_stream_stats_history_frame(&history, t0 + 4 * SECOND_US + 500, 4000, false, false);
+
+	ChiakiStreamStatsSample samples[CHIAKI_STREAM_STATS_HISTORY_SECONDS];
+	size_t count = chiaki_stream_stats_history_samples(&history, t0 + 5 * SECOND_US, samples, CHIAKI_STREAM_STATS_HISTORY_SECONDS);
+	munit_assert_size(count, ==, 5);
+	munit_assert_uint64(samples[0].start_us, ==, t0);
+	munit_assert_uint64(samples[0].frames, ==, 10);
+	munit_assert_uint64(samples[0].bytes, ==, 14000);
+	munit_assert_uint64(samples[0].frame_size_max, ==, 5000);
+	munit_assert_uint64(samples[0].keyframes, ==, 1);
+	munit_assert_uint64(samples[0].keyframe_bytes, ==, 5000);
+	munit_assert_uint64(samples[0].frames_fec_recovered, ==, 1);
+	munit_assert_uint64(samples[0].frames_failed, ==, 1);
+	munit_assert_uint64(samples[1].bytes, ==, 40000);
+	munit_assert_uint64(samples[2].start_us, ==, t0 + 2 * SECOND_US);
+	munit_assert_uint64(samples[2].frames, ==, 0);
+	munit_assert_uint64(samples[3].frames, ==, 0);
+	munit_assert_uint64(samples[4].start_us, ==, t0 + 4 * SECOND_US);
+	munit_assert_uint64(samples[4].bytes, ==, 4000);
+
+	// newest last
+	count = chiaki_stream_stats_history_samples(&history, t0 + 5 * SECOND_US, samples, 1);
+	munit_assert_size(count, ==, 1);
+	munit_assert_uint64(samples[0].bytes, ==, 4000);
+
+	// bitrates 112000, 320000, 0, 0, 32000
+	munit_assert_true(chiaki_stream_stats_history_percentile(&history, t0 + 5 * SECOND_US, CHIAKI_STREAM_STATS_METRIC_BITRATE, 50.0, &v));
+	munit_assert_double(v, ==, 32000.0);
+	munit_assert_true(chiaki_stream_stats_history_percentile(&history, t0 + 5 * SECOND_US, CHIAKI_STREAM_STATS_METRIC_BITRATE, 100.0, &v));
+	munit_assert_double(v, ==, 320000.0);
+	munit_assert_true(chiaki_stream_stats_history_percentile(&history, t0 + 5 * SECOND_US, CHIAKI_STREAM_STATS_METRIC_BITRATE, 0.0, &v));
+	munit_assert_double(v, ==, 0.0);
+
+	// ewma with gain 1/4: 112000, 164000, 123000, 92250, 77187.5
+	munit_assert_true(chiaki_stream_stats_history_ewma(&history, t0 + 5 * SECOND_US, CHIAKI_STREAM_STATS_METRIC_BITRATE, &v));
+	munit_assert_double(v, ==, 77187.5);
+
+	// seconds without keyframes do not count for the keyframe size
+	munit_assert_true(chiaki_stream_stats_history_percentile(&history, t0 + 5 * SECOND_US, CHIAKI_STREAM_STATS_METRIC_KEYFRAME_SIZE, 95.0, &v));
+	munit_assert_double(v, ==, 5000.0);
+	munit_assert_true(chiaki_stream_stats_history_ewma(&history, t0 + 5 * SECOND_US, CHIAKI_STREAM_STATS_METRIC_KEYFRAME_SIZE, &v));
+	munit_assert_double(v, ==, 5000.0);
+
+	// a long pause only keeps as many empty seconds as fit into the ring
+	count = chiaki_stream_stats_history_samples(&history, t0 + 1000 * SECOND_US, samples, CHIAKI_STREAM_STATS_HISTORY_SECONDS);
+	munit_assert_size(count, ==, CHIAKI_STREAM_STATS_HISTORY_SECONDS);
+	munit_assert_uint64(samples[CHIAKI_STREAM_STATS_HISTORY_SECONDS - 1].start_us, ==, t0 + 999 * SECOND_US);
+	for(size_t i=0; i<count; i++)
+		munit_assert_uint64(samples[i].frames, ==, 0);
+
+	chiaki_stream_stats_history_reset(&history);
+	munit_assert_size(chiaki_stream_stats_history_samples(&history, t0 + 1001 * SECOND_US, samples, 1), ==, 0);
+
+	chiaki_stream_stats_history_fini(&history);
+	return MUNIT_OK;
+}
+
+MunitTest tests_stream_stats[] = {
+	{
+		"/history",
+		test_history,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
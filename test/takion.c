@@ -61,20 +61,20 @@ static MunitResult test_av_packet_parse_real_video(const MunitParameter params[]
 	return MUNIT_OK;
 }
 
-static void random_seqnums(ChiakiSeqNum32 *nums, size_t count)
+static ChiakiSeqNum32 random_seqnums(ChiakiSeqNum32 *nums, size_t count)
 {
+	// consecutive seqnums starting anywhere, in random order
+	ChiakiSeqNum32 base = munit_rand_uint32();
 	for(size_t i=0; i<count; i++)
+		nums[i] = base + i;
+	for(size_t i=count-1; i>0; i--)
 	{
-		ChiakiSeqNum32 seqnum;
-		retry:
-		seqnum = munit_rand_uint32();
-		for(size_t j=0; j<i; j++)
-		{
-			if(nums[j] == seqnum)
-				goto retry;
-		}
-		nums[i] = seqnum;
+		size_t j = munit_rand_int_range(0, i);
+		ChiakiSeqNum32 tmp = nums[i];
+		nums[i] = nums[j];
+		nums[j] = tmp;
 	}
+	return base;
 }
 
 static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, const ChiakiSeqNum32 *nums_expected, size_t nums_expected_count)
@@ -87,12 +87,21 @@ static bool check_send_buffer_contents(ChiakiTakionSendBuffer *send_buffer, cons
 	if(send_buffer->packets_count != nums_expected_count)
 		goto fail;
 
+	size_t used = 0;
+	for(size_t j=0; j<send_buffer->packets_alloc; j++)
+	{
+		if(send_buffer->packets[j].buf)
+			used++;
+	}
+	if(used != nums_expected_count)
+		goto fail;
+
 	for(size_t i=0; i<nums_expected_count; i++)
 	{
 		bool found = false;
-		for(size_t j=0; j<send_buffer->packets_count; j++)
+		for(size_t j=0; j<send_buffer->packets_alloc; j++)
 		{
-			if(send_buffer->packets[j].seq_num == nums_expected[i])
+			if(send_buffer->packets[j].buf && send_buffer->packets[j].seq_num == nums_expected[i])
 			{
 				found = true;
 				break;
@@ -133,7 +142,8 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 	send_buffer.log = get_test_log();
 
 	ChiakiSeqNum32 nums_expected[nums_count + 1];
-	random_seqnums(nums_expected, nums_count + 1);
+	ChiakiSeqNum32 base = random_seqnums(nums_expected, nums_count);
+	nums_expected[nums_count] = base + nums_count;
 
 	for(size_t i=0; i<nums_count; i++)
 	{
@@ -160,6 +170,143 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 #undef nums_count
 }
 
+static uint64_t send_buffer_test_clock(void *user)
+{
+	return *((uint64_t *)user);
+}
+
+static uint64_t send_buffer_tries(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[seq_num & (send_buffer->packets_alloc - 1)];
+	munit_assert_not_null(packet->buf);
+	munit_assert_uint32(packet->seq_num, ==, seq_num);
+	return packet->tries;
+}
+
+static MunitResult test_takion_send_buffer_rto(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 16);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	uint64_t now_us = 1000000000;
+	send_buffer.clock = send_buffer_test_clock;
+	send_buffer.clock_user = &now_us;
+
+	// rtt unknown => 200ms
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, CHIAKI_REACTOR_TIMER_IDLE);
+	chiaki_takion_send_buffer_push(&send_buffer, 100, malloc(8), 8);
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, 200);
+	now_us += 199999;
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, 1);
+	munit_assert_uint64(send_buffer_tries(&send_buffer, 100), ==, 0);
+	now_us += 1;
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, 400); // backoff
+	munit_assert_uint64(send_buffer_tries(&send_buffer, 100), ==, 1);
+
+	// Karn: no rtt sample from a re-sent packet
+	now_us += 10000;
+	chiaki_takion_send_buffer_ack(&send_buffer, 100, NULL, NULL);
+	munit_assert_false(send_buffer.rtt_valid);
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, CHIAKI_REACTOR_TIMER_IDLE);
+
+	// first sample: srtt = 10ms, rttvar = 5ms => rto = 30ms
+	chiaki_takion_send_buffer_push(&send_buffer, 101, malloc(8), 8);
+	now_us += 10000;
+	chiaki_takion_send_buffer_ack(&send_buffer, 101, NULL, NULL);
+	munit_assert_true(send_buffer.rtt_valid);
+	munit_assert_uint64(send_buffer.srtt_us, ==, 10000);
+	munit_assert_uint64(send_buffer.rttvar_us, ==, 5000);
+	munit_assert_uint64(send_buffer.rto_us, ==, 30000);
+
+	// stable rtt makes rttvar shrink: srtt = 10ms, rttvar = 3.75ms => rto = 25ms
+	chiaki_takion_send_buffer_push(&send_buffer, 102, malloc(8), 8);
+	now_us += 10000;
+	chiaki_takion_send_buffer_ack(&send_buffer, 102, NULL, NULL);
+	munit_assert_uint64(send_buffer.srtt_us, ==, 10000);
+	munit_assert_uint64(send_buffer.rttvar_us, ==, 3750);
+	munit_assert_uint64(send_buffer.rto_us, ==, 25000);
+
+	// packets are re-sent at rto * 2^tries, up to 1s, and dropped after 10 tries
+	chiaki_takion_send_buffer_push(&send_buffer, 103, malloc(8), 8);
+	chiaki_takion_send_buffer_push(&send_buffer, 104, malloc(8), 8);
+	static const uint64_t backoff_ms[] = { 25, 50, 100, 200, 400, 800, 1000, 1000, 1000, 1000 };
+	for(size_t i=0; i<sizeof(backoff_ms) / sizeof(backoff_ms[0]); i++)
+	{
+		munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, backoff_ms[i]);
+		now_us += backoff_ms[i] * 1000 - 1;
+		chiaki_takion_send_buffer_resend(&send_buffer);
+		munit_assert_uint64(send_buffer_tries(&send_buffer, 103), ==, i);
+		now_us += 1;
+		chiaki_takion_send_buffer_resend(&send_buffer);
+		munit_assert_uint64(send_buffer_tries(&send_buffer, 103), ==, i + 1);
+		munit_assert_uint64(send_buffer_tries(&send_buffer, 104), ==, i + 1);
+	}
+	munit_assert_uint64(send_buffer.resends, ==, 1 + 2 * 10);
+	now_us += 1000000;
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, CHIAKI_REACTOR_TIMER_IDLE);
+	munit_assert_size(send_buffer.packets_count, ==, 0);
+	munit_assert_uint64(send_buffer.give_ups, ==, 2);
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
+static MunitResult test_takion_send_buffer_wheel(const MunitParameter params[], void *user)
+{
+	ChiakiTakionSendBuffer send_buffer;
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, 16);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	send_buffer.log = get_test_log();
+
+	uint64_t now_us = 5000000000;
+	send_buffer.clock = send_buffer_test_clock;
+	send_buffer.clock_user = &now_us;
+
+	// packets pushed at different times are each re-sent exactly when they are due,
+	// even if nobody looked at the buffer for longer than the whole wheel
+	const ChiakiSeqNum32 base = 0xfffffffa; // wraps around
+	for(ChiakiSeqNum32 i=0; i<16; i++)
+	{
+		err = chiaki_takion_send_buffer_push(&send_buffer, base + i, malloc(8), 8);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		now_us += 1500;
+	}
+	err = chiaki_takion_send_buffer_push(&send_buffer, base + 16, malloc(8), 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
+
+	// first packet was pushed 24ms ago
+	munit_assert_uint64(chiaki_takion_send_buffer_resend(&send_buffer), ==, 176);
+	now_us += 176000;
+	chiaki_takion_send_buffer_resend(&send_buffer);
+	for(ChiakiSeqNum32 i=0; i<16; i++)
+		munit_assert_uint64(send_buffer_tries(&send_buffer, base + i), ==, i < 1 ? 1 : 0);
+
+	now_us += 10000000;
+	chiaki_takion_send_buffer_resend(&send_buffer);
+	for(ChiakiSeqNum32 i=0; i<16; i++)
+		munit_assert_uint64(send_buffer_tries(&send_buffer, base + i), ==, i < 1 ? 2 : 1);
+
+	// cumulative ack across the wrap
+	ChiakiSeqNum32 acked[16];
+	size_t acked_count;
+	chiaki_takion_send_buffer_ack(&send_buffer, base + 9, acked, &acked_count);
+	munit_assert_size(acked_count, ==, 10);
+	for(size_t i=0; i<acked_count; i++)
+		munit_assert_uint32(acked[i], ==, (ChiakiSeqNum32)(base + i));
+	munit_assert_size(send_buffer.packets_count, ==, 6);
+
+	// the window moved, so there is room again
+	err = chiaki_takion_send_buffer_push(&send_buffer, base + 16, malloc(8), 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_takion_send_buffer_push(&send_buffer, base + 10, malloc(8), 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	chiaki_takion_send_buffer_fini(&send_buffer);
+	return MUNIT_OK;
+}
+
 static MunitResult test_takion_format_congestion(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0x54, 0x65, 0x4c, 0x34, 0x5c, 0xac, 0x56, 0xb8, 0xea, 0xe6, 0x15, 0x2a, 0xde, 0x1c, 0xe2, 0xe8 };
@@ -220,6 +367,22 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/send_buffer_rto",
+		test_takion_send_buffer_rto,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/send_buffer_wheel",
+		test_takion_send_buffer_wheel,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/format_congestion",
 		test_takion_format_congestion,
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videobuffer.h>
+
+#include <string.h>
+
+static MunitResult test_video_buffer_pool(const MunitParameter params[], void *test_user)
+{
+	ChiakiVideoBufferPool *pool = chiaki_video_buffer_pool_new(1);
+	munit_assert_not_null(pool);
+
+	uint8_t *a = chiaki_video_buffer_alloc(pool, 1000);
+	munit_assert_not_null(a);
+	munit_assert_size(chiaki_video_buffer_size(a), >=, 1000);
+	memset(a, 0x42, chiaki_video_buffer_size(a) + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	munit_assert_true(chiaki_video_buffer_unique(a));
+
+	// as the decoder would hold it
+	chiaki_video_buffer_ref(a);
+	munit_assert_false(chiaki_video_buffer_unique(a));
+	chiaki_video_buffer_unref(a);
+	munit_assert_true(chiaki_video_buffer_unique(a));
+	chiaki_video_buffer_unref(a);
+
+	// released buffer is handed out again if it is big enough
+	uint8_t *b = chiaki_video_buffer_alloc(pool, 500);
+	munit_assert_ptr_equal(b, a);
+	chiaki_video_buffer_unref(b);
+
+	uint8_t *c = chiaki_video_buffer_alloc(pool, chiaki_video_buffer_size(b) + 1);
+	munit_assert_not_null(c);
+	munit_assert_size(chiaki_video_buffer_size(c), >, 1000);
+
+	ChiakiVideoBufferPoolStats stats;
+	chiaki_video_buffer_pool_get_stats(pool, &stats, false);
+	munit_assert_uint64(stats.hits, ==, 1);
+	munit_assert_uint64(stats.misses, ==, 2);
+	munit_assert_size(stats.in_use, ==, 1);
+	munit_assert_size(stats.high_water, ==, 1);
+
+	// buffers may outlive the pool, as with frames still held by FFmpeg
+	chiaki_video_buffer_pool_free(pool);
+	memset(c, 0x42, chiaki_video_buffer_size(c) + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	chiaki_video_buffer_ref(c);
+	chiaki_video_buffer_av_free(c, c);
+	chiaki_video_buffer_unref(c);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_video_buffer_pool_grow(const MunitParameter params[], void *test_user)
+{
+	ChiakiVideoBufferPool *pool = chiaki_video_buffer_pool_new(1);
+	munit_assert_not_null(pool);
+	chiaki_video_buffer_pool_set_count_max(pool, 3);
+
+	// the decoder holds on to more buffers than the pool keeps
+	uint8_t *bufs[4];
+	for(size_t i=0; i<4; i++)
+	{
+		bufs[i] = chiaki_video_buffer_alloc(pool, 1000);
+		munit_assert_not_null(bufs[i]);
+	}
+	ChiakiVideoBufferPoolStats stats;
+	chiaki_video_buffer_pool_get_stats(pool, &stats, true);
+	munit_assert_uint64(stats.misses, ==, 4);
+	munit_assert_size(stats.count, ==, 3);
+
+	// so from now on, enough of them are kept
+	for(size_t i=0; i<4; i++)
+		chiaki_video_buffer_unref(bufs[i]);
+	for(size_t i=0; i<3; i++)
+		bufs[i] = chiaki_video_buffer_alloc(pool, 1000);
+	chiaki_video_buffer_pool_get_stats(pool, &stats, false);
+	munit_assert_uint64(stats.hits, ==, 3);
+	munit_assert_uint64(stats.misses, ==, 0);
+	munit_assert_size(stats.count, ==, 3);
+
+	for(size_t i=0; i<3; i++)
+		chiaki_video_buffer_unref(bufs[i]);
+	chiaki_video_buffer_pool_free(pool);
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_buffer[] = {
+	{
+		"/video_buffer_pool",
+		test_video_buffer_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/video_buffer_pool_grow",
+		test_video_buffer_pool_grow,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
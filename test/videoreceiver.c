@@ -0,0 +1,502 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videoreceiver.h>
+#include <chiaki/session.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#include "test_log.h"
+
+#define UNITS_SOURCE 4
+#define UNITS_FEC 1
+#define UNIT_SIZE 32
+#define FRAMES_MAX 64
+
+typedef struct video_receiver_test_t
+{
+	ChiakiSession session;
+	ChiakiVideoReceiver *video_receiver;
+	uint8_t unit[UNIT_SIZE];
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	int32_t frames[FRAMES_MAX]; // frame indices in the order they were passed to the video sample callback
+	size_t frames_count;
+	size_t frames_wait; // for wait_frames()
+	unsigned int corrupt_reports;
+	ChiakiSeqNum16 corrupt_start; // of the first report
+	ChiakiSeqNum16 corrupt_end;
+	bool hold; // keep the video sample callback from returning, like a stuck decoder
+	bool holding;
+	uint64_t delay_ms; // how long the video sample callback takes for each frame
+} VideoReceiverTest;
+
+static bool test_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, int32_t frame_index, void *user)
+{
+	VideoReceiverTest *test = user;
+	// the header of the profile, which is not a frame
+	if(buf_size < 3 || buf[0] != 0xff)
+	{
+		munit_assert_int32(frame_index, ==, -1);
+		return true;
+	}
+	munit_assert_uint16((uint16_t)frame_index, ==, buf[1] | (buf[2] << 8));
+	chiaki_mutex_lock(&test->mutex);
+	if(test->frames_count < FRAMES_MAX)
+		test->frames[test->frames_count++] = buf[1] | (buf[2] << 8);
+	chiaki_cond_broadcast(&test->cond);
+	while(test->hold)
+	{
+		test->holding = true;
+		chiaki_cond_wait(&test->cond, &test->mutex);
+	}
+	test->holding = false;
+	uint64_t end_ms = chiaki_time_now_monotonic_ms() + test->delay_ms;
+	for(uint64_t now_ms = chiaki_time_now_monotonic_ms(); now_ms < end_ms; now_ms = chiaki_time_now_monotonic_ms())
+		chiaki_cond_timedwait(&test->cond, &test->mutex, end_ms - now_ms);
+	chiaki_mutex_unlock(&test->mutex);
+	return true;
+}
+
+static ChiakiErrorCode test_corrupt_frame_cb(ChiakiSeqNum16 start, ChiakiSeqNum16 end, void *user)
+{
+	VideoReceiverTest *test = user;
+	chiaki_mutex_lock(&test->mutex);
+	if(!test->corrupt_reports++)
+	{
+		test->corrupt_start = start;
+		test->corrupt_end = end;
+	}
+	chiaki_mutex_unlock(&test->mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void video_receiver_test_init(VideoReceiverTest *test, size_t window_size, uint64_t reorder_tolerance_us)
+{
+	memset(test, 0, sizeof(*test));
+	munit_assert_int(chiaki_mutex_init(&test->mutex, false), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_cond_init(&test->cond), ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiSession *session = &test->session;
+	session->log = get_test_log();
+	session->connect_info.video_profile.codec = CHIAKI_CODEC_H264;
+	session->video_sample_cb = test_video_sample_cb;
+	session->video_sample_cb_user = test;
+	munit_assert_int(chiaki_frame_tracer_init(&session->frame_tracer, session->log, NULL, NULL), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiStreamConnection *stream_connection = &session->stream_connection;
+	munit_assert_int(chiaki_packet_stats_init(&stream_connection->packet_stats), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_recv_timing_init(&stream_connection->video_recv_timing), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_congestion_control_init(&stream_connection->congestion_control, 0.05), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_stream_stats_history_init(&stream_connection->video_stats_history), ==, CHIAKI_ERR_SUCCESS);
+
+	test->video_receiver = chiaki_video_receiver_new(session, &stream_connection->packet_stats);
+	munit_assert_not_null(test->video_receiver);
+	test->video_receiver->corrupt_frame_cb = test_corrupt_frame_cb;
+	test->video_receiver->corrupt_frame_cb_user = test;
+	chiaki_video_receiver_set_reorder_window(test->video_receiver, window_size, reorder_tolerance_us);
+
+	ChiakiVideoProfile profile = { 0 };
+	profile.width = 1280;
+	profile.height = 720;
+	// only a start code, so there is nothing for the bitstream parser to look at
+	profile.header = malloc(3);
+	munit_assert_not_null(profile.header);
+	memcpy(profile.header, "\0\0\1", 3);
+	profile.header_sz = 3;
+	chiaki_video_receiver_stream_info(test->video_receiver, &profile, 1);
+}
+
+static void video_receiver_test_fini(VideoReceiverTest *test)
+{
+	chiaki_video_receiver_free(test->video_receiver);
+	ChiakiStreamConnection *stream_connection = &test->session.stream_connection;
+	chiaki_stream_stats_history_fini(&stream_connection->video_stats_history);
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
+	chiaki_recv_timing_fini(&stream_connection->video_recv_timing);
+	chiaki_packet_stats_fini(&stream_connection->packet_stats);
+	chiaki_frame_tracer_fini(&test->session.frame_tracer);
+	chiaki_cond_fini(&test->cond);
+	chiaki_mutex_fini(&test->mutex);
+}
+
+/**
+ * Put a source unit of a frame whose payload starts with 0xff and the frame index
+ */
+static void put_unit(VideoReceiverTest *test, ChiakiSeqNum16 frame_index, unsigned int unit_index)
+{
+	uint8_t *unit = test->unit;
+	memset(unit, 0, UNIT_SIZE); // no padding
+	unit[2] = 0xff;
+	unit[3] = (uint8_t)frame_index;
+	unit[4] = (uint8_t)(frame_index >> 8);
+	unit[5] = (uint8_t)unit_index;
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.frame_index = frame_index;
+	packet.unit_index = (ChiakiSeqNum16)unit_index;
+	packet.units_in_frame_total = UNITS_SOURCE + UNITS_FEC;
+	packet.units_in_frame_fec = UNITS_FEC;
+	packet.data = unit;
+	packet.data_size = UNIT_SIZE;
+	packet.recv_time.arrival_us = chiaki_time_now_monotonic_us();
+	chiaki_video_receiver_av_packet(test->video_receiver, &packet);
+}
+
+static void put_frame(VideoReceiverTest *test, ChiakiSeqNum16 frame_index)
+{
+	for(unsigned int u=0; u<UNITS_SOURCE; u++)
+		put_unit(test, frame_index, u);
+}
+
+static bool frames_count_pred(void *user)
+{
+	VideoReceiverTest *test = user;
+	return test->frames_count >= test->frames_wait;
+}
+
+/**
+ * Wait until the video sample callback got at least count frames
+ * @return the number of frames it got
+ */
+static size_t wait_frames(VideoReceiverTest *test, size_t count, uint64_t timeout_ms)
+{
+	chiaki_mutex_lock(&test->mutex);
+	test->frames_wait = count;
+	chiaki_cond_timedwait_pred(&test->cond, &test->mutex, timeout_ms, frames_count_pred, test);
+	size_t r = test->frames_count;
+	chiaki_mutex_unlock(&test->mutex);
+	return r;
+}
+
+static MunitResult test_reorder(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	video_receiver_test_init(&test, 3, 1000000);
+
+	// units of frames 1 to 3 interleaved, each one finished after a later one started
+	put_unit(&test, 1, 0);
+	put_unit(&test, 1, 1);
+	put_unit(&test, 2, 0);
+	put_unit(&test, 1, 3);
+	put_unit(&test, 3, 0);
+	put_unit(&test, 2, 1);
+	put_unit(&test, 2, 2);
+	put_unit(&test, 3, 1);
+	put_unit(&test, 3, 2);
+	put_unit(&test, 3, 3);
+	put_unit(&test, 1, 2);
+	put_unit(&test, 2, 3);
+	put_frame(&test, 4);
+
+	munit_assert_size(wait_frames(&test, 4, 5000), ==, 4);
+	for(size_t i=0; i<4; i++)
+		munit_assert_int32(test.frames[i], ==, (int32_t)(i + 1));
+	munit_assert_uint(test.corrupt_reports, ==, 0);
+
+	ChiakiVideoReceiverWindowStats stats;
+	chiaki_video_receiver_window_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_rescued, ==, 2);
+	munit_assert_uint64(stats.frames_incomplete, ==, 0);
+	munit_assert_uint64(stats.packets_late, ==, 0);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_duplicate(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	video_receiver_test_init(&test, 3, 1000000);
+
+	put_unit(&test, 1, 0);
+	put_unit(&test, 1, 0);
+	put_unit(&test, 1, 1);
+	put_unit(&test, 1, 2);
+	put_unit(&test, 1, 1);
+	put_unit(&test, 1, 3);
+	// complete frames are handed over right away, so these belong to a frame that is already done
+	put_unit(&test, 1, 3);
+	put_unit(&test, 1, 2);
+	put_frame(&test, 2);
+	put_unit(&test, 2, 0);
+
+	munit_assert_size(wait_frames(&test, 2, 5000), ==, 2);
+	munit_assert_int32(test.frames[0], ==, 1);
+	munit_assert_int32(test.frames[1], ==, 2);
+	// give a wrongly emitted third frame the chance to show up
+	munit_assert_size(wait_frames(&test, 3, 50), ==, 2);
+	munit_assert_uint(test.corrupt_reports, ==, 0);
+
+	ChiakiVideoReceiverWindowStats stats;
+	chiaki_video_receiver_window_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_rescued, ==, 0);
+	munit_assert_uint64(stats.frames_incomplete, ==, 0);
+	munit_assert_uint64(stats.packets_late, ==, 0);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_late(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	// no tolerance, so an incomplete frame is handed over as soon as the next one starts
+	video_receiver_test_init(&test, 3, 0);
+
+	put_unit(&test, 1, 0);
+	put_unit(&test, 1, 1);
+	put_unit(&test, 1, 3);
+	put_frame(&test, 2);
+	// too late for frame 1, which has failed by now
+	put_unit(&test, 1, 2);
+	put_frame(&test, 3);
+	// older than anything in the window or handed over recently
+	put_unit(&test, 0, 0);
+
+	munit_assert_size(wait_frames(&test, 2, 5000), ==, 2);
+	munit_assert_int32(test.frames[0], ==, 2);
+	munit_assert_int32(test.frames[1], ==, 3);
+	munit_assert_uint(test.corrupt_reports, >, 0);
+	munit_assert_uint16(test.corrupt_start, ==, 1);
+	munit_assert_uint16(test.corrupt_end, ==, 1);
+
+	ChiakiVideoReceiverWindowStats stats;
+	chiaki_video_receiver_window_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_rescued, ==, 0);
+	munit_assert_uint64(stats.frames_incomplete, ==, 1);
+	munit_assert_uint64(stats.packets_late, ==, 2);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_wrap(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	video_receiver_test_init(&test, 3, 1000000);
+
+	put_unit(&test, 0xfffe, 0);
+	put_unit(&test, 0xfffe, 1);
+	put_unit(&test, 0xfffe, 2);
+	put_unit(&test, 0xffff, 0);
+	put_unit(&test, 0, 0);
+	put_unit(&test, 0xfffe, 3);
+	put_unit(&test, 0xffff, 1);
+	put_unit(&test, 0xffff, 2);
+	put_unit(&test, 0, 1);
+	put_unit(&test, 0, 2);
+	put_unit(&test, 0, 3);
+	put_unit(&test, 0xffff, 3);
+	put_frame(&test, 1);
+	put_unit(&test, 0xffff, 3);
+
+	munit_assert_size(wait_frames(&test, 4, 5000), ==, 4);
+	munit_assert_int32(test.frames[0], ==, 0xfffe);
+	munit_assert_int32(test.frames[1], ==, 0xffff);
+	munit_assert_int32(test.frames[2], ==, 0);
+	munit_assert_int32(test.frames[3], ==, 1);
+	munit_assert_uint(test.corrupt_reports, ==, 0);
+
+	ChiakiVideoReceiverWindowStats stats;
+	chiaki_video_receiver_window_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_rescued, ==, 2);
+	munit_assert_uint64(stats.frames_incomplete, ==, 0);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_deadline(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	video_receiver_test_init(&test, 3, 100000);
+
+	// frame 1 loses a unit, then the stream stalls after frame 2
+	put_unit(&test, 1, 0);
+	put_unit(&test, 1, 1);
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	put_unit(&test, 1, 2);
+	put_frame(&test, 2);
+
+	// frame 1 may still be completed within the tolerance and frame 2 has to wait for it
+	size_t count = wait_frames(&test, 1, 20);
+	if(chiaki_time_now_monotonic_us() - start_us < 100000)
+		munit_assert_size(count, ==, 0);
+
+	// but it is handed over without more packets arriving once the tolerance is over
+	munit_assert_size(wait_frames(&test, 1, 5000), ==, 1);
+	munit_assert_uint64(chiaki_time_now_monotonic_us() - start_us, >=, 100000);
+	munit_assert_int32(test.frames[0], ==, 2);
+	munit_assert_uint(test.corrupt_reports, >, 0);
+	munit_assert_uint16(test.corrupt_start, ==, 1);
+	munit_assert_uint16(test.corrupt_end, ==, 1);
+
+	ChiakiVideoReceiverWindowStats stats;
+	chiaki_video_receiver_window_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_incomplete, ==, 1);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+/**
+ * Wait until the assembly thread is done with all queued frames, so their frame processors can be reused
+ */
+static void wait_queue_empty(VideoReceiverTest *test)
+{
+	uint64_t end_ms = chiaki_time_now_monotonic_ms() + 5000;
+	ChiakiVideoReceiverQueueStats stats;
+	chiaki_mutex_lock(&test->mutex);
+	while(true)
+	{
+		chiaki_video_receiver_queue_stats(test->video_receiver, &stats);
+		if(!stats.depth || chiaki_time_now_monotonic_ms() >= end_ms)
+			break;
+		chiaki_cond_timedwait(&test->cond, &test->mutex, 1);
+	}
+	chiaki_mutex_unlock(&test->mutex);
+	munit_assert_uint64(stats.depth, ==, 0);
+}
+
+static bool holding_pred(void *user)
+{
+	VideoReceiverTest *test = user;
+	return test->holding;
+}
+
+static MunitResult test_backpressure(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	video_receiver_test_init(&test, 3, 1000000);
+
+	chiaki_mutex_lock(&test.mutex);
+	test.hold = true;
+	chiaki_mutex_unlock(&test.mutex);
+	put_frame(&test, 1);
+	chiaki_mutex_lock(&test.mutex);
+	chiaki_cond_timedwait_pred(&test.cond, &test.mutex, 5000, holding_pred, &test);
+	munit_assert_true(test.holding);
+	chiaki_mutex_unlock(&test.mutex);
+
+	// receiving goes on while the assembly thread is stuck, frames that don't fit anymore are dropped
+	size_t frames_kept = CHIAKI_VIDEO_RECEIVER_QUEUE_SIZE + CHIAKI_VIDEO_RECEIVER_WINDOW_MAX;
+	for(ChiakiSeqNum16 frame_index=2; frame_index<=20; frame_index++)
+		put_frame(&test, frame_index);
+
+	ChiakiVideoReceiverQueueStats stats;
+	chiaki_video_receiver_queue_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_queued, ==, frames_kept);
+	munit_assert_uint64(stats.frames_dropped, ==, 20 - frames_kept);
+	munit_assert_uint64(stats.depth_max, <=, frames_kept);
+
+	chiaki_mutex_lock(&test.mutex);
+	munit_assert_true(test.holding);
+	munit_assert_size(test.frames_count, ==, 1);
+	test.hold = false;
+	chiaki_cond_broadcast(&test.cond);
+	chiaki_mutex_unlock(&test.mutex);
+
+	munit_assert_size(wait_frames(&test, frames_kept, 5000), ==, frames_kept);
+	wait_queue_empty(&test);
+
+	// the dropped frames are reported once the next frame after them is assembled
+	put_frame(&test, 21);
+	munit_assert_size(wait_frames(&test, frames_kept + 1, 5000), ==, frames_kept + 1);
+	for(size_t i=0; i<frames_kept; i++)
+		munit_assert_int32(test.frames[i], ==, (int32_t)(i + 1));
+	munit_assert_int32(test.frames[frames_kept], ==, 21);
+	munit_assert_uint(test.corrupt_reports, ==, 1);
+	munit_assert_uint16(test.corrupt_start, ==, frames_kept + 1);
+	munit_assert_uint16(test.corrupt_end, ==, 20);
+
+	chiaki_video_receiver_queue_stats(test.video_receiver, &stats);
+	munit_assert_uint64(stats.frames_queued, ==, frames_kept + 1);
+	munit_assert_uint64(stats.frames_dropped, ==, 20 - frames_kept);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_shutdown(const MunitParameter params[], void *user)
+{
+	VideoReceiverTest test;
+	video_receiver_test_init(&test, 3, 1000000);
+	test.delay_ms = 20;
+
+	size_t frames_kept = CHIAKI_VIDEO_RECEIVER_QUEUE_SIZE + CHIAKI_VIDEO_RECEIVER_WINDOW_MAX;
+	for(ChiakiSeqNum16 frame_index=1; frame_index<=frames_kept; frame_index++)
+		put_frame(&test, frame_index);
+	munit_assert_size(wait_frames(&test, 1, 5000), >=, 1);
+
+	// frames still queued are dropped instead of being assembled on fini
+	chiaki_video_receiver_free(test.video_receiver);
+	test.video_receiver = NULL;
+	munit_assert_size(test.frames_count, <, frames_kept);
+
+	video_receiver_test_fini(&test);
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_receiver[] = {
+	{
+		"/reorder",
+		test_reorder,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/duplicate",
+		test_duplicate,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/late",
+		test_late,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/wrap",
+		test_wrap,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/deadline",
+		test_deadline,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/backpressure",
+		test_backpressure,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/shutdown",
+		test_shutdown,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};